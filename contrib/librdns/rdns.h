@@ -335,6 +335,22 @@ struct rdns_request* rdns_make_request_full (
 		...
 		);
 
+/**
+ * Make a request object that is already replied without sending anything to
+ * the network (e.g. when reply is restored from some cache). Caller should
+ * append entries allocated with `malloc` to the reply and call the callback
+ * itself, the reply is freed with the request
+ * @param resolver resolver object
+ * @param name requested name
+ * @param type requested type
+ * @param rcode reply code
+ * @return reply object with request refcount = 1 or NULL
+ */
+struct rdns_reply* rdns_make_detached_reply (struct rdns_resolver *resolver,
+		const char *name,
+		enum rdns_request_type type,
+		enum dns_rcode rcode);
+
 /**
  * Get textual presentation of DNS error code
  */
@@ -124,6 +124,45 @@ rdns_make_reply (struct rdns_request *req, enum dns_rcode rcode)
 	return rep;
 }
 
+struct rdns_reply *
+rdns_make_detached_reply (struct rdns_resolver *resolver,
+		const char *name,
+		enum rdns_request_type type,
+		enum dns_rcode rcode)
+{
+	struct rdns_request *req;
+	struct rdns_reply *rep;
+
+	req = calloc (1, sizeof (struct rdns_request));
+	if (req == NULL) {
+		return NULL;
+	}
+
+	req->resolver = resolver;
+	req->async = resolver->async;
+	req->qcount = 1;
+	req->requested_names = calloc (1, sizeof (struct rdns_request_name));
+	if (req->requested_names == NULL) {
+		free (req);
+		return NULL;
+	}
+
+	req->requested_names[0].name = strdup (name);
+	req->requested_names[0].len = strlen (name);
+	req->requested_names[0].type = type;
+	/* No timers and no IO channel are associated with this request */
+	req->state = RDNS_REQUEST_REPLIED;
+	REF_INIT_RETAIN (req, rdns_request_free);
+
+	rep = rdns_make_reply (req, rcode);
+	if (rep == NULL) {
+		REF_RELEASE (req);
+		return NULL;
+	}
+
+	return rep;
+}
+
 static struct rdns_request *
 rdns_find_dns_request (uint8_t *in, struct rdns_io_channel *ioc)
 {
@@ -153,6 +153,7 @@ enum rspamd_metric_action {
 static void rspamc_symbols_output (FILE *out, ucl_object_t *obj);
 static void rspamc_uptime_output (FILE *out, ucl_object_t *obj);
 static void rspamc_counters_output (FILE *out, ucl_object_t *obj);
+static void rspamc_profile_output (FILE *out, ucl_object_t *obj);
 static void rspamc_stat_output (FILE *out, ucl_object_t *obj);
 
 enum rspamc_command_type {
@@ -165,6 +166,9 @@ enum rspamc_command_type {
 	RSPAMC_COMMAND_STAT,
 	RSPAMC_COMMAND_STAT_RESET,
 	RSPAMC_COMMAND_COUNTERS,
+	RSPAMC_COMMAND_PROFILE,
+	RSPAMC_COMMAND_PROFILE_START,
+	RSPAMC_COMMAND_PROFILE_STOP,
 	RSPAMC_COMMAND_UPTIME,
 	RSPAMC_COMMAND_ADD_SYMBOL,
 	RSPAMC_COMMAND_ADD_ACTION
@@ -262,6 +266,36 @@ struct rspamc_command {
 		.need_input = FALSE,
 		.command_output_func = rspamc_counters_output
 	},
+	{
+		.cmd = RSPAMC_COMMAND_PROFILE,
+		.name = "profile",
+		.path = "profile",
+		.description = "display latency profile of rspamd symbols",
+		.is_controller = TRUE,
+		.is_privileged = FALSE,
+		.need_input = FALSE,
+		.command_output_func = rspamc_profile_output
+	},
+	{
+		.cmd = RSPAMC_COMMAND_PROFILE_START,
+		.name = "profile_start",
+		.path = "profilestart",
+		.description = "reset and start profiling of rspamd symbols",
+		.is_controller = TRUE,
+		.is_privileged = TRUE,
+		.need_input = FALSE,
+		.command_output_func = NULL
+	},
+	{
+		.cmd = RSPAMC_COMMAND_PROFILE_STOP,
+		.name = "profile_stop",
+		.path = "profilestop",
+		.description = "stop profiling of rspamd symbols",
+		.is_controller = TRUE,
+		.is_privileged = TRUE,
+		.need_input = FALSE,
+		.command_output_func = NULL
+	},
 	{
 		.cmd = RSPAMC_COMMAND_UPTIME,
 		.name = "uptime",
@@ -388,6 +422,15 @@ check_rspamc_command (const gchar *cmd)
 	else if (g_ascii_strcasecmp (cmd, "COUNTERS") == 0) {
 		ct = RSPAMC_COMMAND_COUNTERS;
 	}
+	else if (g_ascii_strcasecmp (cmd, "PROFILE") == 0) {
+		ct = RSPAMC_COMMAND_PROFILE;
+	}
+	else if (g_ascii_strcasecmp (cmd, "PROFILE_START") == 0) {
+		ct = RSPAMC_COMMAND_PROFILE_START;
+	}
+	else if (g_ascii_strcasecmp (cmd, "PROFILE_STOP") == 0) {
+		ct = RSPAMC_COMMAND_PROFILE_STOP;
+	}
 	else if (g_ascii_strcasecmp (cmd, "UPTIME") == 0) {
 		ct = RSPAMC_COMMAND_UPTIME;
 	}
@@ -814,6 +857,76 @@ rspamc_counters_output (FILE *out, ucl_object_t *obj)
 	printf (" %s \n", dash_buf);
 }
 
+static void
+rspamc_profile_output (FILE *out, ucl_object_t *obj)
+{
+	const ucl_object_t *syms, *cur, *sym, *lat;
+	ucl_object_iter_t iter = NULL;
+	gchar fmt_buf[96], dash_buf[128];
+	gint l, max_len = 6;
+
+	syms = ucl_object_lookup (obj, "symbols");
+
+	if (obj->type != UCL_OBJECT || syms == NULL || syms->type != UCL_ARRAY) {
+		rspamd_printf ("Bad output\n");
+		return;
+	}
+
+	if (!ucl_object_toboolean (ucl_object_lookup (obj, "enabled"))) {
+		printf ("Profiling is disabled\n");
+	}
+
+	/* Find maximum width of symbol's name */
+	while ((cur = ucl_object_iterate (syms, &iter, true)) != NULL) {
+		sym = ucl_object_lookup (cur, "symbol");
+		if (sym != NULL) {
+			l = sym->len;
+			if (l > max_len) {
+				max_len = MIN (40, l);
+			}
+		}
+	}
+
+	rspamd_snprintf (fmt_buf, sizeof (fmt_buf),
+		"| %%%ds | %%8s | %%7s | %%7s | %%7s | %%7s | %%7s | %%7s |\n", max_len);
+	memset (dash_buf, '-', 73 + max_len);
+	dash_buf[73 + max_len] = '\0';
+
+	printf ("Symbols profile (times in milliseconds)\n");
+	printf (" %s \n", dash_buf);
+	if (tty) {
+		printf ("\033[1m");
+	}
+	printf (fmt_buf, "Symbol", "Calls", "Wall", "CPU", "Wait", "p50", "p90",
+		"p99");
+	if (tty) {
+		printf ("\033[0m");
+	}
+	rspamd_snprintf (fmt_buf, sizeof (fmt_buf),
+		"| %%%ds | %%8d | %%7.3f | %%7.3f | %%7.3f | %%7.3f | %%7.3f | %%7.3f |\n",
+		max_len);
+
+	iter = NULL;
+	while ((cur = ucl_object_iterate (syms, &iter, true)) != NULL) {
+		printf (" %s \n", dash_buf);
+		sym = ucl_object_lookup (cur, "symbol");
+		lat = ucl_object_lookup (cur, "latency");
+
+		if (sym && lat) {
+			printf (fmt_buf,
+				ucl_object_tostring (sym),
+				(gint)ucl_object_toint (ucl_object_lookup (cur, "calls")),
+				ucl_object_todouble (ucl_object_lookup (cur, "wall")),
+				ucl_object_todouble (ucl_object_lookup (cur, "cpu")),
+				ucl_object_todouble (ucl_object_lookup (cur, "async_wait")),
+				ucl_object_todouble (ucl_object_lookup (lat, "p50")),
+				ucl_object_todouble (ucl_object_lookup (lat, "p90")),
+				ucl_object_todouble (ucl_object_lookup (lat, "p99")));
+		}
+	}
+	printf (" %s \n", dash_buf);
+}
+
 static void
 rspamc_stat_actions (ucl_object_t *obj, GString *out, gint64 scanned)
 {
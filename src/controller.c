@@ -55,6 +55,9 @@
 #define PATH_STAT "/stat"
 #define PATH_STAT_RESET "/statreset"
 #define PATH_COUNTERS "/counters"
+#define PATH_PROFILE "/profile"
+#define PATH_PROFILE_START "/profilestart"
+#define PATH_PROFILE_STOP "/profilestop"
 
 
 #define msg_err_session(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL, \
@@ -1974,6 +1977,55 @@ rspamd_controller_stat_cleanup_task (void *ud)
 	ucl_object_unref (cbdata->top);
 }
 
+/*
+ * Histograms of peak sizes of pools by tag, keys are upper bounds of buckets
+ */
+static ucl_object_t *
+rspamd_controller_pools_peak_stat (void)
+{
+	ucl_object_t *top, *sub, *hist;
+	GArray *tags;
+	rspamd_mempool_tag_stat_t *tst;
+	gchar buf[32];
+	gsize lim;
+	guint i, j;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	tags = rspamd_mempool_tag_stat ();
+
+	for (i = 0; i < tags->len; i ++) {
+		tst = &g_array_index (tags, rspamd_mempool_tag_stat_t, i);
+		sub = ucl_object_typed_new (UCL_OBJECT);
+		hist = ucl_object_typed_new (UCL_OBJECT);
+
+		for (j = 0; j < MEMPOOL_PEAK_BUCKETS; j ++) {
+			lim = (gsize)MEMPOOL_PEAK_MIN << j;
+
+			if (j == MEMPOOL_PEAK_BUCKETS - 1) {
+				rspamd_strlcpy (buf, "inf", sizeof (buf));
+			}
+			else if (lim >= 1024 * 1024) {
+				rspamd_snprintf (buf, sizeof (buf), "%zM", lim / (1024 * 1024));
+			}
+			else {
+				rspamd_snprintf (buf, sizeof (buf), "%zK", lim / 1024);
+			}
+
+			ucl_object_insert_key (hist, ucl_object_fromint (tst->peak_hist[j]),
+					buf, 0, true);
+		}
+
+		ucl_object_insert_key (sub, ucl_object_fromint (tst->pools),
+				"pools", 0, false);
+		ucl_object_insert_key (sub, hist, "peak", 0, false);
+		ucl_object_insert_key (top, sub, tst->tagname, 0, true);
+	}
+
+	g_array_free (tags, TRUE);
+
+	return top;
+}
+
 /*
  * Stat command handler:
  * request: /stat (/resetstat)
@@ -2077,6 +2129,40 @@ rspamd_controller_handle_stat_common (
 	ucl_object_insert_key (top,
 		ucl_object_fromint (
 			mem_st.oversized_chunks), "chunks_oversized", 0, false);
+	ucl_object_insert_key (top, rspamd_controller_pools_peak_stat (),
+			"pools_peak", 0, false);
+
+	if (session->ctx->cfg->dns_cache) {
+		struct rspamd_dns_cache_stat *dns_st;
+		guint lookups;
+
+		dns_st = rspamd_dns_cache_get_stat (session->ctx->cfg->dns_cache);
+		lookups = dns_st->hits + dns_st->negative_hits + dns_st->misses +
+				dns_st->coalesced;
+		sub = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (sub, ucl_object_fromint (dns_st->hits),
+				"hits", 0, false);
+		ucl_object_insert_key (sub, ucl_object_fromint (dns_st->negative_hits),
+				"negative_hits", 0, false);
+		ucl_object_insert_key (sub, ucl_object_fromint (dns_st->misses),
+				"misses", 0, false);
+		ucl_object_insert_key (sub, ucl_object_fromint (dns_st->coalesced),
+				"coalesced", 0, false);
+		ucl_object_insert_key (sub, ucl_object_fromint (dns_st->stored),
+				"stored", 0, false);
+		ucl_object_insert_key (sub, ucl_object_fromdouble (lookups > 0 ?
+				(gdouble)(lookups - dns_st->misses) / lookups : 0.0),
+				"hit_rate", 0, false);
+		ucl_object_insert_key (top, sub, "dns_cache", 0, false);
+
+		if (do_reset) {
+			memset (dns_st, 0, sizeof (*dns_st));
+		}
+	}
+
+	ucl_object_insert_key (top,
+			rspamd_upstreams_library_stat (session->ctx->cfg->ups_ctx),
+			"upstreams", 0, false);
 
 	if (do_reset) {
 		session->ctx->srv->stat->messages_scanned = 0;
@@ -2160,6 +2246,96 @@ rspamd_controller_handle_counters (
 	return 0;
 }
 
+/*
+ * Profile command handler:
+ * request: /profile
+ * headers: Password
+ * reply: json object with latency profile of all symbols
+ */
+static int
+rspamd_controller_handle_profile (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	ucl_object_t *top;
+	struct symbols_cache *cache;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	cache = session->ctx->cfg->cache;
+
+	if (cache != NULL) {
+		top = rspamd_symbols_cache_profile (cache);
+		rspamd_controller_send_ucl (conn_ent, top);
+		ucl_object_unref (top);
+	}
+	else {
+		rspamd_controller_send_error (conn_ent, 500, "Invalid cache");
+	}
+
+	return 0;
+}
+
+static int
+rspamd_controller_handle_profile_common (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg,
+	gboolean enable)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct symbols_cache *cache;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, TRUE)) {
+		return 0;
+	}
+
+	cache = session->ctx->cfg->cache;
+
+	if (cache != NULL) {
+		msg_info_session ("<%s> %s symbols profiling",
+				rspamd_inet_address_to_string (session->from_addr),
+				enable ? "start" : "stop");
+		rspamd_symbols_cache_set_profiling (cache, enable);
+		rspamd_controller_send_string (conn_ent, "{\"success\":true}");
+	}
+	else {
+		rspamd_controller_send_error (conn_ent, 500, "Invalid cache");
+	}
+
+	return 0;
+}
+
+/*
+ * Profile start command handler:
+ * request: /profilestart
+ * headers: Password
+ * reply: json {"success":true}
+ */
+static int
+rspamd_controller_handle_profile_start (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	return rspamd_controller_handle_profile_common (conn_ent, msg, TRUE);
+}
+
+/*
+ * Profile stop command handler:
+ * request: /profilestop
+ * headers: Password
+ * reply: json {"success":true}
+ */
+static int
+rspamd_controller_handle_profile_stop (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	return rspamd_controller_handle_profile_common (conn_ent, msg, FALSE);
+}
+
 static int
 rspamd_controller_handle_custom (struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
@@ -2700,6 +2876,15 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_COUNTERS,
 			rspamd_controller_handle_counters);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_PROFILE,
+			rspamd_controller_handle_profile);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_PROFILE_START,
+			rspamd_controller_handle_profile_start);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_PROFILE_STOP,
+			rspamd_controller_handle_profile_stop);
 
 	if (ctx->key) {
 		rspamd_http_router_set_key (ctx->http, ctx->key);
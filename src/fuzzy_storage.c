@@ -42,6 +42,8 @@
 #define DEFAULT_SYNC_TIMEOUT 60.0
 #define DEFAULT_KEYPAIR_CACHE_SIZE 512
 #define DEFAULT_MASTER_TIMEOUT 10.0
+/* Maximum number of datagrams that are read and decrypted at once */
+#define FUZZY_BATCH_MAX 16
 
 #define INVALID_NODE_TIME (guint64) - 1
 
@@ -779,8 +781,30 @@ rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
 	return ret;
 }
 
-static gboolean
-rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
+static void
+rspamd_fuzzy_encrypted_parts (struct fuzzy_session *s,
+		struct rspamd_fuzzy_encrypted_req_hdr **phdr,
+		guchar **payload, gsize *payload_len)
+{
+	if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
+		*phdr = &s->cmd.enc_normal.hdr;
+		*payload = (guchar *)&s->cmd.enc_normal.cmd;
+		*payload_len = sizeof (s->cmd.enc_normal.cmd);
+	}
+	else {
+		*phdr = &s->cmd.enc_shingle.hdr;
+		*payload = (guchar *) &s->cmd.enc_shingle.cmd;
+		*payload_len = sizeof (s->cmd.enc_shingle.cmd);
+	}
+}
+
+/*
+ * Checks header of an encrypted command and returns remote key for it,
+ * decryption itself is deferred to process many commands at once
+ */
+static struct rspamd_cryptobox_pubkey *
+rspamd_fuzzy_encrypted_prepare (struct fuzzy_session *s,
+		struct fuzzy_key **pkey)
 {
 	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
 	guchar *payload;
@@ -790,24 +814,15 @@ rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
 
 	if (s->ctx->default_key == NULL) {
 		msg_warn ("received encrypted request when encryption is not enabled");
-		return FALSE;
+		return NULL;
 	}
 
-	if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
-		hdr = &s->cmd.enc_normal.hdr;
-		payload = (guchar *)&s->cmd.enc_normal.cmd;
-		payload_len = sizeof (s->cmd.enc_normal.cmd);
-	}
-	else {
-		hdr = &s->cmd.enc_shingle.hdr;
-		payload = (guchar *) &s->cmd.enc_shingle.cmd;
-		payload_len = sizeof (s->cmd.enc_shingle.cmd);
-	}
+	rspamd_fuzzy_encrypted_parts (s, &hdr, &payload, &payload_len);
 
 	/* Compare magic */
 	if (memcmp (hdr->magic, fuzzy_encrypted_magic, sizeof (hdr->magic)) != 0) {
 		msg_debug ("invalid magic for the encrypted packet");
-		return FALSE;
+		return NULL;
 	}
 
 	/* Try to find the desired key */
@@ -826,27 +841,51 @@ rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
 
 	if (rk == NULL) {
 		msg_err ("bad key");
-		return FALSE;
+		return NULL;
 	}
 
-	rspamd_keypair_cache_process (s->ctx->keypair_cache, key->key, rk);
+	*pkey = key;
+
+	return rk;
+}
+
+/*
+ * Validates encrypted command after decryption
+ */
+static gboolean
+rspamd_fuzzy_encrypted_finish (struct fuzzy_session *s, gboolean decrypted)
+{
+	enum rspamd_fuzzy_epoch epoch;
 
-	/* Now decrypt request */
-	if (!rspamd_cryptobox_decrypt_nm_inplace (payload, payload_len, hdr->nonce,
-			rspamd_pubkey_get_nm (rk),
-			hdr->mac, RSPAMD_CRYPTOBOX_MODE_25519)) {
+	if (!decrypted) {
 		msg_err ("decryption failed");
-		rspamd_pubkey_unref (rk);
+		return FALSE;
+	}
+
+	if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
+		epoch = rspamd_fuzzy_command_valid (&s->cmd.enc_normal.cmd,
+				sizeof (s->cmd.enc_normal.cmd));
+	}
+	else {
+		epoch = rspamd_fuzzy_command_valid (&s->cmd.enc_shingle.cmd.basic,
+				sizeof (s->cmd.enc_shingle.cmd));
+	}
 
+	if (epoch == RSPAMD_FUZZY_EPOCH_MAX) {
+		msg_debug ("invalid encrypted fuzzy command received");
 		return FALSE;
 	}
 
-	memcpy (s->nm, rspamd_pubkey_get_nm (rk), sizeof (s->nm));
-	rspamd_pubkey_unref (rk);
+	/* Encrypted is epoch 10 at least */
+	s->epoch = epoch;
 
 	return TRUE;
 }
 
+/*
+ * Reads command from the datagram, encrypted commands are just copied and
+ * should be decrypted and validated afterwards
+ */
 static gboolean
 rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
 {
@@ -879,36 +918,10 @@ rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
 	case sizeof (struct rspamd_fuzzy_encrypted_cmd):
 		s->cmd_type = CMD_ENCRYPTED_NORMAL;
 		memcpy (&s->cmd.enc_normal, buf, sizeof (s->cmd.enc_normal));
-
-		if (!rspamd_fuzzy_decrypt_command (s)) {
-			return FALSE;
-		}
-		epoch = rspamd_fuzzy_command_valid (&s->cmd.enc_normal.cmd,
-				sizeof (s->cmd.enc_normal.cmd));
-
-		if (epoch == RSPAMD_FUZZY_EPOCH_MAX) {
-			msg_debug ("invalid fuzzy command of size %d received", buflen);
-			return FALSE;
-		}
-		/* Encrypted is epoch 10 at least */
-		s->epoch = epoch;
 		break;
 	case sizeof (struct rspamd_fuzzy_encrypted_shingle_cmd):
 		s->cmd_type = CMD_ENCRYPTED_SHINGLE;
 		memcpy (&s->cmd.enc_shingle, buf, sizeof (s->cmd.enc_shingle));
-
-		if (!rspamd_fuzzy_decrypt_command (s)) {
-			return FALSE;
-		}
-		epoch = rspamd_fuzzy_command_valid (&s->cmd.enc_shingle.cmd.basic,
-				sizeof (s->cmd.enc_shingle.cmd));
-
-		if (epoch == RSPAMD_FUZZY_EPOCH_MAX) {
-			msg_debug ("invalid fuzzy command of size %d received", buflen);
-			return FALSE;
-		}
-
-		s->epoch = epoch;
 		break;
 	default:
 		msg_debug ("invalid fuzzy command of size %d received", buflen);
@@ -1247,6 +1260,108 @@ accept_fuzzy_mirror_socket (gint fd, short what, void *arg)
 			ctx->ev_base);
 }
 
+static void
+rspamd_fuzzy_invalid_command (struct fuzzy_session *session)
+{
+	guint64 *nerrors;
+
+	/* Discard input */
+	session->ctx->stat.invalid_requests ++;
+	msg_debug ("invalid fuzzy command received");
+
+	nerrors = rspamd_lru_hash_lookup (session->ctx->errors_ips,
+			session->addr, -1);
+
+	if (nerrors == NULL) {
+		nerrors = g_malloc (sizeof (*nerrors));
+		*nerrors = 1;
+		rspamd_lru_hash_insert (session->ctx->errors_ips,
+				rspamd_inet_address_copy (session->addr),
+				nerrors, -1, -1);
+	}
+	else {
+		*nerrors = *nerrors + 1;
+	}
+}
+
+/*
+ * Decrypts and processes commands received in a single loop iteration:
+ * shared secrets are derived for all of them at once and the payloads are
+ * decrypted together in SIMD lanes
+ */
+static void
+rspamd_fuzzy_process_batch (struct fuzzy_session **sessions, gboolean *valid,
+		guint nsessions)
+{
+	struct rspamd_cryptobox_batch_elt elts[FUZZY_BATCH_MAX];
+	struct rspamd_cryptobox_keypair *lks[FUZZY_BATCH_MAX];
+	struct rspamd_cryptobox_pubkey *rks[FUZZY_BATCH_MAX];
+	guint idx[FUZZY_BATCH_MAX];
+	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
+	struct fuzzy_session *session;
+	struct fuzzy_key *key;
+	guint i, nenc = 0;
+
+	for (i = 0; i < nsessions; i ++) {
+		session = sessions[i];
+
+		if (!valid[i] || (session->cmd_type != CMD_ENCRYPTED_NORMAL &&
+				session->cmd_type != CMD_ENCRYPTED_SHINGLE)) {
+			continue;
+		}
+
+		rks[nenc] = rspamd_fuzzy_encrypted_prepare (session, &key);
+
+		if (rks[nenc] == NULL) {
+			valid[i] = FALSE;
+			continue;
+		}
+
+		lks[nenc] = key->key;
+		idx[nenc] = i;
+		nenc ++;
+	}
+
+	if (nenc > 0) {
+		rspamd_keypair_cache_process_batch (sessions[0]->ctx->keypair_cache,
+				lks, rks, nenc);
+
+		for (i = 0; i < nenc; i ++) {
+			session = sessions[idx[i]];
+			memcpy (session->nm, rspamd_pubkey_get_nm (rks[i]),
+					sizeof (session->nm));
+			rspamd_pubkey_unref (rks[i]);
+
+			rspamd_fuzzy_encrypted_parts (session, &hdr, &elts[i].data,
+					&elts[i].len);
+			elts[i].nonce = hdr->nonce;
+			elts[i].nm = session->nm;
+			elts[i].mac = hdr->mac;
+		}
+
+		rspamd_cryptobox_decrypt_nm_inplace_batch (elts, nenc,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+
+		for (i = 0; i < nenc; i ++) {
+			valid[idx[i]] = rspamd_fuzzy_encrypted_finish (sessions[idx[i]],
+					elts[i].ok);
+		}
+	}
+
+	for (i = 0; i < nsessions; i ++) {
+		session = sessions[i];
+
+		if (valid[i]) {
+			rspamd_fuzzy_process_command (session);
+		}
+		else {
+			rspamd_fuzzy_invalid_command (session);
+		}
+
+		REF_RELEASE (session);
+	}
+}
+
 /*
  * Accept new connection and construct task
  */
@@ -1254,72 +1369,56 @@ static void
 accept_fuzzy_socket (gint fd, short what, void *arg)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
-	struct fuzzy_session *session;
+	struct fuzzy_session *session, *sessions[FUZZY_BATCH_MAX];
+	gboolean valid[FUZZY_BATCH_MAX], more = TRUE;
 	rspamd_inet_addr_t *addr;
 	gssize r;
 	guint8 buf[512];
-	guint64 *nerrors;
+	guint nsessions;
 
 	/* Got some data */
 	if (what == EV_READ) {
 
-		for (;;) {
-			worker->nconns++;
+		while (more) {
+			nsessions = 0;
 
-			r = rspamd_inet_address_recvfrom (fd,
-					buf,
-					sizeof (buf),
-					0,
-					&addr);
+			while (nsessions < FUZZY_BATCH_MAX) {
+				r = rspamd_inet_address_recvfrom (fd,
+						buf,
+						sizeof (buf),
+						0,
+						&addr);
 
-			if (r == -1) {
-				if (errno == EINTR) {
-					continue;
-				}
-				else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (r == -1) {
+					if (errno == EINTR) {
+						continue;
+					}
+					else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+						msg_err ("got error while reading from socket: %d, %s",
+								errno,
+								strerror (errno));
+					}
 
-					return;
+					more = FALSE;
+					break;
 				}
 
-				msg_err ("got error while reading from socket: %d, %s",
-						errno,
-						strerror (errno));
-				return;
+				worker->nconns++;
+				session = g_slice_alloc0 (sizeof (*session));
+				REF_INIT_RETAIN (session, fuzzy_session_destroy);
+				session->worker = worker;
+				session->fd = fd;
+				session->ctx = worker->ctx;
+				session->time = (guint64) time (NULL);
+				session->addr = addr;
+
+				valid[nsessions] = rspamd_fuzzy_cmd_from_wire (buf, r, session);
+				sessions[nsessions ++] = session;
 			}
 
-			session = g_slice_alloc0 (sizeof (*session));
-			REF_INIT_RETAIN (session, fuzzy_session_destroy);
-			session->worker = worker;
-			session->fd = fd;
-			session->ctx = worker->ctx;
-			session->time = (guint64) time (NULL);
-			session->addr = addr;
-
-			if (rspamd_fuzzy_cmd_from_wire (buf, r, session)) {
-				/* Check shingles count sanity */
-				rspamd_fuzzy_process_command (session);
+			if (nsessions > 0) {
+				rspamd_fuzzy_process_batch (sessions, valid, nsessions);
 			}
-			else {
-				/* Discard input */
-				session->ctx->stat.invalid_requests ++;
-				msg_debug ("invalid fuzzy command of size %z received", r);
-
-				nerrors = rspamd_lru_hash_lookup (session->ctx->errors_ips,
-						addr, -1);
-
-				if (nerrors == NULL) {
-					nerrors = g_malloc (sizeof (*nerrors));
-					*nerrors = 1;
-					rspamd_lru_hash_insert (session->ctx->errors_ips,
-							rspamd_inet_address_copy (addr),
-							nerrors, -1, -1);
-				}
-				else {
-					*nerrors = *nerrors + 1;
-				}
-			}
-
-			REF_RELEASE (session);
 		}
 	}
 }
@@ -1460,14 +1559,12 @@ rspamd_fuzzy_storage_stat_key (struct fuzzy_key_stat *key_stat)
 static ucl_object_t *
 rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat)
 {
-	GHashTableIter it, ip_it;
-	GHashTable *ip_hash;
+	GHashTableIter it;
 	struct fuzzy_key_stat *key_stat;
 	struct fuzzy_key *key;
-	rspamd_lru_element_t *lru_elt;
 	ucl_object_t *obj, *keys_obj, *elt, *ip_elt, *ip_cur;
 	gpointer k, v;
-	gint i;
+	gint i, ip_it;
 	gchar keyname[17];
 
 	obj = ucl_object_typed_new (UCL_OBJECT);
@@ -1485,21 +1582,17 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 			elt = rspamd_fuzzy_storage_stat_key (key_stat);
 
 			if (key_stat->last_ips && ip_stat) {
-				ip_hash = rspamd_lru_hash_get_htable (key_stat->last_ips);
-
-				if (ip_hash) {
-					g_hash_table_iter_init (&ip_it, ip_hash);
-					ip_elt = ucl_object_typed_new (UCL_OBJECT);
-
-					while (g_hash_table_iter_next (&ip_it, &k, &v)) {
-						lru_elt = v;
-						ip_cur = rspamd_fuzzy_storage_stat_key (lru_elt->data);
-						ucl_object_insert_key (ip_elt, ip_cur,
-								rspamd_inet_address_to_string (k), 0, true);
-					}
-
-					ucl_object_insert_key (elt, ip_elt, "ips", 0, false);
+				ip_it = 0;
+				ip_elt = ucl_object_typed_new (UCL_OBJECT);
+
+				while ((ip_it = rspamd_lru_hash_foreach (key_stat->last_ips,
+						ip_it, &k, &v)) != -1) {
+					ip_cur = rspamd_fuzzy_storage_stat_key (v);
+					ucl_object_insert_key (ip_elt, ip_cur,
+							rspamd_inet_address_to_string (k), 0, true);
 				}
+
+				ucl_object_insert_key (elt, ip_elt, "ips", 0, false);
 			}
 
 			ucl_object_insert_key (keys_obj, elt, keyname, 0, true);
@@ -1526,26 +1619,21 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 			false);
 
 	if (ctx->errors_ips && ip_stat) {
-		ip_hash = rspamd_lru_hash_get_htable (ctx->errors_ips);
-
-		if (ip_hash) {
-			g_hash_table_iter_init (&ip_it, ip_hash);
-			ip_elt = ucl_object_typed_new (UCL_OBJECT);
-
-			while (g_hash_table_iter_next (&ip_it, &k, &v)) {
-				lru_elt = v;
-
-				ucl_object_insert_key (ip_elt,
-						ucl_object_fromint (*(guint64 *)lru_elt->data),
-						rspamd_inet_address_to_string (k), 0, true);
-			}
-
-			ucl_object_insert_key (obj,
-					ip_elt,
-					"errors_ips",
-					0,
-					false);
+		ip_it = 0;
+		ip_elt = ucl_object_typed_new (UCL_OBJECT);
+
+		while ((ip_it = rspamd_lru_hash_foreach (ctx->errors_ips,
+				ip_it, &k, &v)) != -1) {
+			ucl_object_insert_key (ip_elt,
+					ucl_object_fromint (*(guint64 *)v),
+					rspamd_inet_address_to_string (k), 0, true);
 		}
+
+		ucl_object_insert_key (obj,
+				ip_elt,
+				"errors_ips",
+				0,
+				false);
 	}
 
 	/* Checked by epoch */
@@ -27,6 +27,11 @@
 #include "chacha.h"
 #include "platform_config.h"
 
+#if defined(__x86_64__) || defined(__SSE2__)
+#define CHACHA_MULTI_SSE2 1
+#include <emmintrin.h>
+#endif
+
 extern unsigned long cpu_config;
 
 typedef struct chacha_impl_t {
@@ -261,3 +266,148 @@ xchacha (const chacha_key *key, const chacha_iv24 *iv,
 {
 	chacha_impl->xchacha (key, iv, in, out, inlen, rounds);
 }
+
+/*
+ * Multi-buffer xchacha: each SIMD lane holds the same state word of a
+ * different message, so independent short messages are processed at once
+ */
+#ifdef CHACHA_MULTI_SSE2
+#define CHACHA_ROTL4(x, n) \
+	_mm_or_si128 (_mm_slli_epi32 ((x), (n)), _mm_srli_epi32 ((x), 32 - (n)))
+#define CHACHA_QUARTER4(a, b, c, d) do { \
+	a = _mm_add_epi32 (a, b); d = CHACHA_ROTL4 (_mm_xor_si128 (d, a), 16); \
+	c = _mm_add_epi32 (c, d); b = CHACHA_ROTL4 (_mm_xor_si128 (b, c), 12); \
+	a = _mm_add_epi32 (a, b); d = CHACHA_ROTL4 (_mm_xor_si128 (d, a), 8); \
+	c = _mm_add_epi32 (c, d); b = CHACHA_ROTL4 (_mm_xor_si128 (b, c), 7); \
+} while (0)
+
+static void
+chacha_multi_rounds (__m128i *x, size_t rounds)
+{
+	size_t i;
+
+	for (i = 0; i < rounds; i += 2) {
+		CHACHA_QUARTER4 (x[0], x[4], x[8], x[12]);
+		CHACHA_QUARTER4 (x[1], x[5], x[9], x[13]);
+		CHACHA_QUARTER4 (x[2], x[6], x[10], x[14]);
+		CHACHA_QUARTER4 (x[3], x[7], x[11], x[15]);
+		CHACHA_QUARTER4 (x[0], x[5], x[10], x[15]);
+		CHACHA_QUARTER4 (x[1], x[6], x[11], x[12]);
+		CHACHA_QUARTER4 (x[2], x[7], x[8], x[13]);
+		CHACHA_QUARTER4 (x[3], x[4], x[9], x[14]);
+	}
+}
+
+/* Loads a little endian word at the specified offset from each lane */
+static inline __m128i
+chacha_multi_load (const unsigned char **p, size_t off)
+{
+	guint32 w[CHACHA_MULTI_LANES];
+	guint i;
+
+	for (i = 0; i < CHACHA_MULTI_LANES; i ++) {
+		memcpy (&w[i], p[i] + off, sizeof (w[i]));
+	}
+
+	return _mm_set_epi32 (w[3], w[2], w[1], w[0]);
+}
+
+/* Transposes 4 words of 4 lanes and stores them to each lane output */
+static inline void
+chacha_multi_store (__m128i a, __m128i b, __m128i c, __m128i d,
+		unsigned char **out, size_t nlanes, size_t off)
+{
+	__m128i t0, t1, t2, t3, r[CHACHA_MULTI_LANES];
+	guint i;
+
+	t0 = _mm_unpacklo_epi32 (a, b);
+	t1 = _mm_unpacklo_epi32 (c, d);
+	t2 = _mm_unpackhi_epi32 (a, b);
+	t3 = _mm_unpackhi_epi32 (c, d);
+	r[0] = _mm_unpacklo_epi64 (t0, t1);
+	r[1] = _mm_unpackhi_epi64 (t0, t1);
+	r[2] = _mm_unpacklo_epi64 (t2, t3);
+	r[3] = _mm_unpackhi_epi64 (t2, t3);
+
+	for (i = 0; i < nlanes; i ++) {
+		_mm_storeu_si128 ((__m128i *)(out[i] + off), r[i]);
+	}
+}
+
+void
+xchacha_multi_stream (const chacha_key **keys, const chacha_iv24 **ivs,
+		size_t nlanes, unsigned char **out, size_t nblocks, size_t rounds)
+{
+	const unsigned char *k[CHACHA_MULTI_LANES], *n[CHACHA_MULTI_LANES];
+	__m128i st[16], x[16];
+	size_t i, blk;
+
+	g_assert (nlanes > 0 && nlanes <= CHACHA_MULTI_LANES);
+
+	/* Missing lanes repeat the first one and are not stored */
+	for (i = 0; i < CHACHA_MULTI_LANES; i ++) {
+		k[i] = keys[i < nlanes ? i : 0]->b;
+		n[i] = ivs[i < nlanes ? i : 0]->b;
+	}
+
+	/* hchacha */
+	x[0] = _mm_set1_epi32 (0x61707865);
+	x[1] = _mm_set1_epi32 (0x3320646e);
+	x[2] = _mm_set1_epi32 (0x79622d32);
+	x[3] = _mm_set1_epi32 (0x6b206574);
+
+	for (i = 0; i < 8; i ++) {
+		x[i + 4] = chacha_multi_load (k, i * 4);
+	}
+	for (i = 0; i < 4; i ++) {
+		x[i + 12] = chacha_multi_load (n, i * 4);
+	}
+
+	memcpy (st, x, sizeof (__m128i) * 4);
+	chacha_multi_rounds (x, rounds);
+
+	/* Subkey is words 0-3 and 12-15 of hchacha output */
+	for (i = 0; i < 4; i ++) {
+		st[i + 4] = x[i];
+		st[i + 8] = x[i + 12];
+	}
+
+	st[12] = _mm_setzero_si128 ();
+	st[13] = _mm_setzero_si128 ();
+	st[14] = chacha_multi_load (n, 16);
+	st[15] = chacha_multi_load (n, 20);
+
+	for (blk = 0; blk < nblocks; blk ++) {
+		st[12] = _mm_set1_epi32 ((guint32)blk);
+		memcpy (x, st, sizeof (x));
+		chacha_multi_rounds (x, rounds);
+
+		for (i = 0; i < 16; i ++) {
+			x[i] = _mm_add_epi32 (x[i], st[i]);
+		}
+
+		for (i = 0; i < 16; i += 4) {
+			chacha_multi_store (x[i], x[i + 1], x[i + 2], x[i + 3], out, nlanes,
+					blk * CHACHA_BLOCKBYTES + i * 4);
+		}
+	}
+
+	rspamd_explicit_memzero (st, sizeof (st));
+	rspamd_explicit_memzero (x, sizeof (x));
+}
+#else
+void
+xchacha_multi_stream (const chacha_key **keys, const chacha_iv24 **ivs,
+		size_t nlanes, unsigned char **out, size_t nblocks, size_t rounds)
+{
+	size_t i;
+
+	g_assert (nlanes > 0 && nlanes <= CHACHA_MULTI_LANES);
+
+	for (i = 0; i < nlanes; i ++) {
+		memset (out[i], 0, nblocks * CHACHA_BLOCKBYTES);
+		xchacha (keys[i], ivs[i], out[i], out[i], nblocks * CHACHA_BLOCKBYTES,
+				rounds);
+	}
+}
+#endif
@@ -28,6 +28,7 @@
 
 enum chacha_constants {
 	CHACHA_BLOCKBYTES = 64,
+	CHACHA_MULTI_LANES = 4,
 };
 
 typedef struct chacha_state_internal_t {
@@ -74,6 +75,13 @@ void xchacha (const chacha_key *key, const chacha_iv24 *iv,
 		const unsigned char *in, unsigned char *out, size_t inlen,
 		size_t rounds);
 
+/*
+ * Generates nblocks of xchacha keystream starting from block 0 for up to
+ * CHACHA_MULTI_LANES independent keys and nonces at once
+ */
+void xchacha_multi_stream (const chacha_key **keys, const chacha_iv24 **ivs,
+		size_t nlanes, unsigned char **out, size_t nblocks, size_t rounds);
+
 const char* chacha_load (void);
 
 #endif /* CHACHA_H_ */
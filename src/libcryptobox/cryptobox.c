@@ -1143,6 +1143,82 @@ rspamd_cryptobox_decrypt_nm_inplace (guchar *data, gsize len,
 	return ret;
 }
 
+/* Messages that are longer are not decrypted in batches */
+#define CRYPTOBOX_BATCH_MAX_BLOCKS 16
+
+static void
+rspamd_cryptobox_decrypt_lanes (struct rspamd_cryptobox_batch_elt **lanes,
+		gsize nlanes, gsize nblocks)
+{
+	guchar RSPAMD_ALIGNED(32) ks[CHACHA_MULTI_LANES][
+			(CRYPTOBOX_BATCH_MAX_BLOCKS + 1) * CHACHA_BLOCKBYTES];
+	const chacha_key *keys[CHACHA_MULTI_LANES];
+	const chacha_iv24 *ivs[CHACHA_MULTI_LANES];
+	guchar *out[CHACHA_MULTI_LANES], *p;
+	struct rspamd_cryptobox_batch_elt *elt;
+	rspamd_mac_t mac;
+	gsize i, j;
+
+	for (i = 0; i < nlanes; i ++) {
+		keys[i] = (const chacha_key *)lanes[i]->nm;
+		ivs[i] = (const chacha_iv24 *)lanes[i]->nonce;
+		out[i] = ks[i];
+	}
+
+	xchacha_multi_stream (keys, ivs, nlanes, out, nblocks, 20);
+
+	for (i = 0; i < nlanes; i ++) {
+		elt = lanes[i];
+		/* The first block is used for poly1305 key as in the stream mode */
+		poly1305_auth (mac, elt->data, elt->len, (const poly1305_key *)ks[i]);
+		elt->ok = poly1305_verify (mac, elt->mac);
+
+		if (elt->ok) {
+			p = ks[i] + CHACHA_BLOCKBYTES;
+
+			for (j = 0; j < elt->len; j ++) {
+				elt->data[j] ^= p[j];
+			}
+		}
+	}
+
+	rspamd_explicit_memzero (ks, sizeof (ks));
+}
+
+void
+rspamd_cryptobox_decrypt_nm_inplace_batch (
+		struct rspamd_cryptobox_batch_elt *elts, gsize cnt,
+		enum rspamd_cryptobox_mode mode)
+{
+	struct rspamd_cryptobox_batch_elt *lanes[CHACHA_MULTI_LANES], *elt;
+	gsize i, nlanes = 0, nblocks = 0, elt_blocks;
+
+	for (i = 0; i < cnt; i ++) {
+		elt = &elts[i];
+		elt_blocks = (elt->len + CHACHA_BLOCKBYTES - 1) / CHACHA_BLOCKBYTES;
+
+		if (mode != RSPAMD_CRYPTOBOX_MODE_25519 ||
+				elt_blocks > CRYPTOBOX_BATCH_MAX_BLOCKS) {
+			elt->ok = rspamd_cryptobox_decrypt_nm_inplace (elt->data, elt->len,
+					elt->nonce, elt->nm, elt->mac, mode);
+			continue;
+		}
+
+		lanes[nlanes ++] = elt;
+		nblocks = MAX (nblocks, elt_blocks + 1);
+
+		if (nlanes == CHACHA_MULTI_LANES) {
+			rspamd_cryptobox_decrypt_lanes (lanes, nlanes, nblocks);
+			nlanes = 0;
+			nblocks = 0;
+		}
+	}
+
+	if (nlanes > 0) {
+		rspamd_cryptobox_decrypt_lanes (lanes, nlanes, nblocks);
+	}
+}
+
 gboolean
 rspamd_cryptobox_decrypt_inplace (guchar *data, gsize len,
 		const rspamd_nonce_t nonce,
@@ -23,6 +23,19 @@ struct rspamd_cryptobox_segment {
 	gsize len;
 };
 
+/*
+ * Element of batch decryption: independent message with its own nonce and
+ * shared secret
+ */
+struct rspamd_cryptobox_batch_elt {
+	guchar *data;
+	gsize len;
+	const guchar *nonce;
+	const guchar *nm;
+	const guchar *mac;
+	gboolean ok;
+};
+
 #define rspamd_cryptobox_MAX_NONCEBYTES 24
 #define rspamd_cryptobox_MAX_PKBYTES 65
 #define rspamd_cryptobox_MAX_SKBYTES 32
@@ -174,6 +187,17 @@ gboolean rspamd_cryptobox_decrypt_nm_inplace (guchar *data, gsize len,
 		 const rspamd_nm_t nm, const rspamd_mac_t sig,
 		 enum rspamd_cryptobox_mode mode);
 
+/**
+ * Decrypt and verify many independent messages inplace. Short messages are
+ * processed in parallel SIMD lanes, so it is faster than decrypting them one
+ * by one. `ok` field of each element is set to TRUE if it has been verified
+ * @param elts messages to decrypt
+ * @param cnt count of messages
+ */
+void rspamd_cryptobox_decrypt_nm_inplace_batch (
+		struct rspamd_cryptobox_batch_elt *elts, gsize cnt,
+		enum rspamd_cryptobox_mode mode);
+
 /**
  * Generate shared secret from local sk and remote pk
  * @param nm shared secret
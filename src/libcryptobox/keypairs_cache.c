@@ -69,10 +69,11 @@ rspamd_keypair_cache_new (guint max_items)
 	return c;
 }
 
-void
-rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
+static void
+rspamd_keypair_cache_process_common (struct rspamd_keypair_cache *c,
 		struct rspamd_cryptobox_keypair *lk,
-		struct rspamd_cryptobox_pubkey *rk)
+		struct rspamd_cryptobox_pubkey *rk,
+		time_t now)
 {
 	struct rspamd_keypair_elt search, *new;
 
@@ -86,7 +87,7 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 	memcpy (search.pair, rk->id, rspamd_cryptobox_HASHBYTES);
 	memcpy (&search.pair[rspamd_cryptobox_HASHBYTES], lk->id,
 			rspamd_cryptobox_HASHBYTES);
-	new = rspamd_lru_hash_lookup (c->hash, &search, time (NULL));
+	new = rspamd_lru_hash_lookup (c->hash, &search, now);
 
 	if (rk->nm) {
 		REF_RELEASE (rk->nm);
@@ -123,7 +124,7 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 			rspamd_cryptobox_nm (new->nm->nm, rk_nist->pk, sk_nist->sk, rk->alg);
 		}
 
-		rspamd_lru_hash_insert (c->hash, new, new, time (NULL), -1);
+		rspamd_lru_hash_insert (c->hash, new, new, now, -1);
 	}
 
 	g_assert (new != NULL);
@@ -132,6 +133,32 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 	REF_RETAIN (rk->nm);
 }
 
+void
+rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
+		struct rspamd_cryptobox_keypair *lk,
+		struct rspamd_cryptobox_pubkey *rk)
+{
+	rspamd_keypair_cache_process_common (c, lk, rk, time (NULL));
+}
+
+void
+rspamd_keypair_cache_process_batch (struct rspamd_keypair_cache *c,
+		struct rspamd_cryptobox_keypair **lks,
+		struct rspamd_cryptobox_pubkey **rks,
+		gsize cnt)
+{
+	time_t now = time (NULL);
+	gsize i;
+
+	/*
+	 * Shared secrets computed for the first element of a batch are inserted
+	 * to the cache, so the same pubkey in the rest of batch is a cache hit
+	 */
+	for (i = 0; i < cnt; i ++) {
+		rspamd_keypair_cache_process_common (c, lks[i], rks[i], now);
+	}
+}
+
 void
 rspamd_keypair_cache_destroy (struct rspamd_keypair_cache *c)
 {
@@ -39,6 +39,19 @@ void rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		struct rspamd_cryptobox_keypair *lk,
 		struct rspamd_cryptobox_pubkey *rk);
 
+/**
+ * Process many pairs of local and remote keys at once, e.g. all requests
+ * received in a single event loop iteration
+ * @param c cache of keypairs
+ * @param lks array of local keys
+ * @param rks array of remote keys
+ * @param cnt number of pairs
+ */
+void rspamd_keypair_cache_process_batch (struct rspamd_keypair_cache *c,
+		struct rspamd_cryptobox_keypair **lks,
+		struct rspamd_cryptobox_pubkey **rks,
+		gsize cnt);
+
 /**
  * Destroy old keypair cache
  * @param c cache object
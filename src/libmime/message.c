@@ -604,8 +604,10 @@ detect_text_language (struct mime_text_part *part)
 	if (part != NULL) {
 		if (IS_PART_UTF (part)) {
 			/* Try to detect encoding by several symbols */
-			const gchar *p, *pp;
-			gunichar c;
+			const guchar *p;
+			gunichar buf[64];
+			gboolean alpha;
+			gsize nchars, consumed, i;
 			gint32 remain = part->content->len, max = 0, processed = 0;
 			gint32 scripts[G_N_ELEMENTS (language_codes)];
 			GUnicodeScript scc, sel = G_UNICODE_SCRIPT_COMMON;
@@ -614,20 +616,27 @@ detect_text_language (struct mime_text_part *part)
 			memset (scripts, 0, sizeof (scripts));
 
 			while (remain > 0 && processed < max_chars) {
-				c = g_utf8_get_char_validated (p, remain);
-				if (c == (gunichar) -2 || c == (gunichar) -1) {
-					break;
-				}
-				if (g_unichar_isalpha (c)) {
-					scc = g_unichar_get_script (c);
-					if (scc < (gint)G_N_ELEMENTS (scripts)) {
-						scripts[scc]++;
+				nchars = rspamd_utf8_decode (p, remain, buf, G_N_ELEMENTS (buf),
+						&consumed);
+
+				for (i = 0; i < nchars && processed < max_chars; i ++) {
+					scc = rspamd_unichar_get_script (buf[i], &alpha);
+
+					if (alpha) {
+						if (scc < (gint)G_N_ELEMENTS (scripts)) {
+							scripts[scc]++;
+						}
+						processed ++;
 					}
-					processed ++;
 				}
-				pp = g_utf8_next_char (p);
-				remain -= pp - p;
-				p = pp;
+
+				if (nchars < G_N_ELEMENTS (buf)) {
+					/* Invalid character or the end of text */
+					break;
+				}
+
+				p += consumed;
+				remain -= consumed;
 			}
 			for (remain = 0; remain < (gint)G_N_ELEMENTS (scripts); remain++) {
 				if (scripts[remain] > max) {
@@ -0,0 +1,1237 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "util.h"
+#include "cfg_file.h"
+#include "rspamd.h"
+#include "message.h"
+#include "expression.h"
+#include "re_cache.h"
+#include "sa_rules.h"
+
+/* SA plugins whose `ifplugin` sections are parsed */
+static const gchar *rspamd_sa_known_plugins[] = {
+	"Mail::SpamAssassin::Plugin::FreeMail",
+	"Mail::SpamAssassin::Plugin::HeaderEval",
+	"Mail::SpamAssassin::Plugin::ReplaceTags",
+	"Mail::SpamAssassin::Plugin::RelayEval",
+	"Mail::SpamAssassin::Plugin::MIMEEval",
+	"Mail::SpamAssassin::Plugin::BodyEval",
+	"Mail::SpamAssassin::Plugin::MIMEHeader",
+	"Mail::SpamAssassin::Plugin::WLBLEval",
+	NULL
+};
+
+/* SA symbols that have rspamd equivalents, used for meta rules atoms */
+static const struct {
+	const gchar *sa;
+	const gchar *rspamd;
+} rspamd_sa_replacements[] = {
+	{"USER_IN_SPF_WHITELIST", "WHITELIST_SPF"},
+	{"USER_IN_DEF_SPF_WL", "WHITELIST_SPF"},
+	{"SPF_PASS", "R_SPF_ALLOW"},
+	{"SPF_FAIL", "R_SPF_FAIL"},
+	{"SPF_SOFTFAIL", "R_SPF_SOFTFAIL"},
+	{"SPF_HELO_PASS", "R_SPF_ALLOW"},
+	{"SPF_HELLO_FAIL", "R_SPF_FAIL"},
+	{"SPF_HELLO_SOFTFAIL", "R_SPF_SOFTFAIL"},
+	{"USER_IN_DKIM_WHITELIST", "WHITELIST_DKIM"},
+	{"USER_IN_DEF_DKIM_WL", "WHITELIST_DKIM"},
+	{"DKIM_VALID", "R_DKIM_ALLOW"},
+	{"URIBL_SBL_A", "URIBL_SBL"},
+	{"URIBL_DBL_SPAM", "DBL_SPAM"},
+	{"URIBL_DBL_PHISH", "DBL_PHISH"},
+	{"URIBL_DBL_MALWARE", "DBL_MALWARE"},
+	{"URIBL_DBL_BOTNETCC", "DBL_BOTNET"},
+	{"URIBL_DBL_ABUSE_SPAM", "DBL_ABUSE"},
+	{"URIBL_DBL_ABUSE_REDIR", "DBL_ABUSE_REDIR"},
+	{"URIBL_DBL_ABUSE_MALW", "DBL_ABUSE_MALWARE"},
+	{"URIBL_DBL_ABUSE_BOTCC", "DBL_ABUSE_BOTNET"},
+	{"URIBL_WS_SURBL", "WS_SURBL_MULTI"},
+	{"URIBL_PH_SURBL", "PH_SURBL_MULTI"},
+	{"URIBL_MW_SURBL", "MW_SURBL_MULTI"},
+	{"URIBL_CR_SURBL", "CRACKED_SURBL"},
+	{"URIBL_ABUSE_SURBL", "ABUSE_SURBL"},
+	{"BODY_URI_ONLY", "R_EMPTY_IMAGE"},
+	{"HTML_IMAGE_ONLY_04", "HTML_SHORT_LINK_IMG_1"},
+	{"HTML_IMAGE_ONLY_08", "HTML_SHORT_LINK_IMG_1"},
+	{"HTML_IMAGE_ONLY_12", "HTML_SHORT_LINK_IMG_1"},
+	{"HTML_IMAGE_ONLY_16", "HTML_SHORT_LINK_IMG_2"},
+	{"HTML_IMAGE_ONLY_20", "HTML_SHORT_LINK_IMG_2"},
+	{"HTML_IMAGE_ONLY_24", "HTML_SHORT_LINK_IMG_3"},
+	{"HTML_IMAGE_ONLY_28", "HTML_SHORT_LINK_IMG_3"},
+	{"HTML_IMAGE_ONLY_32", "HTML_SHORT_LINK_IMG_3"},
+	{NULL, NULL}
+};
+
+/* Priority of scores defined in SA rules */
+#define RSPAMD_SA_SCORE_PRIORITY 2
+
+enum rspamd_sa_rule_type {
+	RSPAMD_SA_RULE_REGEXP = 0,
+	RSPAMD_SA_RULE_EXISTS,
+	RSPAMD_SA_RULE_META
+};
+
+struct rspamd_sa_header {
+	gchar *name;
+	rspamd_regexp_t *re;
+	enum rspamd_re_type type;
+	gboolean strong;
+};
+
+struct rspamd_sa_rule {
+	gchar *name;
+	gchar *description;
+	enum rspamd_sa_rule_type type;
+	/* Regexp and its class for non header rules */
+	rspamd_regexp_t *re;
+	enum rspamd_re_type re_type;
+	/* Array of struct rspamd_sa_header for header rules */
+	GArray *headers;
+	/* Value that is matched when none of headers is found */
+	gchar *unset;
+	/* Meta rules */
+	gchar *meta;
+	struct rspamd_expression *expr;
+	guint maxhits;
+	/* Symbols cache id or -1 if a rule is not a symbol */
+	gint id;
+	gboolean negate;
+	gboolean multiple;
+	gboolean publish;
+	gboolean disabled;
+	gboolean evaluating;
+	/* Used when dependencies of meta rules are checked */
+	gboolean checked;
+	gboolean visiting;
+};
+
+struct rspamd_sa_atom {
+	gchar *name;
+	/* Either local rule or external symbol */
+	struct rspamd_sa_rule *rule;
+	const gchar *symbol;
+};
+
+struct rspamd_sa_rules {
+	struct rspamd_config *cfg;
+	rspamd_mempool_t *pool;
+	/* Rules indexed by name */
+	GHashTable *rules;
+	/* Scores indexed by rule name, scores may be defined before rules */
+	GHashTable *scores;
+	/* Rules that require ReplaceTags plugin */
+	GHashTable *replaced;
+	/* Names of rules that are not supported natively */
+	GHashTable *skipped;
+	/* Depth of the skipped `if` section */
+	guint skip_depth;
+	guint nunsupported;
+	guint nmeta_disabled;
+};
+
+struct rspamd_sa_bind_cbdata {
+	struct rspamd_sa_rules *rules;
+	struct rspamd_sa_rule *rule;
+	/* Foreign symbols the registered meta rule already depends on */
+	GHashTable *deps;
+	/* Meta rules whose atoms have been already collected */
+	GHashTable *visited;
+	gboolean unsupported;
+};
+
+static rspamd_expression_atom_t * rspamd_sa_expr_parse (const gchar *line,
+		gsize len, rspamd_mempool_t *pool, gpointer ud, GError **err);
+static gint rspamd_sa_expr_process (gpointer input, rspamd_expression_atom_t *atom);
+static gint rspamd_sa_expr_priority (rspamd_expression_atom_t *atom);
+static void rspamd_sa_expr_destroy (rspamd_expression_atom_t *atom);
+
+static const struct rspamd_atom_subr sa_expr_subr = {
+	.parse = rspamd_sa_expr_parse,
+	.process = rspamd_sa_expr_process,
+	.priority = rspamd_sa_expr_priority,
+	.destroy = rspamd_sa_expr_destroy
+};
+
+static GQuark
+rspamd_sa_rules_quark (void)
+{
+	return g_quark_from_static_string ("sa-rules");
+}
+
+struct rspamd_sa_rules *
+rspamd_sa_rules_new (struct rspamd_config *cfg, rspamd_mempool_t *pool)
+{
+	struct rspamd_sa_rules *rules;
+
+	g_assert (cfg != NULL);
+	g_assert (pool != NULL);
+
+	rules = rspamd_mempool_alloc0 (pool, sizeof (*rules));
+	rules->cfg = cfg;
+	rules->pool = pool;
+	rules->rules = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	rules->scores = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	rules->replaced = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	rules->skipped = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	rspamd_mempool_add_destructor (pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, rules->rules);
+	rspamd_mempool_add_destructor (pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, rules->scores);
+	rspamd_mempool_add_destructor (pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, rules->replaced);
+	rspamd_mempool_add_destructor (pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, rules->skipped);
+
+	return rules;
+}
+
+/*
+ * Splits line to words dropping the trailing comment
+ */
+static gchar **
+rspamd_sa_split_words (const gchar *line, guint *nwords)
+{
+	gchar **words;
+	guint i, n = 0;
+	gboolean comment = FALSE;
+
+	words = g_strsplit_set (line, " \t\r\n", -1);
+
+	for (i = 0; words[i] != NULL; i ++) {
+		if (!comment && words[i][0] == '#') {
+			comment = TRUE;
+		}
+
+		if (comment || words[i][0] == '\0') {
+			g_free (words[i]);
+		}
+		else {
+			words[n ++] = words[i];
+		}
+	}
+
+	words[n] = NULL;
+	*nwords = n;
+
+	return words;
+}
+
+static gchar *
+rspamd_sa_join_words (struct rspamd_sa_rules *rules, gchar **words,
+		guint start)
+{
+	gchar *tmp, *res;
+
+	tmp = g_strjoinv (" ", words + start);
+	res = rspamd_mempool_strdup (rules->pool, tmp);
+	g_free (tmp);
+
+	return res;
+}
+
+static gboolean
+rspamd_sa_is_known_plugin (const gchar *name, gsize len)
+{
+	const gchar **pl;
+
+	for (pl = rspamd_sa_known_plugins; *pl != NULL; pl ++) {
+		if (strlen (*pl) == len && memcmp (*pl, name, len) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static const gchar *
+rspamd_sa_replacement (const gchar *name)
+{
+	guint i;
+
+	for (i = 0; rspamd_sa_replacements[i].sa != NULL; i ++) {
+		if (strcmp (rspamd_sa_replacements[i].sa, name) == 0) {
+			return rspamd_sa_replacements[i].rspamd;
+		}
+	}
+
+	return name;
+}
+
+static rspamd_regexp_t *
+rspamd_sa_regexp_new (struct rspamd_sa_rules *rules, const gchar *name,
+		const gchar *pattern)
+{
+	struct rspamd_config *cfg = rules->cfg;
+	rspamd_regexp_t *re;
+	GError *err = NULL;
+
+	re = rspamd_regexp_new (pattern, NULL, &err);
+
+	if (re == NULL) {
+		msg_warn_config ("cannot parse regexp '%s' for %s: %e", pattern, name,
+				err);
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		return NULL;
+	}
+
+	rspamd_mempool_add_destructor (rules->pool,
+			(rspamd_mempool_destruct_t)rspamd_regexp_unref, re);
+
+	return re;
+}
+
+static struct rspamd_sa_rule *
+rspamd_sa_rule_new (struct rspamd_sa_rules *rules, const gchar *name,
+		enum rspamd_sa_rule_type type)
+{
+	struct rspamd_sa_rule *rule;
+
+	rule = rspamd_mempool_alloc0 (rules->pool, sizeof (*rule));
+	rule->name = rspamd_mempool_strdup (rules->pool, name);
+	rule->type = type;
+	rule->id = -1;
+	/* Later definitions override the former ones */
+	g_hash_table_insert (rules->rules, rule->name, rule);
+	g_hash_table_remove (rules->skipped, name);
+
+	return rule;
+}
+
+/*
+ * Records rule that is not supported natively, so meta rules that depend on
+ * it are disabled instead of treating it as an unknown symbol
+ */
+static void
+rspamd_sa_rule_skip (struct rspamd_sa_rules *rules, const gchar *name)
+{
+	gchar *p;
+
+	p = rspamd_mempool_strdup (rules->pool, name);
+	g_hash_table_remove (rules->rules, name);
+	g_hash_table_insert (rules->skipped, p, p);
+	rules->nunsupported ++;
+}
+
+static void
+rspamd_sa_add_header (struct rspamd_sa_rules *rules, GArray *headers,
+		const gchar *name, enum rspamd_re_type type, gboolean strong)
+{
+	struct rspamd_sa_header h;
+
+	h.name = rspamd_mempool_strdup (rules->pool, name);
+	h.type = type;
+	h.strong = strong;
+	h.re = NULL;
+	g_array_append_val (headers, h);
+}
+
+/*
+ * Adds header to the rule expanding SA pseudo headers
+ */
+static void
+rspamd_sa_expand_header (struct rspamd_sa_rules *rules, GArray *headers,
+		const gchar *name, enum rspamd_re_type type, gboolean strong)
+{
+	if (strcmp (name, "MESSAGEID") == 0) {
+		rspamd_sa_add_header (rules, headers, "Message-ID", type, strong);
+		rspamd_sa_add_header (rules, headers, "X-Message-ID", type, strong);
+		rspamd_sa_add_header (rules, headers, "Resent-Message-ID", type, strong);
+	}
+	else if (strcmp (name, "ToCc") == 0) {
+		rspamd_sa_add_header (rules, headers, "To", type, strong);
+		rspamd_sa_add_header (rules, headers, "Cc", type, strong);
+		rspamd_sa_add_header (rules, headers, "Bcc", type, strong);
+	}
+	else {
+		rspamd_sa_add_header (rules, headers, name, type, strong);
+	}
+}
+
+/*
+ * Parses header definition like `From:raw|Sender`, returns NULL if some
+ * header function is not supported natively
+ */
+static GArray *
+rspamd_sa_parse_header_def (struct rspamd_sa_rules *rules,
+		const gchar *rule_name, const gchar *def, gboolean mime)
+{
+	struct rspamd_config *cfg = rules->cfg;
+	GArray *headers;
+	gchar **hdrs, **args;
+	enum rspamd_re_type type;
+	gboolean strong, ok = TRUE;
+	guint i, j;
+
+	headers = g_array_sized_new (FALSE, FALSE, sizeof (struct rspamd_sa_header),
+			1);
+	rspamd_mempool_add_destructor (rules->pool, rspamd_array_free_hard, headers);
+	hdrs = g_strsplit (def, "|", -1);
+
+	for (i = 0; hdrs[i] != NULL && ok; i ++) {
+		args = g_strsplit (hdrs[i], ":", -1);
+		type = mime ? RSPAMD_RE_MIMEHEADER : RSPAMD_RE_HEADER;
+		strong = FALSE;
+
+		for (j = 1; args[j] != NULL; j ++) {
+			if (strcmp (args[j], "raw") == 0) {
+				if (!mime) {
+					type = RSPAMD_RE_RAWHEADER;
+				}
+			}
+			else if (strcmp (args[j], "case") == 0) {
+				strong = TRUE;
+			}
+			else {
+				msg_debug_config ("header function %s is not supported "
+						"natively in %s", args[j], rule_name);
+				ok = FALSE;
+				break;
+			}
+		}
+
+		if (ok) {
+			rspamd_sa_expand_header (rules, headers, args[0], type, strong);
+		}
+
+		g_strfreev (args);
+	}
+
+	g_strfreev (hdrs);
+
+	return ok ? headers : NULL;
+}
+
+/* header SYMBOL Header =~ /regexp/ [if-unset: value] */
+static gboolean
+rspamd_sa_parse_header (struct rspamd_sa_rules *rules, gchar **words,
+		guint nwords, gboolean mime, GError **err)
+{
+	struct rspamd_sa_rule *rule;
+	rspamd_regexp_t *re;
+	GArray *headers = NULL;
+	gchar *pattern, *unset = NULL, *p, *end;
+	guint i;
+
+	if (nwords < 3) {
+		g_set_error (err, rspamd_sa_rules_quark (), EINVAL,
+				"invalid header rule definition");
+		return FALSE;
+	}
+
+	if (nwords >= 5 && (strcmp (words[3], "=~") == 0 ||
+			strcmp (words[3], "!~") == 0)) {
+		pattern = rspamd_sa_join_words (rules, words, 4);
+		p = strstr (pattern, "[if-unset:");
+
+		if (p != NULL && p > pattern && g_ascii_isspace (p[-1])) {
+			/* Cut the optional part and strip spaces before it */
+			end = p;
+			p += sizeof ("[if-unset:") - 1;
+
+			while (g_ascii_isspace (*p)) {
+				p ++;
+			}
+
+			unset = p;
+			p = strchr (p, ']');
+
+			if (p != NULL) {
+				*p = '\0';
+			}
+
+			while (end > pattern && g_ascii_isspace (end[-1])) {
+				end --;
+			}
+
+			*end = '\0';
+		}
+
+		re = rspamd_sa_regexp_new (rules, words[1], pattern);
+
+		if (re == NULL) {
+			rspamd_sa_rule_skip (rules, words[1]);
+			return TRUE;
+		}
+
+		if (strcmp (words[2], "ALL") != 0 && strcmp (words[2], "ALL:raw") != 0) {
+			headers = rspamd_sa_parse_header_def (rules, words[1], words[2],
+					mime);
+
+			if (headers == NULL) {
+				rspamd_sa_rule_skip (rules, words[1]);
+				return TRUE;
+			}
+		}
+
+		rule = rspamd_sa_rule_new (rules, words[1], RSPAMD_SA_RULE_REGEXP);
+		rule->negate = (words[3][0] == '!');
+		rule->unset = unset;
+
+		if (headers == NULL) {
+			rule->re = re;
+			rule->re_type = RSPAMD_RE_ALLHEADER;
+		}
+		else {
+			/* Each class requires its own regexp object */
+			for (i = 0; i < headers->len; i ++) {
+				g_array_index (headers, struct rspamd_sa_header, i).re =
+						i == 0 ? re :
+						rspamd_sa_regexp_new (rules, words[1], pattern);
+			}
+
+			rule->headers = headers;
+		}
+	}
+	else if (g_str_has_prefix (words[2], "exists:")) {
+		headers = g_array_sized_new (FALSE, FALSE,
+				sizeof (struct rspamd_sa_header), 1);
+		rspamd_mempool_add_destructor (rules->pool, rspamd_array_free_hard,
+				headers);
+		rspamd_sa_expand_header (rules, headers,
+				words[2] + sizeof ("exists:") - 1, RSPAMD_RE_HEADER, FALSE);
+		rule = rspamd_sa_rule_new (rules, words[1], RSPAMD_SA_RULE_EXISTS);
+		rule->headers = headers;
+	}
+	else {
+		/* Eval functions */
+		rspamd_sa_rule_skip (rules, words[1]);
+	}
+
+	return TRUE;
+}
+
+/* body SYMBOL /regexp/ and similar rules */
+static gboolean
+rspamd_sa_parse_re_rule (struct rspamd_sa_rules *rules, gchar **words,
+		guint nwords, enum rspamd_re_type type, GError **err)
+{
+	struct rspamd_sa_rule *rule;
+	rspamd_regexp_t *re;
+
+	if (nwords < 3) {
+		g_set_error (err, rspamd_sa_rules_quark (), EINVAL,
+				"invalid %s rule definition", words[0]);
+		return FALSE;
+	}
+
+	if (words[2][0] != '/' && words[2][0] != 'm') {
+		/* Eval functions */
+		rspamd_sa_rule_skip (rules, words[1]);
+		return TRUE;
+	}
+
+	re = rspamd_sa_regexp_new (rules, words[1],
+			rspamd_sa_join_words (rules, words, 2));
+
+	if (re != NULL) {
+		rule = rspamd_sa_rule_new (rules, words[1], RSPAMD_SA_RULE_REGEXP);
+		rule->re = re;
+		rule->re_type = type;
+	}
+	else {
+		rspamd_sa_rule_skip (rules, words[1]);
+	}
+
+	return TRUE;
+}
+
+static gdouble
+rspamd_sa_parse_score (struct rspamd_sa_rules *rules, gchar **words,
+		guint nwords)
+{
+	struct rspamd_config *cfg = rules->cfg;
+
+	if (nwords == 3) {
+		/* score rule <x> */
+		return strtod (words[2], NULL);
+	}
+	else if (nwords == 6) {
+		/*
+		 * score rule <x1> <x2> <x3> <x4>
+		 * we assume here that bayes and network are enabled and select <x4>
+		 */
+		return strtod (words[5], NULL);
+	}
+
+	msg_err_config ("invalid score for %s", words[1]);
+
+	return 0;
+}
+
+static void
+rspamd_sa_parse_tflags (struct rspamd_sa_rules *rules, gchar **words)
+{
+	struct rspamd_sa_rule *rule;
+	guint i;
+
+	rule = g_hash_table_lookup (rules->rules, words[1]);
+
+	if (rule == NULL) {
+		return;
+	}
+
+	for (i = 2; words[i] != NULL; i ++) {
+		if (strcmp (words[i], "publish") == 0) {
+			rule->publish = TRUE;
+		}
+		else if (strcmp (words[i], "multiple") == 0) {
+			rule->multiple = TRUE;
+		}
+		else if (g_str_has_prefix (words[i], "maxhits=")) {
+			rule->maxhits = strtoul (words[i] + sizeof ("maxhits=") - 1,
+					NULL, 10);
+		}
+	}
+}
+
+gboolean
+rspamd_sa_rules_parse_line (struct rspamd_sa_rules *rules,
+		const gchar *line, GError **err)
+{
+	struct rspamd_sa_rule *rule;
+	gchar **words, *pname, *p;
+	gdouble *pscore;
+	guint nwords, i;
+	gboolean ret = TRUE;
+
+	g_assert (rules != NULL);
+	g_assert (line != NULL);
+
+	words = rspamd_sa_split_words (line, &nwords);
+
+	if (nwords == 0) {
+		goto end;
+	}
+
+	if (rules->skip_depth > 0) {
+		if (strcmp (words[0], "endif") == 0) {
+			rules->skip_depth --;
+		}
+		else if (g_str_has_prefix (words[0], "if")) {
+			rules->skip_depth ++;
+		}
+
+		goto end;
+	}
+
+	if (strcmp (words[0], "ifplugin") == 0) {
+		if (nwords < 2 || !rspamd_sa_is_known_plugin (words[1],
+				strlen (words[1]))) {
+			rules->skip_depth = 1;
+		}
+	}
+	else if (strcmp (words[0], "if") == 0) {
+		/* Only `if !plugin(Name)` is understood */
+		if (nwords >= 2 && g_str_has_prefix (words[1], "!plugin(")) {
+			pname = words[1] + sizeof ("!plugin(") - 1;
+			p = strchr (pname, ')');
+
+			if (p == NULL || rspamd_sa_is_known_plugin (pname, p - pname)) {
+				rules->skip_depth = 1;
+			}
+		}
+		else {
+			rules->skip_depth = 1;
+		}
+	}
+	else if (strcmp (words[0], "header") == 0) {
+		ret = rspamd_sa_parse_header (rules, words, nwords, FALSE, err);
+	}
+	else if (strcmp (words[0], "mimeheader") == 0) {
+		ret = rspamd_sa_parse_header (rules, words, nwords, TRUE, err);
+	}
+	else if (strcmp (words[0], "body") == 0) {
+		ret = rspamd_sa_parse_re_rule (rules, words, nwords, RSPAMD_RE_SABODY,
+				err);
+	}
+	else if (strcmp (words[0], "rawbody") == 0) {
+		ret = rspamd_sa_parse_re_rule (rules, words, nwords,
+				RSPAMD_RE_SARAWBODY, err);
+	}
+	else if (strcmp (words[0], "full") == 0) {
+		ret = rspamd_sa_parse_re_rule (rules, words, nwords, RSPAMD_RE_BODY,
+				err);
+	}
+	else if (strcmp (words[0], "uri") == 0) {
+		ret = rspamd_sa_parse_re_rule (rules, words, nwords, RSPAMD_RE_URL,
+				err);
+	}
+	else if (strcmp (words[0], "meta") == 0) {
+		if (nwords < 3) {
+			g_set_error (err, rspamd_sa_rules_quark (), EINVAL,
+					"invalid meta rule definition");
+			ret = FALSE;
+		}
+		else {
+			rule = rspamd_sa_rule_new (rules, words[1], RSPAMD_SA_RULE_META);
+			rule->meta = rspamd_sa_join_words (rules, words, 2);
+		}
+	}
+	else if (strcmp (words[0], "describe") == 0 && nwords >= 3) {
+		rule = g_hash_table_lookup (rules->rules, words[1]);
+
+		if (rule != NULL) {
+			rule->description = rspamd_sa_join_words (rules, words, 2);
+		}
+	}
+	else if (strcmp (words[0], "score") == 0 && nwords >= 3) {
+		pscore = rspamd_mempool_alloc (rules->pool, sizeof (*pscore));
+		*pscore = rspamd_sa_parse_score (rules, words, nwords);
+		g_hash_table_insert (rules->scores,
+				rspamd_mempool_strdup (rules->pool, words[1]), pscore);
+	}
+	else if (strcmp (words[0], "tflags") == 0 && nwords >= 3) {
+		rspamd_sa_parse_tflags (rules, words);
+	}
+	else if (strcmp (words[0], "replace_rules") == 0) {
+		for (i = 1; i < nwords; i ++) {
+			p = rspamd_mempool_strdup (rules->pool, words[i]);
+			g_hash_table_insert (rules->replaced, p, p);
+		}
+	}
+
+end:
+	g_strfreev (words);
+
+	return ret;
+}
+
+gboolean
+rspamd_sa_rules_load_file (struct rspamd_sa_rules *rules,
+		const gchar *path, GError **err)
+{
+	struct rspamd_config *cfg;
+	gchar *data, *line, *eol;
+	GError *line_err = NULL;
+	gsize len;
+	guint lineno = 0;
+
+	g_assert (rules != NULL);
+	cfg = rules->cfg;
+
+	if (!g_file_get_contents (path, &data, &len, err)) {
+		return FALSE;
+	}
+
+	line = data;
+
+	while (line != NULL && *line != '\0') {
+		eol = strchr (line, '\n');
+
+		if (eol != NULL) {
+			*eol = '\0';
+		}
+
+		lineno ++;
+
+		if (!rspamd_sa_rules_parse_line (rules, line, &line_err)) {
+			msg_warn_config ("%s:%ud: %e", path, lineno, line_err);
+			g_error_free (line_err);
+			line_err = NULL;
+		}
+
+		line = eol != NULL ? eol + 1 : NULL;
+	}
+
+	g_free (data);
+
+	/* `if` sections cannot span files */
+	rules->skip_depth = 0;
+
+	return TRUE;
+}
+
+static rspamd_expression_atom_t *
+rspamd_sa_expr_parse (const gchar *line, gsize len,
+		rspamd_mempool_t *pool, gpointer ud, GError **err)
+{
+	rspamd_expression_atom_t *res;
+	struct rspamd_sa_atom *satom;
+	gsize clen;
+
+	/* Atoms are just names of rules or symbols */
+	clen = strcspn (line, ", \t()><+!|&\n");
+
+	if (clen > len) {
+		clen = len;
+	}
+
+	if (clen == 0) {
+		g_set_error (err, rspamd_sa_rules_quark (), 100, "Invalid meta atom: %s",
+				line);
+		return NULL;
+	}
+
+	res = rspamd_mempool_alloc0 (pool, sizeof (*res));
+	res->len = clen;
+	res->str = line;
+
+	satom = rspamd_mempool_alloc0 (pool, sizeof (*satom));
+	satom->name = rspamd_mempool_alloc (pool, clen + 1);
+	rspamd_strlcpy (satom->name, line, clen + 1);
+	res->data = satom;
+
+	return res;
+}
+
+static gboolean
+rspamd_sa_has_symbol (struct rspamd_task *task, const gchar *symbol)
+{
+	struct metric_result *mres;
+
+	mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+
+	if (mres) {
+		return g_hash_table_lookup (mres->symbols, symbol) != NULL;
+	}
+
+	return FALSE;
+}
+
+static gboolean
+rspamd_sa_header_exists (struct rspamd_task *task, struct rspamd_sa_header *h)
+{
+	GPtrArray *hdrs;
+
+	if (h->type == RSPAMD_RE_MIMEHEADER) {
+		/* Mime headers are not in the message headers */
+		hdrs = rspamd_message_get_mime_header_array (task, h->name, h->strong);
+
+		return hdrs != NULL && hdrs->len > 0;
+	}
+
+	return g_hash_table_lookup (task->raw_headers, h->name) != NULL;
+}
+
+static gint
+rspamd_sa_rule_process (struct rspamd_sa_rule *rule, struct rspamd_task *task)
+{
+	struct rspamd_sa_header *h;
+	guint i;
+	gint ret = 0, r;
+
+	if (rule->disabled) {
+		return 0;
+	}
+
+	switch (rule->type) {
+	case RSPAMD_SA_RULE_REGEXP:
+		if (rule->headers == NULL) {
+			ret = rspamd_re_cache_process (task, task->re_rt, rule->re,
+					rule->re_type, NULL, 0, FALSE);
+
+			if (rule->negate) {
+				ret = (ret == 0);
+			}
+		}
+		else {
+			/*
+			 * Any of present headers must match, absent headers are checked
+			 * merely with `if-unset` value. Negation is applied to the whole
+			 * result, so `ToCc !~ /x/` does not match just because of Bcc
+			 * is absent
+			 */
+			for (i = 0; i < rule->headers->len; i ++) {
+				h = &g_array_index (rule->headers, struct rspamd_sa_header, i);
+
+				if (!rspamd_sa_header_exists (task, h)) {
+					if (rule->unset == NULL) {
+						continue;
+					}
+
+					r = rspamd_regexp_search (h->re, rule->unset, 0, NULL, NULL,
+							FALSE, NULL);
+				}
+				else {
+					r = rspamd_re_cache_process (task, task->re_rt, h->re,
+							h->type, h->name, strlen (h->name), h->strong);
+				}
+
+				if (r > 0) {
+					ret = r;
+					break;
+				}
+			}
+
+			if (rule->negate) {
+				ret = (ret == 0);
+			}
+		}
+		break;
+	case RSPAMD_SA_RULE_EXISTS:
+		for (i = 0; i < rule->headers->len; i ++) {
+			h = &g_array_index (rule->headers, struct rspamd_sa_header, i);
+
+			if (rspamd_sa_header_exists (task, h)) {
+				ret = 1;
+				break;
+			}
+		}
+		break;
+	case RSPAMD_SA_RULE_META:
+		if (rule->id >= 0 && rspamd_sa_has_symbol (task, rule->name)) {
+			return 1;
+		}
+
+		if (rule->expr == NULL || rule->evaluating) {
+			/* Recursive meta rules are false */
+			return 0;
+		}
+
+		rule->evaluating = TRUE;
+		ret = rspamd_process_expression (rule->expr, 0, task);
+		rule->evaluating = FALSE;
+
+		if (ret > 0 && rule->id >= 0) {
+			/* Symbol is one shot, so it is not inserted twice */
+			rspamd_task_insert_result (task, rule->name, ret, NULL);
+		}
+		break;
+	}
+
+	return ret;
+}
+
+static gint
+rspamd_sa_expr_process (gpointer input, rspamd_expression_atom_t *atom)
+{
+	struct rspamd_task *task = input;
+	struct rspamd_sa_atom *satom = atom->data;
+
+	if (satom->rule != NULL) {
+		return rspamd_sa_rule_process (satom->rule, task);
+	}
+	else if (satom->symbol != NULL) {
+		return rspamd_sa_has_symbol (task, satom->symbol) ? 1 : 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Regexp atoms are mostly cached, so we don't have preferences
+ */
+static gint
+rspamd_sa_expr_priority (rspamd_expression_atom_t *atom)
+{
+	return 0;
+}
+
+static void
+rspamd_sa_expr_destroy (rspamd_expression_atom_t *atom)
+{
+	/* Atoms are destroyed just with the pool */
+}
+
+static void
+rspamd_sa_rule_callback (struct rspamd_task *task, gpointer ud)
+{
+	struct rspamd_sa_rule *rule = ud;
+	gint res;
+
+	res = rspamd_sa_rule_process (rule, task);
+
+	if (res > 0 && rule->type != RSPAMD_SA_RULE_META) {
+		rspamd_task_insert_result (task, rule->name, res, NULL);
+	}
+}
+
+static rspamd_regexp_t *
+rspamd_sa_register_regexp (struct rspamd_sa_rules *rules,
+		struct rspamd_sa_rule *rule, rspamd_regexp_t *re,
+		enum rspamd_re_type type, const gchar *header)
+{
+	if (rule->maxhits > 0) {
+		rspamd_regexp_set_maxhits (re, rule->maxhits);
+	}
+	else if (rule->multiple) {
+		rspamd_regexp_set_maxhits (re, 0);
+	}
+	else {
+		rspamd_regexp_set_maxhits (re, 1);
+	}
+
+	/* Regexp may be replaced with the same one from the cache */
+	return rspamd_re_cache_add (rules->cfg->re_cache, re, type,
+			(gpointer)header, header ? strlen (header) + 1 : 0);
+}
+
+static void
+rspamd_sa_bind_atom (rspamd_expression_atom_t *atom, gpointer ud)
+{
+	struct rspamd_sa_bind_cbdata *cbd = ud;
+	struct rspamd_sa_atom *satom = atom->data;
+
+	satom->rule = g_hash_table_lookup (cbd->rules->rules, satom->name);
+
+	if (satom->rule == NULL) {
+		/* Foreign symbol, so meta rule should be checked after it */
+		satom->symbol = rspamd_sa_replacement (satom->name);
+	}
+}
+
+static gboolean rspamd_sa_check_meta (struct rspamd_sa_rules *rules,
+		struct rspamd_sa_rule *rule);
+
+static void
+rspamd_sa_check_atom (rspamd_expression_atom_t *atom, gpointer ud)
+{
+	struct rspamd_sa_bind_cbdata *cbd = ud;
+	struct rspamd_sa_atom *satom = atom->data;
+
+	if (satom->rule != NULL) {
+		if (!rspamd_sa_check_meta (cbd->rules, satom->rule)) {
+			cbd->unsupported = TRUE;
+		}
+	}
+	else if (satom->symbol == satom->name &&
+			g_hash_table_lookup (cbd->rules->skipped, satom->name)) {
+		/*
+		 * Such a symbol is never inserted unless rspamd has an equivalent
+		 * for it, so meta rule cannot be correct
+		 */
+		cbd->unsupported = TRUE;
+	}
+}
+
+/*
+ * Disables meta rule if it depends on unsupported rules either directly or
+ * via other meta rules
+ */
+static gboolean
+rspamd_sa_check_meta (struct rspamd_sa_rules *rules,
+		struct rspamd_sa_rule *rule)
+{
+	struct rspamd_sa_bind_cbdata cbd;
+	struct rspamd_config *cfg = rules->cfg;
+
+	if (rule->type != RSPAMD_SA_RULE_META || rule->checked ||
+			rule->disabled) {
+		return !rule->disabled;
+	}
+
+	if (rule->visiting) {
+		/* Recursive meta rules are just false */
+		return TRUE;
+	}
+
+	memset (&cbd, 0, sizeof (cbd));
+	cbd.rules = rules;
+	cbd.rule = rule;
+	rule->visiting = TRUE;
+	rspamd_expression_atom_struct_foreach (rule->expr,
+			rspamd_sa_check_atom, &cbd);
+	rule->visiting = FALSE;
+	rule->checked = TRUE;
+
+	if (cbd.unsupported) {
+		msg_debug_config ("meta rule %s depends on rules that are not "
+				"supported natively", rule->name);
+		rule->disabled = TRUE;
+		rules->nmeta_disabled ++;
+	}
+
+	return !rule->disabled;
+}
+
+static void
+rspamd_sa_collect_deps (rspamd_expression_atom_t *atom, gpointer ud)
+{
+	struct rspamd_sa_bind_cbdata *cbd = ud;
+	struct rspamd_sa_atom *satom = atom->data;
+	struct rspamd_config *cfg = cbd->rules->cfg;
+
+	if (satom->symbol != NULL) {
+		if (!g_hash_table_lookup (cbd->deps, satom->symbol)) {
+			g_hash_table_insert (cbd->deps, (gpointer)satom->symbol,
+					(gpointer)satom->symbol);
+			rspamd_symbols_cache_add_dependency (cfg->cache, cbd->rule->id,
+					satom->symbol);
+		}
+	}
+	else if (satom->rule != NULL && satom->rule->type == RSPAMD_SA_RULE_META &&
+			satom->rule->expr != NULL &&
+			!g_hash_table_lookup (cbd->visited, satom->rule)) {
+		/* Sub-rules are evaluated inline, so their symbols are required too */
+		g_hash_table_insert (cbd->visited, satom->rule, satom->rule);
+		rspamd_expression_atom_struct_foreach (satom->rule->expr,
+				rspamd_sa_collect_deps, cbd);
+	}
+}
+
+guint
+rspamd_sa_rules_compile (struct rspamd_sa_rules *rules)
+{
+	struct rspamd_config *cfg;
+	struct rspamd_sa_rule *rule;
+	struct rspamd_sa_header *h;
+	struct rspamd_sa_bind_cbdata cbd;
+	GHashTableIter it;
+	GError *err = NULL;
+	gpointer k, v;
+	gdouble *pscore;
+	guint i, nsyms = 0, nrules = 0;
+
+	g_assert (rules != NULL);
+	cfg = rules->cfg;
+
+	/* Register regexps and parse meta expressions */
+	g_hash_table_iter_init (&it, rules->rules);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		rule = v;
+		nrules ++;
+
+		if (g_hash_table_lookup (rules->replaced, rule->name)) {
+			msg_debug_config ("rule %s requires tags replacement, which is "
+					"not supported natively", rule->name);
+			rule->disabled = TRUE;
+			rules->nunsupported ++;
+			continue;
+		}
+
+		if (rule->type == RSPAMD_SA_RULE_REGEXP) {
+			if (rule->headers == NULL) {
+				rule->re = rspamd_sa_register_regexp (rules, rule, rule->re,
+						rule->re_type, NULL);
+			}
+			else {
+				for (i = 0; i < rule->headers->len; i ++) {
+					h = &g_array_index (rule->headers, struct rspamd_sa_header, i);
+					h->re = rspamd_sa_register_regexp (rules, rule, h->re,
+							h->type, h->name);
+				}
+			}
+		}
+		else if (rule->type == RSPAMD_SA_RULE_META) {
+			if (!rspamd_parse_expression (rule->meta, 0, &sa_expr_subr, rules,
+					rules->pool, &err, &rule->expr)) {
+				msg_warn_config ("cannot parse meta rule %s: %e", rule->name,
+						err);
+				g_error_free (err);
+				err = NULL;
+				rule->expr = NULL;
+				rule->disabled = TRUE;
+			}
+		}
+	}
+
+	/* Resolve atoms of meta rules */
+	g_hash_table_iter_init (&it, rules->rules);
+	memset (&cbd, 0, sizeof (cbd));
+	cbd.rules = rules;
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		rule = v;
+
+		if (rule->type == RSPAMD_SA_RULE_META && rule->expr != NULL) {
+			cbd.rule = rule;
+			rspamd_expression_atom_struct_foreach (rule->expr,
+					rspamd_sa_bind_atom, &cbd);
+		}
+	}
+
+	/* Disable meta rules that depend on unsupported rules */
+	g_hash_table_iter_init (&it, rules->rules);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		rspamd_sa_check_meta (rules, v);
+	}
+
+	/* Register symbols for meta rules and scored rules */
+	g_hash_table_iter_init (&it, rules->rules);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		rule = v;
+		pscore = g_hash_table_lookup (rules->scores, rule->name);
+
+		if (rule->disabled || g_str_has_prefix (rule->name, "__")) {
+			continue;
+		}
+
+		if (rule->type != RSPAMD_SA_RULE_META && !rule->publish &&
+				(pscore == NULL || *pscore == 0)) {
+			/* Subrule that is used merely in meta rules */
+			continue;
+		}
+
+		rule->id = rspamd_symbols_cache_add_symbol (cfg->cache,
+				rule->name,
+				0,
+				rspamd_sa_rule_callback,
+				rule,
+				SYMBOL_TYPE_NORMAL, -1);
+
+		if (pscore != NULL) {
+			rspamd_config_add_metric_symbol (cfg, DEFAULT_METRIC, rule->name,
+					*pscore, rule->description, NULL,
+					RSPAMD_SYMBOL_FLAG_ONESHOT, RSPAMD_SA_SCORE_PRIORITY);
+		}
+
+		nsyms ++;
+	}
+
+	/* Registered meta rules depend on foreign symbols of all their sub-rules */
+	g_hash_table_iter_init (&it, rules->rules);
+	cbd.deps = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	cbd.visited = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		rule = v;
+
+		if (rule->type == RSPAMD_SA_RULE_META && rule->id >= 0) {
+			cbd.rule = rule;
+			g_hash_table_remove_all (cbd.deps);
+			g_hash_table_remove_all (cbd.visited);
+			g_hash_table_insert (cbd.visited, rule, rule);
+			rspamd_expression_atom_struct_foreach (rule->expr,
+					rspamd_sa_collect_deps, &cbd);
+		}
+	}
+
+	g_hash_table_unref (cbd.deps);
+	g_hash_table_unref (cbd.visited);
+
+	msg_info_config ("compiled %ud SpamAssassin rules, %ud symbols registered, "
+			"%ud rules are not supported natively, %ud meta rules are disabled "
+			"as they depend on unsupported rules",
+			nrules, nsyms, rules->nunsupported, rules->nmeta_disabled);
+
+	return nsyms;
+}
+
+gint
+rspamd_sa_rules_process (struct rspamd_sa_rules *rules,
+		struct rspamd_task *task, const gchar *name)
+{
+	struct rspamd_sa_rule *rule;
+
+	g_assert (rules != NULL);
+
+	rule = g_hash_table_lookup (rules->rules, name);
+
+	if (rule == NULL) {
+		return -1;
+	}
+
+	return rspamd_sa_rule_process (rule, task);
+}
@@ -0,0 +1,83 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBMIME_SA_RULES_H_
+#define SRC_LIBMIME_SA_RULES_H_
+
+#include "config.h"
+#include "mem_pool.h"
+
+/**
+ * @file sa_rules.h
+ * Native compiler of SpamAssassin rules: regexp rules are mapped to the
+ * regexp cache classes and meta rules are compiled to expressions, so all
+ * rules are evaluated without lua
+ */
+
+struct rspamd_config;
+struct rspamd_task;
+struct rspamd_sa_rules;
+
+/**
+ * Creates new rules set, all data is allocated in the specified pool
+ * @param cfg config to register regexps and symbols in
+ * @param pool memory pool
+ * @return new rules set
+ */
+struct rspamd_sa_rules *rspamd_sa_rules_new (struct rspamd_config *cfg,
+		rspamd_mempool_t *pool);
+
+/**
+ * Parses a single line of SpamAssassin configuration
+ * @param rules rules set
+ * @param line line to parse
+ * @param err error pointer
+ * @return FALSE if a line is invalid
+ */
+gboolean rspamd_sa_rules_parse_line (struct rspamd_sa_rules *rules,
+		const gchar *line, GError **err);
+
+/**
+ * Loads all rules from a SpamAssassin `.cf` file, invalid lines are logged and
+ * skipped
+ * @param rules rules set
+ * @param path path to file
+ * @param err error pointer
+ * @return FALSE if a file cannot be read
+ */
+gboolean rspamd_sa_rules_load_file (struct rspamd_sa_rules *rules,
+		const gchar *path, GError **err);
+
+/**
+ * Registers all regexps in the regexp cache, compiles meta rules and
+ * registers symbols for meta rules and for scored regexp rules. Meta rules
+ * that depend on rules which are not supported natively are disabled. Should
+ * be called once all files are loaded
+ * @param rules rules set
+ * @return number of symbols registered
+ */
+guint rspamd_sa_rules_compile (struct rspamd_sa_rules *rules);
+
+/**
+ * Evaluates rule by its name
+ * @param rules rules set
+ * @param task task object
+ * @param name name of rule
+ * @return value of rule or -1 if there is no such rule
+ */
+gint rspamd_sa_rules_process (struct rspamd_sa_rules *rules,
+		struct rspamd_task *task, const gchar *name);
+
+#endif /* SRC_LIBMIME_SA_RULES_H_ */
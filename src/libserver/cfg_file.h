@@ -29,6 +29,8 @@ struct rspamd_stat_classifier;
 struct module_s;
 struct worker_s;
 struct rspamd_external_libs_ctx;
+struct rspamd_dns_cache;
+struct rspamd_redis_pool;
 
 enum { VAL_UNDEF=0, VAL_TRUE, VAL_FALSE };
 
@@ -339,6 +341,7 @@ struct rspamd_config {
 	GHashTable * metrics_symbols;                   /**< hash table of metrics indexed by symbol			*/
 	GHashTable * c_modules;                         /**< hash of c modules indexed by module name			*/
 	GHashTable * composite_symbols;                 /**< hash of composite symbols indexed by its name		*/
+	struct rspamd_composites_index *composites_index; /**< compiled composites						*/
 	GList *classifiers;                             /**< list of all classifiers defined                    */
 	GList *statfiles;                               /**< list of all statfiles in config file order         */
 	GHashTable *classifiers_symbols;                /**< hashtable indexed by symbol name of classifiers    */
@@ -358,6 +361,7 @@ struct rspamd_config {
 
 	struct symbols_cache *cache;                    /**< symbols cache object								*/
 	gchar *cache_filename;                          /**< filename of cache file								*/
+	gboolean profile_symbols;                       /**< collect profile of symbols on start				*/
 	struct metric *default_metric;                  /**< default metric										*/
 
 	gchar * checksum;                               /**< real checksum of config file						*/
@@ -379,11 +383,15 @@ struct rspamd_config {
 	guint32 dns_io_per_server;                      /**< number of sockets per DNS server					*/
 	const ucl_object_t *nameservers;                /**< list of nameservers or NULL to parse resolv.conf	*/
 	guint32 dns_max_requests;                       /**< limit of DNS requests per task 					*/
+	guint32 dns_cache_size;                         /**< number of replies in the shared DNS cache			*/
+	gdouble dns_cache_negative_ttl;                 /**< time to cache negative DNS replies					*/
+	struct rspamd_dns_cache *dns_cache;             /**< DNS cache shared between workers					*/
 
 	guint upstream_max_errors;						/**< upstream max errors before shutting off			*/
 	gdouble upstream_error_time;					/**< rate of upstream errors							*/
 	gdouble upstream_revive_time;					/**< revive timeout for upstreams						*/
 	struct upstream_ctx *ups_ctx;					/**< upstream context									*/
+	struct rspamd_redis_pool *redis_pool;			/**< redis connections pool								*/
 
 	guint min_word_len;								/**< minimum length of the word to be considered		*/
 	guint max_word_len;								/**< maximum length of the word to be considered		*/
@@ -1681,6 +1681,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, cache_filename),
 			RSPAMD_CL_FLAG_STRING_PATH,
 			"Path to the cache file");
+	rspamd_rcl_add_default_handler (sub,
+			"profile_symbols",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, profile_symbols),
+			0,
+			"Collect latency profile of symbols (can be switched by controller)");
 	/* Old DNS configuration */
 	rspamd_rcl_add_default_handler (sub,
 			"dns_nameserver",
@@ -1981,6 +1987,18 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, dns_io_per_server),
 			RSPAMD_CL_FLAG_INT_32,
 			"Number of sockets per DNS server");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_size),
+			RSPAMD_CL_FLAG_INT_32,
+			"Number of replies in the DNS cache shared between workers (0, the default, disables cache)");
+	rspamd_rcl_add_default_handler (ssub,
+			"negative_ttl",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_negative_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to cache negative DNS replies");
 
 
 	/* New upstreams configuration */
@@ -27,6 +27,9 @@
 #include "stat_api.h"
 #include "unix-std.h"
 #include "libutil/multipattern.h"
+#include "composites.h"
+#include "dns.h"
+#include "redis_pool.h"
 #include <math.h>
 
 #define DEFAULT_SCORE 10.0
@@ -137,6 +140,8 @@ rspamd_config_new (void)
 	cfg->log_extended = TRUE;
 
 	cfg->dns_max_requests = 64;
+	cfg->dns_cache_size = 0;
+	cfg->dns_cache_negative_ttl = 60.0;
 	cfg->history_rows = 200;
 
 	/* Default log line */
@@ -154,6 +159,9 @@ rspamd_config_new (void)
 	cfg->lua_state = rspamd_lua_init ();
 	cfg->cache = rspamd_symbols_cache_new (cfg);
 	cfg->ups_ctx = rspamd_upstreams_library_init ();
+#ifdef WITH_HIREDIS
+	cfg->redis_pool = rspamd_redis_pool_init ();
+#endif
 	cfg->re_cache = rspamd_re_cache_new ();
 	cfg->doc_strings = ucl_object_typed_new (UCL_OBJECT);
 	/*
@@ -225,6 +233,9 @@ rspamd_config_free (struct rspamd_config *cfg)
 	REF_RELEASE (cfg->libs_ctx);
 	rspamd_re_cache_unref (cfg->re_cache);
 	rspamd_upstreams_library_unref (cfg->ups_ctx);
+#ifdef WITH_HIREDIS
+	rspamd_redis_pool_destroy (cfg->redis_pool);
+#endif
 	rspamd_mempool_delete (cfg->cfg_pool);
 	lua_close (cfg->lua_state);
 	g_slice_free1 (sizeof (*cfg), cfg);
@@ -713,6 +724,12 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 	if (opts & RSPAMD_CONFIG_INIT_LIBS) {
 		/* Config other libraries */
 		rspamd_config_libs (cfg->libs_ctx, cfg);
+
+		if (cfg->dns_cache_size > 0) {
+			/* Allocated before forking to be shared between workers */
+			cfg->dns_cache = rspamd_dns_cache_new (cfg->cfg_pool,
+					cfg->dns_cache_size, cfg->dns_cache_negative_ttl);
+		}
 	}
 
 	/* Execute post load scripts */
@@ -731,6 +748,9 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 		}
 	}
 
+	/* Compile composites when all of them are registered */
+	rspamd_composites_compile (cfg);
+
 	/* Validate cache */
 	if (opts & RSPAMD_CONFIG_INIT_VALIDATE) {
 		return rspamd_symbols_cache_validate (cfg->cache, cfg, FALSE) && ret;
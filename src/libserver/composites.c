@@ -27,6 +27,12 @@ struct composites_data {
 	struct metric_result *metric_res;
 	GHashTable *symbols_to_remove;
 	guint8 *checked;
+	/* Symbols inserted to the metric result, indexed by cache id */
+	guint8 *symbols_set;
+	/* Composites that could possibly match */
+	guint8 *candidates;
+	/* Set when we evaluate composite with all atoms forced to be false */
+	gboolean probe;
 };
 
 enum rspamd_composite_action {
@@ -39,11 +45,52 @@ enum rspamd_composite_action {
 struct symbol_remove_data {
 	struct symbol *ms;
 	struct rspamd_composite *comp;
-	GNode *parent;
+	gboolean negated;
 	guint action;
 	struct symbol_remove_data *prev, *next;
 };
 
+/*
+ * Symbol referenced by a composite atom (group atoms refer to many symbols)
+ */
+struct rspamd_composite_atom_elt {
+	const gchar *sym;
+	/* Symbols cache id or -1 if the symbol is not registered */
+	gint id;
+	/* Non NULL if this symbol is a composite itself */
+	struct rspamd_composite *ncomp;
+};
+
+struct rspamd_composite_atom {
+	/* Symbol or group name without prefixes */
+	gchar *name;
+	/* Default action derived from `~`, `-` and `^` prefixes */
+	guint action;
+	gboolean is_group;
+	/* Atom has a negation operation in its ancestors */
+	gboolean negated;
+	/* Filled by rspamd_composites_compile */
+	struct rspamd_composite_atom_elt *elts;
+	guint nelts;
+};
+
+/*
+ * Compiled form of all composites in config
+ */
+struct rspamd_composites_index {
+	/* Composites array indexed by composite id */
+	GPtrArray *composites;
+	/* Array of GPtrArray of composites indexed by symbols cache id */
+	GPtrArray **by_symbol;
+	guint nsymbols;
+};
+
+struct composites_compile_cbdata {
+	struct rspamd_config *cfg;
+	struct rspamd_composites_index *idx;
+	struct rspamd_composite *comp;
+};
+
 static rspamd_expression_atom_t * rspamd_composite_expr_parse (const gchar *line, gsize len,
 		rspamd_mempool_t *pool, gpointer ud, GError **err);
 static gint rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom);
@@ -69,6 +116,9 @@ rspamd_composite_expr_parse (const gchar *line, gsize len,
 {
 	gsize clen;
 	rspamd_expression_atom_t *res;
+	struct rspamd_composite_atom *catom;
+	const gchar *p, *end;
+	gchar t;
 
 	/*
 	 * Composites are just sequences of symbols
@@ -84,48 +134,82 @@ rspamd_composite_expr_parse (const gchar *line, gsize len,
 	res = rspamd_mempool_alloc0 (pool, sizeof (*res));
 	res->len = clen;
 	res->str = line;
-	res->data = rspamd_mempool_alloc (pool, clen + 1);
-	rspamd_strlcpy (res->data, line, clen + 1);
+
+	catom = rspamd_mempool_alloc0 (pool, sizeof (*catom));
+	/* By default remove symbols */
+	catom->action = (RSPAMD_COMPOSITE_REMOVE_SYMBOL|RSPAMD_COMPOSITE_REMOVE_WEIGHT);
+	p = line;
+	end = line + clen;
+
+	while (p < end) {
+		t = *p;
+
+		if (t == '~') {
+			catom->action &= ~RSPAMD_COMPOSITE_REMOVE_WEIGHT;
+		}
+		else if (t == '-') {
+			catom->action &= ~(RSPAMD_COMPOSITE_REMOVE_WEIGHT|
+					RSPAMD_COMPOSITE_REMOVE_SYMBOL);
+		}
+		else if (t == '^') {
+			catom->action |= RSPAMD_COMPOSITE_REMOVE_FORCED;
+		}
+		else {
+			break;
+		}
+
+		p ++;
+	}
+
+	while (p < end && !g_ascii_isalnum (*p)) {
+		p ++;
+	}
+
+	if (end - p > 2 && p[0] == 'g' && p[1] == ':') {
+		catom->is_group = TRUE;
+		p += 2;
+	}
+
+	catom->name = rspamd_mempool_alloc (pool, end - p + 1);
+	rspamd_strlcpy (catom->name, p, end - p + 1);
+	res->data = catom;
 
 	return res;
 }
 
+static gint rspamd_composite_evaluate (struct composites_data *cd,
+		struct rspamd_composite *comp);
+
 static gint
 rspamd_composite_process_single_symbol (struct composites_data *cd,
-		const gchar *sym, struct symbol **pms)
+		const struct rspamd_composite_atom_elt *elt, struct symbol **pms)
 {
 	struct symbol *ms = NULL;
 	gint rc = 0;
-	struct rspamd_composite *ncomp;
 
-	if ((ms = g_hash_table_lookup (cd->metric_res->symbols, sym)) == NULL) {
-		if ((ncomp =
-				g_hash_table_lookup (cd->task->cfg->composite_symbols,
-						sym)) != NULL) {
-			/* Set checked for this symbol to avoid cyclic references */
-			if (isclr (cd->checked, ncomp->id * 2)) {
-				setbit (cd->checked, cd->composite->id * 2);
-				rc = rspamd_process_expression (ncomp->expr,
-						RSPAMD_EXPRESSION_FLAG_NOOPT, cd);
-				clrbit (cd->checked, cd->composite->id * 2);
-
-				if (rc) {
-					setbit (cd->checked, ncomp->id * 2 + 1);
-				}
-				setbit (cd->checked, ncomp->id * 2);
+	if (elt->id >= 0 && isclr (cd->symbols_set, elt->id)) {
+		/* Fast path: symbol has not been inserted */
+		if (elt->ncomp != NULL) {
+			rc = rspamd_composite_evaluate (cd, elt->ncomp);
 
-				ms = g_hash_table_lookup (cd->metric_res->symbols, sym);
-			}
-			else {
-				/*
-				 * XXX: in case of cyclic references this would return 0
-				 */
-				rc = isset (cd->checked, ncomp->id * 2 + 1);
+			if (rc) {
+				ms = g_hash_table_lookup (cd->metric_res->symbols, elt->sym);
 			}
 		}
 	}
 	else {
-		rc = 1;
+		ms = g_hash_table_lookup (cd->metric_res->symbols, elt->sym);
+
+		if (ms != NULL) {
+			rc = 1;
+		}
+		else if (elt->ncomp != NULL) {
+			rc = rspamd_composite_evaluate (cd, elt->ncomp);
+
+			if (rc) {
+				ms = g_hash_table_lookup (cd->metric_res->symbols, elt->sym);
+			}
+		}
 	}
 
 	*pms = ms;
@@ -136,50 +220,23 @@ static gint
 rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 {
 	struct composites_data *cd = (struct composites_data *)input;
-	const gchar *beg = atom->data, *sym = NULL;
-	gchar t;
+	struct rspamd_composite_atom *catom = atom->data;
 	struct symbol_remove_data *rd, *nrd;
-	struct symbol *ms;
-	struct rspamd_symbols_group *gr;
-	struct rspamd_symbol_def *sdef;
-	struct metric *metric;
-	GHashTableIter it;
-	gpointer k, v;
+	struct symbol *ms = NULL;
+	guint i;
 	gint rc = 0;
 
-	if (isset (cd->checked, cd->composite->id * 2)) {
-		/* We have already checked this composite, so just return its value */
-		rc = isset (cd->checked, cd->composite->id * 2 + 1);
-		return rc;
-	}
-
-	sym = beg;
-
-	while (*sym != '\0' && !g_ascii_isalnum (*sym)) {
-		sym ++;
+	if (cd->probe) {
+		return 0;
 	}
 
-	if (strncmp (sym, "g:", 2) == 0) {
-		metric = g_hash_table_lookup (cd->task->cfg->metrics, DEFAULT_METRIC);
-		g_assert (metric != NULL);
-		gr = g_hash_table_lookup (metric->groups, sym + 2);
-
-		if (gr != NULL) {
-			g_hash_table_iter_init (&it, gr->symbols);
-
-			while (g_hash_table_iter_next (&it, &k, &v)) {
-				sdef = v;
-				rc = rspamd_composite_process_single_symbol (cd, sdef->name, &ms);
+	for (i = 0; i < catom->nelts; i ++) {
+		rc = rspamd_composite_process_single_symbol (cd, &catom->elts[i], &ms);
 
-				if (rc) {
-					break;
-				}
-			}
+		if (rc) {
+			break;
 		}
 	}
-	else {
-		rc = rspamd_composite_process_single_symbol (cd, sym, &ms);
-	}
 
 	if (rc && ms) {
 		/*
@@ -192,32 +249,9 @@ rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 
 		nrd = rspamd_mempool_alloc (cd->task->task_pool, sizeof (*nrd));
 		nrd->ms = ms;
-
-		/* By default remove symbols */
-		nrd->action = (RSPAMD_COMPOSITE_REMOVE_SYMBOL|RSPAMD_COMPOSITE_REMOVE_WEIGHT);
-
-		for (;;) {
-			t = *beg;
-
-			if (t == '~') {
-				nrd->action &= ~RSPAMD_COMPOSITE_REMOVE_WEIGHT;
-			}
-			else if (t == '-') {
-				nrd->action &= ~(RSPAMD_COMPOSITE_REMOVE_WEIGHT|
-						RSPAMD_COMPOSITE_REMOVE_SYMBOL);
-			}
-			else if (t == '^') {
-				nrd->action |= RSPAMD_COMPOSITE_REMOVE_FORCED;
-			}
-			else {
-				break;
-			}
-
-			beg ++;
-		}
-
+		nrd->action = catom->action;
 		nrd->comp = cd->composite;
-		nrd->parent = atom->parent;
+		nrd->negated = catom->negated;
 
 		if (rd == NULL) {
 			DL_APPEND (rd, nrd);
@@ -248,64 +282,250 @@ rspamd_composite_expr_destroy (rspamd_expression_atom_t *atom)
 	/* Composite atoms are destroyed just with the pool */
 }
 
+static void
+rspamd_composite_index_symbol (struct composites_compile_cbdata *cbd, gint id)
+{
+	struct rspamd_composites_index *idx = cbd->idx;
+	GPtrArray *comps;
+
+	if (id < 0 || (guint)id >= idx->nsymbols) {
+		cbd->comp->always = TRUE;
+		return;
+	}
+
+	comps = idx->by_symbol[id];
+
+	if (comps == NULL) {
+		comps = g_ptr_array_new ();
+		rspamd_mempool_add_destructor (cbd->cfg->cfg_pool,
+				rspamd_ptr_array_free_hard, comps);
+		idx->by_symbol[id] = comps;
+	}
+
+	if (comps->len == 0 ||
+			g_ptr_array_index (comps, comps->len - 1) != cbd->comp) {
+		g_ptr_array_add (comps, cbd->comp);
+	}
+}
 
 static void
-composites_foreach_callback (gpointer key, gpointer value, void *data)
+rspamd_composite_compile_atom (rspamd_expression_atom_t *atom, gpointer ud)
 {
-	struct composites_data *cd = data;
-	struct rspamd_composite *comp = value;
-	gint rc;
+	struct composites_compile_cbdata *cbd = ud;
+	struct rspamd_config *cfg = cbd->cfg;
+	struct rspamd_composite_atom *catom = atom->data;
+	struct rspamd_composite_atom_elt *elt;
+	struct rspamd_symbols_group *gr = NULL;
+	struct rspamd_symbol_def *sdef;
+	struct metric *metric;
+	GHashTableIter it;
+	GNode *par;
+	gpointer k, v;
+	guint i;
 
-	cd->composite = comp;
+	catom->negated = FALSE;
+	par = atom->parent;
 
-	rc = rspamd_process_expression (comp->expr, RSPAMD_EXPRESSION_FLAG_NOOPT, cd);
+	/*
+	 * Exclude all elements with any parent that is negation:
+	 * !A || B -> here we can have both !A and B matched, but we do *NOT*
+	 * want to remove symbol in that case
+	 */
+	while (par) {
+		if (rspamd_expression_node_is_op (par, OP_NOT)) {
+			catom->negated = TRUE;
+			break;
+		}
+
+		par = par->parent;
+	}
+
+	if (catom->is_group) {
+		metric = g_hash_table_lookup (cfg->metrics, DEFAULT_METRIC);
+		g_assert (metric != NULL);
+		gr = g_hash_table_lookup (metric->groups, catom->name);
+		catom->nelts = gr ? g_hash_table_size (gr->symbols) : 0;
+	}
+	else {
+		catom->nelts = 1;
+	}
+
+	catom->elts = rspamd_mempool_alloc0 (cfg->cfg_pool,
+			sizeof (*catom->elts) * MAX (catom->nelts, 1));
+
+	if (catom->is_group) {
+		if (gr != NULL) {
+			i = 0;
+			g_hash_table_iter_init (&it, gr->symbols);
+
+			while (g_hash_table_iter_next (&it, &k, &v)) {
+				sdef = v;
+				catom->elts[i ++].sym = sdef->name;
+			}
+		}
+	}
+	else {
+		catom->elts[0].sym = catom->name;
+	}
+
+	for (i = 0; i < catom->nelts; i ++) {
+		elt = &catom->elts[i];
+		elt->id = rspamd_symbols_cache_find_symbol (cfg->cache, elt->sym);
+		elt->ncomp = g_hash_table_lookup (cfg->composite_symbols, elt->sym);
+
+		if (elt->ncomp != NULL) {
+			if (elt->ncomp->rdeps == NULL) {
+				elt->ncomp->rdeps = g_ptr_array_new ();
+				rspamd_mempool_add_destructor (cfg->cfg_pool,
+						rspamd_ptr_array_free_hard, elt->ncomp->rdeps);
+			}
+
+			g_ptr_array_add (elt->ncomp->rdeps, cbd->comp);
+		}
+		else {
+			rspamd_composite_index_symbol (cbd, elt->id);
+		}
+	}
+}
+
+void
+rspamd_composites_compile (struct rspamd_config *cfg)
+{
+	struct rspamd_composites_index *idx;
+	struct rspamd_composite *comp;
+	struct composites_compile_cbdata cbd;
+	struct composites_data cd;
+	GHashTableIter it;
+	gpointer k, v;
+	guint i;
+
+	g_assert (cfg != NULL);
+
+	idx = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*idx));
+	idx->composites = g_ptr_array_sized_new (
+			g_hash_table_size (cfg->composite_symbols));
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			rspamd_ptr_array_free_hard, idx->composites);
+	idx->nsymbols = rspamd_symbols_cache_symbols_count (cfg->cache);
+	idx->by_symbol = rspamd_mempool_alloc0 (cfg->cfg_pool,
+			sizeof (GPtrArray *) * MAX (idx->nsymbols, 1));
+
+	/* Assign dense ids as redefined composites might have duplicated ones */
+	g_hash_table_iter_init (&it, cfg->composite_symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		comp = v;
+		comp->id = idx->composites->len;
+		comp->sym = k;
+		comp->rdeps = NULL;
+		comp->always = FALSE;
+		g_ptr_array_add (idx->composites, comp);
+	}
+
+	memset (&cd, 0, sizeof (cd));
+	cd.probe = TRUE;
+	cbd.cfg = cfg;
+	cbd.idx = idx;
+
+	for (i = 0; i < idx->composites->len; i ++) {
+		comp = g_ptr_array_index (idx->composites, i);
+		cbd.comp = comp;
+		rspamd_expression_atom_struct_foreach (comp->expr,
+				rspamd_composite_compile_atom, &cbd);
+
+		/* Check if composite is true when no atoms match */
+		if (!comp->always) {
+			cd.composite = comp;
+			comp->always = !!rspamd_process_expression (comp->expr,
+					RSPAMD_EXPRESSION_FLAG_NOOPT, &cd);
+		}
+	}
+
+	cfg->composites_index = idx;
+	msg_debug_config ("compiled %ud composites over %ud symbols",
+			idx->composites->len, idx->nsymbols);
+}
+
+static void
+rspamd_composite_mark_candidate (struct composites_data *cd,
+		struct rspamd_composite *comp)
+{
+	guint i;
+
+	if (isset (cd->candidates, comp->id)) {
+		return;
+	}
+
+	setbit (cd->candidates, comp->id);
+
+	if (comp->rdeps) {
+		for (i = 0; i < comp->rdeps->len; i ++) {
+			rspamd_composite_mark_candidate (cd,
+					g_ptr_array_index (comp->rdeps, i));
+		}
+	}
+}
+
+static gint
+rspamd_composite_evaluate (struct composites_data *cd,
+		struct rspamd_composite *comp)
+{
+	struct rspamd_composite *saved;
+	gint rc, id;
+
+	if (isset (cd->checked, comp->id * 2)) {
+		/*
+		 * We have already checked this composite, so just return its value
+		 * XXX: in case of cyclic references this would return 0
+		 */
+		return isset (cd->checked, comp->id * 2 + 1);
+	}
 
 	/* Checked bit */
 	setbit (cd->checked, comp->id * 2);
 
+	if (isclr (cd->candidates, comp->id)) {
+		/* No atoms of this composite matched */
+		return 0;
+	}
+
+	saved = cd->composite;
+	cd->composite = comp;
+	rc = rspamd_process_expression (comp->expr, RSPAMD_EXPRESSION_FLAG_NOOPT, cd);
+	cd->composite = saved;
+
 	/* Result bit */
 	if (rc) {
 		setbit (cd->checked, comp->id * 2 + 1);
-		rspamd_task_insert_result_single (cd->task, key, 1.0, NULL);
-	}
-	else {
-		clrbit (cd->checked, comp->id * 2 + 1);
+		rspamd_task_insert_result_single (cd->task, comp->sym, 1.0, NULL);
+		id = rspamd_symbols_cache_find_symbol (cd->task->cfg->cache, comp->sym);
+
+		if (id >= 0 && (guint)id < cd->task->cfg->composites_index->nsymbols) {
+			setbit (cd->symbols_set, id);
+		}
 	}
-}
 
+	return rc;
+}
 
 static void
 composites_remove_symbols (gpointer key, gpointer value, gpointer data)
 {
 	struct composites_data *cd = data;
 	struct symbol_remove_data *rd = value, *cur;
-	gboolean skip = FALSE, has_valid_op = FALSE,
+	gboolean has_valid_op = FALSE,
 			want_remove_score = TRUE, want_remove_symbol = TRUE,
 			want_forced = FALSE;
-	GNode *par;
 
 	DL_FOREACH (rd, cur) {
 		if (!isset (cd->checked, cur->comp->id * 2 + 1)) {
 			continue;
 		}
 		/*
-		 * First of all exclude all elements with any parent that is negation:
-		 * !A || B -> here we can have both !A and B matched, but we do *NOT*
-		 * want to remove symbol in that case
+		 * First of all exclude all elements with any parent that is negation,
+		 * this is precomputed when composites are compiled
 		 */
-		par = cur->parent;
-		skip = FALSE;
-
-		while (par) {
-			if (rspamd_expression_node_is_op (par, OP_NOT)) {
-				skip = TRUE;
-				break;
-			}
-
-			par = par->parent;
-		}
-
-		if (skip) {
+		if (cur->negated) {
 			continue;
 		}
 
@@ -344,21 +564,62 @@ static void
 composites_metric_callback (gpointer key, gpointer value, gpointer data)
 {
 	struct rspamd_task *task = (struct rspamd_task *)data;
+	struct rspamd_composites_index *idx = task->cfg->composites_index;
 	struct composites_data *cd =
-		rspamd_mempool_alloc (task->task_pool, sizeof (struct composites_data));
+		rspamd_mempool_alloc0 (task->task_pool, sizeof (struct composites_data));
 	struct metric_result *metric_res = (struct metric_result *)value;
+	struct rspamd_composite *comp;
+	GPtrArray *comps;
+	GHashTableIter it;
+	gpointer k, v;
+	guint i;
+	gint id;
 
 	cd->task = task;
 	cd->metric_res = (struct metric_result *)metric_res;
 	cd->symbols_to_remove = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 	cd->checked =
 		rspamd_mempool_alloc0 (task->task_pool,
-			NBYTES (g_hash_table_size (task->cfg->composite_symbols) * 2));
+			NBYTES (idx->composites->len * 2));
+	cd->candidates = rspamd_mempool_alloc0 (task->task_pool,
+			NBYTES (idx->composites->len));
+	cd->symbols_set = rspamd_mempool_alloc0 (task->task_pool,
+			NBYTES (idx->nsymbols));
+
+	/* Fill bitset of inserted symbols and select candidate composites */
+	g_hash_table_iter_init (&it, metric_res->symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		id = rspamd_symbols_cache_find_symbol (task->cfg->cache, k);
+
+		if (id >= 0 && (guint)id < idx->nsymbols) {
+			setbit (cd->symbols_set, id);
+			comps = idx->by_symbol[id];
+
+			if (comps) {
+				for (i = 0; i < comps->len; i ++) {
+					rspamd_composite_mark_candidate (cd,
+							g_ptr_array_index (comps, i));
+				}
+			}
+		}
+	}
 
-	/* Process hash table */
-	g_hash_table_foreach (task->cfg->composite_symbols,
-		composites_foreach_callback,
-		cd);
+	for (i = 0; i < idx->composites->len; i ++) {
+		comp = g_ptr_array_index (idx->composites, i);
+
+		if (comp->always) {
+			rspamd_composite_mark_candidate (cd, comp);
+		}
+	}
+
+	/* Process candidates */
+	for (i = 0; i < idx->composites->len; i ++) {
+		if (isset (cd->candidates, i)) {
+			rspamd_composite_evaluate (cd,
+					g_ptr_array_index (idx->composites, i));
+		}
+	}
 
 	/* Remove symbols that are in composites */
 	g_hash_table_foreach (cd->symbols_to_remove, composites_remove_symbols, cd);
@@ -369,5 +630,11 @@ composites_metric_callback (gpointer key, gpointer value, gpointer data)
 void
 rspamd_make_composites (struct rspamd_task *task)
 {
-	g_hash_table_foreach (task->results, composites_metric_callback, task);
+	struct rspamd_config *cfg = task->cfg;
+
+	/* Index is built on config load and rebuilt when composites change */
+	if (cfg->composites_index != NULL &&
+			cfg->composites_index->composites->len > 0) {
+		g_hash_table_foreach (task->results, composites_metric_callback, task);
+	}
 }
@@ -19,6 +19,7 @@
 #include "config.h"
 
 struct rspamd_task;
+struct rspamd_config;
 
 /**
  * Subr for composite expressions
@@ -30,8 +31,22 @@ extern const struct rspamd_atom_subr composite_expr_subr;
 struct rspamd_composite {
 	struct rspamd_expression *expr;
 	gint id;
+	/* Composite symbol name */
+	const gchar *sym;
+	/* Composites that refer to this composite in their expressions */
+	GPtrArray *rdeps;
+	/* Expression might be true even if no atoms match (e.g. `!A`) */
+	gboolean always;
 };
 
+/**
+ * Compile all composites registered in config: resolve atoms to symbol ids,
+ * detect dependencies between composites and build the index from symbols
+ * to the composites that refer to them
+ * @param cfg config object
+ */
+void rspamd_composites_compile (struct rspamd_config *cfg);
+
 /**
  * Process all results and form composite metrics from existent metrics as it is defined in config
  * @param task worker's task that present message from user
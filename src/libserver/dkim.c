@@ -916,6 +916,43 @@ struct rspamd_dkim_key_cbdata {
 	gpointer ud;
 };
 
+/* Load public key from the decoded key data */
+static gboolean
+rspamd_dkim_key_load (rspamd_dkim_key_t *key, GError **err)
+{
+	key->key_bio = BIO_new_mem_buf (key->keydata, key->decoded_len);
+	if (key->key_bio == NULL) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"cannot make ssl bio from key");
+
+		return FALSE;
+	}
+
+	key->key_evp = d2i_PUBKEY_bio (key->key_bio, NULL);
+	if (key->key_evp == NULL) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"cannot extract pubkey from bio");
+
+		return FALSE;
+	}
+
+	key->key_rsa = EVP_PKEY_get1_RSA (key->key_evp);
+	if (key->key_rsa == NULL) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"cannot extract rsa key from evp key");
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static rspamd_dkim_key_t *
 rspamd_dkim_make_key (rspamd_dkim_context_t *ctx, const gchar *keydata,
 		guint keylen, GError **err)
@@ -944,34 +981,7 @@ rspamd_dkim_make_key (rspamd_dkim_context_t *ctx, const gchar *keydata,
 #endif
 	REF_INIT_RETAIN (key, rspamd_dkim_key_free);
 
-	key->key_bio = BIO_new_mem_buf (key->keydata, key->decoded_len);
-	if (key->key_bio == NULL) {
-		g_set_error (err,
-			DKIM_ERROR,
-			DKIM_SIGERROR_KEYFAIL,
-			"cannot make ssl bio from key");
-		REF_RELEASE (key);
-
-		return NULL;
-	}
-
-	key->key_evp = d2i_PUBKEY_bio (key->key_bio, NULL);
-	if (key->key_evp == NULL) {
-		g_set_error (err,
-			DKIM_ERROR,
-			DKIM_SIGERROR_KEYFAIL,
-			"cannot extract pubkey from bio");
-		REF_RELEASE (key);
-
-		return NULL;
-	}
-
-	key->key_rsa = EVP_PKEY_get1_RSA (key->key_evp);
-	if (key->key_rsa == NULL) {
-		g_set_error (err,
-			DKIM_ERROR,
-			DKIM_SIGERROR_KEYFAIL,
-			"cannot extract rsa key from evp key");
+	if (!rspamd_dkim_key_load (key, err)) {
 		REF_RELEASE (key);
 
 		return NULL;
@@ -2005,6 +2015,52 @@ rspamd_dkim_key_get_ttl (rspamd_dkim_key_t *k)
 	return 0;
 }
 
+rspamd_dkim_key_t *
+rspamd_dkim_key_from_der (const guchar *der, gsize len, guint ttl,
+		GError **err)
+{
+	rspamd_dkim_key_t *key;
+
+	if (len == 0) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"empty key");
+
+		return NULL;
+	}
+
+	key = g_slice_alloc0 (sizeof (rspamd_dkim_key_t));
+	key->keydata = g_slice_alloc (len);
+	memcpy (key->keydata, der, len);
+	key->keylen = len;
+	key->decoded_len = len;
+	key->ttl = ttl;
+	REF_INIT_RETAIN (key, rspamd_dkim_key_free);
+
+	if (!rspamd_dkim_key_load (key, err)) {
+		REF_RELEASE (key);
+
+		return NULL;
+	}
+
+	return key;
+}
+
+const guchar *
+rspamd_dkim_key_get_der (rspamd_dkim_key_t *k, gsize *len)
+{
+	if (k) {
+		*len = k->decoded_len;
+
+		return k->keydata;
+	}
+
+	*len = 0;
+
+	return NULL;
+}
+
 const gchar*
 rspamd_dkim_get_dns_key (rspamd_dkim_context_t *ctx)
 {
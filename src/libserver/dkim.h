@@ -138,6 +138,22 @@ const gchar* rspamd_dkim_get_domain (rspamd_dkim_context_t *ctx);
 const gchar* rspamd_dkim_get_dns_key (rspamd_dkim_context_t *ctx);
 guint rspamd_dkim_key_get_ttl (rspamd_dkim_key_t *k);
 
+/**
+ * Create DKIM key from the DER encoded public key
+ * @param der key data
+ * @param len length of data
+ * @param ttl ttl of the key
+ * @param err error
+ * @return new key with refcount = 1 or NULL
+ */
+rspamd_dkim_key_t * rspamd_dkim_key_from_der (const guchar *der, gsize len,
+	guint ttl, GError **err);
+
+/**
+ * Returns DER encoded public key
+ */
+const guchar * rspamd_dkim_key_get_der (rspamd_dkim_key_t *k, gsize *len);
+
 /**
  * Free DKIM key
  * @param key
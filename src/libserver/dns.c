@@ -20,6 +20,7 @@
 #include "utlist.h"
 #include "uthash.h"
 #include "rdns_event.h"
+#include "hash.h"
 
 static struct rdns_upstream_elt* rspamd_dns_select_upstream (const char *name,
 		size_t len, void *ups_data);
@@ -39,20 +40,95 @@ static struct rdns_upstream_context rspamd_ups_ctx = {
 		.data = NULL
 };
 
+/* Replies larger than this are not stored in the shared cache */
+#define RSPAMD_DNS_CACHE_MAX_REPLY 2048
+/* Upper limit for TTL of cached replies */
+#define RSPAMD_DNS_CACHE_MAX_TTL 86400
+
+struct rspamd_dns_cache {
+	rspamd_shared_cache_t *replies;
+	struct rspamd_dns_cache_stat *stat;
+	guint negative_ttl;
+};
+
+struct rspamd_dns_inflight;
+
 struct rspamd_dns_request_ud {
 	struct rspamd_async_session *session;
 	dns_callback_type cb;
 	gpointer ud;
 	rspamd_mempool_t *pool;
+	/* Request that owns the reply, NULL while waiting for another request */
 	struct rdns_request *req;
+	/* Reply restored from the cache that is delivered from the event loop */
+	struct rdns_reply *cached;
+	struct event ev;
+	struct rspamd_dns_inflight *inflight;
+	struct rspamd_dns_request_ud *prev, *next;
 };
 
+/*
+ * Request that is sent to the network, all identical requests made by the
+ * worker while it is not replied are attached as waiters
+ */
+struct rspamd_dns_inflight {
+	gchar *key;
+	gchar *name;
+	enum rdns_request_type type;
+	struct rspamd_dns_resolver *resolver;
+	/* Network request, owned by the resolver until it is replied */
+	struct rdns_request *req;
+	struct rspamd_dns_request_ud *waiters;
+};
+
+/* Serialized form of reply */
+struct rspamd_dns_cached_hdr {
+	guint16 code;
+	guint16 nentries;
+};
+
+struct rspamd_dns_cached_entry {
+	guint16 type;
+	gint32 ttl;
+};
+
+static void
+rspamd_dns_inflight_cancel (struct rspamd_dns_inflight *inf)
+{
+	g_hash_table_remove (inf->resolver->inflight, inf->key);
+	/* Releasing of a pending request removes it from librdns */
+	rdns_request_release (inf->req);
+	g_free (inf->name);
+	g_free (inf->key);
+	g_slice_free1 (sizeof (*inf), inf);
+}
+
 static void
 rspamd_dns_fin_cb (gpointer arg)
 {
 	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *)arg;
+	struct rspamd_dns_inflight *inf = reqdata->inflight;
+
+	if (inf) {
+		/* Session is terminated before the reply */
+		DL_DELETE (inf->waiters, reqdata);
+		reqdata->inflight = NULL;
+
+		if (inf->waiters == NULL) {
+			/* Nobody else waits for this reply, so stop the query */
+			rspamd_dns_inflight_cancel (inf);
+		}
+	}
+
+	if (reqdata->cached) {
+		event_del (&reqdata->ev);
+		reqdata->cached = NULL;
+	}
+
+	if (reqdata->req) {
+		rdns_request_release (reqdata->req);
+	}
 
-	rdns_request_release (reqdata->req);
 	if (reqdata->pool == NULL) {
 		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
 	}
@@ -78,6 +154,472 @@ rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
 	}
 }
 
+struct rspamd_dns_cache *
+rspamd_dns_cache_new (rspamd_mempool_t *pool, guint nslots, guint negative_ttl)
+{
+	struct rspamd_dns_cache *cache;
+
+	cache = rspamd_mempool_alloc0 (pool, sizeof (*cache));
+	cache->replies = rspamd_shared_cache_new (pool, nslots,
+			RSPAMD_DNS_CACHE_MAX_REPLY);
+	cache->stat = rspamd_mempool_alloc0_shared (pool, sizeof (*cache->stat));
+	cache->negative_ttl = negative_ttl;
+
+	return cache;
+}
+
+struct rspamd_dns_cache_stat *
+rspamd_dns_cache_get_stat (struct rspamd_dns_cache *cache)
+{
+	return cache->stat;
+}
+
+static void
+rspamd_dns_pack_string (GByteArray *ar, const gchar *str)
+{
+	guint16 len;
+
+	len = str ? MIN (strlen (str), G_MAXUINT16) : 0;
+	g_byte_array_append (ar, (const guint8 *)&len, sizeof (len));
+	g_byte_array_append (ar, (const guint8 *)str, len);
+}
+
+static gboolean
+rspamd_dns_unpack (const guchar **p, const guchar *end, gpointer out,
+		gsize len)
+{
+	if (end - *p < len) {
+		return FALSE;
+	}
+
+	memcpy (out, *p, len);
+	*p += len;
+
+	return TRUE;
+}
+
+/* Strings are allocated by malloc as they are freed by librdns */
+static gboolean
+rspamd_dns_unpack_string (const guchar **p, const guchar *end, gchar **out)
+{
+	guint16 len;
+
+	if (!rspamd_dns_unpack (p, end, &len, sizeof (len)) || end - *p < len) {
+		return FALSE;
+	}
+
+	*out = malloc (len + 1);
+	g_assert (*out != NULL);
+	memcpy (*out, *p, len);
+	(*out)[len] = '\0';
+	*p += len;
+
+	return TRUE;
+}
+
+/*
+ * Serialize reply to a pointer free form, returns minimal TTL of the entries
+ */
+static GByteArray *
+rspamd_dns_serialize_reply (struct rdns_reply *reply, guint *min_ttl)
+{
+	struct rspamd_dns_cached_hdr hdr;
+	struct rspamd_dns_cached_entry ce;
+	struct rdns_reply_entry *elt;
+	union rdns_reply_element_un *c;
+	GByteArray *ar;
+	guint hdr_pos;
+
+	ar = g_byte_array_sized_new (128);
+	hdr.code = reply->code;
+	hdr.nentries = 0;
+	hdr_pos = ar->len;
+	g_byte_array_append (ar, (const guint8 *)&hdr, sizeof (hdr));
+	*min_ttl = RSPAMD_DNS_CACHE_MAX_TTL;
+
+	LL_FOREACH (reply->entries, elt) {
+		c = &elt->content;
+
+		switch (elt->type) {
+		case RDNS_REQUEST_A:
+		case RDNS_REQUEST_AAAA:
+		case RDNS_REQUEST_PTR:
+		case RDNS_REQUEST_NS:
+		case RDNS_REQUEST_MX:
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+		case RDNS_REQUEST_SRV:
+		case RDNS_REQUEST_SOA:
+		case RDNS_REQUEST_TLSA:
+			break;
+		default:
+			/* Skip unknown elements */
+			continue;
+		}
+
+		ce.type = elt->type;
+		ce.ttl = elt->ttl;
+		g_byte_array_append (ar, (const guint8 *)&ce, sizeof (ce));
+		hdr.nentries ++;
+
+		if (elt->ttl >= 0 && (guint)elt->ttl < *min_ttl) {
+			*min_ttl = elt->ttl;
+		}
+
+		switch (elt->type) {
+		case RDNS_REQUEST_A:
+			g_byte_array_append (ar, (const guint8 *)&c->a.addr,
+					sizeof (c->a.addr));
+			break;
+		case RDNS_REQUEST_AAAA:
+			g_byte_array_append (ar, (const guint8 *)&c->aaa.addr,
+					sizeof (c->aaa.addr));
+			break;
+		case RDNS_REQUEST_PTR:
+			rspamd_dns_pack_string (ar, c->ptr.name);
+			break;
+		case RDNS_REQUEST_NS:
+			rspamd_dns_pack_string (ar, c->ns.name);
+			break;
+		case RDNS_REQUEST_MX:
+			g_byte_array_append (ar, (const guint8 *)&c->mx.priority,
+					sizeof (c->mx.priority));
+			rspamd_dns_pack_string (ar, c->mx.name);
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			rspamd_dns_pack_string (ar, c->txt.data);
+			break;
+		case RDNS_REQUEST_SRV:
+			g_byte_array_append (ar, (const guint8 *)&c->srv.priority,
+					sizeof (c->srv.priority));
+			g_byte_array_append (ar, (const guint8 *)&c->srv.weight,
+					sizeof (c->srv.weight));
+			g_byte_array_append (ar, (const guint8 *)&c->srv.port,
+					sizeof (c->srv.port));
+			rspamd_dns_pack_string (ar, c->srv.target);
+			break;
+		case RDNS_REQUEST_SOA:
+			rspamd_dns_pack_string (ar, c->soa.mname);
+			rspamd_dns_pack_string (ar, c->soa.admin);
+			g_byte_array_append (ar, (const guint8 *)&c->soa.serial,
+					sizeof (c->soa.serial));
+			g_byte_array_append (ar, (const guint8 *)&c->soa.refresh,
+					sizeof (c->soa.refresh));
+			g_byte_array_append (ar, (const guint8 *)&c->soa.retry,
+					sizeof (c->soa.retry));
+			g_byte_array_append (ar, (const guint8 *)&c->soa.expire,
+					sizeof (c->soa.expire));
+			g_byte_array_append (ar, (const guint8 *)&c->soa.minimum,
+					sizeof (c->soa.minimum));
+			break;
+		case RDNS_REQUEST_TLSA:
+			g_byte_array_append (ar, &c->tlsa.usage, sizeof (c->tlsa.usage));
+			g_byte_array_append (ar, &c->tlsa.selector,
+					sizeof (c->tlsa.selector));
+			g_byte_array_append (ar, &c->tlsa.match_type,
+					sizeof (c->tlsa.match_type));
+			g_byte_array_append (ar, (const guint8 *)&c->tlsa.datalen,
+					sizeof (c->tlsa.datalen));
+			g_byte_array_append (ar, c->tlsa.data, c->tlsa.datalen);
+			break;
+		default:
+			break;
+		}
+	}
+
+	memcpy (ar->data + hdr_pos, &hdr, sizeof (hdr));
+
+	return ar;
+}
+
+static gboolean
+rspamd_dns_deserialize_entry (struct rdns_reply_entry *elt,
+		const guchar **p, const guchar *end)
+{
+	union rdns_reply_element_un *c = &elt->content;
+
+	switch (elt->type) {
+	case RDNS_REQUEST_A:
+		return rspamd_dns_unpack (p, end, &c->a.addr, sizeof (c->a.addr));
+	case RDNS_REQUEST_AAAA:
+		return rspamd_dns_unpack (p, end, &c->aaa.addr, sizeof (c->aaa.addr));
+	case RDNS_REQUEST_PTR:
+		return rspamd_dns_unpack_string (p, end, &c->ptr.name);
+	case RDNS_REQUEST_NS:
+		return rspamd_dns_unpack_string (p, end, &c->ns.name);
+	case RDNS_REQUEST_MX:
+		return rspamd_dns_unpack (p, end, &c->mx.priority,
+				sizeof (c->mx.priority)) &&
+				rspamd_dns_unpack_string (p, end, &c->mx.name);
+	case RDNS_REQUEST_TXT:
+	case RDNS_REQUEST_SPF:
+		return rspamd_dns_unpack_string (p, end, &c->txt.data);
+	case RDNS_REQUEST_SRV:
+		return rspamd_dns_unpack (p, end, &c->srv.priority,
+				sizeof (c->srv.priority)) &&
+				rspamd_dns_unpack (p, end, &c->srv.weight,
+						sizeof (c->srv.weight)) &&
+				rspamd_dns_unpack (p, end, &c->srv.port,
+						sizeof (c->srv.port)) &&
+				rspamd_dns_unpack_string (p, end, &c->srv.target);
+	case RDNS_REQUEST_SOA:
+		if (!rspamd_dns_unpack_string (p, end, &c->soa.mname)) {
+			return FALSE;
+		}
+		if (!rspamd_dns_unpack_string (p, end, &c->soa.admin)) {
+			free (c->soa.mname);
+			return FALSE;
+		}
+		if (!rspamd_dns_unpack (p, end, &c->soa.serial,
+				sizeof (c->soa.serial)) ||
+				!rspamd_dns_unpack (p, end, &c->soa.refresh,
+						sizeof (c->soa.refresh)) ||
+				!rspamd_dns_unpack (p, end, &c->soa.retry,
+						sizeof (c->soa.retry)) ||
+				!rspamd_dns_unpack (p, end, &c->soa.expire,
+						sizeof (c->soa.expire)) ||
+				!rspamd_dns_unpack (p, end, &c->soa.minimum,
+						sizeof (c->soa.minimum))) {
+			free (c->soa.mname);
+			free (c->soa.admin);
+			return FALSE;
+		}
+		return TRUE;
+	case RDNS_REQUEST_TLSA:
+		if (!rspamd_dns_unpack (p, end, &c->tlsa.usage,
+				sizeof (c->tlsa.usage)) ||
+				!rspamd_dns_unpack (p, end, &c->tlsa.selector,
+						sizeof (c->tlsa.selector)) ||
+				!rspamd_dns_unpack (p, end, &c->tlsa.match_type,
+						sizeof (c->tlsa.match_type)) ||
+				!rspamd_dns_unpack (p, end, &c->tlsa.datalen,
+						sizeof (c->tlsa.datalen)) ||
+				end - *p < c->tlsa.datalen) {
+			return FALSE;
+		}
+		c->tlsa.data = malloc (MAX (c->tlsa.datalen, 1));
+		g_assert (c->tlsa.data != NULL);
+		memcpy (c->tlsa.data, *p, c->tlsa.datalen);
+		*p += c->tlsa.datalen;
+		return TRUE;
+	default:
+		break;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Restore reply from the serialized form, TTL of entries is limited by `ttl`
+ */
+static struct rdns_reply *
+rspamd_dns_deserialize_reply (struct rspamd_dns_resolver *resolver,
+		const gchar *name, enum rdns_request_type type,
+		const guchar *data, gsize len, guint ttl)
+{
+	struct rspamd_dns_cached_hdr hdr;
+	struct rspamd_dns_cached_entry ce;
+	struct rdns_reply *rep;
+	struct rdns_reply_entry *elt;
+	const guchar *p = data, *end = data + len;
+	guint i;
+
+	if (!rspamd_dns_unpack (&p, end, &hdr, sizeof (hdr))) {
+		return NULL;
+	}
+
+	rep = rdns_make_detached_reply (resolver->r, name, type, hdr.code);
+
+	if (rep == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < hdr.nentries; i ++) {
+		if (!rspamd_dns_unpack (&p, end, &ce, sizeof (ce))) {
+			break;
+		}
+
+		elt = calloc (1, sizeof (*elt));
+		g_assert (elt != NULL);
+		elt->type = ce.type;
+		elt->ttl = MIN ((guint)MAX (ce.ttl, 0), ttl);
+
+		if (!rspamd_dns_deserialize_entry (elt, &p, end)) {
+			free (elt);
+			break;
+		}
+
+		DL_APPEND (rep->entries, elt);
+	}
+
+	if (i != hdr.nentries) {
+		msg_err ("cannot restore cached DNS reply for %s", name);
+		rdns_request_release (rep->request);
+
+		return NULL;
+	}
+
+	return rep;
+}
+
+static gchar *
+rspamd_dns_cache_key (enum rdns_request_type type, const gchar *name)
+{
+	gchar *key;
+
+	key = g_strdup_printf ("%d:%s", (gint)type, name);
+	rspamd_str_lc (key, strlen (key));
+
+	return key;
+}
+
+static void
+rspamd_dns_cache_insert (struct rspamd_dns_resolver *resolver,
+		const gchar *key, struct rdns_reply *reply, GByteArray *ar,
+		guint min_ttl)
+{
+	struct rspamd_dns_cache *cache = resolver->cache;
+	guint ttl;
+
+	switch (reply->code) {
+	case RDNS_RC_NOERROR:
+		ttl = min_ttl;
+		break;
+	case RDNS_RC_NXDOMAIN:
+	case RDNS_RC_NOREC:
+		ttl = cache->negative_ttl;
+		break;
+	default:
+		/* Do not cache temporary failures */
+		return;
+	}
+
+	if (ttl > 0 && rspamd_shared_cache_insert (cache->replies, key,
+			strlen (key), ar->data, ar->len, time (NULL), ttl)) {
+		g_atomic_int_inc (&cache->stat->stored);
+	}
+}
+
+/* Called from the event loop to deliver reply restored from the cache */
+static void
+rspamd_dns_cached_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamd_dns_request_ud *reqdata = ud;
+	struct rdns_request *req = reqdata->req;
+	struct rdns_reply *reply = reqdata->cached;
+
+	reqdata->cached = NULL;
+	rspamd_dns_callback (reply, reqdata);
+	/* Drop the reference that is owned by a resolver for normal requests */
+	rdns_request_release (req);
+}
+
+static void
+rspamd_dns_inflight_cb (struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dns_inflight *inf = ud;
+	struct rspamd_dns_resolver *resolver = inf->resolver;
+	struct rspamd_dns_request_ud *w, *first;
+	struct rdns_reply *rep;
+	struct rdns_request *req;
+	GByteArray *ar = NULL;
+	guint min_ttl;
+
+	g_hash_table_remove (resolver->inflight, inf->key);
+
+	if (resolver->cache || (inf->waiters && inf->waiters->next)) {
+		ar = rspamd_dns_serialize_reply (reply, &min_ttl);
+
+		if (resolver->cache) {
+			rspamd_dns_cache_insert (resolver, inf->key, reply, ar, min_ttl);
+		}
+	}
+
+	/* The first waiter receives the original reply */
+	first = inf->waiters;
+
+	if (first) {
+		DL_DELETE (inf->waiters, first);
+		first->inflight = NULL;
+		first->req = reply->request;
+		rspamd_dns_callback (reply, first);
+	}
+
+	/* Callbacks could terminate sessions of other waiters, so restart from head */
+	while ((w = inf->waiters) != NULL) {
+		DL_DELETE (inf->waiters, w);
+		w->inflight = NULL;
+		rep = NULL;
+
+		if (ar) {
+			rep = rspamd_dns_deserialize_reply (resolver, inf->name, inf->type,
+					ar->data, ar->len, RSPAMD_DNS_CACHE_MAX_TTL);
+		}
+
+		if (rep == NULL) {
+			rep = rdns_make_detached_reply (resolver->r, inf->name, inf->type,
+					RDNS_RC_SERVFAIL);
+			g_assert (rep != NULL);
+		}
+
+		req = rep->request;
+		w->req = req;
+		rspamd_dns_callback (rep, w);
+		rdns_request_release (req);
+	}
+
+	if (ar) {
+		g_byte_array_free (ar, TRUE);
+	}
+
+	g_free (inf->name);
+	g_free (inf->key);
+	g_slice_free1 (sizeof (*inf), inf);
+}
+
+static gboolean
+rspamd_dns_request_cached (struct rspamd_dns_resolver *resolver,
+		struct rspamd_dns_request_ud *reqdata, const gchar *key,
+		enum rdns_request_type type, const gchar *name)
+{
+	guchar buf[RSPAMD_DNS_CACHE_MAX_REPLY];
+	struct rdns_reply *rep;
+	struct timeval tv;
+	gssize len;
+	guint ttl;
+
+	len = rspamd_shared_cache_lookup (resolver->cache->replies, key,
+			strlen (key), buf, time (NULL), &ttl);
+
+	if (len <= 0) {
+		return FALSE;
+	}
+
+	rep = rspamd_dns_deserialize_reply (resolver, name, type, buf, len, ttl);
+
+	if (rep == NULL) {
+		return FALSE;
+	}
+
+	if (rep->code == RDNS_RC_NOERROR) {
+		g_atomic_int_inc (&resolver->cache->stat->hits);
+	}
+	else {
+		g_atomic_int_inc (&resolver->cache->stat->negative_hits);
+	}
+
+	reqdata->req = rep->request;
+	reqdata->cached = rep;
+	/* Callers expect that callback is never called from this function */
+	event_set (&reqdata->ev, -1, EV_TIMEOUT, rspamd_dns_cached_cb, reqdata);
+	event_base_set (resolver->ev_base, &reqdata->ev);
+	timerclear (&tv);
+	event_add (&reqdata->ev, &tv);
+
+	return TRUE;
+}
+
 gboolean
 make_dns_request (struct rspamd_dns_resolver *resolver,
 	struct rspamd_async_session *session,
@@ -89,6 +631,8 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 {
 	struct rdns_request *req;
 	struct rspamd_dns_request_ud *reqdata = NULL;
+	struct rspamd_dns_inflight *inf;
+	gchar *key;
 
 	g_assert (resolver != NULL);
 
@@ -98,35 +642,70 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 
 	if (pool != NULL) {
 		reqdata =
-			rspamd_mempool_alloc (pool, sizeof (struct rspamd_dns_request_ud));
+			rspamd_mempool_alloc0 (pool, sizeof (struct rspamd_dns_request_ud));
 	}
 	else {
-		reqdata = g_slice_alloc (sizeof (struct rspamd_dns_request_ud));
+		reqdata = g_slice_alloc0 (sizeof (struct rspamd_dns_request_ud));
 	}
 	reqdata->pool = pool;
 	reqdata->session = session;
 	reqdata->cb = cb;
 	reqdata->ud = ud;
 
-	req = rdns_make_request_full (resolver->r, rspamd_dns_callback, reqdata,
-			resolver->request_timeout, resolver->max_retransmits, 1, name,
-			type);
-	reqdata->req = req;
+	key = rspamd_dns_cache_key (type, name);
 
-	if (session) {
-		if (req != NULL) {
-			rspamd_session_add_event (session,
-					(event_finalizer_t)rspamd_dns_fin_cb,
-					reqdata,
-					g_quark_from_static_string ("dns resolver"));
+	if (resolver->cache &&
+			rspamd_dns_request_cached (resolver, reqdata, key, type, name)) {
+		g_free (key);
+	}
+	else if ((inf = g_hash_table_lookup (resolver->inflight, key)) != NULL) {
+		/* The same request is already sent, wait for its reply */
+		g_free (key);
+		reqdata->inflight = inf;
+		DL_APPEND (inf->waiters, reqdata);
+
+		if (resolver->cache) {
+			g_atomic_int_inc (&resolver->cache->stat->coalesced);
 		}
 	}
+	else {
+		inf = g_slice_alloc0 (sizeof (*inf));
+		inf->key = key;
+		inf->name = g_strdup (name);
+		inf->type = type;
+		inf->resolver = resolver;
+
+		req = rdns_make_request_full (resolver->r, rspamd_dns_inflight_cb, inf,
+				resolver->request_timeout, resolver->max_retransmits, 1, name,
+				type);
+
+		if (req == NULL) {
+			g_free (inf->name);
+			g_free (inf->key);
+			g_slice_free1 (sizeof (*inf), inf);
+
+			if (pool == NULL) {
+				g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+			}
+
+			return FALSE;
+		}
 
-	if (req == NULL) {
-		if (pool == NULL) {
-			g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+		inf->req = req;
+		reqdata->inflight = inf;
+		DL_APPEND (inf->waiters, reqdata);
+		g_hash_table_insert (resolver->inflight, inf->key, inf);
+
+		if (resolver->cache) {
+			g_atomic_int_inc (&resolver->cache->stat->misses);
 		}
-		return FALSE;
+	}
+
+	if (session) {
+		rspamd_session_add_event (session,
+				(event_finalizer_t)rspamd_dns_fin_cb,
+				reqdata,
+				g_quark_from_static_string ("dns resolver"));
 	}
 
 	return TRUE;
@@ -229,9 +808,11 @@ dns_resolver_init (rspamd_logger_t *logger,
 
 	dns_resolver = g_slice_alloc0 (sizeof (struct rspamd_dns_resolver));
 	dns_resolver->ev_base = ev_base;
+	dns_resolver->inflight = g_hash_table_new (g_str_hash, g_str_equal);
 	if (cfg != NULL) {
 		dns_resolver->request_timeout = cfg->dns_timeout;
 		dns_resolver->max_retransmits = cfg->dns_retransmits;
+		dns_resolver->cache = cfg->dns_cache;
 	}
 	else {
 		dns_resolver->request_timeout = 1;
@@ -25,18 +25,48 @@
 #include "upstream.h"
 
 struct rspamd_config;
+struct rspamd_dns_cache;
 
 struct rspamd_dns_resolver {
 	struct rdns_resolver *r;
 	struct event_base *ev_base;
 	struct upstream_list *ups;
 	struct rspamd_config *cfg;
+	struct rspamd_dns_cache *cache;
+	GHashTable *inflight;
 	gdouble request_timeout;
 	guint max_retransmits;
 };
 
+/* Counters of the DNS cache, shared between all processes */
+struct rspamd_dns_cache_stat {
+	guint hits;
+	guint negative_hits;
+	guint misses;
+	guint coalesced;
+	guint stored;
+};
+
 /* Rspamd DNS API */
 
+/**
+ * Create DNS cache in the shared memory, it must be called before forking
+ * of the workers to share the cache between them
+ * @param pool memory pool used to allocate shared memory
+ * @param nslots number of cached replies
+ * @param negative_ttl time to cache negative replies
+ * @return new cache
+ */
+struct rspamd_dns_cache * rspamd_dns_cache_new (rspamd_mempool_t *pool,
+	guint nslots,
+	guint negative_ttl);
+
+/**
+ * Get counters for the DNS cache
+ */
+struct rspamd_dns_cache_stat * rspamd_dns_cache_get_stat (
+	struct rspamd_dns_cache *cache);
+
 /**
  * Init DNS resolver, params are obtained from a config file or system file /etc/resolv.conf
  */
@@ -0,0 +1,654 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "redis_pool.h"
+#include "cryptobox.h"
+
+#ifdef WITH_HIREDIS
+#include "hiredis.h"
+#include "adapters/libevent.h"
+
+/* Time to keep idle connection opened */
+static const gdouble default_timeout = 10.0;
+/* Maximum number of idle connections per server */
+static const guint default_max_conns = 16;
+/* Maximum number of users multiplexed over a single connection */
+static const guint default_max_users = 32;
+
+enum rspamd_redis_pool_connection_state {
+	RSPAMD_REDIS_POOL_CONN_INACTIVE = 0,
+	RSPAMD_REDIS_POOL_CONN_ACTIVE
+};
+
+struct rspamd_redis_pool_elt;
+struct rspamd_redis_pool_connection;
+
+/* Command of a user waiting for reply */
+struct rspamd_redis_pool_request {
+	struct rspamd_redis_pool_connection *conn;
+	rspamd_redis_pool_cb fn;
+	gpointer privdata;
+	GList *entry;
+};
+
+struct rspamd_redis_pool_connection {
+	struct redisAsyncContext *ctx;
+	struct rspamd_redis_pool_elt *elt;
+	GList *entry;
+	struct event timeout;
+	enum rspamd_redis_pool_connection_state state;
+	/* Pending requests of users in order of commands */
+	GQueue requests;
+	guint users;
+	/* Connection is not shared and not reused */
+	gboolean exclusive;
+	/* Connection is closed when the last user releases it */
+	gboolean draining;
+	gchar tag[MEMPOOL_UID_LEN];
+};
+
+struct rspamd_redis_pool_elt {
+	struct rspamd_redis_pool *pool;
+	GQueue *active;
+	GQueue *inactive;
+	gchar *key;
+	gchar *ip;
+	gchar *db;
+	gchar *password;
+	gint port;
+};
+
+struct rspamd_redis_pool {
+	struct event_base *ev_base;
+	struct rspamd_config *cfg;
+	GHashTable *elts_by_key;
+	GHashTable *elts_by_ctx;
+	gdouble timeout;
+	guint max_conns;
+	guint max_users;
+};
+
+#define msg_err_rpool(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
+		"redis_pool", conn->tag, \
+		G_STRFUNC, \
+		__VA_ARGS__)
+#define msg_info_rpool(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
+		"redis_pool", conn->tag, \
+		G_STRFUNC, \
+		__VA_ARGS__)
+#define msg_debug_rpool(...)  rspamd_default_log_function (G_LOG_LEVEL_DEBUG, \
+		"redis_pool", conn->tag, \
+		G_STRFUNC, \
+		__VA_ARGS__)
+
+static inline gboolean
+rspamd_redis_pool_conn_usable (struct rspamd_redis_pool_connection *conn)
+{
+	return conn->ctx->err == 0 &&
+			!(conn->ctx->c.flags & (REDIS_DISCONNECTING | REDIS_FREEING));
+}
+
+/*
+ * Removes connection from the pool, hiredis context is not touched. Users
+ * that release this context afterwards are ignored as hiredis owns it now
+ */
+static void
+rspamd_redis_pool_conn_unlink (struct rspamd_redis_pool_connection *conn)
+{
+	struct rspamd_redis_pool_elt *elt = conn->elt;
+	struct rspamd_redis_pool_request *req;
+	GList *cur;
+
+	/* Requests are freed when hiredis calls their callbacks */
+	for (cur = conn->requests.head; cur != NULL; cur = g_list_next (cur)) {
+		req = cur->data;
+		req->conn = NULL;
+		req->entry = NULL;
+	}
+
+	g_queue_clear (&conn->requests);
+
+	if (conn->state == RSPAMD_REDIS_POOL_CONN_ACTIVE) {
+		g_queue_delete_link (elt->active, conn->entry);
+	}
+	else {
+		g_queue_delete_link (elt->inactive, conn->entry);
+
+		if (event_get_base (&conn->timeout)) {
+			event_del (&conn->timeout);
+		}
+	}
+
+	g_hash_table_remove (elt->pool->elts_by_ctx, conn->ctx);
+	conn->ctx->data = NULL;
+	g_slice_free1 (sizeof (*conn), conn);
+}
+
+static void
+rspamd_redis_pool_conn_terminate (struct rspamd_redis_pool_connection *conn)
+{
+	struct redisAsyncContext *ac = conn->ctx;
+
+	msg_debug_rpool ("close connection to %s:%d", conn->elt->ip,
+			conn->elt->port);
+	rspamd_redis_pool_conn_unlink (conn);
+	/* Pending callbacks are called with NULL reply here or after callback */
+	redisAsyncFree (ac);
+}
+
+static void
+rspamd_redis_pool_on_connect (const struct redisAsyncContext *ac, int status)
+{
+	struct rspamd_redis_pool_connection *conn = ac->data;
+
+	if (status != REDIS_OK && conn != NULL) {
+		msg_info_rpool ("cannot connect to redis %s:%d: %s", conn->elt->ip,
+				conn->elt->port, ac->errstr);
+		/* Context is freed by hiredis after this callback */
+		rspamd_redis_pool_conn_unlink (conn);
+	}
+}
+
+static void
+rspamd_redis_pool_on_disconnect (const struct redisAsyncContext *ac, int status)
+{
+	struct rspamd_redis_pool_connection *conn = ac->data;
+
+	if (conn != NULL) {
+		msg_debug_rpool ("connection to %s:%d has been closed: %s",
+				conn->elt->ip, conn->elt->port,
+				status == REDIS_OK ? "no error" : ac->errstr);
+		rspamd_redis_pool_conn_unlink (conn);
+	}
+}
+
+static void
+rspamd_redis_pool_conn_timeout (gint fd, short what, gpointer p)
+{
+	struct rspamd_redis_pool_connection *conn = p;
+
+	g_assert (conn->state == RSPAMD_REDIS_POOL_CONN_INACTIVE);
+	msg_debug_rpool ("idle timeout for connection to %s:%d", conn->elt->ip,
+			conn->elt->port);
+	rspamd_redis_pool_conn_terminate (conn);
+}
+
+static struct rspamd_redis_pool_connection *
+rspamd_redis_pool_new_connection (struct rspamd_redis_pool *pool,
+		struct rspamd_redis_pool_elt *elt)
+{
+	struct rspamd_redis_pool_connection *conn;
+	struct redisAsyncContext *ctx;
+
+	ctx = redisAsyncConnect (elt->ip, elt->port);
+
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	if (ctx->err != REDIS_OK) {
+		msg_err ("cannot connect to redis %s:%d: %s", elt->ip, elt->port,
+				ctx->errstr);
+		redisAsyncFree (ctx);
+
+		return NULL;
+	}
+
+	conn = g_slice_alloc0 (sizeof (*conn));
+	conn->ctx = ctx;
+	conn->elt = elt;
+	conn->state = RSPAMD_REDIS_POOL_CONN_ACTIVE;
+	rspamd_random_hex ((guchar *)conn->tag, sizeof (conn->tag) - 1);
+	ctx->data = conn;
+	g_hash_table_insert (pool->elts_by_ctx, ctx, conn);
+	g_queue_push_head (elt->active, conn);
+	conn->entry = elt->active->head;
+
+	redisLibeventAttach (ctx, pool->ev_base);
+	redisAsyncSetConnectCallback (ctx, rspamd_redis_pool_on_connect);
+	redisAsyncSetDisconnectCallback (ctx, rspamd_redis_pool_on_disconnect);
+
+	/* These commands are sent before any commands of users */
+	if (elt->password) {
+		redisAsyncCommand (ctx, NULL, NULL, "AUTH %s", elt->password);
+	}
+	if (elt->db) {
+		redisAsyncCommand (ctx, NULL, NULL, "SELECT %s", elt->db);
+	}
+
+	msg_debug_rpool ("created new connection to %s:%d", elt->ip, elt->port);
+
+	return conn;
+}
+
+static struct rspamd_redis_pool_elt *
+rspamd_redis_pool_new_elt (struct rspamd_redis_pool *pool, gchar *key,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	struct rspamd_redis_pool_elt *elt;
+
+	elt = g_slice_alloc0 (sizeof (*elt));
+	elt->pool = pool;
+	elt->active = g_queue_new ();
+	elt->inactive = g_queue_new ();
+	elt->key = key;
+	elt->ip = g_strdup (ip);
+	elt->db = db ? g_strdup (db) : NULL;
+	elt->password = password ? g_strdup (password) : NULL;
+	elt->port = port;
+
+	return elt;
+}
+
+static void
+rspamd_redis_pool_elt_dtor (gpointer p)
+{
+	struct rspamd_redis_pool_elt *elt = p;
+	struct rspamd_redis_pool_connection *conn;
+
+	while ((conn = g_queue_peek_head (elt->active)) != NULL) {
+		rspamd_redis_pool_conn_terminate (conn);
+	}
+
+	while ((conn = g_queue_peek_head (elt->inactive)) != NULL) {
+		rspamd_redis_pool_conn_terminate (conn);
+	}
+
+	g_queue_free (elt->active);
+	g_queue_free (elt->inactive);
+	g_free (elt->key);
+	g_free (elt->ip);
+	g_free (elt->db);
+
+	if (elt->password) {
+		rspamd_explicit_memzero (elt->password, strlen (elt->password));
+		g_free (elt->password);
+	}
+
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+struct rspamd_redis_pool *
+rspamd_redis_pool_init (void)
+{
+	struct rspamd_redis_pool *pool;
+
+	pool = g_slice_alloc0 (sizeof (*pool));
+	pool->elts_by_key = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+			rspamd_redis_pool_elt_dtor);
+	pool->elts_by_ctx = g_hash_table_new (g_direct_hash, g_direct_equal);
+	pool->timeout = default_timeout;
+	pool->max_conns = default_max_conns;
+	pool->max_users = default_max_users;
+
+	return pool;
+}
+
+void
+rspamd_redis_pool_config (struct rspamd_redis_pool *pool,
+		struct rspamd_config *cfg,
+		struct event_base *ev_base)
+{
+	g_assert (pool != NULL);
+
+	pool->ev_base = ev_base;
+	pool->cfg = cfg;
+}
+
+static struct rspamd_redis_pool_elt *
+rspamd_redis_pool_get_elt (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	struct rspamd_redis_pool_elt *elt;
+	gchar *key;
+
+	key = g_strdup_printf ("%s:%d/%s/%s", ip, port, db ? db : "",
+			password ? password : "");
+	elt = g_hash_table_lookup (pool->elts_by_key, key);
+
+	if (elt == NULL) {
+		elt = rspamd_redis_pool_new_elt (pool, key, db, password, ip, port);
+		g_hash_table_insert (pool->elts_by_key, elt->key, elt);
+	}
+	else {
+		g_free (key);
+	}
+
+	return elt;
+}
+
+struct redisAsyncContext *
+rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	struct rspamd_redis_pool_elt *elt;
+	struct rspamd_redis_pool_connection *conn, *best = NULL;
+	GList *cur;
+
+	g_assert (pool != NULL);
+
+	if (pool->ev_base == NULL) {
+		msg_err ("redis pool is not configured for this process");
+
+		return NULL;
+	}
+
+	elt = rspamd_redis_pool_get_elt (pool, db, password, ip, port);
+
+	/* Prefer pipelining over the least loaded active connection */
+	for (cur = elt->active->head; cur != NULL; cur = g_list_next (cur)) {
+		conn = cur->data;
+
+		if (!conn->exclusive && !conn->draining &&
+				conn->users < pool->max_users &&
+				rspamd_redis_pool_conn_usable (conn) &&
+				(best == NULL || conn->users < best->users)) {
+			best = conn;
+		}
+	}
+
+	if (best != NULL) {
+		best->users ++;
+		msg_debug_rpool ("share connection to %s:%d with %d users",
+				elt->ip, elt->port, best->users);
+
+		return best->ctx;
+	}
+
+	/* Then reuse an idle connection */
+	while ((conn = g_queue_pop_head (elt->inactive)) != NULL) {
+		if (event_get_base (&conn->timeout)) {
+			event_del (&conn->timeout);
+		}
+
+		if (!rspamd_redis_pool_conn_usable (conn)) {
+			/* Should not normally happen as disconnected contexts are unlinked */
+			g_queue_push_head (elt->inactive, conn);
+			conn->entry = elt->inactive->head;
+			rspamd_redis_pool_conn_terminate (conn);
+			continue;
+		}
+
+		conn->state = RSPAMD_REDIS_POOL_CONN_ACTIVE;
+		g_queue_push_head (elt->active, conn);
+		conn->entry = elt->active->head;
+		conn->users = 1;
+		msg_debug_rpool ("reuse idle connection to %s:%d", elt->ip, elt->port);
+
+		return conn->ctx;
+	}
+
+	conn = rspamd_redis_pool_new_connection (pool, elt);
+
+	if (conn == NULL) {
+		return NULL;
+	}
+
+	conn->users = 1;
+
+	return conn->ctx;
+}
+
+struct redisAsyncContext *
+rspamd_redis_pool_connect_exclusive (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	struct rspamd_redis_pool_elt *elt;
+	struct rspamd_redis_pool_connection *conn;
+
+	g_assert (pool != NULL);
+
+	if (pool->ev_base == NULL) {
+		msg_err ("redis pool is not configured for this process");
+
+		return NULL;
+	}
+
+	elt = rspamd_redis_pool_get_elt (pool, db, password, ip, port);
+	conn = rspamd_redis_pool_new_connection (pool, elt);
+
+	if (conn == NULL) {
+		return NULL;
+	}
+
+	conn->users = 1;
+	conn->exclusive = TRUE;
+	msg_debug_rpool ("created exclusive connection to %s:%d",
+			elt->ip, elt->port);
+
+	return conn->ctx;
+}
+
+static void
+rspamd_redis_pool_on_reply (struct redisAsyncContext *ac, gpointer reply,
+		gpointer p)
+{
+	struct rspamd_redis_pool_request *req = p;
+	rspamd_redis_pool_cb fn;
+	gpointer privdata;
+
+	if (req->conn != NULL) {
+		g_queue_delete_link (&req->conn->requests, req->entry);
+	}
+
+	fn = req->fn;
+	privdata = req->privdata;
+	g_slice_free1 (sizeof (*req), req);
+
+	/* Detached requests have no callback, so reply is just dropped */
+	if (fn != NULL) {
+		fn (ac, reply, privdata);
+	}
+}
+
+static struct rspamd_redis_pool_request *
+rspamd_redis_pool_request_new (struct redisAsyncContext *ctx,
+		rspamd_redis_pool_cb fn, gpointer privdata)
+{
+	struct rspamd_redis_pool_connection *conn = ctx->data;
+	struct rspamd_redis_pool_request *req;
+
+	if (conn == NULL) {
+		/* Connection is being destroyed */
+		return NULL;
+	}
+
+	req = g_slice_alloc (sizeof (*req));
+	req->conn = conn;
+	req->fn = fn;
+	req->privdata = privdata;
+	g_queue_push_tail (&conn->requests, req);
+	req->entry = conn->requests.tail;
+
+	return req;
+}
+
+static gint
+rspamd_redis_pool_request_check (struct rspamd_redis_pool_request *req,
+		gint ret)
+{
+	if (ret != REDIS_OK) {
+		/* Hiredis has not registered callback */
+		if (req->conn != NULL) {
+			g_queue_delete_link (&req->conn->requests, req->entry);
+		}
+
+		g_slice_free1 (sizeof (*req), req);
+	}
+
+	return ret;
+}
+
+gint
+rspamd_redis_pool_command (struct redisAsyncContext *ctx,
+		rspamd_redis_pool_cb fn, gpointer privdata, const gchar *fmt, ...)
+{
+	struct rspamd_redis_pool_request *req;
+	va_list ap;
+	gint ret;
+
+	g_assert (ctx != NULL);
+	req = rspamd_redis_pool_request_new (ctx, fn, privdata);
+
+	if (req == NULL) {
+		return REDIS_ERR;
+	}
+
+	va_start (ap, fmt);
+	ret = redisvAsyncCommand (ctx, rspamd_redis_pool_on_reply, req, fmt, ap);
+	va_end (ap);
+
+	return rspamd_redis_pool_request_check (req, ret);
+}
+
+gint
+rspamd_redis_pool_command_argv (struct redisAsyncContext *ctx,
+		rspamd_redis_pool_cb fn, gpointer privdata,
+		gint argc, const gchar **argv, const gsize *argvlen)
+{
+	struct rspamd_redis_pool_request *req;
+
+	g_assert (ctx != NULL);
+	req = rspamd_redis_pool_request_new (ctx, fn, privdata);
+
+	if (req == NULL) {
+		return REDIS_ERR;
+	}
+
+	return rspamd_redis_pool_request_check (req,
+			redisAsyncCommandArgv (ctx, rspamd_redis_pool_on_reply, req,
+					argc, argv, argvlen));
+}
+
+gint
+rspamd_redis_pool_formatted_command (struct redisAsyncContext *ctx,
+		rspamd_redis_pool_cb fn, gpointer privdata,
+		const gchar *cmd, gsize len)
+{
+	struct rspamd_redis_pool_request *req;
+
+	g_assert (ctx != NULL);
+	req = rspamd_redis_pool_request_new (ctx, fn, privdata);
+
+	if (req == NULL) {
+		return REDIS_ERR;
+	}
+
+	return rspamd_redis_pool_request_check (req,
+			redisAsyncFormattedCommand (ctx, rspamd_redis_pool_on_reply, req,
+					cmd, len));
+}
+
+void
+rspamd_redis_pool_detach_callbacks (struct redisAsyncContext *ctx,
+		gpointer privdata)
+{
+	struct rspamd_redis_pool_connection *conn;
+	struct rspamd_redis_pool_request *req;
+	GList *cur;
+
+	g_assert (ctx != NULL);
+	conn = ctx->data;
+
+	if (conn == NULL) {
+		return;
+	}
+
+	for (cur = conn->requests.head; cur != NULL; cur = g_list_next (cur)) {
+		req = cur->data;
+
+		if (req->privdata == privdata) {
+			req->fn = NULL;
+			req->privdata = NULL;
+		}
+	}
+}
+
+void
+rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx,
+		enum rspamd_redis_pool_release_type how)
+{
+	struct rspamd_redis_pool_connection *conn;
+	struct rspamd_redis_pool_elt *elt;
+	struct timeval tv;
+
+	g_assert (pool != NULL);
+	g_assert (ctx != NULL);
+
+	conn = g_hash_table_lookup (pool->elts_by_ctx, ctx);
+
+	if (conn == NULL) {
+		/* Connection is being destroyed and it is owned by hiredis */
+		return;
+	}
+
+	g_assert (conn->state == RSPAMD_REDIS_POOL_CONN_ACTIVE);
+	elt = conn->elt;
+
+	if (conn->users > 0) {
+		conn->users --;
+	}
+
+	if (how == RSPAMD_REDIS_RELEASE_DRAIN && !conn->draining) {
+		msg_debug_rpool ("drain connection to %s:%d with %d users left",
+				elt->ip, elt->port, conn->users);
+		conn->draining = TRUE;
+	}
+
+	/* User of an exclusive connection could have changed its state */
+	if (how == RSPAMD_REDIS_RELEASE_FATAL || conn->exclusive ||
+			!rspamd_redis_pool_conn_usable (conn)) {
+		rspamd_redis_pool_conn_terminate (conn);
+	}
+	else if (conn->users == 0) {
+		if (conn->draining ||
+				g_queue_get_length (elt->inactive) >= pool->max_conns) {
+			rspamd_redis_pool_conn_terminate (conn);
+		}
+		else {
+			g_queue_delete_link (elt->active, conn->entry);
+			conn->state = RSPAMD_REDIS_POOL_CONN_INACTIVE;
+			g_queue_push_head (elt->inactive, conn);
+			conn->entry = elt->inactive->head;
+
+			double_to_tv (rspamd_time_jitter (pool->timeout, 0), &tv);
+			event_set (&conn->timeout, -1, EV_TIMEOUT,
+					rspamd_redis_pool_conn_timeout, conn);
+			event_base_set (pool->ev_base, &conn->timeout);
+			event_add (&conn->timeout, &tv);
+			msg_debug_rpool ("connection to %s:%d is idle now",
+					elt->ip, elt->port);
+		}
+	}
+}
+
+void
+rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool)
+{
+	g_assert (pool != NULL);
+
+	g_hash_table_unref (pool->elts_by_key);
+	g_hash_table_unref (pool->elts_by_ctx);
+	g_slice_free1 (sizeof (*pool), pool);
+}
+
+#endif
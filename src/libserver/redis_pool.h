@@ -0,0 +1,162 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_REDIS_POOL_H_
+#define SRC_LIBSERVER_REDIS_POOL_H_
+
+#include "config.h"
+
+struct rspamd_redis_pool;
+struct rspamd_config;
+struct redisAsyncContext;
+struct event_base;
+
+enum rspamd_redis_pool_release_type {
+	/* Connection is kept for other users */
+	RSPAMD_REDIS_RELEASE_DEFAULT = 0,
+	/* Connection is closed immediately, e.g. on connection errors */
+	RSPAMD_REDIS_RELEASE_FATAL = 1,
+	/*
+	 * Connection might be stalled (e.g. on timeout), so it is not given to new
+	 * users and it is closed as soon as all current users release it
+	 */
+	RSPAMD_REDIS_RELEASE_DRAIN = 2
+};
+
+/* Has the same signature as hiredis `redisCallbackFn` */
+typedef void (*rspamd_redis_pool_cb) (struct redisAsyncContext *ac,
+		gpointer reply, gpointer privdata);
+
+/**
+ * Creates new redis pool
+ * @return
+ */
+struct rspamd_redis_pool *rspamd_redis_pool_init (void);
+
+/**
+ * Configure redis pool and binds it to a specific event base, it is called
+ * once per worker process
+ * @param cfg
+ * @param ev_base
+ */
+void rspamd_redis_pool_config (struct rspamd_redis_pool *pool,
+		struct rspamd_config *cfg,
+		struct event_base *ev_base);
+
+/**
+ * Returns connection to the specified server with the specified database and
+ * password. Connection may be shared with other users: commands of all users
+ * are pipelined and replies are delivered in order of commands
+ * @param pool
+ * @param db
+ * @param password
+ * @param ip
+ * @param port
+ * @return new or reused connection or NULL on error
+ */
+struct redisAsyncContext *rspamd_redis_pool_connect (
+		struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port);
+
+/**
+ * Returns new connection that is not shared with other users, so commands
+ * that change the state of connection (e.g. `SELECT`) could be used. Such a
+ * connection is closed when released
+ * @param pool
+ * @param db
+ * @param password
+ * @param ip
+ * @param port
+ * @return new connection or NULL on error
+ */
+struct redisAsyncContext *rspamd_redis_pool_connect_exclusive (
+		struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port);
+
+/**
+ * Sends command over a pooled connection, the same as `redisAsyncCommand`.
+ * Callbacks are tracked by the pool, so they could be detached afterwards
+ * @param ctx
+ * @param fn
+ * @param privdata
+ * @param fmt
+ * @return REDIS_OK or REDIS_ERR
+ */
+gint rspamd_redis_pool_command (struct redisAsyncContext *ctx,
+		rspamd_redis_pool_cb fn, gpointer privdata, const gchar *fmt, ...);
+
+/**
+ * Sends command over a pooled connection, the same as `redisAsyncCommandArgv`
+ * @param ctx
+ * @param fn
+ * @param privdata
+ * @param argc
+ * @param argv
+ * @param argvlen
+ * @return REDIS_OK or REDIS_ERR
+ */
+gint rspamd_redis_pool_command_argv (struct redisAsyncContext *ctx,
+		rspamd_redis_pool_cb fn, gpointer privdata,
+		gint argc, const gchar **argv, const gsize *argvlen);
+
+/**
+ * Sends already formatted command over a pooled connection, the same as
+ * `redisAsyncFormattedCommand`
+ * @param ctx
+ * @param fn
+ * @param privdata
+ * @param cmd
+ * @param len
+ * @return REDIS_OK or REDIS_ERR
+ */
+gint rspamd_redis_pool_formatted_command (struct redisAsyncContext *ctx,
+		rspamd_redis_pool_cb fn, gpointer privdata,
+		const gchar *cmd, gsize len);
+
+/**
+ * Removes pending callbacks with the specified private data from connection,
+ * replies for these commands are silently dropped. Users that do not wait for
+ * their replies anymore (e.g. on timeout) must call this function before
+ * releasing a connection, as it might be still used by other users. Only
+ * commands sent by `rspamd_redis_pool_command` and friends are detached
+ * @param ctx
+ * @param privdata
+ */
+void rspamd_redis_pool_detach_callbacks (struct redisAsyncContext *ctx,
+		gpointer privdata);
+
+/**
+ * Release connection obtained by `rspamd_redis_pool_connect`. Fatal release
+ * closes connection and all pending callbacks of all users are called with
+ * NULL reply, so it should be used merely on connection errors. Users that
+ * have timed out should drain connection instead, so it is not shared with
+ * new users anymore. Connection must not be used after releasing
+ * @param pool
+ * @param ctx
+ * @param how
+ */
+void rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx,
+		enum rspamd_redis_pool_release_type how);
+
+/**
+ * Stops redis pool and destroys all connections
+ * @param pool
+ */
+void rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool);
+
+#endif /* SRC_LIBSERVER_REDIS_POOL_H_ */
@@ -1862,6 +1862,125 @@ resolve_spf (struct rspamd_task *task, spf_cb_t callback)
 	return FALSE;
 }
 
+/* Serialized form of struct spf_addr */
+struct spf_addr_serialized {
+	guchar addr6[sizeof (struct in6_addr)];
+	guchar addr4[sizeof (struct in_addr)];
+	guint32 idx;
+	guint32 flags;
+	guint32 mech;
+	guint32 slen;
+};
+
+struct spf_resolved_serialized {
+	guint32 ttl;
+	guint32 failed;
+	guint32 nelts;
+	guint32 dlen;
+};
+
+guchar *
+spf_record_serialize (struct spf_resolved *rec, gsize *len)
+{
+	struct spf_resolved_serialized hdr;
+	struct spf_addr_serialized saddr;
+	struct spf_addr *addr;
+	GByteArray *ar;
+	guint i;
+
+	ar = g_byte_array_new ();
+	hdr.ttl = rec->ttl;
+	hdr.failed = rec->failed;
+	hdr.nelts = rec->elts->len;
+	hdr.dlen = rec->domain ? strlen (rec->domain) : 0;
+	g_byte_array_append (ar, (const guint8 *)&hdr, sizeof (hdr));
+
+	if (hdr.dlen > 0) {
+		g_byte_array_append (ar, rec->domain, hdr.dlen);
+	}
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+		memcpy (saddr.addr6, addr->addr6, sizeof (saddr.addr6));
+		memcpy (saddr.addr4, addr->addr4, sizeof (saddr.addr4));
+		saddr.idx = addr->m.idx;
+		saddr.flags = addr->flags;
+		saddr.mech = addr->mech;
+		saddr.slen = addr->spf_string ? strlen (addr->spf_string) : 0;
+		g_byte_array_append (ar, (const guint8 *)&saddr, sizeof (saddr));
+
+		if (saddr.slen > 0) {
+			g_byte_array_append (ar, addr->spf_string, saddr.slen);
+		}
+	}
+
+	*len = ar->len;
+
+	return g_byte_array_free (ar, FALSE);
+}
+
+struct spf_resolved *
+spf_record_deserialize (const guchar *data, gsize len)
+{
+	struct spf_resolved_serialized hdr;
+	struct spf_addr_serialized saddr;
+	struct spf_resolved *res;
+	struct spf_addr addr;
+	const guchar *p = data, *end = data + len;
+	guint i;
+
+	if (len < sizeof (hdr)) {
+		return NULL;
+	}
+
+	memcpy (&hdr, p, sizeof (hdr));
+	p += sizeof (hdr);
+
+	if (end - p < hdr.dlen) {
+		return NULL;
+	}
+
+	res = g_slice_alloc0 (sizeof (*res));
+	res->elts = g_array_sized_new (FALSE, FALSE, sizeof (struct spf_addr),
+			hdr.nelts);
+	res->domain = g_malloc (hdr.dlen + 1);
+	rspamd_strlcpy (res->domain, p, hdr.dlen + 1);
+	res->ttl = hdr.ttl;
+	res->failed = hdr.failed;
+	REF_INIT_RETAIN (res, rspamd_flatten_record_dtor);
+	p += hdr.dlen;
+
+	for (i = 0; i < hdr.nelts; i ++) {
+		if (end - p < sizeof (saddr)) {
+			REF_RELEASE (res);
+
+			return NULL;
+		}
+
+		memcpy (&saddr, p, sizeof (saddr));
+		p += sizeof (saddr);
+
+		if (end - p < saddr.slen) {
+			REF_RELEASE (res);
+
+			return NULL;
+		}
+
+		memset (&addr, 0, sizeof (addr));
+		memcpy (addr.addr6, saddr.addr6, sizeof (addr.addr6));
+		memcpy (addr.addr4, saddr.addr4, sizeof (addr.addr4));
+		addr.m.idx = saddr.idx;
+		addr.flags = saddr.flags;
+		addr.mech = saddr.mech;
+		addr.spf_string = g_malloc (saddr.slen + 1);
+		rspamd_strlcpy (addr.spf_string, p, saddr.slen + 1);
+		p += saddr.slen;
+		g_array_append_val (res->elts, addr);
+	}
+
+	return res;
+}
+
 struct spf_resolved *
 spf_record_ref (struct spf_resolved *rec)
 {
@@ -84,4 +84,14 @@ struct spf_resolved * spf_record_ref (struct spf_resolved *rec);
  */
 void spf_record_unref (struct spf_resolved *rec);
 
+/*
+ * Serialize flattened record to a pointer free buffer (must be freed by g_free)
+ */
+guchar * spf_record_serialize (struct spf_resolved *rec, gsize *len);
+
+/*
+ * Restore flattened record from the buffer, returns record with refcount = 1
+ */
+struct spf_resolved * spf_record_deserialize (const guchar *data, gsize len);
+
 #endif
@@ -72,6 +72,8 @@ struct symbols_cache {
 	rspamd_mempool_mutex_t *mtx;
 	gdouble reload_time;
 	struct event resort_ev;
+	/* Shared between all processes */
+	gboolean *profiling;
 };
 
 struct counter_data {
@@ -79,6 +81,30 @@ struct counter_data {
 	gint number;
 };
 
+/*
+ * Latency histogram uses 4 linear sub-buckets for each power of 2 of
+ * microseconds, so the relative error is less than 25% up to ~2 minutes
+ */
+#define PROFILE_SUB_BITS 2
+#define PROFILE_SUB_BUCKETS (1 << PROFILE_SUB_BITS)
+#define PROFILE_BUCKETS (PROFILE_SUB_BUCKETS * 26)
+
+struct item_profile {
+	guint64 calls;
+	guint64 async_calls;
+	gdouble wall_time;
+	gdouble cpu_time;
+	gdouble async_time;
+	gdouble pool_bytes;
+	gdouble lua_kb;
+	guint32 latency[PROFILE_BUCKETS];
+};
+
+struct item_profile_start {
+	gdouble start;
+	gdouble end;
+};
+
 struct cache_item {
 	/* This block is likely shared */
 	gdouble avg_time;
@@ -88,6 +114,8 @@ struct cache_item {
 
 	/* Per process counter */
 	struct counter_data *cd;
+	/* Shared profile */
+	struct item_profile *profile;
 	gchar *symbol;
 	enum rspamd_symbol_type type;
 
@@ -134,6 +162,8 @@ struct cache_savepoint {
 	gdouble lim;
 	GPtrArray *waitq;
 	struct symbols_cache_order *order;
+	/* Start times of symbols waiting for async events, used by profiler */
+	struct item_profile_start *profile_start;
 };
 
 /* XXX: Maybe make it configurable */
@@ -628,6 +658,8 @@ rspamd_symbols_cache_add_symbol (struct symbols_cache *cache,
 	 */
 	item->cd = rspamd_mempool_alloc0 (cache->static_pool,
 			sizeof (struct counter_data));
+	item->profile = rspamd_mempool_alloc0_shared (cache->static_pool,
+			sizeof (struct item_profile));
 
 	if (name != NULL) {
 		item->symbol = rspamd_mempool_strdup (cache->static_pool, name);
@@ -784,6 +816,8 @@ rspamd_symbols_cache_new (struct rspamd_config *cfg)
 			rspamd_str_equal);
 	cache->items_by_id = g_ptr_array_new ();
 	cache->mtx = rspamd_mempool_get_mutex (cache->static_pool);
+	cache->profiling = rspamd_mempool_alloc0_shared (cache->static_pool,
+			sizeof (gboolean));
 	cache->reload_time = CACHE_RELOAD_TIME;
 	cache->total_freq = 1;
 	cache->total_weight = 1.0;
@@ -799,6 +833,7 @@ rspamd_symbols_cache_init (struct symbols_cache* cache)
 
 	g_assert (cache != NULL);
 
+	*cache->profiling = cache->cfg->profile_symbols;
 
 	/* Just in-memory cache */
 	if (cache->cfg->cache_filename == NULL) {
@@ -1034,6 +1069,103 @@ rspamd_symbols_cache_metric_limit (struct rspamd_task *task,
 	return FALSE;
 }
 
+static inline guint
+rspamd_symbols_cache_profile_bucket (gdouble t)
+{
+	guint64 us, v;
+	guint exp = 0, idx;
+
+	us = t > 0 ? t * 1e6 : 0;
+
+	if (us < PROFILE_SUB_BUCKETS) {
+		return us;
+	}
+
+	for (v = us >> 1; v != 0; v >>= 1) {
+		exp ++;
+	}
+
+	idx = (exp - PROFILE_SUB_BITS + 1) * PROFILE_SUB_BUCKETS +
+			((us >> (exp - PROFILE_SUB_BITS)) & (PROFILE_SUB_BUCKETS - 1));
+
+	return MIN (idx, PROFILE_BUCKETS - 1);
+}
+
+/* Returns lower bound of a bucket in seconds */
+static gdouble
+rspamd_symbols_cache_profile_bucket_bound (guint idx)
+{
+	guint exp, sub;
+
+	if (idx < PROFILE_SUB_BUCKETS) {
+		return idx / 1e6;
+	}
+
+	exp = idx / PROFILE_SUB_BUCKETS + PROFILE_SUB_BITS - 1;
+	sub = idx % PROFILE_SUB_BUCKETS;
+
+	return (gdouble)((guint64)(PROFILE_SUB_BUCKETS + sub) <<
+			(exp - PROFILE_SUB_BITS)) / 1e6;
+}
+
+static inline gdouble
+rspamd_symbols_cache_lua_memory (struct rspamd_task *task)
+{
+	lua_State *L = task->cfg->lua_state;
+
+	return lua_gc (L, LUA_GCCOUNT, 0) + lua_gc (L, LUA_GCCOUNTB, 0) / 1024.0;
+}
+
+/*
+ * Profile is updated from all workers without locking as counters in shared
+ * cache items do, so it is slightly inaccurate under high load
+ */
+static void
+rspamd_symbols_cache_profile_sync (struct rspamd_task *task,
+		struct symbols_cache *cache,
+		struct cache_item *item,
+		struct cache_savepoint *checkpoint,
+		gdouble t1, gdouble t2,
+		gdouble cpu, gsize pool_bytes, gdouble lua_kb,
+		gboolean finished)
+{
+	struct item_profile *prof = item->profile;
+
+	prof->calls ++;
+	prof->wall_time += t2 - t1;
+	prof->cpu_time += cpu;
+	prof->pool_bytes += pool_bytes;
+	prof->lua_kb += lua_kb;
+
+	if (finished) {
+		prof->latency[rspamd_symbols_cache_profile_bucket (t2 - t1)] ++;
+	}
+	else {
+		/* Latency is recorded when all async events of a symbol are finished */
+		if (checkpoint->profile_start == NULL) {
+			checkpoint->profile_start = rspamd_mempool_alloc0 (task->task_pool,
+					sizeof (struct item_profile_start) *
+					cache->items_by_id->len);
+		}
+
+		checkpoint->profile_start[item->id].start = t1;
+		checkpoint->profile_start[item->id].end = t2;
+	}
+}
+
+static void
+rspamd_symbols_cache_profile_async (struct cache_item *item,
+		struct item_profile_start *ps)
+{
+	struct item_profile *prof = item->profile;
+	gdouble now = rspamd_get_ticks ();
+
+	prof->async_calls ++;
+	prof->async_time += now - ps->end;
+	prof->latency[rspamd_symbols_cache_profile_bucket (now - ps->start)] ++;
+	ps->start = 0;
+}
+
 static void
 rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 {
@@ -1049,6 +1181,12 @@ rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 	/* Specify that we are done with this item */
 	setbit (checkpoint->processed_bits, item->id * 2 + 1);
 
+	if (checkpoint->profile_start != NULL &&
+			checkpoint->profile_start[item->id].start > 0) {
+		rspamd_symbols_cache_profile_async (item,
+				&checkpoint->profile_start[item->id]);
+	}
+
 	if (checkpoint->pass > 0) {
 		for (i = 0; i < (gint)checkpoint->waitq->len; i ++) {
 			it = g_ptr_array_index (checkpoint->waitq, i);
@@ -1081,8 +1219,10 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 	gdouble diff;
 	struct rspamd_task **ptask;
 	lua_State *L;
-	gboolean check = TRUE;
+	gboolean check = TRUE, profiling = FALSE;
 	const gdouble slow_diff_limit = 1e5;
+	gdouble cpu1 = 0, lua1 = 0;
+	gsize pool1 = 0;
 
 	if (item->type & (SYMBOL_TYPE_NORMAL|SYMBOL_TYPE_CALLBACK)) {
 
@@ -1113,6 +1253,13 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 		}
 
 		if (check) {
+			if (*cache->profiling) {
+				profiling = TRUE;
+				cpu1 = rspamd_get_virtual_ticks ();
+				pool1 = task->task_pool->allocated;
+				lua1 = rspamd_symbols_cache_lua_memory (task);
+			}
+
 			t1 = rspamd_get_ticks ();
 			pending_before = rspamd_session_events_pending (task->s);
 			/* Watch for events appeared */
@@ -1138,6 +1285,15 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 			rspamd_session_watch_stop (task->s);
 			pending_after = rspamd_session_events_pending (task->s);
 
+			if (profiling) {
+				rspamd_symbols_cache_profile_sync (task, cache, item, checkpoint,
+						t1, t2,
+						rspamd_get_virtual_ticks () - cpu1,
+						task->task_pool->allocated - pool1,
+						rspamd_symbols_cache_lua_memory (task) - lua1,
+						pending_before == pending_after);
+			}
+
 			if (pending_before == pending_after) {
 				/* No new events registered */
 				setbit (checkpoint->processed_bits, item->id * 2 + 1);
@@ -1565,6 +1721,145 @@ rspamd_symbols_cache_counters (struct symbols_cache * cache)
 	return top;
 }
 
+static gdouble
+rspamd_symbols_cache_profile_percentile (struct item_profile *prof,
+		guint64 total, gdouble q)
+{
+	guint64 cur = 0, target;
+	guint i;
+
+	target = ceil (total * q);
+
+	for (i = 0; i < PROFILE_BUCKETS; i ++) {
+		cur += prof->latency[i];
+
+		if (cur >= target) {
+			/* Use upper bound of bucket */
+			return rspamd_symbols_cache_profile_bucket_bound (i + 1);
+		}
+	}
+
+	return rspamd_symbols_cache_profile_bucket_bound (PROFILE_BUCKETS);
+}
+
+static ucl_object_t *
+rspamd_symbols_cache_profile_item (struct cache_item *item)
+{
+	struct item_profile *prof = item->profile;
+	ucl_object_t *obj, *lat, *hist, *bucket;
+	guint64 total = 0;
+	guint i;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring (item->symbol),
+			"symbol", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (prof->calls),
+			"calls", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (prof->async_calls),
+			"async_calls", 0, false);
+	/* All times are average values in milliseconds */
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (prof->wall_time * 1000.0 / prof->calls),
+			"wall", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (prof->cpu_time * 1000.0 / prof->calls),
+			"cpu", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (prof->async_calls > 0 ?
+					prof->async_time * 1000.0 / prof->async_calls : 0.0),
+			"async_wait", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (prof->pool_bytes / prof->calls),
+			"pool_bytes", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (prof->lua_kb / prof->calls),
+			"lua_kb", 0, false);
+
+	hist = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < PROFILE_BUCKETS; i ++) {
+		if (prof->latency[i] > 0) {
+			total += prof->latency[i];
+			bucket = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (bucket, ucl_object_fromdouble (
+					rspamd_symbols_cache_profile_bucket_bound (i + 1) * 1000.0),
+					"le", 0, false);
+			ucl_object_insert_key (bucket,
+					ucl_object_fromint (prof->latency[i]),
+					"count", 0, false);
+			ucl_array_append (hist, bucket);
+		}
+	}
+
+	lat = ucl_object_typed_new (UCL_OBJECT);
+
+	if (total > 0) {
+		ucl_object_insert_key (lat, ucl_object_fromdouble (
+				rspamd_symbols_cache_profile_percentile (prof, total, 0.5) * 1000.0),
+				"p50", 0, false);
+		ucl_object_insert_key (lat, ucl_object_fromdouble (
+				rspamd_symbols_cache_profile_percentile (prof, total, 0.9) * 1000.0),
+				"p90", 0, false);
+		ucl_object_insert_key (lat, ucl_object_fromdouble (
+				rspamd_symbols_cache_profile_percentile (prof, total, 0.99) * 1000.0),
+				"p99", 0, false);
+	}
+
+	ucl_object_insert_key (lat, hist, "histogram", 0, false);
+	ucl_object_insert_key (obj, lat, "latency", 0, false);
+
+	return obj;
+}
+
+ucl_object_t *
+rspamd_symbols_cache_profile (struct symbols_cache *cache)
+{
+	ucl_object_t *top, *syms;
+	struct cache_item *item;
+	guint i;
+
+	g_assert (cache != NULL);
+	top = ucl_object_typed_new (UCL_OBJECT);
+	syms = ucl_object_typed_new (UCL_ARRAY);
+	ucl_object_insert_key (top, ucl_object_frombool (*cache->profiling),
+			"enabled", 0, false);
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+
+		/* Virtual symbols are executed by their parents */
+		if (item->symbol == NULL || item->profile->calls == 0 ||
+				(item->type & SYMBOL_TYPE_VIRTUAL)) {
+			continue;
+		}
+
+		ucl_array_append (syms, rspamd_symbols_cache_profile_item (item));
+	}
+
+	ucl_object_insert_key (top, syms, "symbols", 0, false);
+
+	return top;
+}
+
+void
+rspamd_symbols_cache_set_profiling (struct symbols_cache *cache,
+		gboolean enable)
+{
+	struct cache_item *item;
+	guint i;
+
+	g_assert (cache != NULL);
+
+	if (enable && !*cache->profiling) {
+		for (i = 0; i < cache->items_by_id->len; i ++) {
+			item = g_ptr_array_index (cache->items_by_id, i);
+			memset (item->profile, 0, sizeof (*item->profile));
+		}
+	}
+
+	*cache->profiling = enable;
+}
+
 static void
 rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 {
@@ -159,6 +159,24 @@ gboolean rspamd_symbols_cache_validate (struct symbols_cache *cache,
  */
 ucl_object_t *rspamd_symbols_cache_counters (struct symbols_cache * cache);
 
+/**
+ * Return profile of symbols as ucl object: latency histograms, CPU and wall
+ * time, async waiting time, task pool and lua memory used. Profile data is
+ * stored in shared memory, so it is aggregated over all workers
+ * @param cache
+ * @return
+ */
+ucl_object_t *rspamd_symbols_cache_profile (struct symbols_cache *cache);
+
+/**
+ * Enables or disables profiling of symbols in all workers, profile data is
+ * cleared when profiling is enabled
+ * @param cache
+ * @param enable
+ */
+void rspamd_symbols_cache_set_profiling (struct symbols_cache *cache,
+		gboolean enable);
+
 /**
  * Start cache reloading
  * @param cache
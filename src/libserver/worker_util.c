@@ -25,6 +25,7 @@
 #include "libutil/map.h"
 #include "libutil/map_private.h"
 #include "libutil/http_private.h"
+#include "libserver/redis_pool.h"
 
 #ifdef WITH_GPERF_TOOLS
 #include <gperftools/profiler.h>
@@ -268,6 +269,10 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 
 	rspamd_worker_init_signals (worker, ev_base);
 	rspamd_control_worker_add_default_handler (worker, ev_base);
+#ifdef WITH_HIREDIS
+	rspamd_redis_pool_config (worker->srv->cfg->redis_pool,
+			worker->srv->cfg, ev_base);
+#endif
 
 	/* Accept all sockets */
 	if (accept_handler) {
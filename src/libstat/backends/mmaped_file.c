@@ -527,11 +527,17 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 }
 
 /*
- * Pre-load mmaped file into memory
+ * Pre-load mmaped file into memory: kernel reads pages ahead asynchronously,
+ * so we do not stall on touching all pages of a large statfile
  */
 static void
 rspamd_mmaped_file_preload (rspamd_mmaped_file_t *file)
 {
+#ifdef MADV_WILLNEED
+	if (madvise (file->map, file->len, MADV_WILLNEED) == -1) {
+		msg_info ("madvise failed: %s", strerror (errno));
+	}
+#else
 	guint8 *pos, *end;
 	volatile guint8 t;
 	gsize size;
@@ -555,6 +561,7 @@ rspamd_mmaped_file_preload (rspamd_mmaped_file_t *file)
 			pos += size;
 		}
 	}
+#endif
 }
 
 rspamd_mmaped_file_t *
@@ -18,6 +18,7 @@
 #include "stat_internal.h"
 #include "upstream.h"
 #include "lua/lua_common.h"
+#include "libserver/redis_pool.h"
 
 #ifdef WITH_HIREDIS
 #include "hiredis.h"
@@ -35,6 +36,7 @@
 #define REDIS_STAT_TIMEOUT 30
 
 struct redis_stat_ctx {
+	struct rspamd_config *cfg;
 	struct rspamd_statfile_config *stcf;
 	struct upstream_list *read_servers;
 	struct upstream_list *write_servers;
@@ -65,6 +67,7 @@ struct redis_stat_runtime {
 	gchar *redis_object_expanded;
 	redisAsyncContext *redis;
 	guint64 learned;
+	gdouble start_time;
 	gint id;
 	gboolean has_event;
 };
@@ -325,14 +328,40 @@ rspamd_redis_expand_object (const gchar *pattern,
 	return tlen;
 }
 
+/*
+ * Connections are taken from the pool of worker, so commands of concurrent
+ * tasks are pipelined over the same connection
+ */
+static redisAsyncContext *
+rspamd_redis_connect (struct redis_stat_ctx *ctx, struct upstream *up)
+{
+	rspamd_inet_addr_t *addr;
+
+	addr = rspamd_upstream_addr (up);
+	g_assert (addr != NULL);
+
+	return rspamd_redis_pool_connect (ctx->cfg->redis_pool,
+			ctx->dbname, ctx->password,
+			rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+}
+
+/*
+ * Returns connection to the pool, replies for commands that are still pending
+ * are ignored as the connection could be shared with other tasks
+ */
 static void
-rspamd_redis_maybe_auth (struct redis_stat_ctx *ctx, redisAsyncContext *redis)
+rspamd_redis_maybe_release (struct redis_stat_runtime *rt,
+		enum rspamd_redis_pool_release_type how)
 {
-	if (ctx->password) {
-		redisAsyncCommand (redis, NULL, NULL, "AUTH %s", ctx->password);
-	}
-	if (ctx->dbname) {
-		redisAsyncCommand (redis, NULL, NULL, "SELECT %s", ctx->dbname);
+	redisAsyncContext *redis;
+
+	if (rt->redis) {
+		redis = rt->redis;
+		rt->redis = NULL;
+		rspamd_redis_pool_detach_callbacks (redis, rt);
+		rspamd_redis_pool_release_connection (rt->ctx->cfg->redis_pool,
+				redis, how);
 	}
 }
 
@@ -416,7 +445,13 @@ rspamd_redis_async_cbdata_cleanup (struct rspamd_redis_stat_cbdata *cbdata)
 	if (cbdata && !cbdata->wanna_die) {
 		/* Avoid double frees */
 		cbdata->wanna_die = TRUE;
-		redisAsyncFree (cbdata->redis);
+
+		if (cbdata->redis) {
+			rspamd_redis_pool_detach_callbacks (cbdata->redis, cbdata);
+			rspamd_redis_pool_release_connection (
+					cbdata->elt->ctx->cfg->redis_pool,
+					cbdata->redis, RSPAMD_REDIS_RELEASE_DEFAULT);
+		}
 
 		for (i = 0; i < cbdata->cur_keys->len; i ++) {
 			k = g_ptr_array_index (cbdata->cur_keys, i);
@@ -570,11 +605,13 @@ rspamd_redis_stat_keys (redisAsyncContext *c, gpointer r, gpointer priv)
 					k = (gchar *)g_ptr_array_index (cbdata->cur_keys, i);
 
 					if (k) {
-						redisAsyncCommand (cbdata->redis, rspamd_redis_stat_key,
+						rspamd_redis_pool_command (cbdata->redis,
+								rspamd_redis_stat_key,
 								cbdata,
 								"HLEN %s",
 								k);
-						redisAsyncCommand (cbdata->redis, rspamd_redis_stat_learns,
+						rspamd_redis_pool_command (cbdata->redis,
+								rspamd_redis_stat_learns,
 								cbdata,
 								"HGET %s learns",
 								k);
@@ -622,7 +659,6 @@ rspamd_redis_async_stat_cb (struct rspamd_stat_async_elt *elt, gpointer d)
 	struct redis_stat_ctx *ctx;
 	struct rspamd_redis_stat_elt *redis_elt = elt->ud;
 	struct rspamd_redis_stat_cbdata *cbdata;
-	rspamd_inet_addr_t *addr;
 
 	g_assert (redis_elt != NULL);
 
@@ -643,13 +679,16 @@ rspamd_redis_async_stat_cb (struct rspamd_stat_async_elt *elt, gpointer d)
 					0);
 
 	g_assert (cbdata->selected != NULL);
-	addr = rspamd_upstream_addr (cbdata->selected);
-	g_assert (addr != NULL);
-	cbdata->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
-			rspamd_inet_address_get_port (addr));
-	g_assert (cbdata->redis != NULL);
+	cbdata->redis = rspamd_redis_connect (ctx, cbdata->selected);
 
-	redisLibeventAttach (cbdata->redis, redis_elt->ev_base);
+	if (cbdata->redis == NULL) {
+		msg_err ("cannot connect to redis server %s",
+				rspamd_upstream_name (cbdata->selected));
+		g_slice_free1 (sizeof (*cbdata), cbdata);
+		elt->enabled = TRUE;
+
+		return;
+	}
 
 	cbdata->inflight = 1;
 	cbdata->cur = ucl_object_typed_new (UCL_OBJECT);
@@ -659,8 +698,7 @@ rspamd_redis_async_stat_cb (struct rspamd_stat_async_elt *elt, gpointer d)
 
 	/* XXX: deal with timeouts maybe */
 	/* Get keys in redis that match our symbol */
-	rspamd_redis_maybe_auth (ctx, cbdata->redis);
-	redisAsyncCommand (cbdata->redis, rspamd_redis_stat_keys, cbdata,
+	rspamd_redis_pool_command (cbdata->redis, rspamd_redis_stat_keys, cbdata,
 			"KEYS %s*",
 			ctx->stcf->symbol);
 }
@@ -678,7 +716,6 @@ static void
 rspamd_redis_fin (gpointer data)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (data);
-	redisAsyncContext *redis;
 
 	rt->has_event = FALSE;
 	/* Stop timeout */
@@ -686,19 +723,14 @@ rspamd_redis_fin (gpointer data)
 		event_del (&rt->timeout_event);
 	}
 
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		/* This calls for all callbacks pending */
-		redisAsyncFree (redis);
-	}
+	/* Connection is released on the last reply, so replies are pending here */
+	rspamd_redis_maybe_release (rt, RSPAMD_REDIS_RELEASE_DEFAULT);
 }
 
 static void
 rspamd_redis_fin_learn (gpointer data)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (data);
-	redisAsyncContext *redis;
 
 	rt->has_event = FALSE;
 	/* Stop timeout */
@@ -706,20 +738,18 @@ rspamd_redis_fin_learn (gpointer data)
 		event_del (&rt->timeout_event);
 	}
 
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		/* This calls for all callbacks pending */
-		redisAsyncFree (redis);
-	}
+	rspamd_redis_maybe_release (rt, RSPAMD_REDIS_RELEASE_DEFAULT);
 }
 
+/*
+ * Replies of the timed out task are dropped, but the connection itself is
+ * kept as it might be shared with other tasks
+ */
 static void
-rspamd_redis_timeout (gint fd, short what, gpointer d)
+rspamd_redis_timeout_common (struct redis_stat_runtime *rt,
+		event_finalizer_t fin)
 {
-	struct redis_stat_runtime *rt = REDIS_RUNTIME (d);
 	struct rspamd_task *task;
-	redisAsyncContext *redis;
 
 	task = rt->task;
 
@@ -727,15 +757,30 @@ rspamd_redis_timeout (gint fd, short what, gpointer d)
 			rspamd_upstream_name (rt->selected));
 
 	rspamd_upstream_fail (rt->selected);
+	/* Connection might be stalled, so it should not get new users */
+	rspamd_redis_maybe_release (rt, RSPAMD_REDIS_RELEASE_DRAIN);
 
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		/* This calls for all callbacks pending */
-		redisAsyncFree (redis);
+	if (rt->has_event) {
+		rspamd_session_remove_event (task->s, fin, rt);
 	}
 }
 
+static void
+rspamd_redis_timeout (gint fd, short what, gpointer d)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (d);
+
+	rspamd_redis_timeout_common (rt, rspamd_redis_fin);
+}
+
+static void
+rspamd_redis_learn_timeout (gint fd, short what, gpointer d)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (d);
+
+	rspamd_redis_timeout_common (rt, rspamd_redis_fin_learn);
+}
+
 /* Called when we have connected to the redis server and got stats */
 static void
 rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
@@ -853,6 +898,8 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 			msg_debug_task_check ("received tokens for %s: %d processed, %d found",
 					rt->redis_object_expanded, processed, found);
 			rspamd_upstream_ok (rt->selected);
+			rspamd_upstream_latency (rt->selected,
+					rspamd_get_ticks () - rt->start_time);
 		}
 	}
 	else {
@@ -864,6 +911,9 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 		}
 	}
 
+	/* It is the last command of this task */
+	rspamd_redis_maybe_release (rt, RSPAMD_REDIS_RELEASE_DEFAULT);
+
 	if (rt->has_event) {
 		rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
 	}
@@ -878,18 +928,24 @@ rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
 
 	task = rt->task;
 
-	if (c->err == 0) {
+	if (c->err == 0 && r != NULL) {
 		rspamd_upstream_ok (rt->selected);
+		rspamd_upstream_latency (rt->selected,
+				rspamd_get_ticks () - rt->start_time);
 	}
 	else {
+		/* NULL reply means that connection has been closed */
 		msg_err_task_check ("error getting reply from redis server %s: %s",
-				rspamd_upstream_name (rt->selected), c->errstr);
+				rspamd_upstream_name (rt->selected),
+				c->err ? c->errstr : "no reply");
 
 		if (rt->redis) {
 			rspamd_upstream_fail (rt->selected);
 		}
 	}
 
+	rspamd_redis_maybe_release (rt, RSPAMD_REDIS_RELEASE_DEFAULT);
+
 	if (rt->has_event) {
 		rspamd_session_remove_event (task->s, rspamd_redis_fin_learn, rt);
 	}
@@ -1058,6 +1114,7 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 
 	stf->clcf->flags |= RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
 	backend->stcf = stf;
+	backend->cfg = cfg;
 
 	st_elt = g_slice_alloc0 (sizeof (*st_elt));
 	st_elt->ev_base = ctx->ev_base;
@@ -1080,7 +1137,6 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	struct redis_stat_ctx *ctx = REDIS_CTX (c);
 	struct redis_stat_runtime *rt;
 	struct upstream *up;
-	rspamd_inet_addr_t *addr;
 
 	g_assert (ctx != NULL);
 	g_assert (stcf != NULL);
@@ -1112,23 +1168,18 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	rspamd_redis_expand_object (ctx->redis_object, ctx, task,
 			&rt->redis_object_expanded);
 	rt->selected = up;
+	rt->start_time = rspamd_get_ticks ();
 	rt->task = task;
 	rt->ctx = ctx;
 	rt->stcf = stcf;
 
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-	rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
-			rspamd_inet_address_get_port (addr));
+	rt->redis = rspamd_redis_connect (ctx, up);
 
 	if (rt->redis == NULL) {
 		msg_err_task ("cannot connect redis");
 		return NULL;
 	}
 
-	redisLibeventAttach (rt->redis, task->ev_base);
-	rspamd_redis_maybe_auth (ctx, rt->redis);
-
 	return rt;
 }
 
@@ -1164,7 +1215,8 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 
 	rt->id = id;
 
-	if (redisAsyncCommand (rt->redis, rspamd_redis_connected, rt, "HGET %s %s",
+	if (rspamd_redis_pool_command (rt->redis, rspamd_redis_connected, rt,
+			"HGET %s %s",
 			rt->redis_object_expanded, "learns") == REDIS_OK) {
 
 		rspamd_session_add_event (task->s, rspamd_redis_fin, rt,
@@ -1186,7 +1238,8 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 		rspamd_mempool_add_destructor (task->task_pool,
 				(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
 
-		ret = redisAsyncFormattedCommand (rt->redis, rspamd_redis_processed, rt,
+		ret = rspamd_redis_pool_formatted_command (rt->redis,
+				rspamd_redis_processed, rt,
 				query->str, query->len);
 
 		if (ret == REDIS_OK) {
@@ -1205,17 +1258,12 @@ rspamd_redis_finalize_process (struct rspamd_task *task, gpointer runtime,
 		gpointer ctx)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
-	redisAsyncContext *redis;
 
 	if (event_get_base (&rt->timeout_event)) {
 		event_del (&rt->timeout_event);
 	}
 
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		redisAsyncFree (redis);
-	}
+	rspamd_redis_maybe_release (rt, RSPAMD_REDIS_RELEASE_DEFAULT);
 }
 
 gboolean
@@ -1224,7 +1272,6 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
 	struct upstream *up;
-	rspamd_inet_addr_t *addr;
 	struct timeval tv;
 	rspamd_fstring_t *query;
 	const gchar *redis_cmd;
@@ -1242,15 +1289,16 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	}
 
 	rt->selected = up;
+	rt->start_time = rspamd_get_ticks ();
 
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-	rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
-			rspamd_inet_address_get_port (addr));
-	g_assert (rt->redis != NULL);
+	/* Connection taken for runtime might point to another upstream */
+	rspamd_redis_maybe_release (rt, RSPAMD_REDIS_RELEASE_DEFAULT);
+	rt->redis = rspamd_redis_connect (rt->ctx, up);
 
-	redisLibeventAttach (rt->redis, task->ev_base);
-	rspamd_redis_maybe_auth (rt->ctx, rt->redis);
+	if (rt->redis == NULL) {
+		msg_err_task ("cannot connect redis");
+		return FALSE;
+	}
 
 	if (rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER) {
 		redis_cmd = "HINCRBY";
@@ -1305,7 +1353,8 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	rspamd_mempool_add_destructor (task->task_pool,
 				(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
 
-	ret = redisAsyncFormattedCommand (rt->redis, rspamd_redis_learned, rt,
+	ret = rspamd_redis_pool_formatted_command (rt->redis,
+			rspamd_redis_learned, rt,
 			query->str, query->len);
 
 	if (ret == REDIS_OK) {
@@ -1317,7 +1366,8 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		if (event_get_base (&rt->timeout_event)) {
 			event_del (&rt->timeout_event);
 		}
-		event_set (&rt->timeout_event, -1, EV_TIMEOUT, rspamd_redis_timeout, rt);
+		event_set (&rt->timeout_event, -1, EV_TIMEOUT,
+				rspamd_redis_learn_timeout, rt);
 		event_base_set (task->ev_base, &rt->timeout_event);
 		double_to_tv (rt->ctx->timeout, &tv);
 		event_add (&rt->timeout_event, &tv);
@@ -1337,17 +1387,12 @@ rspamd_redis_finalize_learn (struct rspamd_task *task, gpointer runtime,
 		gpointer ctx)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
-	redisAsyncContext *redis;
 
 	if (event_get_base (&rt->timeout_event)) {
 		event_del (&rt->timeout_event);
 	}
 
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		redisAsyncFree (redis);
-	}
+	rspamd_redis_maybe_release (rt, RSPAMD_REDIS_RELEASE_DEFAULT);
 }
 
 gulong
@@ -1394,16 +1439,10 @@ rspamd_redis_get_stat (gpointer runtime,
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
 	struct rspamd_redis_stat_elt *st;
-	redisAsyncContext *redis;
 
 	if (rt->ctx->stat_elt) {
 		st = rt->ctx->stat_elt->ud;
-
-		if (rt->redis) {
-			redis = rt->redis;
-			rt->redis = NULL;
-			redisAsyncFree (redis);
-		}
+		rspamd_redis_maybe_release (rt, RSPAMD_REDIS_RELEASE_DEFAULT);
 
 		if (st->stat) {
 			return ucl_object_ref (st->stat);
@@ -21,7 +21,7 @@
 #include "cryptobox.h"
 #include "ucl.h"
 #include "hiredis.h"
-#include "adapters/libevent.h"
+#include "libserver/redis_pool.h"
 
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
@@ -52,15 +52,49 @@ rspamd_stat_cache_redis_quark (void)
 	return g_quark_from_static_string ("redis-statistics");
 }
 
-static void
-rspamd_redis_cache_maybe_auth (struct rspamd_redis_cache_ctx *ctx,
-		redisAsyncContext *redis)
+/*
+ * Connection is acquired from the pool just before sending a command, as
+ * runtime might be created without any command sent
+ */
+static gboolean
+rspamd_redis_cache_connect (struct rspamd_redis_cache_runtime *rt)
 {
-	if (ctx->password) {
-		redisAsyncCommand (redis, NULL, NULL, "AUTH %s", ctx->password);
+	rspamd_inet_addr_t *addr;
+	struct rspamd_task *task = rt->task;
+
+	addr = rspamd_upstream_addr (rt->selected);
+	g_assert (addr != NULL);
+	rt->redis = rspamd_redis_pool_connect (task->cfg->redis_pool,
+			rt->ctx->dbname, rt->ctx->password,
+			rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+	if (rt->redis == NULL) {
+		msg_err_task ("cannot connect to redis server %s",
+				rspamd_upstream_name (rt->selected));
+
+		return FALSE;
 	}
-	if (ctx->dbname) {
-		redisAsyncCommand (redis, NULL, NULL, "SELECT %s", ctx->dbname);
+
+	return TRUE;
+}
+
+/*
+ * Pending replies of this runtime are ignored, as the connection could be
+ * shared with other tasks, so it should be fatal merely on connection errors
+ */
+static void
+rspamd_redis_cache_release (struct rspamd_redis_cache_runtime *rt,
+		enum rspamd_redis_pool_release_type how)
+{
+	redisAsyncContext *redis;
+
+	if (rt->redis) {
+		redis = rt->redis;
+		rt->redis = NULL;
+		rspamd_redis_pool_detach_callbacks (redis, rt);
+		rspamd_redis_pool_release_connection (rt->task->cfg->redis_pool,
+				redis, how);
 	}
 }
 
@@ -71,7 +105,8 @@ rspamd_redis_cache_fin (gpointer data)
 	struct rspamd_redis_cache_runtime *rt = data;
 
 	event_del (&rt->timeout_event);
-	redisAsyncFree (rt->redis);
+	/* Reply has not been received if connection is still here */
+	rspamd_redis_cache_release (rt, RSPAMD_REDIS_RELEASE_DEFAULT);
 }
 
 static void
@@ -85,6 +120,8 @@ rspamd_redis_cache_timeout (gint fd, short what, gpointer d)
 	msg_err_task ("connection to redis server %s timed out",
 			rspamd_upstream_name (rt->selected));
 	rspamd_upstream_fail (rt->selected);
+	/* Connection might be stalled, so it should not get new users */
+	rspamd_redis_cache_release (rt, RSPAMD_REDIS_RELEASE_DRAIN);
 	rspamd_session_remove_event (task->s, rspamd_redis_cache_fin, d);
 }
 
@@ -99,7 +136,12 @@ rspamd_stat_cache_redis_get (redisAsyncContext *c, gpointer r, gpointer priv)
 
 	task = rt->task;
 
-	if (c->err == 0) {
+	if (rt->redis == NULL) {
+		/* Connection has been terminated by us */
+		return;
+	}
+
+	if (c->err == 0 && reply != NULL) {
 		if (G_LIKELY (reply->type == REDIS_REPLY_INTEGER)) {
 			val = reply->integer;
 		}
@@ -134,6 +176,7 @@ rspamd_stat_cache_redis_get (redisAsyncContext *c, gpointer r, gpointer priv)
 		rspamd_upstream_fail (rt->selected);
 	}
 
+	rspamd_redis_cache_release (rt, RSPAMD_REDIS_RELEASE_DEFAULT);
 	rspamd_session_remove_event (task->s, rspamd_redis_cache_fin, rt);
 }
 
@@ -146,7 +189,11 @@ rspamd_stat_cache_redis_set (redisAsyncContext *c, gpointer r, gpointer priv)
 
 	task = rt->task;
 
-	if (c->err == 0) {
+	if (rt->redis == NULL) {
+		return;
+	}
+
+	if (c->err == 0 && r != NULL) {
 		/* XXX: we ignore results here */
 		rspamd_upstream_ok (rt->selected);
 	}
@@ -154,6 +201,7 @@ rspamd_stat_cache_redis_set (redisAsyncContext *c, gpointer r, gpointer priv)
 		rspamd_upstream_fail (rt->selected);
 	}
 
+	rspamd_redis_cache_release (rt, RSPAMD_REDIS_RELEASE_DEFAULT);
 	rspamd_session_remove_event (task->s, rspamd_redis_cache_fin, rt);
 }
 
@@ -318,7 +366,6 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	struct rspamd_redis_cache_ctx *ctx = c;
 	struct rspamd_redis_cache_runtime *rt;
 	struct upstream *up;
-	rspamd_inet_addr_t *addr;
 
 	g_assert (ctx != NULL);
 
@@ -355,18 +402,9 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	rt->task = task;
 	rt->ctx = ctx;
 
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-	rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
-			rspamd_inet_address_get_port (addr));
-	g_assert (rt->redis != NULL);
-
-	redisLibeventAttach (rt->redis, task->ev_base);
-
 	/* Now check stats */
 	event_set (&rt->timeout_event, -1, EV_TIMEOUT, rspamd_redis_cache_timeout, rt);
 	event_base_set (task->ev_base, &rt->timeout_event);
-	rspamd_redis_cache_maybe_auth (ctx, rt->redis);
 
 	if (!learn) {
 		rspamd_stat_cache_redis_generate_id (task);
@@ -392,13 +430,20 @@ rspamd_stat_cache_redis_check (struct rspamd_task *task,
 
 	double_to_tv (rt->ctx->timeout, &tv);
 
-	if (redisAsyncCommand (rt->redis, rspamd_stat_cache_redis_get, rt,
+	if (!rspamd_redis_cache_connect (rt)) {
+		return RSPAMD_LEARN_OK;
+	}
+
+	if (rspamd_redis_pool_command (rt->redis, rspamd_stat_cache_redis_get, rt,
 			"HGET %s %s",
 			rt->ctx->redis_object, h) == REDIS_OK) {
 		rspamd_session_add_event (task->s, rspamd_redis_cache_fin, rt,
 				rspamd_stat_cache_redis_quark ());
 		event_add (&rt->timeout_event, &tv);
 	}
+	else {
+		rspamd_redis_cache_release (rt, RSPAMD_REDIS_RELEASE_FATAL);
+	}
 
 	/* We need to return OK every time */
 	return RSPAMD_LEARN_OK;
@@ -420,13 +465,20 @@ rspamd_stat_cache_redis_learn (struct rspamd_task *task,
 	double_to_tv (rt->ctx->timeout, &tv);
 	flag = (task->flags & RSPAMD_TASK_FLAG_LEARN_SPAM) ? 1 : -1;
 
-	if (redisAsyncCommand (rt->redis, rspamd_stat_cache_redis_set, rt,
+	if (!rspamd_redis_cache_connect (rt)) {
+		return RSPAMD_LEARN_OK;
+	}
+
+	if (rspamd_redis_pool_command (rt->redis, rspamd_stat_cache_redis_set, rt,
 			"HSET %s %s %d",
 			rt->ctx->redis_object, h, flag) == REDIS_OK) {
 		rspamd_session_add_event (task->s, rspamd_redis_cache_fin, rt,
 				rspamd_stat_cache_redis_quark ());
 		event_add (&rt->timeout_event, &tv);
 	}
+	else {
+		rspamd_redis_cache_release (rt, RSPAMD_REDIS_RELEASE_FATAL);
+	}
 
 	/* We need to return OK every time */
 	return RSPAMD_LEARN_OK;
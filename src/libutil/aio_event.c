@@ -27,6 +27,24 @@
 #include <aio.h>
 #endif
 
+#if defined(LINUX) && defined(HAVE_LINUX_IO_URING_H)
+#define WITH_IO_URING 1
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* These syscalls have the same numbers on all platforms but alpha */
+# ifdef __NR_io_uring_setup
+#  define SYS_io_uring_setup      __NR_io_uring_setup
+#  define SYS_io_uring_enter      __NR_io_uring_enter
+#  define SYS_io_uring_register   __NR_io_uring_register
+# else
+#  define SYS_io_uring_setup      425
+#  define SYS_io_uring_enter      426
+#  define SYS_io_uring_register   427
+# endif
+#endif
+
 /* Linux syscall numbers */
 #if defined(__i386__)
 # define SYS_io_setup      245
@@ -60,6 +78,12 @@ struct io_cbdata {
 	gpointer buf;
 	gpointer io_buf;
 	gpointer ud;
+#ifdef WITH_IO_URING
+	guint64 offset;
+	guint64 done;
+	struct iovec iov;
+	guint8 opcode;
+#endif
 };
 
 #ifdef LINUX
@@ -173,6 +197,54 @@ eventfd (guint initval, guint flags)
 
 #endif
 
+#ifdef WITH_IO_URING
+/*
+ * Mappings of io_uring rings, we use raw syscalls here for the same reason
+ * as for the legacy aio: to avoid dependency on liburing
+ */
+struct rspamd_io_uring {
+	gint fd;
+	guint entries;
+	guint inflight;
+	/* Submission queue */
+	guint *sq_head;
+	guint *sq_tail;
+	guint *sq_mask;
+	guint *sq_array;
+	struct io_uring_sqe *sqes;
+	/* Completion queue */
+	guint *cq_head;
+	guint *cq_tail;
+	guint *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Mapped regions */
+	gpointer sq_ring;
+	gpointer cq_ring;
+	gsize sq_ring_len;
+	gsize cq_ring_len;
+	gsize sqes_len;
+};
+
+static int
+io_uring_setup (guint entries, struct io_uring_params *p)
+{
+	return syscall (SYS_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter (gint fd, guint to_submit, guint min_complete, guint flags)
+{
+	return syscall (SYS_io_uring_enter, fd, to_submit, min_complete, flags,
+			NULL, 0);
+}
+
+static int
+io_uring_register (gint fd, guint opcode, gpointer arg, guint nr_args)
+{
+	return syscall (SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+#endif
+
 /**
  * AIO context
  */
@@ -184,6 +256,10 @@ struct aio_context {
 	gint event_fd;
 	struct event eventfd_ev;
 	aio_context_t io_ctx;
+#ifdef WITH_IO_URING
+	gboolean has_uring;     /**< Whether io_uring is used instead of io (3) */
+	struct rspamd_io_uring ring;
+#endif
 #elif defined(HAVE_AIO_H)
 	/* POSIX aio */
 	struct event rtsigs[128];
@@ -191,6 +267,210 @@ struct aio_context {
 };
 
 #ifdef LINUX
+static void
+rspamd_aio_finish (struct io_cbdata *ev_data, gint res, guint64 len)
+{
+	ev_data->cb (ev_data->fd, res, len, ev_data->buf, ev_data->ud);
+
+	if (ev_data->io_buf) {
+		free (ev_data->io_buf);
+	}
+
+	g_slice_free1 (sizeof (struct io_cbdata), ev_data);
+}
+
+#ifdef WITH_IO_URING
+static void
+rspamd_uring_free (struct rspamd_io_uring *ring)
+{
+	if (ring->sqes) {
+		munmap (ring->sqes, ring->sqes_len);
+	}
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+		munmap (ring->cq_ring, ring->cq_ring_len);
+	}
+	if (ring->sq_ring) {
+		munmap (ring->sq_ring, ring->sq_ring_len);
+	}
+
+	close (ring->fd);
+	memset (ring, 0, sizeof (*ring));
+	ring->fd = -1;
+}
+
+static gboolean
+rspamd_uring_init (struct rspamd_io_uring *ring, guint entries, gint event_fd)
+{
+	struct io_uring_params p;
+	guchar *sq, *cq;
+
+	memset (&p, 0, sizeof (p));
+	memset (ring, 0, sizeof (*ring));
+	ring->fd = io_uring_setup (entries, &p);
+
+	if (ring->fd == -1) {
+		/* Old kernel or io_uring is disabled by a system policy */
+		msg_info ("io_uring_setup failed: %s", strerror (errno));
+		return FALSE;
+	}
+
+	ring->entries = p.sq_entries;
+	ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof (guint);
+	ring->cq_ring_len = p.cq_off.cqes +
+			p.cq_entries * sizeof (struct io_uring_cqe);
+
+#ifdef IORING_FEAT_SINGLE_MMAP
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_len = MAX (ring->sq_ring_len, ring->cq_ring_len);
+		ring->cq_ring_len = ring->sq_ring_len;
+	}
+#endif
+
+	sq = mmap (NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+	if (sq == MAP_FAILED) {
+		msg_err ("cannot map io_uring submission queue: %s", strerror (errno));
+		close (ring->fd);
+
+		return FALSE;
+	}
+
+	ring->sq_ring = sq;
+
+#ifdef IORING_FEAT_SINGLE_MMAP
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	}
+	else
+#endif
+	{
+		cq = mmap (NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+		if (cq == MAP_FAILED) {
+			msg_err ("cannot map io_uring completion queue: %s",
+					strerror (errno));
+			rspamd_uring_free (ring);
+
+			return FALSE;
+		}
+	}
+
+	ring->cq_ring = cq;
+	ring->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap (NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (ring->sqes == MAP_FAILED) {
+		msg_err ("cannot map io_uring entries: %s", strerror (errno));
+		ring->sqes = NULL;
+		rspamd_uring_free (ring);
+
+		return FALSE;
+	}
+
+	ring->sq_head = (guint *)(sq + p.sq_off.head);
+	ring->sq_tail = (guint *)(sq + p.sq_off.tail);
+	ring->sq_mask = (guint *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (guint *)(sq + p.sq_off.array);
+	ring->cq_head = (guint *)(cq + p.cq_off.head);
+	ring->cq_tail = (guint *)(cq + p.cq_off.tail);
+	ring->cq_mask = (guint *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* Completions are signalled to libevent via eventfd */
+	if (io_uring_register (ring->fd, IORING_REGISTER_EVENTFD,
+			&event_fd, 1) == -1) {
+		msg_err ("cannot register eventfd for io_uring: %s", strerror (errno));
+		rspamd_uring_free (ring);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_uring_submit (struct rspamd_io_uring *ring, struct io_cbdata *cbdata)
+{
+	struct io_uring_sqe *sqe;
+	guint tail, idx;
+
+	/* Do not allow more requests than the completion queue can hold */
+	if (ring->inflight >= ring->entries) {
+		return FALSE;
+	}
+
+	tail = *ring->sq_tail;
+
+	if (tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE) >=
+			ring->entries) {
+		return FALSE;
+	}
+
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset (sqe, 0, sizeof (*sqe));
+
+	cbdata->iov.iov_base = (guchar *)(cbdata->io_buf ? cbdata->io_buf :
+			cbdata->buf) + cbdata->done;
+	cbdata->iov.iov_len = cbdata->len - cbdata->done;
+	sqe->opcode = cbdata->opcode;
+	sqe->fd = cbdata->fd;
+	sqe->addr = (guint64)((uintptr_t)&cbdata->iov);
+	sqe->len = 1;
+	sqe->off = cbdata->offset + cbdata->done;
+	sqe->user_data = (guint64)((uintptr_t)cbdata);
+	ring->sq_array[idx] = idx;
+	__atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (io_uring_enter (ring->fd, 1, 0, 0) != 1) {
+		/* Entry has not been consumed by kernel, so we can take it back */
+		__atomic_store_n (ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+		return FALSE;
+	}
+
+	ring->inflight ++;
+
+	return TRUE;
+}
+
+static void
+rspamd_uring_reap (struct rspamd_io_uring *ring)
+{
+	struct io_uring_cqe *cqe;
+	struct io_cbdata *ev_data;
+	guint head;
+	gint res;
+
+	head = *ring->cq_head;
+
+	while (head != __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		ev_data = (struct io_cbdata *) (uintptr_t) cqe->user_data;
+		res = cqe->res;
+		/* Release the entry before callback as it can submit new requests */
+		head ++;
+		__atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+		ring->inflight --;
+
+		if (res > 0) {
+			ev_data->done += res;
+
+			/* Short read or write, continue from the current position */
+			if (ev_data->done < ev_data->len &&
+					rspamd_uring_submit (ring, ev_data)) {
+				continue;
+			}
+		}
+
+		rspamd_aio_finish (ev_data, res < 0 ? res : 0, ev_data->done);
+	}
+}
+#endif
+
 /* Eventfd read callback */
 static void
 rspamd_eventfdcb (gint fd, gshort what, gpointer ud)
@@ -200,7 +480,6 @@ rspamd_eventfdcb (gint fd, gshort what, gpointer ud)
 	gint done, i;
 	struct io_event event[32];
 	struct timespec ts;
-	struct io_cbdata *ev_data;
 
 	/* Eventfd returns number of events ready got from kernel */
 	if (read (fd, &ready, 8) != 8) {
@@ -210,6 +489,14 @@ rspamd_eventfdcb (gint fd, gshort what, gpointer ud)
 		msg_err ("eventfd read returned error: %s", strerror (errno));
 	}
 
+#ifdef WITH_IO_URING
+	if (ctx->has_uring) {
+		rspamd_uring_reap (&ctx->ring);
+
+		return;
+	}
+#endif
+
 	ts.tv_sec = 0;
 	ts.tv_nsec = 0;
 
@@ -221,17 +508,17 @@ rspamd_eventfdcb (gint fd, gshort what, gpointer ud)
 			ready -= done;
 
 			for (i = 0; i < done; i++) {
-				ev_data = (struct io_cbdata *) (uintptr_t) event[i].data;
 				/* Call this callback */
-				ev_data->cb (ev_data->fd,
-					event[i].res,
-					ev_data->len,
-					ev_data->buf,
-					ev_data->ud);
-				if (ev_data->io_buf) {
-					free (ev_data->io_buf);
+				if (event[i].res < 0) {
+					rspamd_aio_finish (
+							(struct io_cbdata *) (uintptr_t) event[i].data,
+							event[i].res, 0);
+				}
+				else {
+					rspamd_aio_finish (
+							(struct io_cbdata *) (uintptr_t) event[i].data,
+							0, event[i].res);
 				}
-				g_slice_free1 (sizeof (struct io_cbdata), ev_data);
 			}
 		}
 		else if (done == 0) {
@@ -260,7 +547,7 @@ rspamd_aio_init (struct event_base *base)
 	new->base = base;
 
 #ifdef LINUX
-	/* On linux we are trying to use io (3) and eventfd for notifying */
+	/* On linux we are trying to use io_uring or io (3) and eventfd for notifying */
 	new->event_fd = eventfd (0, 0);
 	if (new->event_fd == -1) {
 		msg_err ("eventfd failed: %s", strerror (errno));
@@ -272,13 +559,13 @@ rspamd_aio_init (struct event_base *base)
 			close (new->event_fd);
 		}
 		else {
-			event_set (&new->eventfd_ev,
-				new->event_fd,
-				EV_READ | EV_PERSIST,
-				rspamd_eventfdcb,
-				new);
-			event_base_set (new->base, &new->eventfd_ev);
-			event_add (&new->eventfd_ev, NULL);
+#ifdef WITH_IO_URING
+			if (rspamd_uring_init (&new->ring, MAX_AIO_EV, new->event_fd)) {
+				new->has_uring = TRUE;
+				new->has_aio = TRUE;
+			}
+			else
+#endif
 			if (io_setup (MAX_AIO_EV, &new->io_ctx) == -1) {
 				msg_err ("io_setup failed: %s", strerror (errno));
 				close (new->event_fd);
@@ -286,6 +573,16 @@ rspamd_aio_init (struct event_base *base)
 			else {
 				new->has_aio = TRUE;
 			}
+
+			if (new->has_aio) {
+				event_set (&new->eventfd_ev,
+						new->event_fd,
+						EV_READ | EV_PERSIST,
+						rspamd_eventfdcb,
+						new);
+				event_base_set (new->base, &new->eventfd_ev);
+				event_add (&new->eventfd_ev, NULL);
+			}
 		}
 	}
 #elif defined(HAVE_AIO_H)
@@ -295,6 +592,36 @@ rspamd_aio_init (struct event_base *base)
 	return new;
 }
 
+/**
+ * Destroy aio context
+ */
+void
+rspamd_aio_destroy (struct aio_context *ctx)
+{
+	if (ctx == NULL) {
+		return;
+	}
+
+#ifdef LINUX
+	if (ctx->has_aio) {
+		event_del (&ctx->eventfd_ev);
+#ifdef WITH_IO_URING
+		if (ctx->has_uring) {
+			rspamd_uring_free (&ctx->ring);
+		}
+		else
+#endif
+		{
+			io_destroy (ctx->io_ctx);
+		}
+
+		close (ctx->event_fd);
+	}
+#endif
+
+	g_free (ctx);
+}
+
 /**
  * Open file for aio
  */
@@ -307,6 +634,12 @@ rspamd_aio_open (struct aio_context *ctx, const gchar *path, int flags)
 		return open (path, flags);
 	}
 #ifdef LINUX
+#ifdef WITH_IO_URING
+	/* io_uring does not block on buffered io, so page cache is still used */
+	if (ctx->has_uring) {
+		return open (path, flags);
+	}
+#endif
 
 	fd = open (path, flags | O_DIRECT);
 
@@ -337,7 +670,7 @@ rspamd_aio_read (gint fd,
 		struct iocb *iocb[1];
 		struct io_cbdata *cbdata;
 
-		cbdata = g_slice_alloc (sizeof (struct io_cbdata));
+		cbdata = g_slice_alloc0 (sizeof (struct io_cbdata));
 		cbdata->cb = cb;
 		cbdata->buf = buf;
 		cbdata->len = len;
@@ -345,6 +678,21 @@ rspamd_aio_read (gint fd,
 		cbdata->fd = fd;
 		cbdata->io_buf = NULL;
 
+#ifdef WITH_IO_URING
+		if (ctx->has_uring) {
+			cbdata->opcode = IORING_OP_READV;
+			cbdata->offset = offset;
+
+			if (rspamd_uring_submit (&ctx->ring, cbdata)) {
+				return len;
+			}
+
+			/* Ring is full, fall back to sync read */
+			g_slice_free1 (sizeof (struct io_cbdata), cbdata);
+			goto blocking;
+		}
+#endif
+
 		iocb[0] = alloca (sizeof (struct iocb));
 		memset (iocb[0], 0, sizeof (struct iocb));
 		iocb[0]->aio_fildes = fd;
@@ -362,6 +710,8 @@ rspamd_aio_read (gint fd,
 			return len;
 		}
 		else {
+			g_slice_free1 (sizeof (struct io_cbdata), cbdata);
+
 			if (errno == EAGAIN || errno == ENOSYS) {
 				/* Fall back to sync read */
 				goto blocking;
@@ -376,19 +726,10 @@ rspamd_aio_read (gint fd,
 		/* Blocking variant */
 		goto blocking;
 blocking:
-#ifdef _LARGEFILE64_SOURCE
-		r = lseek64 (fd, offset, SEEK_SET);
-#else
-		r = lseek (fd, offset, SEEK_SET);
-#endif
-		if (r > 0) {
-			r = read (fd, buf, len);
-			if (r >= 0) {
-				cb (fd, 0, r, buf, ud);
-			}
-			else {
-				cb (fd, r, -1, buf, ud);
-			}
+		r = pread (fd, buf, len, offset);
+
+		if (r >= 0) {
+			cb (fd, 0, r, buf, ud);
 		}
 	}
 
@@ -414,7 +755,7 @@ rspamd_aio_write (gint fd,
 		struct iocb *iocb[1];
 		struct io_cbdata *cbdata;
 
-		cbdata = g_slice_alloc (sizeof (struct io_cbdata));
+		cbdata = g_slice_alloc0 (sizeof (struct io_cbdata));
 		cbdata->cb = cb;
 		cbdata->buf = buf;
 		cbdata->len = len;
@@ -422,10 +763,27 @@ rspamd_aio_write (gint fd,
 		cbdata->fd = fd;
 		/* We need to align pointer on boundary of 512 bytes here */
 		if (posix_memalign (&cbdata->io_buf, 512, len) != 0) {
+			g_slice_free1 (sizeof (struct io_cbdata), cbdata);
 			return -1;
 		}
 		memcpy (cbdata->io_buf, buf, len);
 
+#ifdef WITH_IO_URING
+		if (ctx->has_uring) {
+			cbdata->opcode = IORING_OP_WRITEV;
+			cbdata->offset = offset;
+
+			if (rspamd_uring_submit (&ctx->ring, cbdata)) {
+				return len;
+			}
+
+			/* Ring is full, fall back to sync write */
+			free (cbdata->io_buf);
+			g_slice_free1 (sizeof (struct io_cbdata), cbdata);
+			goto blocking;
+		}
+#endif
+
 		iocb[0] = alloca (sizeof (struct iocb));
 		memset (iocb[0], 0, sizeof (struct iocb));
 		iocb[0]->aio_fildes = fd;
@@ -443,6 +801,9 @@ rspamd_aio_write (gint fd,
 			return len;
 		}
 		else {
+			free (cbdata->io_buf);
+			g_slice_free1 (sizeof (struct io_cbdata), cbdata);
+
 			if (errno == EAGAIN || errno == ENOSYS) {
 				/* Fall back to sync read */
 				goto blocking;
@@ -457,19 +818,10 @@ rspamd_aio_write (gint fd,
 		/* Blocking variant */
 		goto blocking;
 blocking:
-#ifdef _LARGEFILE64_SOURCE
-		r = lseek64 (fd, offset, SEEK_SET);
-#else
-		r = lseek (fd, offset, SEEK_SET);
-#endif
-		if (r > 0) {
-			r = write (fd, buf, len);
-			if (r >= 0) {
-				cb (fd, 0, r, buf, ud);
-			}
-			else {
-				cb (fd, r, -1, buf, ud);
-			}
+		r = pwrite (fd, buf, len, offset);
+
+		if (r >= 0) {
+			cb (fd, 0, r, buf, ud);
 		}
 	}
 
@@ -489,6 +841,13 @@ rspamd_aio_close (gint fd, struct aio_context *ctx)
 		struct iocb iocb;
 		struct io_event ev;
 
+#ifdef WITH_IO_URING
+		if (ctx->has_uring) {
+			/* Pending requests hold their own reference to the file */
+			return close (fd);
+		}
+#endif
+
 		memset (&iocb, 0, sizeof (struct iocb));
 		iocb.aio_fildes = fd;
 		iocb.aio_lio_opcode = IO_CMD_NOOP;
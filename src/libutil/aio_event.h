@@ -24,7 +24,8 @@
 struct aio_context;
 
 /**
- * Callback for notifying
+ * Callback for notifying: `res` is zero on success or negative errno code
+ * on error, `len` is the number of bytes transferred
  */
 typedef void (*rspamd_aio_cb) (gint fd, gint res, guint64 len, gpointer data,
 	gpointer ud);
@@ -34,19 +35,28 @@ typedef void (*rspamd_aio_cb) (gint fd, gint res, guint64 len, gpointer data,
  */
 struct aio_context * rspamd_aio_init (struct event_base *base);
 
+/**
+ * Destroy aio context, pending requests are not notified
+ */
+void rspamd_aio_destroy (struct aio_context *ctx);
+
 /**
  * Open file for aio
  */
 gint rspamd_aio_open (struct aio_context *ctx, const gchar *path, int flags);
 
 /**
- * Asynchronous read of file
+ * Asynchronous read of file, `buf` must be valid until callback is called.
+ * Callback can be called before this function returns if request cannot
+ * be queued and blocking read is performed instead. Returns -1 if
+ * request has failed, callback is not called in this case
  */
 gint rspamd_aio_read (gint fd, gpointer buf, guint64 len, guint64 offset,
 	struct aio_context *ctx, rspamd_aio_cb cb, gpointer ud);
 
 /**
- * Asynchronous write of file
+ * Asynchronous write of file, data is copied so `buf` can be freed
+ * immediately
  */
 gint rspamd_aio_write (gint fd, gpointer buf, guint64 len, guint64 offset,
 	struct aio_context *ctx, rspamd_aio_cb cb, gpointer ud);
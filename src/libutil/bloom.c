@@ -16,6 +16,9 @@
 #include "config.h"
 #include "bloom.h"
 #include "cryptobox.h"
+#include "logger.h"
+#include "printf.h"
+#include "unix-std.h"
 
 /* 4 bits are used for counting (implementing delete operation) */
 #define SIZE_BIT 4
@@ -156,3 +159,429 @@ rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s)
 
 	return TRUE;
 }
+
+/*
+ * Blocked bloom filter
+ */
+
+#define RSPAMD_BLOOM_BLOCK 64
+#define RSPAMD_BLOOM_BLOCK_BITS (RSPAMD_BLOOM_BLOCK * NBBY)
+/* 4 bits counters in counting filters */
+#define RSPAMD_BLOOM_BLOCK_COUNTERS (RSPAMD_BLOOM_BLOCK * 2)
+#define RSPAMD_BLOOM_MAX_PROBES 16
+#define RSPAMD_BLOOM_DEFAULT_BITS 10
+
+static const guchar rspamd_bloom_magic[8] = {'r', 's', 'b', 'l', 'o', 'o', 'm', '1'};
+static const guint64 rspamd_bloom_seed = 0xa41b2508f97542d1ULL;
+
+/* Header occupies the first block of mapping */
+struct rspamd_blocked_bloom_hdr {
+	guchar magic[8];
+	guint64 nblocks;
+	guint32 nprobes;
+	guint32 flags;
+	guchar padding[RSPAMD_BLOOM_BLOCK - 24];
+};
+
+struct rspamd_blocked_bloom_s {
+	struct rspamd_blocked_bloom_hdr *hdr;
+	guchar *blocks;
+	gsize map_len;
+	guint64 nblocks;
+	guint nprobes;
+	gboolean counting;
+	gboolean shared;
+	gboolean readonly;
+};
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#define RSPAMD_BLOOM_SSE2 1
+#include <emmintrin.h>
+#endif
+
+static GQuark
+rspamd_bloom_quark (void)
+{
+	return g_quark_from_static_string ("bloom-filter");
+}
+
+static gboolean
+rspamd_blocked_bloom_init (rspamd_blocked_bloom_t *bloom, gpointer map,
+		gsize len)
+{
+	struct rspamd_blocked_bloom_hdr *hdr = map;
+
+	if (len < sizeof (*hdr) ||
+			memcmp (hdr->magic, rspamd_bloom_magic, sizeof (hdr->magic)) != 0 ||
+			hdr->nblocks == 0 || hdr->nblocks > G_MAXUINT32 ||
+			hdr->nprobes == 0 || hdr->nprobes > RSPAMD_BLOOM_MAX_PROBES ||
+			(len - sizeof (*hdr)) / RSPAMD_BLOOM_BLOCK < hdr->nblocks) {
+		return FALSE;
+	}
+
+	bloom->hdr = hdr;
+	bloom->blocks = ((guchar *)map) + sizeof (*hdr);
+	bloom->map_len = len;
+	bloom->nblocks = hdr->nblocks;
+	bloom->nprobes = hdr->nprobes;
+	bloom->counting = (hdr->flags & RSPAMD_BLOOM_COUNTING) != 0;
+
+	return TRUE;
+}
+
+rspamd_blocked_bloom_t *
+rspamd_blocked_bloom_new (gsize nelts, guint bits_per_elt, gint flags)
+{
+	rspamd_blocked_bloom_t *bloom;
+	struct rspamd_blocked_bloom_hdr hdr;
+	guint64 nblocks;
+	gsize len;
+	gpointer map;
+
+	if (bits_per_elt == 0) {
+		bits_per_elt = RSPAMD_BLOOM_DEFAULT_BITS;
+	}
+
+	nblocks = (guint64)MAX (nelts, 1) * bits_per_elt;
+	nblocks = (nblocks + ((flags & RSPAMD_BLOOM_COUNTING) ?
+			RSPAMD_BLOOM_BLOCK_COUNTERS : RSPAMD_BLOOM_BLOCK_BITS) - 1) /
+			((flags & RSPAMD_BLOOM_COUNTING) ?
+			RSPAMD_BLOOM_BLOCK_COUNTERS : RSPAMD_BLOOM_BLOCK_BITS);
+
+	g_assert (nblocks <= G_MAXUINT32);
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, rspamd_bloom_magic, sizeof (hdr.magic));
+	hdr.nblocks = nblocks;
+	/* Optimal number of hash functions is bits_per_elt * ln 2 */
+	hdr.nprobes = CLAMP ((guint)(bits_per_elt * 0.693 + 0.5), 1,
+			RSPAMD_BLOOM_MAX_PROBES);
+	hdr.flags = flags & RSPAMD_BLOOM_COUNTING;
+
+	len = sizeof (hdr) + nblocks * RSPAMD_BLOOM_BLOCK;
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE,
+			MAP_ANON | ((flags & RSPAMD_BLOOM_SHARED) ? MAP_SHARED : MAP_PRIVATE),
+			-1, 0);
+
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes for bloom filter: %s", len,
+				strerror (errno));
+
+		return NULL;
+	}
+
+	memcpy (map, &hdr, sizeof (hdr));
+	bloom = g_malloc0 (sizeof (*bloom));
+	rspamd_blocked_bloom_init (bloom, map, len);
+	bloom->shared = (flags & RSPAMD_BLOOM_SHARED) != 0;
+
+	return bloom;
+}
+
+rspamd_blocked_bloom_t *
+rspamd_blocked_bloom_open (const gchar *path, GError **err)
+{
+	rspamd_blocked_bloom_t *bloom;
+	struct stat st;
+	gpointer map;
+	gint fd;
+
+	if ((fd = open (path, O_RDONLY)) == -1) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot open %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot stat %s: %s", path, strerror (errno));
+		close (fd);
+		return NULL;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot mmap %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	bloom = g_malloc0 (sizeof (*bloom));
+
+	if (!rspamd_blocked_bloom_init (bloom, map, st.st_size)) {
+		g_set_error (err, rspamd_bloom_quark (), EINVAL,
+				"%s is not a valid bloom filter", path);
+		munmap (map, st.st_size);
+		g_free (bloom);
+
+		return NULL;
+	}
+
+	bloom->shared = TRUE;
+	bloom->readonly = TRUE;
+
+	return bloom;
+}
+
+gboolean
+rspamd_blocked_bloom_save (rspamd_blocked_bloom_t *bloom, const gchar *path,
+		GError **err)
+{
+	gchar tmp[PATH_MAX];
+	const guchar *p = (const guchar *)bloom->hdr;
+	gsize remain = sizeof (*bloom->hdr) + bloom->nblocks * RSPAMD_BLOOM_BLOCK;
+	gssize r;
+	gint fd;
+
+	/* Write to a temporary file to avoid mapping of partially written filter */
+	rspamd_snprintf (tmp, sizeof (tmp), "%s.new", path);
+
+	if ((fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 00644)) == -1) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot open %s: %s", tmp, strerror (errno));
+		return FALSE;
+	}
+
+	while (remain > 0) {
+		if ((r = write (fd, p, remain)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			g_set_error (err, rspamd_bloom_quark (), errno,
+					"cannot write %s: %s", tmp, strerror (errno));
+			close (fd);
+			unlink (tmp);
+
+			return FALSE;
+		}
+
+		p += r;
+		remain -= r;
+	}
+
+	/* Data must reach the disk before the file is visible under its name */
+	if (fsync (fd) == -1) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot sync %s: %s", tmp, strerror (errno));
+		close (fd);
+		unlink (tmp);
+
+		return FALSE;
+	}
+
+	close (fd);
+
+	if (rename (tmp, path) == -1) {
+		g_set_error (err, rspamd_bloom_quark (), errno,
+				"cannot rename %s to %s: %s", tmp, path, strerror (errno));
+		unlink (tmp);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_blocked_bloom_destroy (rspamd_blocked_bloom_t *bloom)
+{
+	if (bloom) {
+		munmap (bloom->hdr, bloom->map_len);
+		g_free (bloom);
+	}
+}
+
+/*
+ * Counters are accessed as 32 bits words, so shared filters could be updated
+ * atomically. For little endian hosts it is the same as 2 counters per byte
+ */
+static inline guint
+rspamd_blocked_bloom_counter (const guchar *blk, guint pos)
+{
+	const guint32 *words = (const guint32 *)blk;
+
+	return (words[pos >> 3] >> ((pos & 7) * 4)) & 0xF;
+}
+
+/*
+ * Increments or decrements counter, saturated and zero counters are never
+ * changed. Shared filters are updated by CAS as other processes might change
+ * other counters in the same word concurrently
+ */
+static inline void
+rspamd_blocked_bloom_counter_update (rspamd_blocked_bloom_t *bloom,
+		guchar *blk, guint pos, gboolean inc)
+{
+	guint32 *w = &((guint32 *)blk)[pos >> 3], old, nv, c, shift;
+
+	shift = (pos & 7) * 4;
+
+	if (!bloom->shared) {
+		c = (*w >> shift) & 0xF;
+
+		if (c != 0xF && (inc || c != 0)) {
+			*w = inc ? *w + (1u << shift) : *w - (1u << shift);
+		}
+
+		return;
+	}
+
+	do {
+		old = (guint32)g_atomic_int_get ((gint *)w);
+		c = (old >> shift) & 0xF;
+
+		if (c == 0xF || (!inc && c == 0)) {
+			return;
+		}
+
+		nv = inc ? old + (1u << shift) : old - (1u << shift);
+	} while (!g_atomic_int_compare_and_exchange ((gint *)w, (gint)old,
+			(gint)nv));
+}
+
+/*
+ * Returns block for element and fills positions of its bits within
+ * the block using double hashing of a single 64 bits hash
+ */
+static inline guchar *
+rspamd_blocked_bloom_probes (rspamd_blocked_bloom_t *bloom,
+		const void *data, gsize len, guint *pos)
+{
+	guint64 h;
+	guint32 h1, h2;
+	guint i, shift;
+
+	h = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			data, len, rspamd_bloom_seed);
+	h1 = (guint32)h;
+	h2 = ((guint32)((h * 0x9E3779B97F4A7C15ULL) >> 32)) | 1;
+	/* 9 bits select bit in block, 7 bits select counter */
+	shift = bloom->counting ? 32 - 7 : 32 - 9;
+
+	for (i = 0; i < bloom->nprobes; i ++) {
+		pos[i] = (h1 + i * h2) >> shift;
+	}
+
+	return bloom->blocks +
+			(((h >> 32) * bloom->nblocks) >> 32) * RSPAMD_BLOOM_BLOCK;
+}
+
+gboolean
+rspamd_blocked_bloom_add (rspamd_blocked_bloom_t *bloom,
+		const void *data, gsize len)
+{
+	guint pos[RSPAMD_BLOOM_MAX_PROBES], i;
+	guchar *blk;
+	guint32 *words;
+
+	if (bloom == NULL || bloom->readonly) {
+		return FALSE;
+	}
+
+	blk = rspamd_blocked_bloom_probes (bloom, data, len, pos);
+
+	if (bloom->counting) {
+		for (i = 0; i < bloom->nprobes; i ++) {
+			rspamd_blocked_bloom_counter_update (bloom, blk, pos[i], TRUE);
+		}
+	}
+	else {
+		words = (guint32 *)blk;
+
+		for (i = 0; i < bloom->nprobes; i ++) {
+			if (bloom->shared) {
+				g_atomic_int_or (&words[pos[i] >> 5], 1u << (pos[i] & 31));
+			}
+			else {
+				words[pos[i] >> 5] |= 1u << (pos[i] & 31);
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_blocked_bloom_del (rspamd_blocked_bloom_t *bloom,
+		const void *data, gsize len)
+{
+	guint pos[RSPAMD_BLOOM_MAX_PROBES], i;
+	guchar *blk;
+
+	if (bloom == NULL || bloom->readonly || !bloom->counting) {
+		return FALSE;
+	}
+
+	blk = rspamd_blocked_bloom_probes (bloom, data, len, pos);
+
+	for (i = 0; i < bloom->nprobes; i ++) {
+		if (rspamd_blocked_bloom_counter (blk, pos[i]) == 0) {
+			return FALSE;
+		}
+	}
+
+	/* Counters that became zero meanwhile (e.g. used twice) are kept */
+	for (i = 0; i < bloom->nprobes; i ++) {
+		rspamd_blocked_bloom_counter_update (bloom, blk, pos[i], FALSE);
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_blocked_bloom_check (rspamd_blocked_bloom_t *bloom,
+		const void *data, gsize len)
+{
+	guint pos[RSPAMD_BLOOM_MAX_PROBES], i;
+	guint32 mask[RSPAMD_BLOOM_BLOCK / sizeof (guint32)];
+	const guchar *blk;
+#ifdef RSPAMD_BLOOM_SSE2
+	__m128i m, b, res;
+#endif
+
+	if (bloom == NULL) {
+		return FALSE;
+	}
+
+	blk = rspamd_blocked_bloom_probes (bloom, data, len, pos);
+
+	if (bloom->counting) {
+		for (i = 0; i < bloom->nprobes; i ++) {
+			if (rspamd_blocked_bloom_counter (blk, pos[i]) == 0) {
+				return FALSE;
+			}
+		}
+
+		return TRUE;
+	}
+
+	/* Build mask of the element and test the whole block at once */
+	memset (mask, 0, sizeof (mask));
+
+	for (i = 0; i < bloom->nprobes; i ++) {
+		mask[pos[i] >> 5] |= 1u << (pos[i] & 31);
+	}
+
+#ifdef RSPAMD_BLOOM_SSE2
+	res = _mm_set1_epi8 (-1);
+
+	for (i = 0; i < RSPAMD_BLOOM_BLOCK / sizeof (__m128i); i ++) {
+		m = _mm_loadu_si128 ((const __m128i *)mask + i);
+		b = _mm_load_si128 ((const __m128i *)blk + i);
+		res = _mm_and_si128 (res, _mm_cmpeq_epi8 (_mm_and_si128 (b, m), m));
+	}
+
+	return _mm_movemask_epi8 (res) == 0xFFFF;
+#else
+	for (i = 0; i < G_N_ELEMENTS (mask); i ++) {
+		if ((((const guint32 *)blk)[i] & mask[i]) != mask[i]) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+#endif
+}
@@ -45,4 +45,65 @@ gboolean rspamd_bloom_del (rspamd_bloom_filter_t * bloom, const gchar *s);
  */
 gboolean rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s);
 
+/*
+ * Blocked bloom filter: a single hash is calculated for each element and all
+ * its bits are set within one 64 bytes block, so each operation touches
+ * a single cache line. Counting filters use 4 bits counters instead of bits.
+ * Filter is stored in a single memory mapping which could be shared between
+ * processes or saved to a file and mapped by other processes.
+ */
+typedef struct rspamd_blocked_bloom_s rspamd_blocked_bloom_t;
+
+enum rspamd_blocked_bloom_flags {
+	/* Use counters allowing deletion of elements */
+	RSPAMD_BLOOM_COUNTING = (1u << 0),
+	/* Allocate filter in shared memory, it must be created before fork */
+	RSPAMD_BLOOM_SHARED = (1u << 1),
+};
+
+/*
+ * Create new blocked bloom filter
+ * @param nelts expected number of elements
+ * @param bits_per_elt number of bits (or counters) per element, 10 if 0
+ * @param flags combination of rspamd_blocked_bloom_flags
+ */
+rspamd_blocked_bloom_t * rspamd_blocked_bloom_new (gsize nelts,
+		guint bits_per_elt, gint flags);
+
+/*
+ * Map read only filter previously saved by `rspamd_blocked_bloom_save`
+ */
+rspamd_blocked_bloom_t * rspamd_blocked_bloom_open (const gchar *path,
+		GError **err);
+
+/*
+ * Save filter to a file
+ */
+gboolean rspamd_blocked_bloom_save (rspamd_blocked_bloom_t *bloom,
+		const gchar *path, GError **err);
+
+/*
+ * Destroy blocked bloom filter
+ */
+void rspamd_blocked_bloom_destroy (rspamd_blocked_bloom_t *bloom);
+
+/*
+ * Add element to blocked bloom filter
+ */
+gboolean rspamd_blocked_bloom_add (rspamd_blocked_bloom_t *bloom,
+		const void *data, gsize len);
+
+/*
+ * Delete element from counting blocked bloom filter, returns FALSE if the
+ * element is definitely not in the filter
+ */
+gboolean rspamd_blocked_bloom_del (rspamd_blocked_bloom_t *bloom,
+		const void *data, gsize len);
+
+/*
+ * Check whether the element is in the filter (false positives are possible)
+ */
+gboolean rspamd_blocked_bloom_check (rspamd_blocked_bloom_t *bloom,
+		const void *data, gsize len);
+
 #endif
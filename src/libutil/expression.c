@@ -46,6 +46,33 @@ struct rspamd_expression_elt {
 	gint flags;
 	gint value;
 	gint priority;
+	/* Number of atom evaluations since the last resort */
+	guint evals;
+	/* Estimated cost of the branch (negative if unknown) */
+	gdouble cost;
+	/* Estimated probability of the branch to be true */
+	gdouble p_true;
+};
+
+/*
+ * Compiled expression is a linear code for a stack machine:
+ * operands are pushed on stack, operations are applied to the top of stack
+ * and short-circuit evaluation is implemented by forward jumps
+ */
+enum rspamd_expression_opcode {
+	EXPR_OPCODE_ATOM = 0, /* process atom and push its value */
+	EXPR_OPCODE_PUSH, /* push constant `arg` */
+	EXPR_OPCODE_FIRST, /* apply operation to the top of stack */
+	EXPR_OPCODE_APPLY, /* pop operand and apply operation to it and the accumulator */
+	EXPR_OPCODE_JUMP /* jump to `target` if the accumulator is final for `op` */
+};
+
+struct rspamd_expression_insn {
+	enum rspamd_expression_opcode opcode;
+	enum rspamd_expression_op op;
+	gint arg;
+	guint target;
+	struct rspamd_expression_elt *elt;
 };
 
 struct rspamd_expression {
@@ -53,6 +80,8 @@ struct rspamd_expression {
 	GArray *expressions;
 	GPtrArray *expression_stack;
 	GNode *ast;
+	GArray *code;
+	guint max_stack;
 	guint next_resort;
 	guint evals;
 };
@@ -357,6 +386,10 @@ rspamd_expression_destroy (struct rspamd_expression *expr)
 		g_array_free (expr->expressions, TRUE);
 		g_ptr_array_free (expr->expression_stack, TRUE);
 		g_node_destroy (expr->ast);
+
+		if (expr->code) {
+			g_array_free (expr->code, TRUE);
+		}
 	}
 }
 
@@ -454,6 +487,7 @@ rspamd_ast_priority_traverse (GNode *node, gpointer d)
 	struct rspamd_expression_elt *elt = node->data, *cur_elt;
 	struct rspamd_expression *expr = d;
 	gint cnt = 0;
+	gdouble cost = 0, p = 1.0;
 	GNode *cur;
 
 	if (node->children) {
@@ -461,9 +495,38 @@ rspamd_ast_priority_traverse (GNode *node, gpointer d)
 		while (cur) {
 			cur_elt = cur->data;
 			cnt += cur_elt->priority;
+
+			if (cur_elt->type != ELT_LIMIT) {
+				if (cur_elt->cost < 0 || cost < 0) {
+					cost = -1;
+				}
+				else {
+					cost += cur_elt->cost;
+				}
+
+				switch (elt->p.op) {
+				case OP_AND:
+				case OP_MULT:
+					p *= cur_elt->p_true;
+					break;
+				case OP_OR:
+					p *= 1.0 - cur_elt->p_true;
+					break;
+				case OP_NOT:
+					p = 1.0 - cur_elt->p_true;
+					break;
+				default:
+					p = 0.5;
+					break;
+				}
+			}
+
 			cur = cur->next;
 		}
+
 		elt->priority = cnt;
+		elt->cost = cost;
+		elt->p_true = elt->p.op == OP_OR ? 1.0 - p : p;
 	}
 	else {
 		/* It is atom or limit */
@@ -472,6 +535,8 @@ rspamd_ast_priority_traverse (GNode *node, gpointer d)
 		if (elt->type == ELT_LIMIT) {
 			/* Always push limit first */
 			elt->priority = 0;
+			elt->cost = 0;
+			elt->p_true = 1.0;
 		}
 		else {
 			elt->priority = RSPAMD_EXPRESSION_MAX_PRIORITY;
@@ -480,21 +545,53 @@ rspamd_ast_priority_traverse (GNode *node, gpointer d)
 				elt->priority = RSPAMD_EXPRESSION_MAX_PRIORITY -
 						expr->subr->priority (elt->p.atom);
 			}
-			elt->p.atom->hits = 0;
-			elt->p.atom->avg_ticks = 0.0;
+
+			if (elt->evals > 0 && elt->p.atom->avg_ticks > 0) {
+				elt->cost = elt->p.atom->avg_ticks;
+				elt->p_true = (gdouble)MIN (elt->p.atom->hits, elt->evals) /
+						elt->evals;
+			}
+			else {
+				elt->cost = -1;
+				elt->p_true = 0.5;
+			}
+
+			/* Decay statistics to adapt to the changing input */
+			elt->evals /= 2;
+			elt->p.atom->hits /= 2;
 		}
 	}
 
 	return FALSE;
 }
 
-#define ATOM_PRIORITY(a) ((a)->p.atom->hits / ((a)->p.atom->avg_ticks > 0 ?	\
-				(a)->p.atom->avg_ticks * 10000000 : 1.0))
+/*
+ * Cost of evaluating a branch per a short-circuit exit of the parent operation:
+ * the lower it is, the earlier the branch should be evaluated
+ */
+static gdouble
+rspamd_ast_short_circuit_rank (struct rspamd_expression_elt *elt,
+		enum rspamd_expression_op op)
+{
+	gdouble p;
+
+	switch (op) {
+	case OP_AND:
+	case OP_MULT:
+		p = 1.0 - elt->p_true;
+		break;
+	default:
+		p = elt->p_true;
+		break;
+	}
+
+	return elt->cost / MAX (p, 0.001);
+}
 
 static gint
 rspamd_ast_priority_cmp (GNode *a, GNode *b)
 {
-	struct rspamd_expression_elt *ea = a->data, *eb = b->data;
+	struct rspamd_expression_elt *ea = a->data, *eb = b->data, *par;
 	gdouble w1, w2;
 
 	if (ea->type == ELT_LIMIT) {
@@ -504,28 +601,35 @@ rspamd_ast_priority_cmp (GNode *a, GNode *b)
 		return 1;
 	}
 
-	/* Special logic for atoms */
-	if (ea->type == ELT_ATOM && eb->type == ELT_ATOM &&
-			ea->priority == eb->priority) {
-		w1 = ATOM_PRIORITY (ea);
-		w2 = ATOM_PRIORITY (eb);
+	par = a->parent->data;
 
-		ea->p.atom->hits = 0;
-		ea->p.atom->avg_ticks = 0.0;
+	/* Use measured costs and hit rates if we have them for both branches */
+	if (ea->cost >= 0 && eb->cost >= 0) {
+		w1 = rspamd_ast_short_circuit_rank (ea, par->p.op);
+		w2 = rspamd_ast_short_circuit_rank (eb, par->p.op);
 
-		return w1 - w2;
-	}
-	else {
-		return ea->priority - eb->priority;
+		if (w1 < w2) {
+			return -1;
+		}
+		else if (w1 > w2) {
+			return 1;
+		}
 	}
+
+	return ea->priority - eb->priority;
 }
 
 static gboolean
 rspamd_ast_resort_traverse (GNode *node, gpointer unused)
 {
 	GNode *children, *last;
+	struct rspamd_expression_elt *elt = node->data;
 
 	if (node->children) {
+		if (elt->p.op == OP_NOT) {
+			/* Nothing to sort */
+			return FALSE;
+		}
 
 		children = node->children;
 		last = g_node_last_sibling (children);
@@ -540,6 +644,168 @@ rspamd_ast_resort_traverse (GNode *node, gpointer unused)
 	return FALSE;
 }
 
+static void
+rspamd_expr_emit (struct rspamd_expression *expr,
+		enum rspamd_expression_opcode opcode,
+		enum rspamd_expression_op op,
+		gint arg,
+		struct rspamd_expression_elt *elt,
+		guint *depth)
+{
+	struct rspamd_expression_insn insn;
+
+	insn.opcode = opcode;
+	insn.op = op;
+	insn.arg = arg;
+	insn.target = 0;
+	insn.elt = elt;
+	g_array_append_val (expr->code, insn);
+
+	switch (opcode) {
+	case EXPR_OPCODE_ATOM:
+	case EXPR_OPCODE_PUSH:
+		(*depth) ++;
+		break;
+	case EXPR_OPCODE_APPLY:
+		(*depth) --;
+		break;
+	default:
+		break;
+	}
+
+	if (*depth > expr->max_stack) {
+		expr->max_stack = *depth;
+	}
+}
+
+static void
+rspamd_expr_compile_node (struct rspamd_expression *expr, GNode *node,
+		guint *depth)
+{
+	struct rspamd_expression_elt *elt = node->data, *celt, *parelt = NULL;
+	struct rspamd_expression_insn *insn;
+	enum rspamd_expression_op jump_op = OP_INVALID;
+	GNode *cld;
+	GArray *jumps;
+	gint lim = G_MININT;
+	guint i, nops = 0;
+
+	switch (elt->type) {
+	case ELT_ATOM:
+		rspamd_expr_emit (expr, EXPR_OPCODE_ATOM, OP_INVALID, 0, elt, depth);
+		break;
+	case ELT_LIMIT:
+		rspamd_expr_emit (expr, EXPR_OPCODE_PUSH, OP_INVALID, elt->p.lim.val,
+				NULL, depth);
+		break;
+	case ELT_OP:
+		/* Try to find limit at the parent node */
+		if (node->parent) {
+			parelt = node->parent->data;
+			celt = node->parent->children->data;
+
+			if (celt->type == ELT_LIMIT) {
+				lim = celt->p.lim.val;
+			}
+		}
+
+		/* Limits are always sorted first */
+		DL_FOREACH (node->children, cld) {
+			celt = cld->data;
+
+			if (celt->type == ELT_LIMIT) {
+				lim = celt->p.lim.val;
+			}
+		}
+
+		switch (elt->p.op) {
+		case OP_AND:
+		case OP_MULT:
+			jump_op = OP_AND;
+			break;
+		case OP_OR:
+			jump_op = OP_OR;
+			break;
+		case OP_PLUS:
+			/* Sum could be final only if it is compared using `>` or `>=` */
+			if (parelt && lim > 0 &&
+					(parelt->p.op == OP_GE || parelt->p.op == OP_GT)) {
+				jump_op = parelt->p.op;
+			}
+			break;
+		default:
+			break;
+		}
+
+		jumps = g_array_new (FALSE, FALSE, sizeof (guint));
+
+		DL_FOREACH (node->children, cld) {
+			celt = cld->data;
+
+			if (celt->type == ELT_LIMIT) {
+				continue;
+			}
+
+			rspamd_expr_compile_node (expr, cld, depth);
+
+			if (nops == 0) {
+				/* Logic operations and sum have no effect on the first operand */
+				if (elt->p.op == OP_NOT ||
+						(elt->p.op >= OP_LT && elt->p.op <= OP_GE)) {
+					rspamd_expr_emit (expr, EXPR_OPCODE_FIRST, elt->p.op,
+							lim, NULL, depth);
+				}
+			}
+			else {
+				rspamd_expr_emit (expr, EXPR_OPCODE_APPLY, elt->p.op,
+						lim, NULL, depth);
+			}
+
+			nops ++;
+
+			if (jump_op != OP_INVALID && cld->next != NULL) {
+				g_array_append_val (jumps, expr->code->len);
+				rspamd_expr_emit (expr, EXPR_OPCODE_JUMP, jump_op,
+						lim, NULL, depth);
+			}
+		}
+
+		if (nops == 0) {
+			rspamd_expr_emit (expr, EXPR_OPCODE_PUSH, OP_INVALID, G_MININT,
+					NULL, depth);
+		}
+
+		/* Patch forward jumps to the end of this node */
+		for (i = 0; i < jumps->len; i ++) {
+			insn = &g_array_index (expr->code, struct rspamd_expression_insn,
+					g_array_index (jumps, guint, i));
+			insn->target = expr->code->len;
+		}
+
+		g_array_free (jumps, TRUE);
+		break;
+	}
+}
+
+static void
+rspamd_expr_compile (struct rspamd_expression *expr)
+{
+	guint depth = 0;
+
+	if (expr->code == NULL) {
+		expr->code = g_array_sized_new (FALSE, FALSE,
+				sizeof (struct rspamd_expression_insn),
+				expr->expressions->len * 2);
+	}
+	else {
+		g_array_set_size (expr->code, 0);
+	}
+
+	expr->max_stack = 0;
+	rspamd_expr_compile_node (expr, expr->ast, &depth);
+	g_assert (depth == 1);
+}
+
 static struct rspamd_expression_elt *
 rspamd_expr_dup_elt (rspamd_mempool_t *pool, struct rspamd_expression_elt *elt)
 {
@@ -590,6 +856,8 @@ rspamd_parse_expression (const gchar *line, gsize len,
 			sizeof (struct rspamd_expression_elt));
 	operand_stack = g_ptr_array_sized_new (32);
 	e->ast = NULL;
+	e->code = NULL;
+	e->max_stack = 0;
 	e->expression_stack = g_ptr_array_sized_new (32);
 	e->subr = subr;
 	e->evals = 0;
@@ -844,6 +1112,8 @@ rspamd_parse_expression (const gchar *line, gsize len,
 	g_node_traverse (e->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 			rspamd_ast_resort_traverse, NULL);
 
+	rspamd_expr_compile (e);
+
 	if (target) {
 		*target = e;
 		rspamd_mempool_add_destructor (pool,
@@ -991,6 +1261,7 @@ rspamd_ast_process_node (struct rspamd_expression *expr, gint flags, GNode *node
 			}
 
 			elt->value = expr->subr->process (data, elt->p.atom);
+			elt->evals ++;
 
 			if (elt->value) {
 				elt->p.atom->hits ++;
@@ -1070,6 +1341,159 @@ rspamd_ast_cleanup_traverse (GNode *n, gpointer d)
 	return FALSE;
 }
 
+static inline gboolean
+rspamd_expr_code_is_final (enum rspamd_expression_op op, gint acc, gint lim)
+{
+	switch (op) {
+	case OP_AND:
+		return !acc;
+	case OP_OR:
+		return !!acc;
+	case OP_GE:
+		return acc >= lim;
+	case OP_GT:
+		return acc > lim;
+	default:
+		break;
+	}
+
+	return FALSE;
+}
+
+static gint
+rspamd_expr_code_process (struct rspamd_expression *expr, gint flags,
+		gpointer data, GPtrArray *track)
+{
+	struct rspamd_expression_insn *insn, *code;
+	struct rspamd_expression_elt *elt;
+	gint *stack, sp = 0, val;
+	guint ip = 0, ncode;
+	gdouble t1, t2;
+	gboolean calc_ticks;
+
+	code = (struct rspamd_expression_insn *)expr->code->data;
+	ncode = expr->code->len;
+	stack = g_alloca (sizeof (gint) * (expr->max_stack + 1));
+
+	while (ip < ncode) {
+		insn = &code[ip];
+
+		switch (insn->opcode) {
+		case EXPR_OPCODE_ATOM:
+			elt = insn->elt;
+			/*
+			 * Sometimes get ticks for this atom. 'Sometimes' here means
+			 * that we get lowest 5 bits of the counter `evals` and 5 bits
+			 * of the instruction pointer to provide some sort of jittering
+			 */
+			calc_ticks = ((expr->evals & 0x1F) == (ip & 0x1F));
+
+			if (calc_ticks) {
+				t1 = rspamd_get_ticks ();
+			}
+
+			val = expr->subr->process (data, elt->p.atom);
+			elt->evals ++;
+
+			if (val) {
+				elt->p.atom->hits ++;
+
+				if (track) {
+					g_ptr_array_add (track, elt->p.atom);
+				}
+			}
+
+			if (calc_ticks) {
+				t2 = rspamd_get_ticks ();
+
+				if (elt->p.atom->avg_ticks > 0) {
+					elt->p.atom->avg_ticks += ((t2 - t1) -
+							elt->p.atom->avg_ticks) / 8.0;
+				}
+				else {
+					elt->p.atom->avg_ticks = t2 - t1;
+				}
+			}
+
+			stack[sp ++] = val;
+			break;
+		case EXPR_OPCODE_PUSH:
+			stack[sp ++] = insn->arg;
+			break;
+		case EXPR_OPCODE_FIRST:
+			val = stack[sp - 1];
+
+			switch (insn->op) {
+			case OP_NOT:
+				val = !val;
+				break;
+			case OP_GE:
+				val = val >= insn->arg;
+				break;
+			case OP_GT:
+				val = val > insn->arg;
+				break;
+			case OP_LE:
+				val = val <= insn->arg;
+				break;
+			case OP_LT:
+				val = val < insn->arg;
+				break;
+			default:
+				break;
+			}
+
+			stack[sp - 1] = val;
+			break;
+		case EXPR_OPCODE_APPLY:
+			val = stack[-- sp];
+
+			switch (insn->op) {
+			case OP_PLUS:
+				stack[sp - 1] += val;
+				break;
+			case OP_AND:
+			case OP_MULT:
+				stack[sp - 1] = stack[sp - 1] && val;
+				break;
+			case OP_OR:
+				stack[sp - 1] = stack[sp - 1] || val;
+				break;
+			case OP_GE:
+				stack[sp - 1] = stack[sp - 1] >= insn->arg;
+				break;
+			case OP_GT:
+				stack[sp - 1] = stack[sp - 1] > insn->arg;
+				break;
+			case OP_LE:
+				stack[sp - 1] = stack[sp - 1] <= insn->arg;
+				break;
+			case OP_LT:
+				stack[sp - 1] = stack[sp - 1] < insn->arg;
+				break;
+			default:
+				g_assert (0);
+				break;
+			}
+			break;
+		case EXPR_OPCODE_JUMP:
+			if (!(flags & RSPAMD_EXPRESSION_FLAG_NOOPT) &&
+					rspamd_expr_code_is_final (insn->op, stack[sp - 1],
+							insn->arg)) {
+				ip = insn->target;
+				continue;
+			}
+			break;
+		}
+
+		ip ++;
+	}
+
+	g_assert (sp == 1);
+
+	return stack[0];
+}
+
 gint
 rspamd_process_expression_track (struct rspamd_expression *expr, gint flags,
 		gpointer data, GPtrArray *track)
@@ -1080,18 +1504,23 @@ rspamd_process_expression_track (struct rspamd_expression *expr, gint flags,
 	/* Ensure that stack is empty at this point */
 	g_assert (expr->expression_stack->len == 0);
 
-	ret = rspamd_ast_process_node (expr, flags, expr->ast, data, track);
+	if (flags & RSPAMD_EXPRESSION_FLAG_AST) {
+		ret = rspamd_ast_process_node (expr, flags, expr->ast, data, track);
 
-	/* Cleanup */
-	g_node_traverse (expr->ast, G_IN_ORDER, G_TRAVERSE_ALL, -1,
-			rspamd_ast_cleanup_traverse, NULL);
+		/* Cleanup */
+		g_node_traverse (expr->ast, G_IN_ORDER, G_TRAVERSE_ALL, -1,
+				rspamd_ast_cleanup_traverse, NULL);
+	}
+	else {
+		ret = rspamd_expr_code_process (expr, flags, data, track);
+	}
 
 	expr->evals ++;
 
 	/* Check if we need to resort */
 	if (expr->evals == expr->next_resort) {
-		expr->next_resort = ottery_rand_range (MAX_RESORT_EVALS) +
-				MIN_RESORT_EVALS;
+		expr->next_resort = expr->evals +
+				ottery_rand_range (MAX_RESORT_EVALS) + MIN_RESORT_EVALS;
 		/* Set priorities for branches */
 		g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_ALL, -1,
 				rspamd_ast_priority_traverse, expr);
@@ -1099,6 +1528,9 @@ rspamd_process_expression_track (struct rspamd_expression *expr, gint flags,
 		/* Now set less expensive branches to be evaluated first */
 		g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 				rspamd_ast_resort_traverse, NULL);
+
+		/* And regenerate code according to the new order */
+		rspamd_expr_compile (expr);
 	}
 
 	return ret;
@@ -1201,6 +1633,25 @@ rspamd_expression_atom_foreach (struct rspamd_expression *expr,
 			rspamd_ast_atom_traverse, &data);
 }
 
+void
+rspamd_expression_atom_struct_foreach (struct rspamd_expression *expr,
+		rspamd_expression_atom_struct_cb cb, gpointer cbdata)
+{
+	struct rspamd_expression_elt *elt;
+	guint i;
+
+	g_assert (expr != NULL);
+
+	for (i = 0; i < expr->expressions->len; i ++) {
+		elt = &g_array_index (expr->expressions,
+				struct rspamd_expression_elt, i);
+
+		if (elt->type == ELT_ATOM) {
+			cb (elt->p.atom, cbdata);
+		}
+	}
+}
+
 gboolean
 rspamd_expression_node_is_op (GNode *node, enum rspamd_expression_op op)
 {
@@ -23,6 +23,8 @@
 #define RSPAMD_EXPRESSION_MAX_PRIORITY 1024
 
 #define RSPAMD_EXPRESSION_FLAG_NOOPT (1 << 0)
+/* Walk AST instead of the compiled code (slower, for debugging and benchmarks) */
+#define RSPAMD_EXPRESSION_FLAG_AST (1 << 1)
 
 enum rspamd_expression_op {
 	OP_INVALID = 0,
@@ -129,6 +131,23 @@ typedef void (*rspamd_expression_atom_foreach_cb) (const rspamd_ftok_t *atom,
 void rspamd_expression_atom_foreach (struct rspamd_expression *expr,
 		rspamd_expression_atom_foreach_cb cb, gpointer cbdata);
 
+/**
+ * Callback that is called on @see rspamd_expression_atom_struct_foreach, unlike
+ * @see rspamd_expression_atom_foreach_cb it receives the atom structure itself,
+ * so callers can precompile or annotate atoms' opaque data
+ */
+typedef void (*rspamd_expression_atom_struct_cb) (rspamd_expression_atom_t *atom,
+		gpointer ud);
+
+/**
+ * Traverse over all atom structures in the expression
+ * @param expr expression
+ * @param cb callback to be called
+ * @param ud opaque data passed to `cb`
+ */
+void rspamd_expression_atom_struct_foreach (struct rspamd_expression *expr,
+		rspamd_expression_atom_struct_cb cb, gpointer cbdata);
+
 /**
  * Checks if a specified node in AST is the specified operation
  * @param node AST node packed in GNode container
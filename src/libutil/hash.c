@@ -16,71 +16,161 @@
 #include "config.h"
 #include "hash.h"
 #include "util.h"
+#include "cryptobox.h"
 
 /**
  * LRU hashing
+ *
+ * Elements are stored inline in an open addressing table with linear probing,
+ * eviction uses CLOCK algorithm with a small usage counter: the hand sweeps
+ * over the slots decrementing counters and evicts the first element whose
+ * counter is zero or whose ttl has expired
  */
 
-static const guint expire_aggressive_count = 10;
+/* Maximum value of usage counter */
+static const guint8 lru_max_usages = 3;
+static const guint lru_min_size = 16;
+
+struct rspamd_lru_element_s {
+	gpointer key;
+	gpointer data;
+	time_t storage;
+	guint32 hv;
+	guint ttl;
+	guint8 used;
+	guint8 usages;
+};
+
+typedef struct rspamd_lru_element_s rspamd_lru_element_t;
 
 struct rspamd_lru_hash_s {
 	guint maxsize;
+	guint nelts;
+	guint mask;
+	guint hand;
 	GDestroyNotify value_destroy;
 	GDestroyNotify key_destroy;
-	struct rspamd_min_heap *heap;
-	GHashTable *tbl;
+	GHashFunc hfunc;
+	GEqualFunc eqfunc;
+	rspamd_lru_element_t *elts;
 };
 
+static inline gboolean
+rspamd_lru_expired (rspamd_lru_element_t *elt, time_t now)
+{
+	return elt->ttl != 0 && ((guint)now) - elt->storage > elt->ttl;
+}
+
 static void
-rspamd_lru_destroy_node (gpointer value)
+rspamd_lru_destroy_node (rspamd_lru_hash_t *hash, rspamd_lru_element_t *elt)
 {
-	rspamd_lru_element_t *elt = (rspamd_lru_element_t *)value;
+	if (hash->key_destroy) {
+		hash->key_destroy (elt->key);
+	}
+	if (hash->value_destroy) {
+		hash->value_destroy (elt->data);
+	}
+}
+
+static rspamd_lru_element_t *
+rspamd_lru_hash_find (rspamd_lru_hash_t *hash, gconstpointer key, guint32 hv)
+{
+	rspamd_lru_element_t *elt;
+	guint i;
+
+	for (i = hv & hash->mask; ; i = (i + 1) & hash->mask) {
+		elt = &hash->elts[i];
 
-	if (elt) {
-		if (elt->hash && elt->hash->key_destroy) {
-			elt->hash->key_destroy (elt->key);
+		if (!elt->used) {
+			return NULL;
 		}
-		if (elt->hash && elt->hash->value_destroy) {
-			elt->hash->value_destroy (elt->data);
+
+		if (elt->hv == hv && hash->eqfunc (elt->key, key)) {
+			return elt;
 		}
+	}
+}
+
+/*
+ * Removes element moving the following elements of the probe sequence
+ * backwards, so no tombstones are required
+ */
+static void
+rspamd_lru_hash_remove_elt (rspamd_lru_hash_t *hash, rspamd_lru_element_t *elt)
+{
+	guint i, j, k;
+
+	rspamd_lru_destroy_node (hash, elt);
+	i = elt - hash->elts;
+	j = i;
+
+	for (;;) {
+		j = (j + 1) & hash->mask;
+
+		if (!hash->elts[j].used) {
+			break;
+		}
+
+		k = hash->elts[j].hv & hash->mask;
 
-		g_slice_free1 (sizeof (*elt), elt);
+		/* Move element if its ideal position is not in (i, j] */
+		if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+			hash->elts[i] = hash->elts[j];
+			i = j;
+		}
 	}
+
+	hash->elts[i].used = 0;
+	hash->nelts --;
 }
 
-static inline guint
-rspamd_lru_priority (guint ttl, guint usages)
+static void
+rspamd_lru_hash_resize (rspamd_lru_hash_t *hash, guint nsize)
 {
-	/* 1 day */
-	static const  guint max_ttl = 3600 * 24;
+	rspamd_lru_element_t *old = hash->elts, *elt;
+	guint i, j, osize = hash->mask + 1;
+
+	hash->elts = g_malloc0 (nsize * sizeof (*hash->elts));
+	hash->mask = nsize - 1;
+	hash->hand = 0;
 
-	if (ttl > 0 && usages > 0) {
-		return G_MAXUINT / (MIN (max_ttl, ttl) * usages);
+	for (i = 0; i < osize; i ++) {
+		if (old[i].used) {
+			for (j = old[i].hv & hash->mask; ; j = (j + 1) & hash->mask) {
+				elt = &hash->elts[j];
+
+				if (!elt->used) {
+					*elt = old[i];
+					break;
+				}
+			}
+		}
 	}
 
-	return G_MAXUINT;
+	g_free (old);
 }
 
-static rspamd_lru_element_t *
-rspamd_lru_create_node (rspamd_lru_hash_t *hash,
-	gpointer key,
-	gpointer value,
-	time_t now,
-	guint ttl)
+/* Evicts a single element using CLOCK algorithm */
+static void
+rspamd_lru_hash_evict (rspamd_lru_hash_t *hash, time_t now)
 {
-	rspamd_lru_element_t *node;
+	rspamd_lru_element_t *elt;
+
+	for (;;) {
+		elt = &hash->elts[hash->hand];
 
-	node = g_slice_alloc (sizeof (rspamd_lru_element_t));
-	node->data = value;
-	node->key = key;
-	node->ttl = ttl;
-	node->helt.pri = now;
-	node->hash = hash;
-	node->usages = 1;
-	node->storage = now;
-	node->helt.pri = rspamd_lru_priority (ttl, 1);
+		if (elt->used) {
+			if (elt->usages == 0 || rspamd_lru_expired (elt, now)) {
+				/* Hand now points to the next element moved to this slot */
+				rspamd_lru_hash_remove_elt (hash, elt);
+				return;
+			}
+
+			elt->usages --;
+		}
 
-	return node;
+		hash->hand = (hash->hand + 1) & hash->mask;
+	}
 }
 
 rspamd_lru_hash_t *
@@ -92,13 +182,16 @@ rspamd_lru_hash_new_full (
 	GEqualFunc cmpf)
 {
 	rspamd_lru_hash_t *new;
+	guint size = lru_min_size;
 
-	new = g_slice_alloc (sizeof (rspamd_lru_hash_t));
-	new->tbl = g_hash_table_new_full (hf, cmpf, NULL, rspamd_lru_destroy_node);
-	new->heap = rspamd_min_heap_create (maxsize);
-	new->maxsize = maxsize;
+	new = g_slice_alloc0 (sizeof (rspamd_lru_hash_t));
+	new->maxsize = MAX (maxsize, 0);
 	new->value_destroy = value_destroy;
 	new->key_destroy = key_destroy;
+	new->hfunc = hf;
+	new->eqfunc = cmpf;
+	new->elts = g_malloc0 (size * sizeof (*new->elts));
+	new->mask = size - 1;
 
 	return new;
 }
@@ -119,18 +212,17 @@ rspamd_lru_hash_lookup (rspamd_lru_hash_t *hash, gconstpointer key, time_t now)
 {
 	rspamd_lru_element_t *res;
 
-	res = g_hash_table_lookup (hash->tbl, key);
+	res = rspamd_lru_hash_find (hash, key, hash->hfunc (key));
+
 	if (res != NULL) {
-		if (res->ttl != 0) {
-			if (((guint)now) - res->storage > res->ttl) {
-				rspamd_min_heap_remove_elt (hash->heap, &res->helt);
-				g_hash_table_remove (hash->tbl, key);
-				return NULL;
-			}
+		if (rspamd_lru_expired (res, now)) {
+			rspamd_lru_hash_remove_elt (hash, res);
+			return NULL;
 		}
 
-		rspamd_min_heap_update_elt (hash->heap, &res->helt,
-				rspamd_lru_priority (res->ttl, ++res->usages));
+		if (res->usages < lru_max_usages) {
+			res->usages ++;
+		}
 
 		return res->data;
 	}
@@ -143,47 +235,244 @@ rspamd_lru_hash_insert (rspamd_lru_hash_t *hash, gpointer key, gpointer value,
 	time_t now, guint ttl)
 {
 	rspamd_lru_element_t *res;
+	guint32 hv;
 	guint i;
 
-	res = g_hash_table_lookup (hash->tbl, key);
+	hv = hash->hfunc (key);
+	res = rspamd_lru_hash_find (hash, key, hv);
 
 	if (res != NULL) {
-		rspamd_min_heap_remove_elt (hash->heap, &res->helt);
-		g_hash_table_remove (hash->tbl, key);
+		rspamd_lru_hash_remove_elt (hash, res);
+	}
+	else if (hash->maxsize > 0 && hash->nelts >= hash->maxsize) {
+		rspamd_lru_hash_evict (hash, now);
 	}
-	else {
-		if (hash->maxsize > 0 &&
-				g_hash_table_size (hash->tbl) >= hash->maxsize) {
 
-			for (i = 0; i < MIN (hash->maxsize, expire_aggressive_count); i ++) {
-				res = (rspamd_lru_element_t *)rspamd_min_heap_pop (hash->heap);
+	/* Keep load factor below 3/4 */
+	if ((hash->nelts + 1) * 4 > (hash->mask + 1) * 3) {
+		rspamd_lru_hash_resize (hash, (hash->mask + 1) * 2);
+	}
 
-				if (res) {
-					g_hash_table_remove (hash->tbl, res->key);
-				}
-				else {
-					break;
-				}
-			}
+	for (i = hv & hash->mask; ; i = (i + 1) & hash->mask) {
+		res = &hash->elts[i];
+
+		if (!res->used) {
+			break;
 		}
 	}
 
-	res = rspamd_lru_create_node (hash, key, value, now, ttl);
-	g_hash_table_insert (hash->tbl, key, res);
-	rspamd_min_heap_push (hash->heap, &res->helt);
+	res->key = key;
+	res->data = value;
+	res->hv = hv;
+	res->ttl = ttl;
+	res->storage = now;
+	res->usages = 1;
+	res->used = 1;
+	hash->nelts ++;
 }
 
 void
 rspamd_lru_hash_destroy (rspamd_lru_hash_t *hash)
 {
-	rspamd_min_heap_destroy (hash->heap);
-	g_hash_table_unref (hash->tbl);
+	guint i;
+
+	for (i = 0; i <= hash->mask; i ++) {
+		if (hash->elts[i].used) {
+			rspamd_lru_destroy_node (hash, &hash->elts[i]);
+		}
+	}
+
+	g_free (hash->elts);
 	g_slice_free1 (sizeof (rspamd_lru_hash_t), hash);
 }
 
+gint
+rspamd_lru_hash_foreach (rspamd_lru_hash_t *hash, gint it, gpointer *k,
+		gpointer *v)
+{
+	guint i;
+
+	g_assert (it >= 0);
+
+	for (i = it; i <= hash->mask; i ++) {
+		if (hash->elts[i].used) {
+			*k = hash->elts[i].key;
+			*v = hash->elts[i].data;
+
+			return i + 1;
+		}
+	}
+
+	return -1;
+}
+
+guint
+rspamd_lru_hash_size (rspamd_lru_hash_t *hash)
+{
+	return hash->nelts;
+}
+
+/**
+ * Shared cache
+ *
+ * Each slot is protected by a sequence counter: writers make it odd while
+ * updating the slot and readers retry or give up if the counter has been
+ * changed while they copied the value
+ */
+
+struct rspamd_shared_cache_slot {
+	gint seq;
+	guint len;
+	guint64 hash;
+	time_t expire;
+	guchar data[];
+};
+
+struct rspamd_shared_cache_s {
+	guint nslots;
+	gsize max_value;
+	gsize slot_size;
+	guint64 seed;
+	guchar *slots;
+};
+
+static inline struct rspamd_shared_cache_slot *
+rspamd_shared_cache_slot (rspamd_shared_cache_t *cache, guint idx)
+{
+	return (struct rspamd_shared_cache_slot *)(cache->slots +
+			(gsize)idx * cache->slot_size);
+}
+
+rspamd_shared_cache_t *
+rspamd_shared_cache_new (rspamd_mempool_t *pool, guint nslots, gsize max_value)
+{
+	rspamd_shared_cache_t *cache;
+
+	g_assert (pool != NULL);
+	g_assert (nslots > 0);
+
+	/* Slots are checked in pairs */
+	nslots = (nslots + 1) & ~1u;
+	cache = rspamd_mempool_alloc0_shared (pool, sizeof (*cache));
+	cache->nslots = nslots;
+	cache->max_value = max_value;
+	cache->slot_size = sizeof (struct rspamd_shared_cache_slot) + max_value;
+	cache->slot_size = (cache->slot_size + 7) & ~7;
+	cache->seed = rspamd_hash_seed ();
+	cache->slots = rspamd_mempool_alloc0_shared (pool,
+			cache->slot_size * nslots);
+
+	return cache;
+}
+
+gssize
+rspamd_shared_cache_lookup (rspamd_shared_cache_t *cache,
+	const gchar *key,
+	gsize keylen,
+	guchar *buf,
+	time_t now,
+	guint *ttl)
+{
+	struct rspamd_shared_cache_slot *slot;
+	guint64 h;
+	guint idx, i, len;
+	gint seq;
+	time_t expire;
+
+	h = rspamd_cryptobox_fast_hash (key, keylen, cache->seed);
+	idx = (h % cache->nslots) & ~1u;
+
+	for (i = idx; i < idx + 2; i ++) {
+		slot = rspamd_shared_cache_slot (cache, i);
+		seq = g_atomic_int_get (&slot->seq);
+
+		if ((seq & 1) || slot->hash != h) {
+			continue;
+		}
+
+		len = slot->len;
+		expire = slot->expire;
+
+		if (len > cache->max_value || expire <= now) {
+			continue;
+		}
+
+		memcpy (buf, slot->data, len);
+
+		if (g_atomic_int_get (&slot->seq) != seq) {
+			/* Slot has been modified while we have been reading it */
+			continue;
+		}
+
+		if (ttl) {
+			*ttl = expire - now;
+		}
+
+		return len;
+	}
+
+	return -1;
+}
+
+gboolean
+rspamd_shared_cache_insert (rspamd_shared_cache_t *cache,
+	const gchar *key,
+	gsize keylen,
+	const guchar *value,
+	gsize len,
+	time_t now,
+	guint ttl)
+{
+	struct rspamd_shared_cache_slot *slot, *s1, *s2;
+	guint64 h;
+	guint idx;
+	gint seq;
+
+	if (len > cache->max_value || ttl == 0) {
+		return FALSE;
+	}
+
+	h = rspamd_cryptobox_fast_hash (key, keylen, cache->seed);
+	idx = (h % cache->nslots) & ~1u;
+	s1 = rspamd_shared_cache_slot (cache, idx);
+	s2 = rspamd_shared_cache_slot (cache, idx + 1);
+
+	/* Prefer the same key, then expired slot, then the slot that expires first */
+	if (s1->hash == h) {
+		slot = s1;
+	}
+	else if (s2->hash == h) {
+		slot = s2;
+	}
+	else if (s1->expire <= now) {
+		slot = s1;
+	}
+	else if (s2->expire <= now) {
+		slot = s2;
+	}
+	else {
+		slot = s1->expire < s2->expire ? s1 : s2;
+	}
+
+	seq = g_atomic_int_get (&slot->seq);
+
+	if ((seq & 1) || !g_atomic_int_compare_and_exchange (&slot->seq,
+			seq, seq + 1)) {
+		/* Another process is writing this slot */
+		return FALSE;
+	}
+
+	slot->hash = h;
+	slot->len = len;
+	slot->expire = now + ttl;
+	memcpy (slot->data, value, len);
+	g_atomic_int_inc (&slot->seq);
+
+	return TRUE;
+}
 
-GHashTable *
-rspamd_lru_hash_get_htable (rspamd_lru_hash_t *hash)
+gsize
+rspamd_shared_cache_max_value (rspamd_shared_cache_t *cache)
 {
-	return hash->tbl;
+	return cache->max_value;
 }
@@ -8,21 +8,11 @@
 #define RSPAMD_HASH_H
 
 #include "config.h"
-#include "heap.h"
+#include "mem_pool.h"
 
 struct rspamd_lru_hash_s;
 typedef struct rspamd_lru_hash_s rspamd_lru_hash_t;
 
-typedef struct rspamd_lru_element_s {
-	struct rspamd_min_heap_elt helt;
-	guint ttl;
-	guint usages;
-	time_t storage;
-	gpointer data;
-	gpointer key;
-	rspamd_lru_hash_t *hash;
-} rspamd_lru_element_t;
-
 
 /**
  * Create new lru hash
@@ -82,9 +72,77 @@ void rspamd_lru_hash_insert (rspamd_lru_hash_t *hash,
 void rspamd_lru_hash_destroy (rspamd_lru_hash_t *hash);
 
 /**
- * Get hash table for this lru hash (use rspamd_lru_element_t as data)
+ * Iterate over elements of lru hash, iteration should start from 0:
+ *
+ * it = 0;
+ * while ((it = rspamd_lru_hash_foreach (hash, it, &k, &v)) != -1) {...}
+ *
+ * Hash must not be modified during iteration
+ * @param hash hash object
+ * @param it current iterator
+ * @param k output key
+ * @param v output value
+ * @return next iterator or -1 if there are no more elements
+ */
+gint rspamd_lru_hash_foreach (rspamd_lru_hash_t *hash, gint it, gpointer *k,
+	gpointer *v);
+
+/**
+ * Returns number of elements in lru hash
+ */
+guint rspamd_lru_hash_size (rspamd_lru_hash_t *hash);
+
+struct rspamd_shared_cache_s;
+typedef struct rspamd_shared_cache_s rspamd_shared_cache_t;
+
+/**
+ * Create new cache in the shared memory. The cache must be created before
+ * forking of the workers, it has fixed number of slots of fixed size and
+ * could be read without locking from all processes
+ * @param pool memory pool used to allocate shared memory
+ * @param nslots number of slots
+ * @param max_value maximum size of a value
+ * @return new cache
+ */
+rspamd_shared_cache_t * rspamd_shared_cache_new (rspamd_mempool_t *pool,
+	guint nslots,
+	gsize max_value);
+
+/**
+ * Copy value from the shared cache
+ * @param cache cache object
+ * @param key key to find
+ * @param keylen length of the key
+ * @param buf output buffer (must be at least `max_value` bytes)
+ * @param now current time
+ * @param ttl output remaining time to live of the value
+ * @return length of value or -1 if the value has not been found
+ */
+gssize rspamd_shared_cache_lookup (rspamd_shared_cache_t *cache,
+	const gchar *key,
+	gsize keylen,
+	guchar *buf,
+	time_t now,
+	guint *ttl);
+
+/**
+ * Insert value to the shared cache. Values that are larger than `max_value`
+ * are not inserted, insertion is also skipped when another process is
+ * writing the same slot
+ * @return TRUE if a value has been inserted
+ */
+gboolean rspamd_shared_cache_insert (rspamd_shared_cache_t *cache,
+	const gchar *key,
+	gsize keylen,
+	const guchar *value,
+	gsize len,
+	time_t now,
+	guint ttl);
+
+/**
+ * Returns maximum size of a value stored in the cache
  */
-GHashTable *rspamd_lru_hash_get_htable (rspamd_lru_hash_t *hash);
+gsize rspamd_shared_cache_max_value (rspamd_shared_cache_t *cache);
 #endif
 
 /*
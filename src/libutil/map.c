@@ -26,6 +26,7 @@
 #include "unix-std.h"
 #include "http_parser.h"
 #include "libutil/regexp.h"
+#include "aio_event.h"
 
 #ifdef WITH_HYPERSCAN
 #include "hs.h"
@@ -59,6 +60,11 @@ static void free_http_cbdata (struct http_callback_data *cbd);
 static void rspamd_map_periodic_callback (gint fd, short what, void *ud);
 static void rspamd_map_schedule_periodic (struct rspamd_map *map, gboolean locked,
 		gboolean initial, gboolean errored);
+static void rspamd_map_feed_data (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic, gchar *in, gsize len);
+static void rspamd_map_apply_content (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic);
+static void rspamd_map_unlink_image (struct rspamd_map *map);
 
 struct rspamd_http_map_cached_cbdata {
 	struct event timeout;
@@ -476,7 +482,7 @@ read_data:
 			goto err;
 		}
 
-		map->read_callback (in, cbd->data_len, &cbd->periodic->cbdata, TRUE);
+		rspamd_map_feed_data (map, cbd->periodic, in, cbd->data_len);
 		msg_info_map ("read map data from %s", cbd->data->host);
 
 		/*
@@ -573,7 +579,7 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 	}
 
 	if (len > 0) {
-		map->read_callback (bytes, len, &periodic->cbdata, TRUE);
+		rspamd_map_feed_data (map, periodic, bytes, len);
 	}
 
 	munmap (bytes, len);
@@ -581,6 +587,91 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 	return TRUE;
 }
 
+static void
+rspamd_map_file_aio_cb (gint fd, gint res, guint64 len, gpointer buf,
+		gpointer ud)
+{
+	struct file_callback_data *cbd = ud;
+	struct rspamd_map *map = cbd->map;
+	struct map_periodic_cbdata *periodic = cbd->periodic;
+
+	close (fd);
+
+	if (res < 0) {
+		msg_err_map ("can't read map %s: %s", cbd->data->filename,
+				strerror (-res));
+		periodic->errored = TRUE;
+	}
+	else if (cbd->bk->is_signed &&
+			!rspamd_map_check_file_sig (cbd->data->filename, map, cbd->bk,
+					cbd->buf, len)) {
+		periodic->errored = TRUE;
+	}
+	else if (len > 0) {
+		rspamd_map_feed_data (map, periodic, cbd->buf, len);
+	}
+
+	g_free (cbd->buf);
+	MAP_RELEASE (cbd->bk, "rspamd_map_backend");
+	g_slice_free1 (sizeof (*cbd), cbd);
+
+	/* Switch to the next backend */
+	periodic->cur_backend ++;
+	rspamd_map_periodic_callback (-1, EV_TIMEOUT, periodic);
+	MAP_RELEASE (periodic, "periodic");
+}
+
+/*
+ * Starts asynchronous reading of map file, returns FALSE if it is not possible
+ * and the file should be read synchronously
+ */
+static gboolean
+read_map_file_async (struct rspamd_map *map, struct file_map_data *data,
+		struct rspamd_map_backend *bk, struct map_periodic_cbdata *periodic)
+{
+	struct file_callback_data *cbd;
+	struct stat st;
+	gint fd;
+
+	if (map->read_callback == NULL || map->fin_callback == NULL) {
+		return FALSE;
+	}
+
+	/* Buffered io is used as direct io requires aligned buffers */
+	if ((fd = open (data->filename, O_RDONLY)) == -1) {
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 || st.st_size == 0) {
+		close (fd);
+
+		return FALSE;
+	}
+
+	cbd = g_slice_alloc0 (sizeof (*cbd));
+	cbd->map = map;
+	cbd->bk = bk;
+	cbd->data = data;
+	cbd->periodic = periodic;
+	cbd->len = st.st_size;
+	cbd->buf = g_malloc (cbd->len);
+	MAP_RETAIN (periodic, "periodic");
+	MAP_RETAIN (bk, "rspamd_map_backend");
+
+	if (rspamd_aio_read (fd, cbd->buf, cbd->len, 0, map->aio,
+			rspamd_map_file_aio_cb, cbd) == -1) {
+		close (fd);
+		g_free (cbd->buf);
+		g_slice_free1 (sizeof (*cbd), cbd);
+		MAP_RELEASE (bk, "rspamd_map_backend");
+		MAP_RELEASE (periodic, "periodic");
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static void
 rspamd_map_periodic_dtor (struct map_periodic_cbdata *periodic)
 {
@@ -591,6 +682,10 @@ rspamd_map_periodic_dtor (struct map_periodic_cbdata *periodic)
 
 	if (periodic->need_modify) {
 		/* We are done */
+		if (periodic->content) {
+			rspamd_map_apply_content (map, periodic);
+		}
+
 		periodic->map->fin_callback (&periodic->cbdata);
 		*periodic->map->user_data = periodic->cbdata.cur_data;
 	}
@@ -598,6 +693,10 @@ rspamd_map_periodic_dtor (struct map_periodic_cbdata *periodic)
 		/* Not modified */
 	}
 
+	if (periodic->content) {
+		g_string_free (periodic->content, TRUE);
+	}
+
 	rspamd_map_schedule_periodic (periodic->map, FALSE, FALSE, FALSE);
 	g_atomic_int_set (periodic->map->locked, 0);
 	g_slice_free1 (sizeof (*periodic), periodic);
@@ -724,7 +823,7 @@ rspamd_map_read_cached (struct rspamd_map *map,
 		return FALSE;
 	}
 
-	map->read_callback (in, map->cache->len, &periodic->cbdata, TRUE);
+	rspamd_map_feed_data (map, periodic, in, map->cache->len);
 	msg_info_map ("read map data from %s (cached)", host);
 	munmap (in, len);
 
@@ -881,6 +980,11 @@ rspamd_map_file_read_callback (gint fd, short what, void *ud)
 
 	msg_info_map ("rereading map file %s", data->filename);
 
+	if (map->aio && read_map_file_async (map, data, bk, periodic)) {
+		/* Processing is continued in rspamd_map_file_aio_cb */
+		return;
+	}
+
 	if (!read_map_file (map, data, bk, periodic)) {
 		periodic->errored = TRUE;
 	}
@@ -944,12 +1048,19 @@ rspamd_map_watch (struct rspamd_config *cfg,
 {
 	GList *cur = cfg->maps;
 	struct rspamd_map *map;
+	struct aio_context *aio = NULL;
+
+	if (cur) {
+		/* File maps are read without blocking of the event loop */
+		aio = rspamd_aio_init (ev_base);
+	}
 
 	/* First of all do synced read of data */
 	while (cur) {
 		map = cur->data;
 		map->ev_base = ev_base;
 		map->r = resolver;
+		map->aio = aio;
 
 		if (!g_atomic_int_compare_and_exchange (map->locked, 0, 1)) {
 			msg_debug_map (
@@ -971,6 +1082,7 @@ rspamd_map_remove_all (struct rspamd_config *cfg)
 	struct rspamd_map *map;
 	GList *cur;
 	struct rspamd_map_backend *bk;
+	struct aio_context *aio = NULL;
 	guint i;
 
 	for (cur = cfg->maps; cur != NULL; cur = g_list_next (cur)) {
@@ -984,8 +1096,38 @@ rspamd_map_remove_all (struct rspamd_config *cfg)
 		if (map->dtor) {
 			map->dtor (map->dtor_data);
 		}
+
+		if (map->prev_content) {
+			g_string_free (map->prev_content, TRUE);
+			map->prev_content = NULL;
+		}
+
+		if (map->prev_lines) {
+			g_array_free (map->prev_lines, TRUE);
+			map->prev_lines = NULL;
+		}
+
+		/*
+		 * Image could be replaced by another process after we have published
+		 * it, and forked children inherit the flag, so check the owner as well
+		 */
+		if (map->image_owner && map->image->owner == getpid () &&
+				g_atomic_int_compare_and_exchange (&map->image->lock, 0, 1)) {
+			if (map->image->owner == getpid ()) {
+				rspamd_map_unlink_image (map);
+			}
+
+			g_atomic_int_set (&map->image->lock, 0);
+		}
+
+		if (map->aio) {
+			/* All maps share the same context */
+			aio = map->aio;
+			map->aio = NULL;
+		}
 	}
 
+	rspamd_aio_destroy (aio);
 	g_list_free (cfg->maps);
 	cfg->maps = NULL;
 }
@@ -1259,6 +1401,8 @@ rspamd_map_add (struct rspamd_config *cfg,
 		rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (gint));
 	map->cache =
 			rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (*map->cache));
+	map->image =
+			rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (*map->image));
 	map->backends = g_ptr_array_sized_new (1);
 	g_ptr_array_add (map->backends, bk);
 	map->name = g_strdup (map_line);
@@ -1307,6 +1451,8 @@ rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 			rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (gint));
 	map->cache =
 				rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (*map->cache));
+	map->image =
+				rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (*map->image));
 	map->backends = g_ptr_array_new ();
 	map->poll_timeout = cfg->map_timeout;
 
@@ -1360,6 +1506,26 @@ rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 			map->poll_timeout = ucl_object_todouble (elt);
 		}
 
+		elt = ucl_object_lookup (obj, "incremental");
+		if (elt && ucl_object_type (elt) == UCL_BOOLEAN) {
+			map->incremental = ucl_object_toboolean (elt);
+		}
+
+		elt = ucl_object_lookup (obj, "engine");
+		if (elt && ucl_object_type (elt) == UCL_STRING) {
+			if (g_ascii_strcasecmp (ucl_object_tostring (elt), "poptrie") == 0) {
+				map->radix_engine = RSPAMD_RADIX_ENGINE_POPTRIE;
+			}
+			else if (g_ascii_strcasecmp (ucl_object_tostring (elt), "btrie") == 0) {
+				map->radix_engine = RSPAMD_RADIX_ENGINE_BTRIE;
+			}
+			else {
+				msg_err_config ("unknown map engine: %s",
+						ucl_object_tostring (elt));
+				goto err;
+			}
+		}
+
 		elt = ucl_object_lookup_any (obj, "upstreams", "url", "urls", NULL);
 		if (elt == NULL) {
 			msg_err_config ("map has no urls to be loaded");
@@ -1789,6 +1955,32 @@ hash_insert_helper (gpointer st, gconstpointer key, gconstpointer value)
 	g_hash_table_replace (ht, k, v);
 }
 
+static void
+hash_remove_helper (gpointer st, gconstpointer key, gconstpointer value)
+{
+	GHashTable *ht = st;
+
+	g_hash_table_remove (ht, key);
+}
+
+static gpointer
+hash_copy_helper (gpointer st)
+{
+	GHashTable *ht = st, *nht;
+	GHashTableIter it;
+	gpointer k, v;
+
+	nht = g_hash_table_new_full (rspamd_strcase_hash, rspamd_strcase_equal,
+			g_free, g_free);
+	g_hash_table_iter_init (&it, ht);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		g_hash_table_insert (nht, g_strdup (k), g_strdup (v));
+	}
+
+	return nht;
+}
+
 /* Helpers */
 gchar *
 rspamd_hosts_read (
@@ -1870,7 +2062,7 @@ rspamd_radix_read (
 	struct rspamd_map *map = data->map;
 
 	if (data->cur_data == NULL) {
-		tree = radix_create_compressed ();
+		tree = radix_create_compressed_engine (map->radix_engine);
 		rpool = radix_get_pool (tree);
 		memcpy (rpool->tag.uid, map->tag, sizeof (rpool->tag.uid));
 		data->cur_data = tree;
@@ -1893,11 +2085,536 @@ rspamd_radix_fin (struct map_cb_data *data)
 		radix_destroy_compressed (data->prev_data);
 	}
 	if (data->cur_data) {
+		/* Do not leave compilation for the first lookup in a task */
+		radix_compile (data->cur_data);
 		msg_info_map ("read radix trie of %z elements: %s",
 				radix_get_size (data->cur_data), radix_get_info (data->cur_data));
 	}
 }
 
+/*
+ * Maps that are parsed once content from all backends is loaded: instead of
+ * parsing the whole content on each reload, incremental maps compare lines of
+ * the new content with lines of the previous one and apply the difference to
+ * a copy of the existing structure
+ */
+struct rspamd_map_delta_ops {
+	insert_func insert;
+	insert_func remove;
+	/* NULL if the structure cannot be copied, so deltas are not supported */
+	gpointer (*copy) (gpointer st);
+	const gchar *default_value;
+};
+
+static gboolean
+rspamd_map_get_delta_ops (struct rspamd_map *map,
+		struct rspamd_map_delta_ops *ops)
+{
+	if (map->read_callback == rspamd_hosts_read) {
+		ops->insert = hash_insert_helper;
+		ops->remove = hash_remove_helper;
+		ops->copy = hash_copy_helper;
+		ops->default_value = hash_fill;
+	}
+	else if (map->read_callback == rspamd_kv_list_read) {
+		ops->insert = hash_insert_helper;
+		ops->remove = hash_remove_helper;
+		ops->copy = hash_copy_helper;
+		ops->default_value = "";
+	}
+	else if (map->read_callback == rspamd_radix_read) {
+		/* Content is still needed to share compiled images */
+		ops->insert = radix_tree_insert_helper;
+		ops->remove = NULL;
+		ops->copy = NULL;
+		ops->default_value = hash_fill;
+	}
+	else {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_map_feed_data (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic, gchar *in, gsize len)
+{
+	struct rspamd_map_delta_ops ops;
+
+	if (rspamd_map_get_delta_ops (map, &ops)) {
+		/* Postpone parsing till we have content from all backends */
+		if (periodic->content == NULL) {
+			periodic->content = g_string_sized_new (len + 1);
+		}
+		else {
+			g_string_append_c (periodic->content, '\n');
+		}
+
+		g_string_append_len (periodic->content, in, len);
+	}
+	else {
+		map->read_callback (in, len, &periodic->cbdata, TRUE);
+	}
+}
+
+static gint
+rspamd_map_line_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_map_line *l1 = a, *l2 = b;
+
+	if (l1->hash < l2->hash) {
+		return -1;
+	}
+	else if (l1->hash > l2->hash) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static GArray *
+rspamd_map_index_lines (GString *content)
+{
+	GArray *lines;
+	struct rspamd_map_line line;
+	const gchar *p, *end, *c;
+
+	lines = g_array_new (FALSE, FALSE, sizeof (struct rspamd_map_line));
+	p = content->str;
+	end = p + content->len;
+
+	while (p < end) {
+		c = p;
+
+		while (p < end && *p != '\n' && *p != '\r') {
+			p ++;
+		}
+
+		line.off = c - content->str;
+		line.len = p - c;
+
+		/* Trim spaces */
+		while (line.len > 0 && g_ascii_isspace (content->str[line.off])) {
+			line.off ++;
+			line.len --;
+		}
+
+		while (line.len > 0 &&
+				g_ascii_isspace (content->str[line.off + line.len - 1])) {
+			line.len --;
+		}
+
+		if (line.len > 0) {
+			line.hash = rspamd_cryptobox_fast_hash (content->str + line.off,
+					line.len, rspamd_hash_seed ());
+			g_array_append_val (lines, line);
+		}
+
+		while (p < end && (*p == '\n' || *p == '\r')) {
+			p ++;
+		}
+	}
+
+	g_array_sort (lines, rspamd_map_line_cmp);
+
+	return lines;
+}
+
+static gint
+rspamd_map_key_hash_cmp (gconstpointer a, gconstpointer b)
+{
+	const guint *h1 = a, *h2 = b;
+
+	if (*h1 < *h2) {
+		return -1;
+	}
+	else if (*h1 > *h2) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Elements are removed by key, so if some key is defined by several lines,
+ * removal of one of them would drop the key defined by the others as well.
+ * We detect such content and do not apply deltas to it. Keys are compared
+ * case insensitively just like in the hash maps, collisions of hashes are
+ * harmless as they merely cause a full rebuild
+ */
+static gboolean
+rspamd_map_has_duplicate_keys (GString *content, GArray *lines)
+{
+	struct rspamd_map_line *line;
+	rspamd_ftok_t tok;
+	GArray *keys;
+	const gchar *p, *end;
+	guint i, h;
+	gboolean ret = FALSE;
+
+	keys = g_array_sized_new (FALSE, FALSE, sizeof (guint), lines->len);
+
+	for (i = 0; i < lines->len; i ++) {
+		line = &g_array_index (lines, struct rspamd_map_line, i);
+		p = content->str + line->off;
+		end = p + line->len;
+
+		if (*p == '"') {
+			p ++;
+		}
+
+		tok.begin = p;
+
+		while (p < end && !g_ascii_isspace (*p) && *p != '#' && *p != '"') {
+			p ++;
+		}
+
+		tok.len = p - tok.begin;
+
+		if (tok.len > 0) {
+			h = rspamd_ftok_icase_hash (&tok);
+			g_array_append_val (keys, h);
+		}
+	}
+
+	g_array_sort (keys, rspamd_map_key_hash_cmp);
+
+	for (i = 1; i < keys->len; i ++) {
+		if (g_array_index (keys, guint, i) == g_array_index (keys, guint, i - 1)) {
+			ret = TRUE;
+			break;
+		}
+	}
+
+	g_array_free (keys, TRUE);
+
+	return ret;
+}
+
+static void
+rspamd_map_delta_append (GString *out, GString *content,
+		struct rspamd_map_line *line)
+{
+	g_string_append_len (out, content->str + line->off, line->len);
+	g_string_append_c (out, '\n');
+}
+
+static void
+rspamd_map_delta_apply (struct map_cb_data *cbdata, GString *delta,
+		insert_func func, const gchar *default_value)
+{
+	if (delta->len > 0) {
+		cbdata->state = 0;
+		rspamd_parse_kv_list (delta->str, delta->len, cbdata, func,
+				default_value, TRUE);
+	}
+}
+
+/* Seed must be the same in all processes to compare images */
+#define RSPAMD_MAP_IMAGE_SEED 0x6d61705f696d6167ULL
+
+static void
+rspamd_map_unlink_image (struct rspamd_map *map)
+{
+	if (map->image->shmem_name[0] != '\0') {
+#ifdef HAVE_SANE_SHMEM
+		shm_unlink (map->image->shmem_name);
+#else
+		unlink (map->image->shmem_name);
+#endif
+		map->image->shmem_name[0] = '\0';
+		map->image->len = 0;
+		map->image->hash = 0;
+		map->image->owner = 0;
+	}
+
+	map->image_owner = FALSE;
+}
+
+/*
+ * Map the current shared image, must be called with the image lock held
+ */
+static radix_compressed_t *
+rspamd_map_image_tree (struct rspamd_map *map)
+{
+	radix_compressed_t *tree;
+	rspamd_mempool_t *rpool;
+	guchar *data;
+	gsize len;
+
+	data = rspamd_shmem_xmap (map->image->shmem_name, PROT_READ, &len);
+
+	if (data == NULL) {
+		return NULL;
+	}
+
+	tree = radix_create_compressed_flat (data, len, (uintptr_t)hash_fill);
+
+	if (tree == NULL) {
+		munmap (data, len);
+		msg_err_map ("invalid shared image %s", map->image->shmem_name);
+
+		return NULL;
+	}
+
+	rpool = radix_get_pool (tree);
+	memcpy (rpool->tag.uid, map->tag, sizeof (rpool->tag.uid));
+
+	return tree;
+}
+
+/*
+ * Try to attach radix trie compiled by another process for the same content
+ */
+static gboolean
+rspamd_map_attach_image (struct rspamd_map *map, struct map_cb_data *cbdata,
+		guint64 hash)
+{
+	radix_compressed_t *tree;
+	gboolean ret = FALSE;
+
+	if (!g_atomic_int_compare_and_exchange (&map->image->lock, 0, 1)) {
+		/* Image is being updated, build the trie on our own */
+		return FALSE;
+	}
+
+	if (map->image->len > 0 && map->image->hash == hash) {
+		tree = rspamd_map_image_tree (map);
+
+		if (tree) {
+			cbdata->cur_data = tree;
+			/* Image is owned by the process that has published it */
+			map->image_owner = (map->image->owner == getpid ());
+			ret = TRUE;
+			msg_info_map ("attached shared image %s of %z bytes",
+					map->image->shmem_name, map->image->len);
+		}
+	}
+
+	g_atomic_int_set (&map->image->lock, 0);
+
+	return ret;
+}
+
+/*
+ * Store trie as a flat image in the shared memory so other processes can
+ * just map it instead of parsing the same content, and switch to this image
+ */
+static void
+rspamd_map_publish_image (struct rspamd_map *map, struct map_cb_data *cbdata,
+		guint64 hash)
+{
+	radix_compressed_t *tree;
+	guchar *image;
+	gchar shmem_name[sizeof (map->image->shmem_name)];
+	gsize len;
+	gint fd;
+
+	image = radix_serialize_flat (cbdata->cur_data, (uintptr_t)hash_fill,
+			&len);
+
+	if (image == NULL) {
+		return;
+	}
+
+	if (!g_atomic_int_compare_and_exchange (&map->image->lock, 0, 1)) {
+		g_free (image);
+
+		return;
+	}
+
+	if (map->image->len > 0 && map->image->hash == hash) {
+		/* Another process has published the same content while we built it */
+		tree = rspamd_map_image_tree (map);
+
+		if (tree) {
+			radix_destroy_compressed (cbdata->cur_data);
+			cbdata->cur_data = tree;
+			map->image_owner = (map->image->owner == getpid ());
+			msg_info_map ("attached shared image %s of %z bytes",
+					map->image->shmem_name, map->image->len);
+		}
+
+		goto end;
+	}
+
+#ifdef HAVE_SANE_SHMEM
+	rspamd_strlcpy (shmem_name, "/rmi.XXXXXXXXXXXXXXXXXXXX",
+			sizeof (shmem_name));
+	fd = rspamd_shmem_mkstemp (shmem_name);
+#else
+	/* XXX: assume that tempdir is /tmp */
+	rspamd_strlcpy (shmem_name, "/tmp/rmi.XXXXXXXXXXXXXXXXXXXX",
+			sizeof (shmem_name));
+	fd = mkstemp (shmem_name);
+#endif
+
+	if (fd == -1) {
+		msg_err_map ("cannot create shared image: %s", strerror (errno));
+		goto end;
+	}
+
+	if (write (fd, image, len) != (gssize)len) {
+		msg_err_map ("cannot write shared image %s: %s", shmem_name,
+				strerror (errno));
+		close (fd);
+#ifdef HAVE_SANE_SHMEM
+		shm_unlink (shmem_name);
+#else
+		unlink (shmem_name);
+#endif
+		goto end;
+	}
+
+	close (fd);
+
+	/* Processes that have mapped the old image can still use it */
+	rspamd_map_unlink_image (map);
+	rspamd_strlcpy (map->image->shmem_name, shmem_name,
+			sizeof (map->image->shmem_name));
+	map->image->len = len;
+	map->image->hash = hash;
+	map->image->owner = getpid ();
+	map->image_owner = TRUE;
+
+	tree = rspamd_map_image_tree (map);
+
+	if (tree) {
+		radix_destroy_compressed (cbdata->cur_data);
+		cbdata->cur_data = tree;
+	}
+
+	msg_info_map ("published shared image %s of %z bytes", shmem_name, len);
+
+end:
+	g_atomic_int_set (&map->image->lock, 0);
+	g_free (image);
+}
+
+static void
+rspamd_map_apply_content (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic)
+{
+	struct rspamd_map_delta_ops ops;
+	struct rspamd_map_line *ol, *nl;
+	struct map_cb_data *cbdata = &periodic->cbdata;
+	GArray *lines = NULL;
+	GString *added = NULL, *removed = NULL;
+	guint i = 0, j = 0, nadded = 0, nremoved = 0;
+	gboolean full = TRUE, has_ops, incremental, shared = FALSE,
+			dup_keys = FALSE;
+	guint64 hash = 0;
+
+	has_ops = rspamd_map_get_delta_ops (map, &ops);
+	g_assert (has_ops);
+	incremental = map->incremental && ops.copy != NULL;
+
+	if (incremental) {
+		lines = rspamd_map_index_lines (periodic->content);
+		dup_keys = rspamd_map_has_duplicate_keys (periodic->content, lines);
+	}
+
+	if (map->read_callback == rspamd_radix_read &&
+			map->radix_engine == RSPAMD_RADIX_ENGINE_BTRIE) {
+		hash = rspamd_cryptobox_fast_hash (periodic->content->str,
+				periodic->content->len, RSPAMD_MAP_IMAGE_SEED);
+		shared = rspamd_map_attach_image (map, cbdata, hash);
+	}
+
+	if (shared) {
+		full = FALSE;
+	}
+	else if (incremental && cbdata->prev_data != NULL &&
+			map->prev_lines != NULL && !dup_keys && !map->prev_dup_keys) {
+		added = g_string_new (NULL);
+		removed = g_string_new (NULL);
+
+		/* Both arrays are sorted, so we can find difference in a single pass */
+		while (i < map->prev_lines->len || j < lines->len) {
+			ol = i < map->prev_lines->len ?
+					&g_array_index (map->prev_lines, struct rspamd_map_line, i) :
+					NULL;
+			nl = j < lines->len ?
+					&g_array_index (lines, struct rspamd_map_line, j) :
+					NULL;
+
+			if (ol && nl && ol->hash == nl->hash) {
+				i ++;
+				j ++;
+			}
+			else if (nl == NULL || (ol && ol->hash < nl->hash)) {
+				rspamd_map_delta_append (removed, map->prev_content, ol);
+				nremoved ++;
+				i ++;
+			}
+			else {
+				rspamd_map_delta_append (added, periodic->content, nl);
+				nadded ++;
+				j ++;
+			}
+		}
+
+		/*
+		 * It is cheaper to rebuild structure if the most of it has changed
+		 */
+		if (nadded + nremoved <= lines->len / 2) {
+			full = FALSE;
+			/*
+			 * The previous structure is never modified: lookups could still
+			 * use it, so the delta is applied to a copy which is published
+			 * by the same pointer swap as for the full reload
+			 */
+			cbdata->cur_data = ops.copy (cbdata->prev_data);
+
+			if (nremoved > 0) {
+				rspamd_map_delta_apply (cbdata, removed, ops.remove,
+						ops.default_value);
+			}
+
+			rspamd_map_delta_apply (cbdata, added, ops.insert,
+					ops.default_value);
+			msg_info_map ("applied delta to the copy of map: %ud lines added, "
+					"%ud lines removed", nadded, nremoved);
+		}
+		else {
+			msg_debug_map ("cannot apply delta (%ud lines added, %ud removed), "
+					"rebuild map", nadded, nremoved);
+		}
+
+		g_string_free (added, TRUE);
+		g_string_free (removed, TRUE);
+	}
+
+	if (full) {
+		cbdata->state = 0;
+		map->read_callback (periodic->content->str, periodic->content->len,
+				cbdata, TRUE);
+	}
+
+	if (map->read_callback == rspamd_radix_read && !shared &&
+			cbdata->cur_data != NULL &&
+			map->radix_engine == RSPAMD_RADIX_ENGINE_BTRIE) {
+		rspamd_map_publish_image (map, cbdata, hash);
+	}
+
+	if (incremental) {
+		/* Save content to compute the next delta */
+		if (map->prev_content) {
+			g_string_free (map->prev_content, TRUE);
+		}
+
+		if (map->prev_lines) {
+			g_array_free (map->prev_lines, TRUE);
+		}
+
+		map->prev_content = periodic->content;
+		map->prev_lines = lines;
+		map->prev_dup_keys = dup_keys;
+		periodic->content = NULL;
+	}
+}
+
 struct rspamd_regexp_map {
 	struct rspamd_map *map;
 	GPtrArray *regexps;
@@ -21,6 +21,7 @@
 #include "keypair.h"
 #include "unix-std.h"
 #include "ref.h"
+#include "radix.h"
 
 typedef void (*rspamd_map_dtor) (gpointer p);
 
@@ -66,6 +67,19 @@ struct rspamd_map_cachepoint {
 	gchar shmem_name[256];
 };
 
+/**
+ * Compiled image of a map shared between all processes
+ */
+struct rspamd_map_image {
+	gint lock;
+	/* Hash of the source content */
+	guint64 hash;
+	gsize len;
+	/* Process that has published the image */
+	pid_t owner;
+	gchar shmem_name[256];
+};
+
 struct rspamd_map {
 	struct rspamd_dns_resolver *r;
 	struct rspamd_config *cfg;
@@ -87,6 +101,31 @@ struct rspamd_map {
 	gchar tag[MEMPOOL_UID_LEN];
 	rspamd_map_dtor dtor;
 	gpointer dtor_data;
+	/* Apply deltas of content instead of parsing it on each reload */
+	gboolean incremental;
+	/* Content of the last load used to compute deltas of incremental maps */
+	GString *prev_content;
+	/* Array of struct rspamd_map_line sorted by line hash */
+	GArray *prev_lines;
+	/* TRUE if some key is defined by several lines of the previous content */
+	gboolean prev_dup_keys;
+	/* Shared compiled image */
+	struct rspamd_map_image *image;
+	/* TRUE if this process has published the current image */
+	gboolean image_owner;
+	/* Lookup engine for radix maps */
+	enum rspamd_radix_engine radix_engine;
+	/* Asynchronous reading of file maps, shared by all maps of a process */
+	struct aio_context *aio;
+};
+
+/**
+ * Line of map content identified by its hash
+ */
+struct rspamd_map_line {
+	guint64 hash;
+	gsize off;
+	gsize len;
 };
 
 /**
@@ -123,9 +162,20 @@ struct map_periodic_cbdata {
 	gboolean need_modify;
 	gboolean errored;
 	guint cur_backend;
+	/* Accumulated content for maps that support delta updates */
+	GString *content;
 	ref_entry_t ref;
 };
 
+struct file_callback_data {
+	struct rspamd_map *map;
+	struct rspamd_map_backend *bk;
+	struct file_map_data *data;
+	struct map_periodic_cbdata *periodic;
+	guchar *buf;
+	gsize len;
+};
+
 struct http_callback_data {
 	struct event_base *ev_base;
 	struct rspamd_http_connection *conn;
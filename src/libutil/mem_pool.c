@@ -24,6 +24,7 @@
 #ifdef HAVE_SCHED_YIELD
 #include <sched.h>
 #endif
+#include <pthread.h>
 
 /* Sleep time for spin lock in nanoseconds */
 #define MUTEX_SLEEP_TIME 10000000L
@@ -42,8 +43,63 @@
  */
 #undef MEMORY_GREEDY
 
-/* Internal statistic */
+/*
+ * Chains of deleted pools are not freed but cached in the current process to
+ * be reused by new pools, these defines limit the cache. Only pools deleted
+ * and created at about the same time benefit from it, and 16Mb is enough for
+ * tens of typical task chains or a few chains of the maximum size. Anything
+ * above would stay in every worker without being reused
+ */
+#define POOL_CACHE_MAX_CHAINS 64
+#define POOL_CACHE_MAX_BYTES (16 * 1024 * 1024)
+/* Chains larger than this are always freed and sizes hints are limited by it */
+#define POOL_CACHE_MAX_CHAIN_LEN (4 * 1024 * 1024)
+/* Do not use cached chain if it is larger than requested by this factor */
+#define POOL_CACHE_MAX_WASTE 4
+
+struct rspamd_mempool_chain_cache {
+	struct _pool_chain *chains[POOL_CACHE_MAX_CHAINS];
+	guint nchains;
+	gsize bytes;
+};
+
+/*
+ * Typical amount of memory used by pools with some specific tag
+ */
+struct rspamd_mempool_size_hint {
+	gsize size;
+	guint samples;
+};
+
+/*
+ * Statistics are stored in shared memory in a separate slot per process, so
+ * each process updates its own counters only. Slots are aligned to the cache
+ * line size to avoid false sharing. Owner of a slot holds a lock on the byte
+ * of a lock file with the same index: the kernel releases it when the owner
+ * exits, so, unlike pids, locks cannot be confused with another process
+ */
+#define MEMPOOL_STAT_SLOTS 128
+#define MEMPOOL_STAT_TAGS 16
+#define MEMPOOL_STAT_ALIGN 64
+
+struct rspamd_mempool_stat_slot {
+	rspamd_mempool_stat_t st;
+	rspamd_mempool_tag_stat_t tags[MEMPOOL_STAT_TAGS];
+	gint pid;
+};
+
+/* Internal statistic of the current process */
 static rspamd_mempool_stat_t *mem_pool_stat = NULL;
+static struct rspamd_mempool_stat_slot *mem_pool_slot = NULL;
+static guchar *mem_pool_slots = NULL;
+static gsize mem_pool_slot_len = 0;
+static gint mem_pool_slots_fd = -1;
+/* Used if all slots are taken, these counters are not shared */
+static rspamd_mempool_stat_t mem_pool_local_stat;
+/* Per process cache of chains */
+static struct rspamd_mempool_chain_cache chain_cache;
+/* Size hints indexed by pool tag */
+static GHashTable *size_hints = NULL;
 /* Environment variable */
 static gboolean env_checked = FALSE;
 static gboolean always_malloc = FALSE;
@@ -61,6 +117,49 @@ pool_chain_free (struct _pool_chain *chain)
 			chain->len - occupied : 0);
 }
 
+/*
+ * Finds the smallest cached chain that is not less than size
+ */
+static struct _pool_chain *
+rspamd_mempool_chain_cache_get (gsize size)
+{
+	struct _pool_chain *cur, *best = NULL;
+	guint i, best_idx = 0;
+
+	for (i = 0; i < chain_cache.nchains; i ++) {
+		cur = chain_cache.chains[i];
+
+		if (cur->len >= size && cur->len / POOL_CACHE_MAX_WASTE <= size &&
+				(best == NULL || cur->len < best->len)) {
+			best = cur;
+			best_idx = i;
+		}
+	}
+
+	if (best != NULL) {
+		chain_cache.nchains --;
+		chain_cache.chains[best_idx] = chain_cache.chains[chain_cache.nchains];
+		chain_cache.bytes -= best->len;
+	}
+
+	return best;
+}
+
+static gboolean
+rspamd_mempool_chain_cache_put (struct _pool_chain *chain)
+{
+	if (chain->len > POOL_CACHE_MAX_CHAIN_LEN ||
+			chain_cache.nchains >= G_N_ELEMENTS (chain_cache.chains) ||
+			chain_cache.bytes + chain->len > POOL_CACHE_MAX_BYTES) {
+		return FALSE;
+	}
+
+	chain_cache.chains[chain_cache.nchains ++] = chain;
+	chain_cache.bytes += chain->len;
+
+	return TRUE;
+}
+
 static struct _pool_chain *
 rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 {
@@ -107,15 +206,24 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 #else
 #error No mmap methods are defined
 #endif
-		g_atomic_int_inc (&mem_pool_stat->shared_chunks_allocated);
-		g_atomic_int_add (&mem_pool_stat->bytes_allocated, size);
+		mem_pool_stat->shared_chunks_allocated ++;
+		mem_pool_stat->bytes_allocated += size;
 	}
 	else {
-		map = g_slice_alloc (sizeof (struct _pool_chain) + size);
-		chain = map;
-		chain->begin = ((guint8 *) chain) + sizeof (struct _pool_chain);
-		g_atomic_int_add (&mem_pool_stat->bytes_allocated, size);
-		g_atomic_int_inc (&mem_pool_stat->chunks_allocated);
+		chain = rspamd_mempool_chain_cache_get (size);
+
+		if (chain != NULL) {
+			/* Reused chain keeps its real length */
+			size = chain->len;
+		}
+		else {
+			map = g_slice_alloc (sizeof (struct _pool_chain) + size);
+			chain = map;
+			chain->begin = ((guint8 *) chain) + sizeof (struct _pool_chain);
+		}
+
+		mem_pool_stat->bytes_allocated += size;
+		mem_pool_stat->chunks_allocated ++;
 	}
 
 	chain->pos = align_ptr (chain->begin, MEM_ALIGNMENT);
@@ -125,6 +233,279 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 	return chain;
 }
 
+static void
+rspamd_mempool_chain_free (struct _pool_chain *chain,
+		enum rspamd_mempool_chain_type pool_type)
+{
+	gsize len;
+
+	mem_pool_stat->bytes_allocated -= chain->len;
+	mem_pool_stat->chunks_allocated --;
+	mem_pool_stat->chunks_freed ++;
+
+	len = chain->len + sizeof (struct _pool_chain);
+
+	if (pool_type == RSPAMD_MEMPOOL_SHARED) {
+		munmap ((void *)chain, len);
+	}
+	else if (!rspamd_mempool_chain_cache_put (chain)) {
+		g_slice_free1 (len, chain);
+	}
+}
+
+static inline struct rspamd_mempool_stat_slot *
+rspamd_mempool_stat_slot (guint idx)
+{
+	return (struct rspamd_mempool_stat_slot *)(mem_pool_slots +
+			idx * mem_pool_slot_len);
+}
+
+static gint
+rspamd_mempool_stat_slot_fcntl (guint idx, gint cmd, struct flock *fl)
+{
+	memset (fl, 0, sizeof (*fl));
+	fl->l_type = F_WRLCK;
+	fl->l_whence = SEEK_SET;
+	fl->l_start = idx;
+	fl->l_len = 1;
+
+	return fcntl (mem_pool_slots_fd, cmd, fl);
+}
+
+static gboolean
+rspamd_mempool_stat_slot_alive (guint idx)
+{
+	struct rspamd_mempool_stat_slot *slot = rspamd_mempool_stat_slot (idx);
+	struct flock fl;
+
+	if (slot == mem_pool_slot) {
+		/* Our own lock is not reported by F_GETLK */
+		return TRUE;
+	}
+
+	if (g_atomic_int_get (&slot->pid) == 0) {
+		return FALSE;
+	}
+
+	if (rspamd_mempool_stat_slot_fcntl (idx, F_GETLK, &fl) == -1) {
+		return TRUE;
+	}
+
+	return fl.l_type != F_UNLCK;
+}
+
+/*
+ * Finds a free slot or a slot of a dead process. If all slots are taken,
+ * the process counts its statistics in its own memory
+ */
+static void
+rspamd_mempool_stat_claim_slot (void)
+{
+	struct rspamd_mempool_stat_slot *slot;
+	struct flock fl;
+	guint i;
+
+	mem_pool_slot = NULL;
+	memset (&mem_pool_local_stat, 0, sizeof (mem_pool_local_stat));
+	mem_pool_stat = &mem_pool_local_stat;
+
+	if (mem_pool_slots_fd == -1) {
+		return;
+	}
+
+	for (i = 0; i < MEMPOOL_STAT_SLOTS; i ++) {
+		/* Locks are not inherited, so slot of the parent is busy for a child */
+		if (rspamd_mempool_stat_slot_fcntl (i, F_SETLK, &fl) == 0) {
+			slot = rspamd_mempool_stat_slot (i);
+			memset (&slot->st, 0, sizeof (slot->st));
+			memset (slot->tags, 0, sizeof (slot->tags));
+			g_atomic_int_set (&slot->pid, getpid ());
+			mem_pool_slot = slot;
+			mem_pool_stat = &slot->st;
+
+			return;
+		}
+	}
+}
+
+static void
+rspamd_mempool_stat_atfork_child (void)
+{
+	rspamd_mempool_stat_claim_slot ();
+}
+
+static void
+rspamd_mempool_stat_init (void)
+{
+	gpointer map;
+	gsize len;
+	gchar lockname[] = "/tmp/rspamd-mempool.XXXXXX";
+
+	mem_pool_slot_len = sizeof (struct rspamd_mempool_stat_slot);
+	mem_pool_slot_len = (mem_pool_slot_len + MEMPOOL_STAT_ALIGN - 1) &
+			~((gsize)MEMPOOL_STAT_ALIGN - 1);
+	len = mem_pool_slot_len * MEMPOOL_STAT_SLOTS;
+
+#if defined(HAVE_MMAP_ANON)
+	map = mmap (NULL,
+			len,
+			PROT_READ | PROT_WRITE,
+			MAP_ANON | MAP_SHARED,
+			-1,
+			0);
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes, aborting", len);
+		abort ();
+	}
+#elif defined(HAVE_MMAP_ZERO)
+	gint fd;
+
+	fd = open ("/dev/zero", O_RDWR);
+	g_assert (fd != -1);
+	map = mmap (NULL,
+			len,
+			PROT_READ | PROT_WRITE,
+			MAP_SHARED,
+			fd,
+			0);
+	if (map == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes, aborting", len);
+		abort ();
+	}
+	close (fd);
+#else
+#       error No mmap methods are defined
+#endif
+	memset (map, 0, len);
+	mem_pool_slots = map;
+
+	/* XXX: assume that tempdir is /tmp, only locks are used in this file */
+	mem_pool_slots_fd = mkstemp (lockname);
+
+	if (mem_pool_slots_fd != -1) {
+		unlink (lockname);
+	}
+	else {
+		msg_warn ("cannot create lock file for memory statistics: %s",
+				strerror (errno));
+	}
+
+	rspamd_mempool_stat_claim_slot ();
+	/* Children processes must not share slot with their parent */
+	pthread_atfork (NULL, NULL, rspamd_mempool_stat_atfork_child);
+}
+
+/*
+ * Bucket of peak sizes histogram: bucket i is for sizes below
+ * MEMPOOL_PEAK_MIN << i, the last bucket holds all larger sizes
+ */
+static guint
+rspamd_mempool_peak_bucket (gsize size)
+{
+	guint i;
+
+	for (i = 0; i < MEMPOOL_PEAK_BUCKETS - 1; i ++) {
+		if (size < ((gsize)MEMPOOL_PEAK_MIN << i)) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+static void
+rspamd_mempool_stat_peak (const gchar *tag, gsize size)
+{
+	rspamd_mempool_tag_stat_t *tst;
+	guint i;
+
+	if (mem_pool_slot == NULL) {
+		/* Tags are tracked in shared slots only */
+		return;
+	}
+
+	for (i = 0; i < MEMPOOL_STAT_TAGS; i ++) {
+		tst = &mem_pool_slot->tags[i];
+
+		if (tst->tagname[0] == '\0') {
+			rspamd_strlcpy (tst->tagname, tag, sizeof (tst->tagname));
+			break;
+		}
+		else if (strcmp (tst->tagname, tag) == 0) {
+			break;
+		}
+	}
+
+	if (i == MEMPOOL_STAT_TAGS) {
+		/* Too many tags */
+		return;
+	}
+
+	tst->pools ++;
+	tst->peak_hist[rspamd_mempool_peak_bucket (size)] ++;
+}
+
+static struct rspamd_mempool_size_hint *
+rspamd_mempool_get_size_hint (const gchar *tag)
+{
+	struct rspamd_mempool_size_hint *hint;
+
+	if (size_hints == NULL) {
+		size_hints = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+				g_free, g_free);
+	}
+
+	hint = g_hash_table_lookup (size_hints, tag);
+
+	if (hint == NULL) {
+		hint = g_malloc0 (sizeof (*hint));
+		g_hash_table_insert (size_hints, g_strdup (tag), hint);
+	}
+
+	return hint;
+}
+
+/*
+ * Learns memory used by a pool being deleted: hint grows fast to avoid chains
+ * appending and decays slowly so a single small pool does not reset it
+ */
+static void
+rspamd_mempool_update_size_hint (rspamd_mempool_t *pool)
+{
+	struct rspamd_mempool_size_hint *hint = pool->size_hint;
+	struct _pool_chain *cur;
+	GPtrArray *chains;
+	gsize used = 0;
+	guint i;
+
+	chains = pool->pools[RSPAMD_MEMPOOL_NORMAL];
+
+	if (chains == NULL || chains->len == 0) {
+		return;
+	}
+
+	for (i = 0; i < chains->len; i ++) {
+		cur = g_ptr_array_index (chains, i);
+		used += cur->pos - cur->begin;
+	}
+
+	/* Pools never shrink, so it is the peak size of this pool */
+	rspamd_mempool_stat_peak (pool->tag.tagname, used);
+	used = MIN (used, POOL_CACHE_MAX_CHAIN_LEN);
+
+	if (hint->samples == 0) {
+		hint->size = used;
+	}
+	else if (used > hint->size) {
+		hint->size += (used - hint->size) / 2;
+	}
+	else {
+		hint->size -= (hint->size - used) / 8;
+	}
+
+	hint->samples ++;
+}
+
 static void
 rspamd_mempool_create_pool_type (rspamd_mempool_t * pool,
 		enum rspamd_mempool_chain_type pool_type)
@@ -196,48 +577,16 @@ rspamd_mempool_t *
 rspamd_mempool_new (gsize size, const gchar *tag)
 {
 	rspamd_mempool_t *new;
-	gpointer map;
+	struct _pool_chain *chain;
 	unsigned char uidbuf[10];
 	const gchar hexdigits[] = "0123456789abcdef";
 	unsigned i;
+	gsize hint_len;
 
 	g_return_val_if_fail (size > 0, NULL);
 	/* Allocate statistic structure if it is not allocated before */
 	if (mem_pool_stat == NULL) {
-#if defined(HAVE_MMAP_ANON)
-		map = mmap (NULL,
-				sizeof (rspamd_mempool_stat_t),
-				PROT_READ | PROT_WRITE,
-				MAP_ANON | MAP_SHARED,
-				-1,
-				0);
-		if (map == MAP_FAILED) {
-			msg_err ("cannot allocate %z bytes, aborting",
-				sizeof (rspamd_mempool_stat_t));
-			abort ();
-		}
-		mem_pool_stat = (rspamd_mempool_stat_t *)map;
-#elif defined(HAVE_MMAP_ZERO)
-		gint fd;
-
-		fd = open ("/dev/zero", O_RDWR);
-		g_assert (fd != -1);
-		map = mmap (NULL,
-				sizeof (rspamd_mempool_stat_t),
-				PROT_READ | PROT_WRITE,
-				MAP_SHARED,
-				fd,
-				0);
-		if (map == MAP_FAILED) {
-			msg_err ("cannot allocate %z bytes, aborting",
-				sizeof (rspamd_mempool_stat_t));
-			abort ();
-		}
-		mem_pool_stat = (rspamd_mempool_stat_t *)map;
-#else
-#       error No mmap methods are defined
-#endif
-		memset (map, 0, sizeof (rspamd_mempool_stat_t));
+		rspamd_mempool_stat_init ();
 	}
 
 	if (!env_checked) {
@@ -265,6 +614,20 @@ rspamd_mempool_new (gsize size, const gchar *tag)
 		new->tag.tagname[0] = '\0';
 	}
 
+	if (new->tag.tagname[0] != '\0' && !always_malloc) {
+		new->size_hint = rspamd_mempool_get_size_hint (new->tag.tagname);
+
+		if (new->size_hint->size > size) {
+			/* Start with a single chain that fits a typical pool with this tag */
+			hint_len = new->size_hint->size + new->size_hint->size / 8;
+			hint_len = (hint_len / size + 1) * size;
+			hint_len = MIN (hint_len, POOL_CACHE_MAX_CHAIN_LEN - MEM_ALIGNMENT);
+			chain = rspamd_mempool_chain_new (hint_len + MEM_ALIGNMENT,
+					RSPAMD_MEMPOOL_NORMAL);
+			rspamd_mempool_append_chain (new, chain, RSPAMD_MEMPOOL_NORMAL);
+		}
+	}
+
 	/* Generate new uid */
 	ottery_rand_bytes (uidbuf, sizeof (uidbuf));
 	for (i = 0; i < G_N_ELEMENTS (uidbuf); i ++) {
@@ -288,6 +651,8 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
 
 	if (pool) {
 		POOL_MTX_LOCK ();
+		pool->allocated += size;
+
 		if (always_malloc && pool_type != RSPAMD_MEMPOOL_SHARED) {
 			void *ptr;
 
@@ -507,7 +872,6 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 	struct _pool_destructors *destructor;
 	gpointer ptr;
 	guint i, j;
-	gsize len;
 
 	POOL_MTX_LOCK ();
 
@@ -522,22 +886,15 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 
 	g_array_free (pool->destructors, TRUE);
 
+	if (pool->size_hint) {
+		rspamd_mempool_update_size_hint (pool);
+	}
+
 	for (i = 0; i < G_N_ELEMENTS (pool->pools); i ++) {
 		if (pool->pools[i]) {
 			for (j = 0; j < pool->pools[i]->len; j++) {
 				cur = g_ptr_array_index (pool->pools[i], j);
-				g_atomic_int_add (&mem_pool_stat->bytes_allocated,
-						-((gint)cur->len));
-				g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
-
-				len = cur->len + sizeof (struct _pool_chain);
-
-				if (i == RSPAMD_MEMPOOL_SHARED) {
-					munmap ((void *)cur, len);
-				}
-				else {
-					g_slice_free1 (len, cur);
-				}
+				rspamd_mempool_chain_free (cur, i);
 			}
 
 			g_ptr_array_free (pool->pools[i], TRUE);
@@ -557,7 +914,7 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 		g_ptr_array_free (pool->trash_stack, TRUE);
 	}
 
-	g_atomic_int_inc (&mem_pool_stat->pools_freed);
+	mem_pool_stat->pools_freed ++;
 	POOL_MTX_UNLOCK ();
 	g_slice_free (rspamd_mempool_t, pool);
 }
@@ -567,52 +924,157 @@ rspamd_mempool_cleanup_tmp (rspamd_mempool_t * pool)
 {
 	struct _pool_chain *cur;
 	guint i;
-	gsize len;
 
 	POOL_MTX_LOCK ();
 
 	if (pool->pools[RSPAMD_MEMPOOL_TMP]) {
 		for (i = 0; i < pool->pools[RSPAMD_MEMPOOL_TMP]->len; i++) {
 			cur = g_ptr_array_index (pool->pools[RSPAMD_MEMPOOL_TMP], i);
-			g_atomic_int_add (&mem_pool_stat->bytes_allocated,
-					-((gint)cur->len));
-			g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
-			len = cur->len + sizeof (struct _pool_chain);
-
-			g_slice_free1 (len, cur);
+			rspamd_mempool_chain_free (cur, RSPAMD_MEMPOOL_TMP);
 		}
 
 		g_ptr_array_free (pool->pools[RSPAMD_MEMPOOL_TMP], TRUE);
 		pool->pools[RSPAMD_MEMPOOL_TMP] = NULL;
 	}
 
-	g_atomic_int_inc (&mem_pool_stat->pools_freed);
+	mem_pool_stat->pools_freed ++;
 	POOL_MTX_UNLOCK ();
 }
 
+static void
+rspamd_mempool_stat_add (rspamd_mempool_stat_t *st,
+		const rspamd_mempool_stat_t *src)
+{
+	st->pools_allocated += src->pools_allocated;
+	st->pools_freed += src->pools_freed;
+	st->bytes_allocated += src->bytes_allocated;
+	st->chunks_allocated += src->chunks_allocated;
+	st->shared_chunks_allocated += src->shared_chunks_allocated;
+	st->chunks_freed += src->chunks_freed;
+	st->oversized_chunks += src->oversized_chunks;
+}
+
 void
 rspamd_mempool_stat (rspamd_mempool_stat_t * st)
 {
-	if (mem_pool_stat != NULL) {
-		st->pools_allocated = mem_pool_stat->pools_allocated;
-		st->pools_freed = mem_pool_stat->pools_freed;
-		st->shared_chunks_allocated = mem_pool_stat->shared_chunks_allocated;
-		st->bytes_allocated = mem_pool_stat->bytes_allocated;
-		st->chunks_allocated = mem_pool_stat->chunks_allocated;
-		st->shared_chunks_allocated = mem_pool_stat->shared_chunks_allocated;
-		st->chunks_freed = mem_pool_stat->chunks_freed;
-		st->oversized_chunks = mem_pool_stat->oversized_chunks;
+	struct rspamd_mempool_stat_slot *slot;
+	guint i;
+
+	memset (st, 0, sizeof (*st));
+
+	if (mem_pool_slots == NULL) {
+		return;
+	}
+
+	for (i = 0; i < MEMPOOL_STAT_SLOTS; i ++) {
+		slot = rspamd_mempool_stat_slot (i);
+
+		if (!rspamd_mempool_stat_slot_alive (i)) {
+			continue;
+		}
+
+		rspamd_mempool_stat_add (st, &slot->st);
+	}
+
+	if (mem_pool_slot == NULL) {
+		rspamd_mempool_stat_add (st, &mem_pool_local_stat);
 	}
 }
 
+GArray *
+rspamd_mempool_tag_stat (void)
+{
+	struct rspamd_mempool_stat_slot *slot;
+	rspamd_mempool_tag_stat_t *src, *dst;
+	GArray *res;
+	guint i, j, k, l;
+
+	res = g_array_new (FALSE, TRUE, sizeof (rspamd_mempool_tag_stat_t));
+
+	if (mem_pool_slots == NULL) {
+		return res;
+	}
+
+	for (i = 0; i < MEMPOOL_STAT_SLOTS; i ++) {
+		slot = rspamd_mempool_stat_slot (i);
+
+		if (!rspamd_mempool_stat_slot_alive (i)) {
+			continue;
+		}
+
+		for (j = 0; j < MEMPOOL_STAT_TAGS; j ++) {
+			src = &slot->tags[j];
+
+			if (src->tagname[0] == '\0') {
+				break;
+			}
+
+			for (k = 0; k < res->len; k ++) {
+				dst = &g_array_index (res, rspamd_mempool_tag_stat_t, k);
+
+				if (strncmp (dst->tagname, src->tagname,
+						sizeof (dst->tagname)) == 0) {
+					break;
+				}
+			}
+
+			if (k == res->len) {
+				g_array_set_size (res, k + 1);
+				dst = &g_array_index (res, rspamd_mempool_tag_stat_t, k);
+				rspamd_strlcpy (dst->tagname, src->tagname,
+						sizeof (dst->tagname));
+			}
+
+			dst->pools += src->pools;
+
+			for (l = 0; l < MEMPOOL_PEAK_BUCKETS; l ++) {
+				dst->peak_hist[l] += src->peak_hist[l];
+			}
+		}
+	}
+
+	return res;
+}
+
 void
 rspamd_mempool_stat_reset (void)
 {
-	if (mem_pool_stat != NULL) {
-		memset (mem_pool_stat, 0, sizeof (rspamd_mempool_stat_t));
+	struct rspamd_mempool_stat_slot *slot;
+	guint i, j;
+
+	if (mem_pool_slots == NULL) {
+		return;
+	}
+
+	memset (&mem_pool_local_stat, 0, sizeof (mem_pool_local_stat));
+
+	/* Tag names are kept as owners of slots might be updating them */
+	for (i = 0; i < MEMPOOL_STAT_SLOTS; i ++) {
+		slot = rspamd_mempool_stat_slot (i);
+		memset (&slot->st, 0, sizeof (slot->st));
+
+		for (j = 0; j < MEMPOOL_STAT_TAGS; j ++) {
+			slot->tags[j].pools = 0;
+			memset (slot->tags[j].peak_hist, 0, sizeof (slot->tags[j].peak_hist));
+		}
 	}
 }
 
+void
+rspamd_mempool_release_cached (void)
+{
+	struct _pool_chain *cur;
+	guint i;
+
+	for (i = 0; i < chain_cache.nchains; i ++) {
+		cur = chain_cache.chains[i];
+		g_slice_free1 (cur->len + sizeof (struct _pool_chain), cur);
+	}
+
+	chain_cache.nchains = 0;
+	chain_cache.bytes = 0;
+}
+
 /* By default allocate 8Kb chunks of memory */
 #define FIXED_POOL_SIZE 8192
 gsize
@@ -90,12 +90,15 @@ struct rspamd_mempool_tag {
  * Memory pool type
  */
 struct rspamd_mutex_s;
+struct rspamd_mempool_size_hint;
 typedef struct memory_pool_s {
 	GPtrArray *pools[RSPAMD_MEMPOOL_MAX];
 	GArray *destructors;
 	GPtrArray *trash_stack;
 	GHashTable *variables;                  /**< private memory pool variables			*/
 	gsize elt_len;							/**< size of an element						*/
+	gsize allocated;						/**< bytes requested from this pool			*/
+	struct rspamd_mempool_size_hint *size_hint; /**< learned size of pools with the same tag */
 	struct rspamd_mempool_tag tag;          /**< memory pool tag						*/
 } rspamd_mempool_t;
 
@@ -112,11 +115,27 @@ typedef struct memory_pool_stat_s {
 	guint oversized_chunks;             /**< oversized chunks									*/
 } rspamd_mempool_stat_t;
 
+#define MEMPOOL_PEAK_BUCKETS 12
+#define MEMPOOL_PEAK_MIN 8192
+
+/**
+ * Peak sizes of pools with some specific tag
+ */
+typedef struct memory_pool_tag_stat_s {
+	gchar tagname[MEMPOOL_TAG_LEN];     /**< tag of pools										*/
+	guint pools;                        /**< number of deleted pools							*/
+	guint peak_hist[MEMPOOL_PEAK_BUCKETS]; /**< bucket i counts pools with peak size below MEMPOOL_PEAK_MIN << i,
+	                                        the last one counts all larger pools */
+} rspamd_mempool_tag_stat_t;
+
 
 
 /**
- * Allocate new memory poll
+ * Allocate new memory poll. Pools with the same tag learn their typical size,
+ * so the first chain of a tagged pool is allocated large enough to hold
+ * everything a typical pool with this tag allocates
  * @param size size of pool's page
+ * @param tag tag of pool (e.g. "task")
  * @return new memory pool object
  */
 rspamd_mempool_t *rspamd_mempool_new (gsize size, const gchar *tag);
@@ -278,11 +297,17 @@ void rspamd_mempool_runlock_rwlock (rspamd_mempool_rwlock_t *lock);
 void rspamd_mempool_wunlock_rwlock (rspamd_mempool_rwlock_t *lock);
 
 /**
- * Get pool allocator statistics
+ * Get pool allocator statistics summed over all running processes
  * @param st stat pool struct
  */
 void rspamd_mempool_stat (rspamd_mempool_stat_t *st);
 
+/**
+ * Get peak sizes of tagged pools summed over all running processes
+ * @return array of rspamd_mempool_tag_stat_t that should be freed by caller
+ */
+GArray *rspamd_mempool_tag_stat (void);
+
 /**
  * Reset memory pool stat
  */
@@ -294,6 +319,11 @@ void rspamd_mempool_stat_reset (void);
  */
 gsize rspamd_mempool_suggest_size (void);
 
+/**
+ * Free chains that are cached by the current process for reuse by new pools
+ */
+void rspamd_mempool_release_cached (void);
+
 /**
  * Set memory pool variable
  * @param pool memory pool object
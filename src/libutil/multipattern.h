@@ -72,12 +72,12 @@ struct rspamd_multipattern *rspamd_multipattern_create (
 
 /**
  * Creates multipattern with preallocated number of patterns to speed up loading
- * @param flags
- * @param reserved
+ * @param npatterns number of patterns to reserve
+ * @param flags flags applied to all patterns
  * @return
  */
-struct rspamd_multipattern *rspamd_multipattern_create_sized (
-		enum rspamd_multipattern_flags flags, guint reserved);
+struct rspamd_multipattern *rspamd_multipattern_create_sized (guint npatterns,
+		enum rspamd_multipattern_flags flags);
 
 /**
  * Creates new multipattern structure
@@ -18,6 +18,7 @@
 #include "rspamd.h"
 #include "mem_pool.h"
 #include "btrie.h"
+#include "unix-std.h"
 
 #define msg_err_radix(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "radix", tree->pool->tag.uid, \
@@ -36,12 +37,530 @@
         G_STRFUNC, \
         __VA_ARGS__)
 
+#define RADIX_FLAT_MAGIC "rdxflat1"
+
+/*
+ * Flat image is a pointer free representation of a trie that could be shared
+ * between processes: it contains sorted and merged arrays of address ranges,
+ * so it can only store a single value for all prefixes
+ */
+struct radix_flat_header {
+	gchar magic[8];
+	guint64 size;
+	/* Number of IPv4 ranges: pairs of guint32 (start, end) */
+	guint64 n4;
+	/* Number of IPv6 ranges: quads of guint64 (start_hi, start_lo, end_hi, end_lo) */
+	guint64 n6;
+};
+
 struct radix_tree_compressed {
 	rspamd_mempool_t *pool;
 	size_t size;
 	struct btrie *tree;
+	/* Btrie cannot walk over full length prefixes, so we cannot flatten it */
+	gboolean has_full_prefix;
+	enum rspamd_radix_engine engine;
+	/* Poptrie engine */
+	struct radix_poptrie *pop4;
+	struct radix_poptrie *pop6;
+	GArray *pop_values;
+	GArray *full_prefixes;
+	GArray *full_values;
+	gboolean pop_dirty;
+	/* Flat image */
+	guchar *flat;
+	gsize flat_len;
+	const guint32 *v4;
+	const guint64 *v6;
+	gsize n4;
+	gsize n6;
+	uintptr_t flat_value;
+};
+
+static gboolean
+radix_find_flat (radix_compressed_t *tree, const guint8 *key, gsize keylen)
+{
+	guint32 k4;
+	guint64 hi, lo;
+	gsize l, r, m;
+	const guint64 *range;
+
+	if (keylen == sizeof (guint32)) {
+		memcpy (&k4, key, sizeof (k4));
+		k4 = ntohl (k4);
+		l = 0;
+		r = tree->n4;
+
+		/* Find the last range with start <= k4 */
+		while (l < r) {
+			m = l + (r - l) / 2;
+
+			if (tree->v4[m * 2] <= k4) {
+				l = m + 1;
+			}
+			else {
+				r = m;
+			}
+		}
+
+		return l > 0 && k4 <= tree->v4[(l - 1) * 2 + 1];
+	}
+	else if (keylen == sizeof (guint64) * 2) {
+		memcpy (&hi, key, sizeof (hi));
+		memcpy (&lo, key + sizeof (hi), sizeof (lo));
+		hi = GUINT64_FROM_BE (hi);
+		lo = GUINT64_FROM_BE (lo);
+		l = 0;
+		r = tree->n6;
+
+		while (l < r) {
+			m = l + (r - l) / 2;
+			range = &tree->v6[m * 4];
+
+			if (range[0] < hi || (range[0] == hi && range[1] <= lo)) {
+				l = m + 1;
+			}
+			else {
+				r = m;
+			}
+		}
+
+		if (l > 0) {
+			range = &tree->v6[(l - 1) * 4];
+
+			return hi < range[2] || (hi == range[2] && lo <= range[3]);
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Poptrie: multibit trie where each node covers 6 bits of a key and stores
+ * its children and leaves in compressed arrays indexed by the population
+ * count of bitmaps, the first 16 bits are resolved by a direct table.
+ * Lookup touches a single cache line per level instead of following
+ * a pointer per bit.
+ *
+ * Poptrie is compiled from the btrie on the first lookup after a
+ * modification. There are separate tables for IPv4 and IPv6 keys as keys
+ * of different lengths could not share stride boundaries.
+ */
+#define RADIX_POPTRIE_DIRECT_BITS 16
+#define RADIX_POPTRIE_STRIDE 6
+#define RADIX_POPTRIE_NODE (1U << 31)
+
+struct radix_poptrie_node {
+	/* Slots that have child nodes */
+	guint64 vector;
+	/* Slots where a new run of equal leaves starts */
+	guint64 leafvec;
+	guint32 base0;
+	guint32 base1;
+};
+
+struct radix_poptrie {
+	guint32 *dir;
+	struct radix_poptrie_node *nodes;
+	guint32 *leaves;
+	gsize nnodes;
+	gsize nleaves;
+};
+
+struct radix_poptrie_prefix {
+	guint8 key[BTRIE_MAX_PREFIX / NBBY];
+	guint len;
+	/* Index in the values array, 0 means no value */
+	guint32 value;
+};
+
+struct radix_poptrie_builder {
+	GArray *nodes;
+	GArray *leaves;
+	struct radix_poptrie_prefix *prefixes;
+};
+
+static inline guint
+radix_popcount64 (guint64 v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_popcountll (v);
+#else
+	v = v - ((v >> 1) & G_GUINT64_CONSTANT (0x5555555555555555));
+	v = (v & G_GUINT64_CONSTANT (0x3333333333333333)) +
+			((v >> 2) & G_GUINT64_CONSTANT (0x3333333333333333));
+	v = (v + (v >> 4)) & G_GUINT64_CONSTANT (0x0f0f0f0f0f0f0f0f);
+
+	return (v * G_GUINT64_CONSTANT (0x0101010101010101)) >> 56;
+#endif
+}
+
+/* Extract nbits (up to 16) starting from off, bits after the key are zeroes */
+static inline guint
+radix_poptrie_bits (const guint8 *key, gsize keylen, guint off, guint nbits)
+{
+	guint32 w = 0;
+	guint i, pos = off / NBBY;
+
+	for (i = 0; i < 3; i ++) {
+		w <<= NBBY;
+
+		if (pos + i < keylen) {
+			w |= key[pos + i];
+		}
+	}
+
+	return (w >> (24 - off % NBBY - nbits)) & ((1U << nbits) - 1);
+}
+
+static inline guint32
+radix_poptrie_lookup (const struct radix_poptrie *pt, const guint8 *key,
+		gsize keylen)
+{
+	const struct radix_poptrie_node *node;
+	guint32 e;
+	guint d, v;
+	guint64 bit;
+
+	e = pt->dir[((guint)key[0] << NBBY) | key[1]];
+
+	if (!(e & RADIX_POPTRIE_NODE)) {
+		return e;
+	}
+
+	node = &pt->nodes[e & ~RADIX_POPTRIE_NODE];
+	d = RADIX_POPTRIE_DIRECT_BITS;
+
+	for (;;) {
+		v = radix_poptrie_bits (key, keylen, d, RADIX_POPTRIE_STRIDE);
+		bit = G_GUINT64_CONSTANT (1) << v;
+
+		if (node->vector & bit) {
+			node = &pt->nodes[node->base1 +
+					radix_popcount64 (node->vector & ((bit << 1) - 1)) - 1];
+			d += RADIX_POPTRIE_STRIDE;
+		}
+		else {
+			return pt->leaves[node->base0 +
+					radix_popcount64 (node->leafvec & ((bit << 1) - 1)) - 1];
+		}
+	}
+}
+
+static void
+radix_poptrie_build_node (struct radix_poptrie_builder *b, gsize idx,
+		guint d, gsize lo, gsize hi, guint32 inherited)
+{
+	const guint nslots = 1U << RADIX_POPTRIE_STRIDE;
+	struct radix_poptrie_prefix *p;
+	struct radix_poptrie_node *node;
+	guint32 leaf[1U << RADIX_POPTRIE_STRIDE], last = 0;
+	gsize child_lo[1U << RADIX_POPTRIE_STRIDE], child_hi[1U << RADIX_POPTRIE_STRIDE];
+	guint64 vector = 0, leafvec = 0;
+	guint32 base0, base1;
+	guint s, k, span, end = d + RADIX_POPTRIE_STRIDE;
+	gsize i;
+	gboolean first = TRUE;
+
+	for (s = 0; s < nslots; s ++) {
+		leaf[s] = inherited;
+	}
+
+	/*
+	 * Prefixes are sorted, so the shorter prefix is always expanded before
+	 * the longer ones that it covers
+	 */
+	for (i = lo; i < hi; i ++) {
+		p = &b->prefixes[i];
+
+		if (p->len <= d) {
+			continue;
+		}
+
+		s = radix_poptrie_bits (p->key, sizeof (p->key), d,
+				RADIX_POPTRIE_STRIDE);
+
+		if (p->len <= end) {
+			span = 1U << (end - p->len);
+
+			for (k = s; k < s + span; k ++) {
+				leaf[k] = p->value;
+			}
+		}
+		else {
+			if (!(vector & (G_GUINT64_CONSTANT (1) << s))) {
+				vector |= G_GUINT64_CONSTANT (1) << s;
+				child_lo[s] = i;
+			}
+
+			child_hi[s] = i + 1;
+		}
+	}
+
+	base0 = b->leaves->len;
+
+	for (s = 0; s < nslots; s ++) {
+		if (vector & (G_GUINT64_CONSTANT (1) << s)) {
+			continue;
+		}
+
+		if (first || leaf[s] != last) {
+			leafvec |= G_GUINT64_CONSTANT (1) << s;
+			g_array_append_val (b->leaves, leaf[s]);
+			last = leaf[s];
+			first = FALSE;
+		}
+	}
+
+	/* Children must be allocated contiguously */
+	base1 = b->nodes->len;
+	g_array_set_size (b->nodes, b->nodes->len + radix_popcount64 (vector));
+
+	node = &g_array_index (b->nodes, struct radix_poptrie_node, idx);
+	node->vector = vector;
+	node->leafvec = leafvec;
+	node->base0 = base0;
+	node->base1 = base1;
+
+	for (s = 0, k = 0; s < nslots; s ++) {
+		if (vector & (G_GUINT64_CONSTANT (1) << s)) {
+			radix_poptrie_build_node (b, base1 + k, end, child_lo[s],
+					child_hi[s], leaf[s]);
+			k ++;
+		}
+	}
+}
+
+static gint
+radix_poptrie_prefix_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct radix_poptrie_prefix *p1 = a, *p2 = b;
+	gint r;
+
+	r = memcmp (p1->key, p2->key, sizeof (p1->key));
+
+	if (r == 0) {
+		return (gint)p1->len - (gint)p2->len;
+	}
+
+	return r;
+}
+
+static struct radix_poptrie *
+radix_poptrie_build (struct radix_poptrie_prefix *prefixes, gsize nprefixes)
+{
+	struct radix_poptrie *pt;
+	struct radix_poptrie_builder b;
+	struct radix_poptrie_prefix *p;
+	gsize i, j, idx;
+	guint s, k, span;
+
+	qsort (prefixes, nprefixes, sizeof (*prefixes), radix_poptrie_prefix_cmp);
+
+	pt = g_malloc0 (sizeof (*pt));
+	pt->dir = g_malloc0 (sizeof (guint32) << RADIX_POPTRIE_DIRECT_BITS);
+	b.nodes = g_array_new (FALSE, TRUE, sizeof (struct radix_poptrie_node));
+	b.leaves = g_array_new (FALSE, FALSE, sizeof (guint32));
+	b.prefixes = prefixes;
+
+	for (i = 0; i < nprefixes; i ++) {
+		p = &prefixes[i];
+
+		if (p->len <= RADIX_POPTRIE_DIRECT_BITS) {
+			s = radix_poptrie_bits (p->key, sizeof (p->key), 0,
+					RADIX_POPTRIE_DIRECT_BITS);
+			span = 1U << (RADIX_POPTRIE_DIRECT_BITS - p->len);
+
+			for (k = s; k < s + span; k ++) {
+				pt->dir[k] = p->value;
+			}
+		}
+	}
+
+	for (i = 0; i < nprefixes; ) {
+		p = &prefixes[i];
+
+		if (p->len <= RADIX_POPTRIE_DIRECT_BITS) {
+			i ++;
+			continue;
+		}
+
+		s = radix_poptrie_bits (p->key, sizeof (p->key), 0,
+				RADIX_POPTRIE_DIRECT_BITS);
+
+		for (j = i + 1; j < nprefixes; j ++) {
+			if (radix_poptrie_bits (prefixes[j].key, sizeof (p->key), 0,
+					RADIX_POPTRIE_DIRECT_BITS) != s) {
+				break;
+			}
+		}
+
+		idx = b.nodes->len;
+		g_array_set_size (b.nodes, idx + 1);
+		radix_poptrie_build_node (&b, idx, RADIX_POPTRIE_DIRECT_BITS, i, j,
+				pt->dir[s]);
+		pt->dir[s] = idx | RADIX_POPTRIE_NODE;
+		i = j;
+	}
+
+	pt->nnodes = b.nodes->len;
+	pt->nleaves = b.leaves->len;
+	pt->nodes = (struct radix_poptrie_node *)g_array_free (b.nodes, FALSE);
+	pt->leaves = (guint32 *)g_array_free (b.leaves, FALSE);
+
+	return pt;
+}
+
+static void
+radix_poptrie_destroy (struct radix_poptrie *pt)
+{
+	if (pt) {
+		g_free (pt->dir);
+		g_free (pt->nodes);
+		g_free (pt->leaves);
+		g_free (pt);
+	}
+}
+
+struct radix_poptrie_cbdata {
+	GArray *v4;
+	GArray *v6;
+	GArray *values;
+	GHashTable *indexes;
 };
 
+static guint32
+radix_poptrie_value_index (struct radix_poptrie_cbdata *cbd, uintptr_t value)
+{
+	gpointer idx;
+
+	idx = g_hash_table_lookup (cbd->indexes, (gpointer)value);
+
+	if (idx == NULL) {
+		g_array_append_val (cbd->values, value);
+		idx = GUINT_TO_POINTER (cbd->values->len - 1);
+		g_hash_table_insert (cbd->indexes, (gpointer)value, idx);
+	}
+
+	return GPOINTER_TO_UINT (idx);
+}
+
+static void
+radix_poptrie_add_prefix (struct radix_poptrie_cbdata *cbd,
+		const guint8 *key, guint len, uintptr_t value)
+{
+	struct radix_poptrie_prefix p;
+
+	memset (&p, 0, sizeof (p));
+	memcpy (p.key, key, (len + NBBY - 1) / NBBY);
+
+	if (len % NBBY) {
+		p.key[len / NBBY] &= 0xff << (NBBY - len % NBBY);
+	}
+
+	p.len = len;
+	p.value = radix_poptrie_value_index (cbd, value);
+
+	/* The same rules as for btrie: short prefixes match IPv4 keys as well */
+	if (len <= 32) {
+		g_array_append_val (cbd->v4, p);
+	}
+
+	g_array_append_val (cbd->v6, p);
+}
+
+static void
+radix_poptrie_walk_cb (const btrie_oct_t *prefix, unsigned len,
+		const void *data, int post, void *user_data)
+{
+	if (!post) {
+		radix_poptrie_add_prefix (user_data, prefix, len, (uintptr_t)data);
+	}
+}
+
+static void
+radix_poptrie_compile (radix_compressed_t *tree)
+{
+	struct radix_poptrie_cbdata cbd;
+	guint i;
+	uintptr_t none = RADIX_NO_VALUE;
+
+	radix_poptrie_destroy (tree->pop4);
+	radix_poptrie_destroy (tree->pop6);
+
+	if (tree->pop_values) {
+		g_array_free (tree->pop_values, TRUE);
+	}
+
+	cbd.v4 = g_array_new (FALSE, FALSE, sizeof (struct radix_poptrie_prefix));
+	cbd.v6 = g_array_new (FALSE, FALSE, sizeof (struct radix_poptrie_prefix));
+	cbd.values = g_array_new (FALSE, FALSE, sizeof (uintptr_t));
+	cbd.indexes = g_hash_table_new (g_direct_hash, g_direct_equal);
+	/* Index 0 means that there is no value */
+	g_array_append_val (cbd.values, none);
+
+	btrie_walk (tree->tree, radix_poptrie_walk_cb, &cbd);
+
+	/* Btrie cannot walk over full length prefixes */
+	if (tree->full_prefixes) {
+		for (i = 0; i < tree->full_prefixes->len; i ++) {
+			struct radix_poptrie_prefix *fp = &g_array_index (
+					tree->full_prefixes, struct radix_poptrie_prefix, i);
+
+			radix_poptrie_add_prefix (&cbd, fp->key, fp->len,
+					g_array_index (tree->full_values, uintptr_t, i));
+		}
+	}
+
+	tree->pop4 = radix_poptrie_build (
+			(struct radix_poptrie_prefix *)cbd.v4->data, cbd.v4->len);
+	tree->pop6 = radix_poptrie_build (
+			(struct radix_poptrie_prefix *)cbd.v6->data, cbd.v6->len);
+	tree->pop_values = cbd.values;
+	tree->pop_dirty = FALSE;
+
+	g_array_free (cbd.v4, TRUE);
+	g_array_free (cbd.v6, TRUE);
+	g_hash_table_unref (cbd.indexes);
+
+	msg_debug_radix ("compiled poptrie: %z IPv4 nodes, %z IPv6 nodes, "
+			"%ud values", tree->pop4->nnodes, tree->pop6->nnodes,
+			tree->pop_values->len - 1);
+}
+
+static inline uintptr_t
+radix_find_poptrie (radix_compressed_t *tree, const guint8 *key, gsize keylen)
+{
+	guint32 idx;
+
+	if (tree->pop_dirty) {
+		radix_poptrie_compile (tree);
+	}
+
+	if (keylen == sizeof (guint32)) {
+		idx = radix_poptrie_lookup (tree->pop4, key, keylen);
+	}
+	else {
+		idx = radix_poptrie_lookup (tree->pop6, key, keylen);
+	}
+
+	return g_array_index (tree->pop_values, uintptr_t, idx);
+}
+
+static inline uintptr_t
+radix_find_btrie (radix_compressed_t *tree, const guint8 *key, gsize keylen)
+{
+	gconstpointer ret;
+
+	ret = btrie_lookup (tree->tree, key, keylen * NBBY);
+
+	if (ret == NULL) {
+		return RADIX_NO_VALUE;
+	}
+
+	return (uintptr_t)ret;
+}
+
 uintptr_t
 radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keylen)
 {
@@ -49,6 +568,16 @@ radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keyle
 
 	g_assert (tree != NULL);
 
+	if (tree->tree == NULL) {
+		return radix_find_flat (tree, key, keylen) ?
+				tree->flat_value : RADIX_NO_VALUE;
+	}
+
+	if (tree->engine == RSPAMD_RADIX_ENGINE_POPTRIE &&
+			(keylen == sizeof (guint32) || keylen == BTRIE_MAX_PREFIX / NBBY)) {
+		return radix_find_poptrie (tree, key, keylen);
+	}
+
 	ret = btrie_lookup (tree->tree, key, keylen * NBBY);
 
 	if (ret == NULL) {
@@ -72,10 +601,17 @@ radix_insert_compressed (radix_compressed_t * tree,
 	g_assert (tree != NULL);
 	g_assert (keybits >= masklen);
 
+	if (tree->tree == NULL) {
+		msg_err_radix ("cannot insert %p to the read only flat trie",
+				(gpointer)value);
+
+		return RADIX_NO_VALUE;
+	}
+
 	msg_debug_radix ("want insert value %p with mask %z, key: %*xs",
 			(gpointer)value, keybits - masklen, (int)keylen, key);
 
-	old = radix_find_compressed (tree, key, keylen);
+	old = radix_find_btrie (tree, key, keylen);
 
 	ret = btrie_add_prefix (tree->tree, key, keybits - masklen,
 			(gconstpointer)value);
@@ -86,6 +622,22 @@ radix_insert_compressed (radix_compressed_t * tree,
 	}
 	else {
 		tree->size ++;
+
+		tree->pop_dirty = TRUE;
+
+		if (keybits - masklen >= BTRIE_MAX_PREFIX) {
+			tree->has_full_prefix = TRUE;
+
+			if (tree->engine == RSPAMD_RADIX_ENGINE_POPTRIE) {
+				struct radix_poptrie_prefix fp;
+
+				memset (&fp, 0, sizeof (fp));
+				memcpy (fp.key, key, sizeof (fp.key));
+				fp.len = BTRIE_MAX_PREFIX;
+				g_array_append_val (tree->full_prefixes, fp);
+				g_array_append_val (tree->full_values, value);
+			}
+		}
 	}
 
 	return old;
@@ -94,10 +646,16 @@ radix_insert_compressed (radix_compressed_t * tree,
 
 radix_compressed_t *
 radix_create_compressed (void)
+{
+	return radix_create_compressed_engine (RSPAMD_RADIX_ENGINE_BTRIE);
+}
+
+radix_compressed_t *
+radix_create_compressed_engine (enum rspamd_radix_engine engine)
 {
 	radix_compressed_t *tree;
 
-	tree = g_slice_alloc (sizeof (*tree));
+	tree = g_slice_alloc0 (sizeof (*tree));
 	if (tree == NULL) {
 		return NULL;
 	}
@@ -105,6 +663,14 @@ radix_create_compressed (void)
 	tree->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
 	tree->size = 0;
 	tree->tree = btrie_init (tree->pool);
+	tree->engine = engine;
+
+	if (engine == RSPAMD_RADIX_ENGINE_POPTRIE) {
+		tree->full_prefixes = g_array_new (FALSE, FALSE,
+				sizeof (struct radix_poptrie_prefix));
+		tree->full_values = g_array_new (FALSE, FALSE, sizeof (uintptr_t));
+		tree->pop_dirty = TRUE;
+	}
 
 	return tree;
 }
@@ -113,11 +679,268 @@ void
 radix_destroy_compressed (radix_compressed_t *tree)
 {
 	if (tree) {
+		if (tree->flat) {
+			munmap (tree->flat, tree->flat_len);
+		}
+
+		if (tree->engine == RSPAMD_RADIX_ENGINE_POPTRIE) {
+			radix_poptrie_destroy (tree->pop4);
+			radix_poptrie_destroy (tree->pop6);
+
+			if (tree->pop_values) {
+				g_array_free (tree->pop_values, TRUE);
+			}
+
+			g_array_free (tree->full_prefixes, TRUE);
+			g_array_free (tree->full_values, TRUE);
+		}
+
 		rspamd_mempool_delete (tree->pool);
 		g_slice_free1 (sizeof (*tree), tree);
 	}
 }
 
+struct radix_flat_cbdata {
+	GArray *v4;
+	GArray *v6;
+	uintptr_t value;
+	gboolean valid;
+};
+
+static void
+radix_flat_walk_cb (const btrie_oct_t *prefix, unsigned len,
+		const void *data, int post, void *user_data)
+{
+	struct radix_flat_cbdata *cbd = user_data;
+	btrie_oct_t key[BTRIE_MAX_PREFIX / NBBY];
+	guint32 s4, e4;
+	guint64 range[4], hi, lo;
+
+	if (post) {
+		return;
+	}
+
+	/* Clear bits after the prefix */
+	memset (key, 0, sizeof (key));
+	memcpy (key, prefix, (len + NBBY - 1) / NBBY);
+
+	if (len % NBBY) {
+		key[len / NBBY] &= 0xff << (NBBY - len % NBBY);
+	}
+
+	prefix = key;
+
+	if ((uintptr_t)data != cbd->value) {
+		/* Flat image does not store values */
+		cbd->valid = FALSE;
+	}
+
+	/* Prefixes not longer than 32 bits are also matched by IPv4 keys */
+	if (len <= 32) {
+		memcpy (&s4, prefix, sizeof (s4));
+		s4 = ntohl (s4);
+		e4 = len == 0 ? G_MAXUINT32 : s4 | (len == 32 ? 0 : G_MAXUINT32 >> len);
+		g_array_append_val (cbd->v4, s4);
+		g_array_append_val (cbd->v4, e4);
+	}
+
+	memcpy (&hi, prefix, sizeof (hi));
+	memcpy (&lo, prefix + sizeof (hi), sizeof (lo));
+	range[0] = GUINT64_FROM_BE (hi);
+	range[1] = GUINT64_FROM_BE (lo);
+
+	if (len == 0) {
+		range[2] = G_MAXUINT64;
+		range[3] = G_MAXUINT64;
+	}
+	else if (len <= 64) {
+		range[2] = range[0] | (len == 64 ? 0 : (G_MAXUINT64 >> len));
+		range[3] = G_MAXUINT64;
+	}
+	else {
+		range[2] = range[0];
+		range[3] = range[1] | (len == 128 ? 0 : (G_MAXUINT64 >> (len - 64)));
+	}
+
+	g_array_append_vals (cbd->v6, range, 4);
+}
+
+static gint
+radix_flat_v4_cmp (gconstpointer a, gconstpointer b)
+{
+	const guint32 *r1 = a, *r2 = b;
+
+	if (r1[0] != r2[0]) {
+		return r1[0] < r2[0] ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static gint
+radix_flat_v6_cmp (gconstpointer a, gconstpointer b)
+{
+	const guint64 *r1 = a, *r2 = b;
+
+	if (r1[0] != r2[0]) {
+		return r1[0] < r2[0] ? -1 : 1;
+	}
+	if (r1[1] != r2[1]) {
+		return r1[1] < r2[1] ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/* Merge overlapping ranges in the sorted array */
+static gsize
+radix_flat_merge_v4 (guint32 *r, gsize n)
+{
+	gsize i, out = 0;
+
+	for (i = 0; i < n; i ++) {
+		if (out > 0 && r[i * 2] <= r[(out - 1) * 2 + 1]) {
+			r[(out - 1) * 2 + 1] = MAX (r[(out - 1) * 2 + 1], r[i * 2 + 1]);
+		}
+		else {
+			r[out * 2] = r[i * 2];
+			r[out * 2 + 1] = r[i * 2 + 1];
+			out ++;
+		}
+	}
+
+	return out;
+}
+
+static gsize
+radix_flat_merge_v6 (guint64 *r, gsize n)
+{
+	gsize i, out = 0;
+	guint64 *prev, *cur;
+
+	for (i = 0; i < n; i ++) {
+		cur = &r[i * 4];
+		prev = out > 0 ? &r[(out - 1) * 4] : NULL;
+
+		if (prev && (cur[0] < prev[2] ||
+				(cur[0] == prev[2] && cur[1] <= prev[3]))) {
+			if (cur[2] > prev[2] || (cur[2] == prev[2] && cur[3] > prev[3])) {
+				prev[2] = cur[2];
+				prev[3] = cur[3];
+			}
+		}
+		else {
+			memmove (&r[out * 4], cur, sizeof (guint64) * 4);
+			out ++;
+		}
+	}
+
+	return out;
+}
+
+guchar *
+radix_serialize_flat (radix_compressed_t *tree, uintptr_t value, gsize *len)
+{
+	struct radix_flat_cbdata cbd;
+	struct radix_flat_header hdr;
+	gsize n4, n6, v4_len;
+	guchar *res;
+
+	g_assert (tree != NULL);
+	g_assert (len != NULL);
+
+	if (tree->tree == NULL || tree->has_full_prefix) {
+		/* Already flat or has IPv6 host addresses */
+		return NULL;
+	}
+
+	cbd.v4 = g_array_new (FALSE, FALSE, sizeof (guint32));
+	cbd.v6 = g_array_new (FALSE, FALSE, sizeof (guint64));
+	cbd.value = value;
+	cbd.valid = TRUE;
+	btrie_walk (tree->tree, radix_flat_walk_cb, &cbd);
+
+	if (!cbd.valid) {
+		msg_info_radix ("cannot serialize trie with custom values");
+		g_array_free (cbd.v4, TRUE);
+		g_array_free (cbd.v6, TRUE);
+
+		return NULL;
+	}
+
+	n4 = cbd.v4->len / 2;
+	n6 = cbd.v6->len / 4;
+	qsort (cbd.v4->data, n4, sizeof (guint32) * 2, radix_flat_v4_cmp);
+	qsort (cbd.v6->data, n6, sizeof (guint64) * 4, radix_flat_v6_cmp);
+	n4 = radix_flat_merge_v4 ((guint32 *)cbd.v4->data, n4);
+	n6 = radix_flat_merge_v6 ((guint64 *)cbd.v6->data, n6);
+
+	/* Keep IPv6 ranges 8 bytes aligned */
+	v4_len = n4 * sizeof (guint32) * 2;
+	v4_len = (v4_len + 7) & ~7;
+	*len = sizeof (hdr) + v4_len + n6 * sizeof (guint64) * 4;
+	res = g_malloc0 (*len);
+
+	memcpy (hdr.magic, RADIX_FLAT_MAGIC, sizeof (hdr.magic));
+	hdr.size = tree->size;
+	hdr.n4 = n4;
+	hdr.n6 = n6;
+	memcpy (res, &hdr, sizeof (hdr));
+	memcpy (res + sizeof (hdr), cbd.v4->data, n4 * sizeof (guint32) * 2);
+	memcpy (res + sizeof (hdr) + v4_len, cbd.v6->data,
+			n6 * sizeof (guint64) * 4);
+
+	g_array_free (cbd.v4, TRUE);
+	g_array_free (cbd.v6, TRUE);
+
+	return res;
+}
+
+radix_compressed_t *
+radix_create_compressed_flat (guchar *data, gsize len, uintptr_t value)
+{
+	radix_compressed_t *tree;
+	struct radix_flat_header hdr;
+	gsize v4_len;
+
+	if (len < sizeof (hdr)) {
+		return NULL;
+	}
+
+	memcpy (&hdr, data, sizeof (hdr));
+
+	if (memcmp (hdr.magic, RADIX_FLAT_MAGIC, sizeof (hdr.magic)) != 0) {
+		return NULL;
+	}
+
+	v4_len = hdr.n4 * sizeof (guint32) * 2;
+	v4_len = (v4_len + 7) & ~7;
+
+	if (len < sizeof (hdr) + v4_len + hdr.n6 * sizeof (guint64) * 4) {
+		return NULL;
+	}
+
+	tree = g_slice_alloc0 (sizeof (*tree));
+	tree->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+	tree->size = hdr.size;
+	tree->tree = NULL;
+	tree->flat = data;
+	tree->flat_len = len;
+	tree->v4 = (const guint32 *)(data + sizeof (hdr));
+	tree->v6 = (const guint64 *)(data + sizeof (hdr) + v4_len);
+	tree->n4 = hdr.n4;
+	tree->n6 = hdr.n6;
+	tree->flat_value = value;
+
+	return tree;
+}
+
+gboolean
+radix_is_flat (radix_compressed_t *tree)
+{
+	return tree != NULL && tree->tree == NULL;
+}
+
 uintptr_t
 radix_find_compressed_addr (radix_compressed_t *tree,
 		const rspamd_inet_addr_t *addr)
@@ -329,12 +1152,41 @@ radix_get_pool (radix_compressed_t *tree)
 	return NULL;
 }
 
+void
+radix_compile (radix_compressed_t *tree)
+{
+	if (tree != NULL && tree->tree != NULL &&
+			tree->engine == RSPAMD_RADIX_ENGINE_POPTRIE && tree->pop_dirty) {
+		radix_poptrie_compile (tree);
+	}
+}
+
 const gchar *
 radix_get_info (radix_compressed_t *tree)
 {
+	static gchar buf[256];
+
 	if (tree == NULL) {
 		return NULL;
 	}
 
+	if (tree->tree == NULL) {
+		return "flat image";
+	}
+
+	if (tree->engine == RSPAMD_RADIX_ENGINE_POPTRIE) {
+		if (tree->pop_dirty) {
+			radix_poptrie_compile (tree);
+		}
+
+		rspamd_snprintf (buf, sizeof (buf), "poptrie: %z IPv4 nodes, "
+				"%z IPv6 nodes, %z leaves, btrie: %s",
+				tree->pop4->nnodes, tree->pop6->nnodes,
+				tree->pop4->nleaves + tree->pop6->nleaves,
+				btrie_stats (tree->tree));
+
+		return buf;
+	}
+
 	return btrie_stats (tree->tree);
 }
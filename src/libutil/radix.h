@@ -25,6 +25,16 @@
 
 typedef struct radix_tree_compressed radix_compressed_t;
 
+/**
+ * Lookup engines for radix tries
+ */
+enum rspamd_radix_engine {
+	/* Level compressed binary trie */
+	RSPAMD_RADIX_ENGINE_BTRIE = 0,
+	/* Multibit trie compiled on the first lookup after modification */
+	RSPAMD_RADIX_ENGINE_POPTRIE,
+};
+
 /**
  * Insert new key to the radix trie
  * @param tree radix trie
@@ -71,6 +81,14 @@ void radix_destroy_compressed (radix_compressed_t *tree);
  */
 radix_compressed_t *radix_create_compressed (void);
 
+/**
+ * Create new radix trie that uses the specified lookup engine
+ * @param engine lookup engine
+ * @return
+ */
+radix_compressed_t *radix_create_compressed_engine (
+		enum rspamd_radix_engine engine);
+
 /**
  * Insert list of ip addresses and masks to the radix tree
  * @param list string line of addresses
@@ -102,9 +120,44 @@ gsize radix_get_size (radix_compressed_t *tree);
  */
 const gchar * radix_get_info (radix_compressed_t *tree);
 
+/**
+ * Builds lookup structures of the trie if they are outdated, so the first
+ * lookup does not pay for that. Does nothing for btrie and flat tries
+ * @param tree
+ */
+void radix_compile (radix_compressed_t *tree);
+
 /**
  * Returns memory pool associated with the radix tree
  */
 rspamd_mempool_t* radix_get_pool (radix_compressed_t *tree);
 
+/**
+ * Serialize trie to the flat, pointer free image that could be shared between
+ * processes. Flat image does not store values, so this function fails if
+ * any prefix in the trie has a value different from the specified one
+ * @param tree trie to serialize
+ * @param value the only value allowed in the trie
+ * @param len output length of the image
+ * @return newly allocated image (must be freed by g_free) or NULL
+ */
+guchar * radix_serialize_flat (radix_compressed_t *tree, uintptr_t value,
+		gsize *len);
+
+/**
+ * Create read only trie from the memory mapped flat image. The image is
+ * unmapped when the trie is destroyed
+ * @param data mapped image
+ * @param len length of the image
+ * @param value value returned for all matched keys
+ * @return new trie or NULL if an image is invalid
+ */
+radix_compressed_t *radix_create_compressed_flat (guchar *data, gsize len,
+		uintptr_t value);
+
+/**
+ * Returns TRUE if the trie is a read only flat image
+ */
+gboolean radix_is_flat (radix_compressed_t *tree);
+
 #endif
@@ -16,9 +16,218 @@
 #include "shingles.h"
 #include "fstring.h"
 #include "cryptobox.h"
+#include "platform_config.h"
 
 #define SHINGLES_WINDOW 3
 
+/*
+ * Vector shingles: each word is hashed just once and all pipes are derived
+ * from the same window hash by a keyed multiply-xorshift permutation, so
+ * all pipes could be evaluated in SIMD lanes at the same time
+ */
+struct rspamd_shingles_perm {
+	guint64 xkey[RSPAMD_SHINGLE_SIZE];
+	guint64 mult[RSPAMD_SHINGLE_SIZE];
+	guint64 seed;
+};
+
+typedef void (*rspamd_shingles_min_func) (const struct rspamd_shingles_perm *perm,
+		const guint64 *wh, gsize count, guint64 *mins);
+
+static inline guint64
+rspamd_shingles_permute (guint64 h, guint64 xkey, guint64 mult)
+{
+	h = (h ^ xkey) * mult;
+
+	return h ^ (h >> 32);
+}
+
+static inline guint64
+rspamd_shingles_splitmix (guint64 *st)
+{
+	guint64 z = (*st += G_GUINT64_CONSTANT (0x9E3779B97F4A7C15));
+
+	z = (z ^ (z >> 30)) * G_GUINT64_CONSTANT (0xBF58476D1CE4E5B9);
+	z = (z ^ (z >> 27)) * G_GUINT64_CONSTANT (0x94D049BB133111EB);
+
+	return z ^ (z >> 31);
+}
+
+static void
+rspamd_shingles_perm_init (struct rspamd_shingles_perm *perm,
+		const guchar key[16])
+{
+	guchar hbuf[rspamd_cryptobox_HASHBYTES];
+	guint64 st;
+	guint i;
+
+	rspamd_cryptobox_hash (hbuf, key, 16, NULL, 0);
+	memcpy (&st, hbuf, sizeof (st));
+	memcpy (&perm->seed, hbuf + sizeof (st), sizeof (perm->seed));
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		perm->xkey[i] = rspamd_shingles_splitmix (&st);
+		/* Multiplier must be odd to be a permutation */
+		perm->mult[i] = rspamd_shingles_splitmix (&st) | 1;
+	}
+}
+
+static void
+rspamd_shingles_min_ref (const struct rspamd_shingles_perm *perm,
+		const guint64 *wh, gsize count, guint64 *mins)
+{
+	guint64 v;
+	gsize i, j;
+
+	for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+		mins[j] = G_MAXUINT64;
+	}
+
+	for (i = 0; i < count; i ++) {
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			v = rspamd_shingles_permute (wh[i], perm->xkey[j], perm->mult[j]);
+
+			if (v < mins[j]) {
+				mins[j] = v;
+			}
+		}
+	}
+}
+
+#if defined(HAVE_AVX2) && (defined(__GNUC__) || defined(__clang__))
+#define RSPAMD_SHINGLES_AVX2 1
+#include <immintrin.h>
+
+/* AVX2 has no 64 bit multiplication, so it is composed from 32 bit ones */
+static inline __m256i __attribute__((target("avx2")))
+rspamd_shingles_mul64_avx2 (__m256i a, __m256i b)
+{
+	__m256i lo, cross;
+
+	lo = _mm256_mul_epu32 (a, b);
+	cross = _mm256_add_epi64 (
+			_mm256_mul_epu32 (_mm256_srli_epi64 (a, 32), b),
+			_mm256_mul_epu32 (a, _mm256_srli_epi64 (b, 32)));
+
+	return _mm256_add_epi64 (lo, _mm256_slli_epi64 (cross, 32));
+}
+
+static void __attribute__((target("avx2")))
+rspamd_shingles_min_avx2 (const struct rspamd_shingles_perm *perm,
+		const guint64 *wh, gsize count, guint64 *mins)
+{
+	/* Unsigned comparison is done as signed one with flipped sign bits */
+	const __m256i sign = _mm256_set1_epi64x ((gint64)G_GUINT64_CONSTANT (0x8000000000000000));
+	__m256i xk0, xk1, m0, m1, min0, min1, h, v0, v1, gt;
+	gsize i, j;
+
+	for (j = 0; j < RSPAMD_SHINGLE_SIZE; j += 8) {
+		xk0 = _mm256_loadu_si256 ((const __m256i *)&perm->xkey[j]);
+		xk1 = _mm256_loadu_si256 ((const __m256i *)&perm->xkey[j + 4]);
+		m0 = _mm256_loadu_si256 ((const __m256i *)&perm->mult[j]);
+		m1 = _mm256_loadu_si256 ((const __m256i *)&perm->mult[j + 4]);
+		/* Minimums are kept with flipped sign bits */
+		min0 = _mm256_set1_epi64x (G_MAXINT64);
+		min1 = min0;
+
+		for (i = 0; i < count; i ++) {
+			h = _mm256_set1_epi64x ((gint64)wh[i]);
+			v0 = rspamd_shingles_mul64_avx2 (_mm256_xor_si256 (h, xk0), m0);
+			v1 = rspamd_shingles_mul64_avx2 (_mm256_xor_si256 (h, xk1), m1);
+			v0 = _mm256_xor_si256 (v0, _mm256_srli_epi64 (v0, 32));
+			v1 = _mm256_xor_si256 (v1, _mm256_srli_epi64 (v1, 32));
+			v0 = _mm256_xor_si256 (v0, sign);
+			v1 = _mm256_xor_si256 (v1, sign);
+			gt = _mm256_cmpgt_epi64 (min0, v0);
+			min0 = _mm256_blendv_epi8 (min0, v0, gt);
+			gt = _mm256_cmpgt_epi64 (min1, v1);
+			min1 = _mm256_blendv_epi8 (min1, v1, gt);
+		}
+
+		_mm256_storeu_si256 ((__m256i *)&mins[j], _mm256_xor_si256 (min0, sign));
+		_mm256_storeu_si256 ((__m256i *)&mins[j + 4], _mm256_xor_si256 (min1, sign));
+	}
+}
+#endif
+
+static rspamd_shingles_min_func
+rspamd_shingles_min_impl (void)
+{
+	static rspamd_shingles_min_func impl = NULL;
+
+	if (impl == NULL) {
+		impl = rspamd_shingles_min_ref;
+#ifdef RSPAMD_SHINGLES_AVX2
+		/* Cryptobox is initialised once, so CPU features are detected already */
+		if (rspamd_cryptobox_init ()->cpu_config & CPUID_AVX2) {
+			impl = rspamd_shingles_min_avx2;
+		}
+#endif
+	}
+
+	return impl;
+}
+
+static void
+rspamd_shingles_generate_vector (GArray *input,
+		const guchar key[16],
+		struct rspamd_shingle *res,
+		rspamd_shingles_filter filter,
+		gpointer filterd)
+{
+	struct rspamd_shingles_perm perm;
+	rspamd_ftok_t *word;
+	guint64 *wh, *pipe, h[SHINGLES_WINDOW];
+	gsize i, j, hlen;
+
+	rspamd_shingles_perm_init (&perm, key);
+	hlen = input->len > SHINGLES_WINDOW ? (input->len - SHINGLES_WINDOW + 1) : 1;
+	wh = g_malloc (hlen * sizeof (guint64));
+	memset (h, 0, sizeof (h));
+
+	/* Window hashes are built from the single hash per word */
+	for (i = 0; i < input->len || i < SHINGLES_WINDOW; i ++) {
+		memmove (h, h + 1, sizeof (h) - sizeof (h[0]));
+
+		if (i < input->len) {
+			word = &g_array_index (input, rspamd_ftok_t, i);
+			h[SHINGLES_WINDOW - 1] = rspamd_cryptobox_fast_hash_specific (
+					RSPAMD_CRYPTOBOX_XXHASH64, word->begin, word->len,
+					perm.seed);
+		}
+		else {
+			h[SHINGLES_WINDOW - 1] = 0;
+		}
+
+		if (i >= SHINGLES_WINDOW - 1) {
+			wh[i - SHINGLES_WINDOW + 1] = h[0] ^
+					((h[1] << 21) | (h[1] >> 43)) ^
+					((h[2] << 42) | (h[2] >> 22));
+		}
+	}
+
+	if (filter == rspamd_shingles_default_filter) {
+		/* Minhash is evaluated in the same pass for all pipes */
+		rspamd_shingles_min_impl () (&perm, wh, hlen, res->hashes);
+	}
+	else {
+		pipe = g_malloc (hlen * sizeof (guint64));
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			for (i = 0; i < hlen; i ++) {
+				pipe[i] = rspamd_shingles_permute (wh[i], perm.xkey[j],
+						perm.mult[j]);
+			}
+
+			res->hashes[j] = filter (pipe, hlen, j, key, filterd);
+		}
+
+		g_free (pipe);
+	}
+
+	g_free (wh);
+}
+
 struct rspamd_shingle* RSPAMD_OPTIMIZE("unroll-loops")
 rspamd_shingles_generate (GArray *input,
 		const guchar key[16],
@@ -47,6 +256,12 @@ rspamd_shingles_generate (GArray *input,
 		res = g_malloc (sizeof (*res));
 	}
 
+	if (alg == RSPAMD_SHINGLES_VECTOR) {
+		rspamd_shingles_generate_vector (input, key, res, filter, filterd);
+
+		return res;
+	}
+
 	rspamd_cryptobox_hash_init (&bs, NULL, 0);
 	row = rspamd_fstring_sized_new (256);
 	cur_key = key;
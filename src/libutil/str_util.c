@@ -1861,3 +1861,213 @@ rspamd_urls_cmp (gconstpointer a, gconstpointer b)
 
 	return r == 0;
 }
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#define RSPAMD_UTF8_SSE2 1
+#include <emmintrin.h>
+#endif
+
+static inline gboolean
+rspamd_utf8_cont (guchar c)
+{
+	return (c & 0xC0) == 0x80;
+}
+
+gsize
+rspamd_utf8_decode (const guchar *in, gsize len, gunichar *out,
+		gsize outlen, gsize *consumed)
+{
+	const guchar *p = in, *end = in + len;
+	gsize n = 0, l;
+	gunichar c;
+#ifdef RSPAMD_UTF8_SSE2
+	__m128i v, zero = _mm_setzero_si128 (), lo, hi;
+#endif
+
+	while (p < end && n < outlen) {
+#ifdef RSPAMD_UTF8_SSE2
+		/* Convert runs of ASCII characters without checking each byte */
+		while (end - p >= 16 && outlen - n >= 16) {
+			v = _mm_loadu_si128 ((const __m128i *)p);
+
+			if (_mm_movemask_epi8 (v) != 0 ||
+					_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero)) != 0) {
+				break;
+			}
+
+			lo = _mm_unpacklo_epi8 (v, zero);
+			hi = _mm_unpackhi_epi8 (v, zero);
+			_mm_storeu_si128 ((__m128i *)&out[n], _mm_unpacklo_epi16 (lo, zero));
+			_mm_storeu_si128 ((__m128i *)&out[n + 4], _mm_unpackhi_epi16 (lo, zero));
+			_mm_storeu_si128 ((__m128i *)&out[n + 8], _mm_unpacklo_epi16 (hi, zero));
+			_mm_storeu_si128 ((__m128i *)&out[n + 12], _mm_unpackhi_epi16 (hi, zero));
+			p += 16;
+			n += 16;
+		}
+
+		if (p == end || n == outlen) {
+			break;
+		}
+#endif
+		c = *p;
+		l = 0;
+
+		/*
+		 * Well formed sequences are decoded here, everything else including
+		 * NUL characters and noncharacters is checked by glib
+		 */
+		if (c > 0 && c < 0x80) {
+			l = 1;
+		}
+		else if (c >= 0xC2 && c < 0xE0) {
+			if (end - p >= 2 && rspamd_utf8_cont (p[1])) {
+				c = ((c & 0x1F) << 6) | (p[1] & 0x3F);
+				l = 2;
+			}
+		}
+		else if (c >= 0xE0 && c < 0xF0) {
+			if (end - p >= 3 && rspamd_utf8_cont (p[1]) &&
+					rspamd_utf8_cont (p[2])) {
+				c = ((c & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+
+				if (c >= 0x800 && (c < 0xD800 || c > 0xDFFF) &&
+						(c < 0xFDD0 || c > 0xFDEF) && (c & 0xFFFE) != 0xFFFE) {
+					l = 3;
+				}
+			}
+		}
+		else if (c >= 0xF0 && c < 0xF5) {
+			if (end - p >= 4 && rspamd_utf8_cont (p[1]) &&
+					rspamd_utf8_cont (p[2]) && rspamd_utf8_cont (p[3])) {
+				c = ((c & 0x07) << 18) | ((p[1] & 0x3F) << 12) |
+						((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+
+				if (c >= 0x10000 && c < 0x110000 && (c & 0xFFFE) != 0xFFFE) {
+					l = 4;
+				}
+			}
+		}
+
+		if (l == 0) {
+			c = g_utf8_get_char_validated ((const gchar *)p, end - p);
+
+			if (c == (gunichar)-1 || c == (gunichar)-2) {
+				break;
+			}
+
+			l = g_utf8_next_char (p) - (const gchar *)p;
+		}
+
+		out[n++] = c;
+		p += l;
+	}
+
+	if (consumed) {
+		*consumed = p - in;
+	}
+
+	return n;
+}
+
+/*
+ * Scripts of characters are stored in blocks of 128 characters, identical
+ * blocks are shared, so the whole table takes about a hundred of kilobytes
+ */
+#define RSPAMD_SCRIPT_BLOCK_BITS 7
+#define RSPAMD_SCRIPT_BLOCK (1u << RSPAMD_SCRIPT_BLOCK_BITS)
+/* Characters above this limit are checked by glib */
+#define RSPAMD_SCRIPT_TABLE_MAX 0x30000
+/* Script that is not representable in the table */
+#define RSPAMD_SCRIPT_OTHER 0xFF
+
+struct rspamd_script_block {
+	guint8 script[RSPAMD_SCRIPT_BLOCK];
+	guint8 alpha[RSPAMD_SCRIPT_BLOCK / 8];
+};
+
+struct rspamd_script_table {
+	guint16 idx[RSPAMD_SCRIPT_TABLE_MAX >> RSPAMD_SCRIPT_BLOCK_BITS];
+	struct rspamd_script_block *blocks;
+};
+
+static struct rspamd_script_table *script_table = NULL;
+
+static struct rspamd_script_table *
+rspamd_script_table_build (void)
+{
+	struct rspamd_script_table *tbl;
+	struct rspamd_script_block blk;
+	GHashTable *uniq;
+	GArray *blocks;
+	GBytes *key;
+	GUnicodeScript sc;
+	gpointer pidx;
+	gunichar c;
+	guint i, j;
+
+	tbl = g_malloc0 (sizeof (*tbl));
+	blocks = g_array_new (FALSE, FALSE, sizeof (blk));
+	uniq = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+			(GDestroyNotify)g_bytes_unref, NULL);
+
+	for (i = 0; i < G_N_ELEMENTS (tbl->idx); i ++) {
+		memset (&blk, 0, sizeof (blk));
+
+		for (j = 0; j < RSPAMD_SCRIPT_BLOCK; j ++) {
+			c = (i << RSPAMD_SCRIPT_BLOCK_BITS) | j;
+			sc = g_unichar_get_script (c);
+			blk.script[j] = (sc >= 0 && sc < RSPAMD_SCRIPT_OTHER) ?
+					sc : RSPAMD_SCRIPT_OTHER;
+
+			if (g_unichar_isalpha (c)) {
+				blk.alpha[j >> 3] |= 1u << (j & 7);
+			}
+		}
+
+		key = g_bytes_new (&blk, sizeof (blk));
+
+		if ((pidx = g_hash_table_lookup (uniq, key)) != NULL) {
+			tbl->idx[i] = GPOINTER_TO_UINT (pidx) - 1;
+			g_bytes_unref (key);
+		}
+		else {
+			tbl->idx[i] = blocks->len;
+			g_array_append_val (blocks, blk);
+			g_hash_table_insert (uniq, key, GUINT_TO_POINTER (blocks->len));
+		}
+	}
+
+	g_hash_table_unref (uniq);
+	tbl->blocks = (struct rspamd_script_block *)g_array_free (blocks, FALSE);
+
+	return tbl;
+}
+
+GUnicodeScript
+rspamd_unichar_get_script (gunichar c, gboolean *alpha)
+{
+	const struct rspamd_script_block *blk;
+	guint off;
+
+	if (G_UNLIKELY (script_table == NULL)) {
+		script_table = rspamd_script_table_build ();
+	}
+
+	if (c < RSPAMD_SCRIPT_TABLE_MAX) {
+		blk = &script_table->blocks[script_table->idx[c >> RSPAMD_SCRIPT_BLOCK_BITS]];
+		off = c & (RSPAMD_SCRIPT_BLOCK - 1);
+
+		if (alpha) {
+			*alpha = (blk->alpha[off >> 3] >> (off & 7)) & 1;
+		}
+
+		if (blk->script[off] != RSPAMD_SCRIPT_OTHER) {
+			return blk->script[off];
+		}
+	}
+	else if (alpha) {
+		*alpha = g_unichar_isalpha (c);
+	}
+
+	return g_unichar_get_script (c);
+}
@@ -310,4 +310,28 @@ gboolean rspamd_urls_cmp (gconstpointer a, gconstpointer b);
 
 extern const guchar lc_map[256];
 
+/**
+ * Decode UTF-8 string to code points. Decoding stops when `outlen` code points
+ * are decoded or at the first invalid sequence, so input is invalid if less
+ * than `outlen` code points are returned and `*consumed` is less than `len`.
+ * Validation rules are the same as for `g_utf8_get_char_validated`
+ * @param in input string
+ * @param len length of input
+ * @param out output buffer
+ * @param outlen number of code points in output buffer
+ * @param consumed number of input bytes processed
+ * @return number of decoded code points
+ */
+gsize rspamd_utf8_decode (const guchar *in, gsize len, gunichar *out,
+		gsize outlen, gsize *consumed);
+
+/**
+ * Returns script of unicode character using lookup table, results are
+ * the same as for `g_unichar_get_script` and `g_unichar_isalpha`
+ * @param c character
+ * @param alpha output TRUE if character is alphabetic
+ * @return script of character
+ */
+GUnicodeScript rspamd_unichar_get_script (gunichar c, gboolean *alpha);
+
 #endif /* SRC_LIBUTIL_STR_UTIL_H_ */
@@ -21,6 +21,7 @@
 #include "rdns.h"
 #include "cryptobox.h"
 #include "utlist.h"
+#include <math.h>
 
 struct upstream_inet_addr_entry {
 	rspamd_inet_addr_t *addr;
@@ -32,12 +33,25 @@ struct upstream_addr_elt {
 	guint errors;
 };
 
+/* Latency statistics are shared between processes if created before fork */
+struct upstream_stat {
+	gdouble latency;
+	gdouble last_update;
+	guint requests;
+	guint failures;
+	/* Protects latency and last_update that are updated together */
+	gint lock;
+};
+
 struct upstream {
 	guint weight;
 	guint cur_weight;
 	guint errors;
 	guint dns_requests;
+	guint inflight;
 	gint active_idx;
+	gdouble last_selected;
+	struct upstream_stat *st;
 	gchar *name;
 	struct event ev;
 	struct timeval tv;
@@ -78,6 +92,7 @@ struct upstream_ctx {
 	gdouble dns_timeout;
 	guint dns_retransmits;
 	GQueue *upstreams;
+	rspamd_mempool_t *pool;
 	gboolean configured;
 	ref_entry_t ref;
 };
@@ -97,6 +112,8 @@ static gdouble default_revive_jitter = 0.4;
 static gdouble default_error_time = 10;
 static gdouble default_dns_timeout = 1.0;
 static guint default_dns_retransmits = 2;
+/* Latency assumed for the failed request when nothing is known yet */
+static gdouble default_fail_latency = 0.1;
 
 void
 rspamd_upstreams_library_config (struct rspamd_config *cfg,
@@ -143,6 +160,7 @@ rspamd_upstream_ctx_dtor (struct upstream_ctx *ctx)
 	}
 
 	g_queue_free (ctx->upstreams);
+	rspamd_mempool_delete (ctx->pool);
 	g_slice_free1 (sizeof (*ctx), ctx);
 }
 
@@ -166,6 +184,7 @@ rspamd_upstreams_library_init (void)
 	ctx->revive_time = default_revive_time;
 
 	ctx->upstreams = g_queue_new ();
+	ctx->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "upstreams");
 	REF_INIT_RETAIN (ctx, rspamd_upstream_ctx_dtor);
 
 	return ctx;
@@ -383,14 +402,62 @@ rspamd_upstream_set_inactive (struct upstream_list *ls, struct upstream *up)
 	RSPAMD_UPSTREAM_UNLOCK (ls->lock);
 }
 
+static inline void
+rspamd_upstream_stat_lock (struct upstream_stat *st)
+{
+	/* Critical sections are tiny, so just spin */
+	while (!g_atomic_int_compare_and_exchange (&st->lock, 0, 1)) {
+	}
+}
+
+static inline void
+rspamd_upstream_stat_unlock (struct upstream_stat *st)
+{
+	g_atomic_int_set (&st->lock, 0);
+}
+
+/*
+ * Latency decays with time since the last update, so upstreams that have been
+ * penalized are eventually tried again. Should be called with stat locked
+ */
+static inline gdouble
+rspamd_upstream_stat_latency (struct upstream *up, gdouble now)
+{
+	struct upstream_stat *st = up->st;
+
+	if (st->last_update == 0 || now <= st->last_update) {
+		return st->latency;
+	}
+
+	return st->latency * exp (-(now - st->last_update) / up->ctx->error_time);
+}
+
 void
 rspamd_upstream_fail (struct upstream *up)
 {
 	struct timeval tv;
 	gdouble error_rate, max_error_rate;
-	gdouble sec_last, sec_cur;
+	gdouble sec_last, sec_cur, now, lat;
 	struct upstream_addr_elt *addr_elt;
 
+	g_atomic_int_inc (&up->st->failures);
+
+	if (up->inflight > 0) {
+		up->inflight --;
+	}
+
+	/*
+	 * Failed request is treated as a slow one, but the penalty is limited by
+	 * error time, so it is forgotten like errors are
+	 */
+	now = rspamd_get_ticks ();
+	rspamd_upstream_stat_lock (up->st);
+	lat = rspamd_upstream_stat_latency (up, now);
+	lat = MAX (lat * 2.0, default_fail_latency);
+	up->st->latency = MIN (lat, up->ctx->error_time);
+	up->st->last_update = now;
+	rspamd_upstream_stat_unlock (up->st);
+
 	if (up->active_idx != -1) {
 		gettimeofday (&tv, NULL);
 
@@ -453,6 +520,41 @@ rspamd_upstream_ok (struct upstream *up)
 	RSPAMD_UPSTREAM_UNLOCK (up->lock);
 }
 
+void
+rspamd_upstream_latency (struct upstream *up, gdouble latency)
+{
+	struct upstream_stat *st = up->st;
+	gdouble now, w;
+
+	if (up->inflight > 0) {
+		up->inflight --;
+	}
+
+	if (latency < 0) {
+		return;
+	}
+
+	now = rspamd_get_ticks ();
+	g_atomic_int_inc (&st->requests);
+
+	/*
+	 * Peak EWMA: slow responses are taken into account immediately and
+	 * the average decays towards faster responses with time
+	 */
+	rspamd_upstream_stat_lock (st);
+
+	if (latency > st->latency || st->last_update == 0) {
+		st->latency = latency;
+	}
+	else if (now > st->last_update) {
+		w = exp (-(now - st->last_update) / up->ctx->error_time);
+		st->latency = st->latency * w + latency * (1.0 - w);
+	}
+
+	st->last_update = now;
+	rspamd_upstream_stat_unlock (st);
+}
+
 #define SEED_CONSTANT 0xa574de7df64e9b9dULL
 
 struct upstream_list*
@@ -576,6 +678,7 @@ rspamd_upstreams_add_upstream (struct upstream_list *ups,
 	REF_INIT_RETAIN (up, rspamd_upstream_dtor);
 	up->lock = rspamd_mutex_new ();
 	up->ctx = ups->ctx;
+	up->st = rspamd_mempool_alloc0_shared (ups->ctx->pool, sizeof (*up->st));
 	REF_RETAIN (ups->ctx);
 	g_queue_push_tail (ups->ctx->upstreams, up);
 	up->ctx_pos = g_queue_peek_tail_link (ups->ctx->upstreams);
@@ -650,6 +753,12 @@ rspamd_upstreams_parse_line (struct upstream_list *ups,
 		ups->rot_alg = RSPAMD_UPSTREAM_SEQUENTIAL;
 		p += sizeof ("sequential:") - 1;
 	}
+	else if (g_ascii_strncasecmp (p,
+			"latency:",
+			sizeof ("latency:") - 1) == 0) {
+		ups->rot_alg = RSPAMD_UPSTREAM_LATENCY;
+		p += sizeof ("latency:") - 1;
+	}
 
 	while (p < end) {
 		len = strcspn (p, separators);
@@ -827,6 +936,65 @@ rspamd_upstream_get_hashed (struct upstream_list *ups, const guint8 *key, guint
 	return g_ptr_array_index (ups->alive, idx);
 }
 
+static inline gdouble
+rspamd_upstream_cost (struct upstream *up, gdouble now)
+{
+	gdouble lat;
+
+	/*
+	 * Requests that have not been reported for a long time are likely lost
+	 * by the caller, so they are not counted
+	 */
+	if (up->inflight > 0 && now - up->last_selected > up->ctx->error_time) {
+		up->inflight = 0;
+	}
+
+	rspamd_upstream_stat_lock (up->st);
+	lat = rspamd_upstream_stat_latency (up, now);
+	rspamd_upstream_stat_unlock (up->st);
+
+	/* Upstreams without latency information are tried first */
+	return (lat + 1e-6) * (up->inflight + 1);
+}
+
+/*
+ * Power of two choices: select two random upstreams and use the one with
+ * lower latency multiplied by the number of requests in flight
+ */
+static struct upstream*
+rspamd_upstream_get_latency (struct upstream_list *ups)
+{
+	struct upstream *u1, *u2, *selected;
+	guint i1, i2;
+	gdouble now;
+
+	RSPAMD_UPSTREAM_LOCK (ups->lock);
+	now = rspamd_get_ticks ();
+
+	if (ups->alive->len == 1) {
+		selected = g_ptr_array_index (ups->alive, 0);
+	}
+	else {
+		i1 = ottery_rand_range (ups->alive->len - 1);
+		i2 = ottery_rand_range (ups->alive->len - 2);
+
+		if (i2 >= i1) {
+			i2 ++;
+		}
+
+		u1 = g_ptr_array_index (ups->alive, i1);
+		u2 = g_ptr_array_index (ups->alive, i2);
+		selected = rspamd_upstream_cost (u1, now) <= rspamd_upstream_cost (u2, now) ?
+				u1 : u2;
+	}
+
+	selected->inflight ++;
+	selected->last_selected = now;
+	RSPAMD_UPSTREAM_UNLOCK (ups->lock);
+
+	return selected;
+}
+
 static struct upstream*
 rspamd_upstream_get_common (struct upstream_list *ups,
 		enum rspamd_upstream_rotation default_type,
@@ -863,6 +1031,8 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 		return rspamd_upstream_get_round_robin (ups, TRUE);
 	case RSPAMD_UPSTREAM_MASTER_SLAVE:
 		return rspamd_upstream_get_round_robin (ups, FALSE);
+	case RSPAMD_UPSTREAM_LATENCY:
+		return rspamd_upstream_get_latency (ups);
 	case RSPAMD_UPSTREAM_SEQUENTIAL:
 		if (ups->cur_elt >= ups->alive->len) {
 			ups->cur_elt = 0;
@@ -965,3 +1135,40 @@ rspamd_upstreams_foreach (struct upstream_list *ups,
 		cb (up, ud);
 	}
 }
+
+ucl_object_t *
+rspamd_upstreams_library_stat (struct upstream_ctx *ctx)
+{
+	ucl_object_t *res, *obj;
+	GList *cur;
+	struct upstream *up;
+
+	res = ucl_object_typed_new (UCL_ARRAY);
+
+	if (ctx == NULL) {
+		return res;
+	}
+
+	for (cur = ctx->upstreams->head; cur != NULL; cur = g_list_next (cur)) {
+		up = cur->data;
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromstring (up->name),
+				"name", 0, false);
+		ucl_object_insert_key (obj, ucl_object_frombool (up->active_idx != -1),
+				"alive", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (up->st->requests),
+				"requests", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (up->st->failures),
+				"failures", 0, false);
+		rspamd_upstream_stat_lock (up->st);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (
+				rspamd_upstream_stat_latency (up, rspamd_get_ticks ())),
+				"latency", 0, false);
+		rspamd_upstream_stat_unlock (up->st);
+		ucl_object_insert_key (obj, ucl_object_fromint (up->inflight),
+				"inflight", 0, false);
+		ucl_array_append (res, obj);
+	}
+
+	return res;
+}
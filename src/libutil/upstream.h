@@ -12,6 +12,7 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
 	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LATENCY,
 	RSPAMD_UPSTREAM_UNDEF
 };
 
@@ -62,6 +63,16 @@ void rspamd_upstream_fail (struct upstream *up);
  */
 void rspamd_upstream_ok (struct upstream *up);
 
+/**
+ * Report latency of a successful request to upstream in seconds.
+ * Latency rotation selects two random upstreams and prefers the one with
+ * lower peak EWMA of latency multiplied by number of requests in flight,
+ * so every request to an upstream selected this way should be finished
+ * by either this function or `rspamd_upstream_fail`. Latency decays with
+ * `error_time` since the last report, failures double it up to `error_time`
+ */
+void rspamd_upstream_latency (struct upstream *up, gdouble latency);
+
 /**
  * Create new list of upstreams
  * @return
@@ -205,6 +216,12 @@ struct upstream* rspamd_upstream_get_forced (struct upstream_list *ups,
  */
 void rspamd_upstream_reresolve (struct upstream_ctx *ctx);
 
+/**
+ * Returns array of latency statistics for all upstreams registered,
+ * statistics of upstreams created before fork are shared between processes
+ */
+ucl_object_t *rspamd_upstreams_library_stat (struct upstream_ctx *ctx);
+
 #endif /* UPSTREAM_H */
 /*
  * vi:ts=4
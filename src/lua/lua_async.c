@@ -0,0 +1,331 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lua_common.h"
+
+/***
+ * @module rspamd_async
+ * This module allows to write asynchronous code without callbacks. If a symbol
+ * is registered with `coroutine = true` then its callback is executed as a lua
+ * coroutine. Within such a callback, `rspamd_http.request`, `rspamd_tcp.request`,
+ * `rspamd_redis.make_request` and resolver methods called without `callback`
+ * argument suspend the symbol's callback until the request is finished and
+ * return its results instead of calling a callback. Functions from this module
+ * allow to run several requests at once.
+ *
+ * Please note that Lua 5.1 cannot yield across `pcall` and metamethods, hence
+ * asynchronous functions should not be called from them (LuaJIT has no such limitation).
+ * @example
+local rspamd_async = require "rspamd_async"
+local rspamd_http = require "rspamd_http"
+
+local function symbol_callback(task)
+	-- Both requests are sent at once
+	local body, results = rspamd_async.all(
+		function()
+			local err, code, body = rspamd_http.request({
+				task = task,
+				url = 'http://example.com/data',
+			})
+			return body
+		end,
+		function()
+			return task:get_resolver():resolve_a({
+				task = task,
+				name = 'example.com',
+			})
+		end)
+
+	if body and results then
+		return true
+	end
+end
+
+rspamd_config:register_symbol({
+	name = 'SYMBOL',
+	callback = symbol_callback,
+	coroutine = true,
+})
+ */
+
+LUA_FUNCTION_DEF (async, all);
+
+static const struct luaL_reg asynclib_f[] = {
+	LUA_INTERFACE_DEF (async, all),
+	{NULL, NULL}
+};
+
+/* Coroutines indexed by their lua states */
+static GHashTable *lua_coroutines = NULL;
+
+struct lua_async_join {
+	struct rspamd_lua_coroutine *co;
+	lua_State *L;
+	gint *refs;
+	guint nfuncs;
+	guint pending;
+	gboolean suspended;
+};
+
+struct lua_async_child {
+	struct lua_async_join *join;
+	guint idx;
+};
+
+static void
+rspamd_lua_coroutine_dtor (gpointer p)
+{
+	struct rspamd_lua_coroutine *co = p;
+
+	g_hash_table_remove (lua_coroutines, co->L);
+	luaL_unref (co->main, LUA_REGISTRYINDEX, co->ref);
+}
+
+struct rspamd_lua_coroutine *
+rspamd_lua_coroutine_new (lua_State *L,
+		struct rspamd_task *task,
+		rspamd_lua_coroutine_fin_t fin,
+		gpointer ud)
+{
+	struct rspamd_lua_coroutine *co;
+
+	g_assert (task != NULL);
+
+	if (lua_coroutines == NULL) {
+		lua_coroutines = g_hash_table_new (g_direct_hash, g_direct_equal);
+	}
+
+	co = rspamd_mempool_alloc0 (task->task_pool, sizeof (*co));
+	co->task = task;
+	co->fin = fin;
+	co->ud = ud;
+	co->parent = rspamd_lua_coroutine_current (L);
+	co->main = co->parent ? co->parent->main : L;
+	co->L = lua_newthread (L);
+	/* Thread is referenced until the task is destroyed */
+	co->ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	if (co->parent == NULL) {
+		/*
+		 * Top level coroutine is created from a symbol's callback, so we
+		 * remember its watcher to keep the symbol pending while suspended
+		 */
+		co->w = rspamd_session_get_watcher (task->s);
+	}
+
+	g_hash_table_insert (lua_coroutines, co->L, co);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_lua_coroutine_dtor, co);
+
+	return co;
+}
+
+gint
+rspamd_lua_coroutine_resume (struct rspamd_lua_coroutine *co, gint nargs)
+{
+	struct rspamd_task *task = co->task;
+	gint ret;
+
+	if (co->finished) {
+		msg_err_task ("cannot resume finished coroutine");
+		lua_pop (co->L, nargs);
+
+		return LUA_ERRRUN;
+	}
+
+	ret = rspamd_lua_resume (co->L, nargs);
+
+	if (ret == LUA_YIELD) {
+		if (co->w != NULL && !co->watching) {
+			co->watching = TRUE;
+			rspamd_session_watcher_push_specific (task->s, co->w);
+		}
+
+		return ret;
+	}
+
+	co->finished = TRUE;
+
+	if (co->fin) {
+		co->fin (co, ret, ret == 0 ? lua_gettop (co->L) : 1, co->ud);
+	}
+	else if (ret != 0) {
+		msg_err_task ("call to lua coroutine failed: %s",
+				lua_tostring (co->L, -1));
+	}
+
+	lua_settop (co->L, 0);
+
+	if (co->watching) {
+		co->watching = FALSE;
+		rspamd_session_watcher_pop (task->s, co->w);
+	}
+
+	return ret;
+}
+
+struct rspamd_lua_coroutine *
+rspamd_lua_coroutine_current (lua_State *L)
+{
+	if (lua_coroutines == NULL) {
+		return NULL;
+	}
+
+	return g_hash_table_lookup (lua_coroutines, L);
+}
+
+lua_State *
+rspamd_lua_coroutine_main_state (lua_State *L)
+{
+	struct rspamd_lua_coroutine *co;
+
+	co = rspamd_lua_coroutine_current (L);
+
+	return co ? co->main : L;
+}
+
+static void
+lua_async_join_dtor (gpointer p)
+{
+	struct lua_async_join *join = p;
+	guint i;
+
+	/* Results are not pushed if a task has been terminated */
+	for (i = 0; i < join->nfuncs; i ++) {
+		luaL_unref (join->L, LUA_REGISTRYINDEX, join->refs[i]);
+	}
+}
+
+static void
+lua_async_join_push (struct lua_async_join *join, lua_State *L)
+{
+	guint i;
+
+	luaL_checkstack (L, join->nfuncs, "too many results");
+
+	for (i = 0; i < join->nfuncs; i ++) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, join->refs[i]);
+		luaL_unref (L, LUA_REGISTRYINDEX, join->refs[i]);
+		join->refs[i] = LUA_NOREF;
+	}
+}
+
+static void
+lua_async_child_fin (struct rspamd_lua_coroutine *co, gint status,
+		gint nresults, gpointer ud)
+{
+	struct lua_async_child *child = ud;
+	struct lua_async_join *join = child->join;
+	struct rspamd_task *task = co->task;
+
+	if (status != 0) {
+		msg_err_task ("call to async function failed: %s",
+				lua_tostring (co->L, -1));
+	}
+	else if (nresults > 0) {
+		/* We use merely the first returned value */
+		lua_pushvalue (co->L, -nresults);
+		join->refs[child->idx] = luaL_ref (co->L, LUA_REGISTRYINDEX);
+	}
+
+	join->pending --;
+
+	if (join->pending == 0 && join->suspended) {
+		join->suspended = FALSE;
+		lua_async_join_push (join, join->co->L);
+		rspamd_lua_coroutine_resume (join->co, join->nfuncs);
+	}
+}
+
+/***
+ * @function rspamd_async.all(f1, f2, ...)
+ * Runs all functions specified as coroutines and waits for all of them to
+ * finish. This function can be called merely from a coroutine (e.g. a symbol
+ * callback registered with `coroutine = true`).
+ * @param {function} f functions to run, each of them is called with no arguments
+ * @return {multiple} the first value returned by each function (or `nil` on error) in the same order
+ */
+static gint
+lua_async_all (lua_State *L)
+{
+	struct rspamd_lua_coroutine *co, *child_co;
+	struct lua_async_join *join;
+	struct lua_async_child *child;
+	rspamd_mempool_t *pool;
+	gint i, nfuncs;
+
+	co = rspamd_lua_coroutine_current (L);
+
+	if (co == NULL) {
+		return luaL_error (L, "rspamd_async.all must be called from a coroutine");
+	}
+
+	nfuncs = lua_gettop (L);
+
+	for (i = 1; i <= nfuncs; i ++) {
+		luaL_checktype (L, i, LUA_TFUNCTION);
+	}
+
+	pool = co->task->task_pool;
+	join = rspamd_mempool_alloc0 (pool, sizeof (*join));
+	join->co = co;
+	join->L = co->main;
+	join->nfuncs = nfuncs;
+	join->pending = nfuncs;
+	join->refs = rspamd_mempool_alloc (pool, sizeof (gint) * MAX (nfuncs, 1));
+
+	for (i = 0; i < nfuncs; i ++) {
+		join->refs[i] = LUA_NOREF;
+	}
+
+	rspamd_mempool_add_destructor (pool, lua_async_join_dtor, join);
+
+	for (i = 0; i < nfuncs; i ++) {
+		child = rspamd_mempool_alloc (pool, sizeof (*child));
+		child->join = join;
+		child->idx = i;
+		child_co = rspamd_lua_coroutine_new (L, co->task,
+				lua_async_child_fin, child);
+		lua_pushvalue (L, i + 1);
+		lua_xmove (L, child_co->L, 1);
+		rspamd_lua_coroutine_resume (child_co, 0);
+	}
+
+	if (join->pending > 0) {
+		join->suspended = TRUE;
+
+		return lua_yield (L, 0);
+	}
+
+	/* All functions have finished without suspending */
+	lua_async_join_push (join, L);
+
+	return nfuncs;
+}
+
+static gint
+lua_load_async (lua_State * L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, asynclib_f);
+
+	return 1;
+}
+
+void
+luaopen_async (lua_State * L)
+{
+	rspamd_lua_add_preload (L, "rspamd_async", lua_load_async);
+}
@@ -121,10 +121,12 @@ rspamd_lua_post_load_config (struct rspamd_config *cfg)
 	lua_State *L = cfg->lua_state;
 	const gchar *name, *val;
 	gchar *sym;
-	struct rspamd_expression *expr, *old_expr;
+	struct rspamd_expression *expr;
+	struct rspamd_composite *composite, *old_composite;
 	ucl_object_t *obj;
 	gsize keylen;
 	GError *err = NULL;
+	gboolean composites_changed = FALSE;
 
 	/* First check all module options that may be overriden in 'config' global */
 	lua_getglobal (L, "config");
@@ -183,22 +185,33 @@ rspamd_lua_post_load_config (struct rspamd_config *cfg)
 					err = NULL;
 					continue;
 				}
+				composite = rspamd_mempool_alloc0 (cfg->cfg_pool,
+						sizeof (struct rspamd_composite));
+				composite->expr = expr;
+				composite->id = g_hash_table_size (cfg->composite_symbols);
 				/* Now check hash table for this composite */
-				if ((old_expr =
+				if ((old_composite =
 					g_hash_table_lookup (cfg->composite_symbols,
 					name)) != NULL) {
 					msg_info_config("replacing composite symbol %s", name);
-					g_hash_table_replace (cfg->composite_symbols, sym, expr);
+					g_hash_table_replace (cfg->composite_symbols, sym, composite);
 				}
 				else {
-					g_hash_table_insert (cfg->composite_symbols, sym, expr);
+					g_hash_table_insert (cfg->composite_symbols, sym, composite);
 					rspamd_symbols_cache_add_symbol (cfg->cache, sym,
 							0, NULL, NULL, SYMBOL_TYPE_COMPOSITE, -1);
 				}
+
+				composites_changed = TRUE;
 			}
 		}
 	}
 
+	if (composites_changed && cfg->composites_index != NULL) {
+		/* Index refers to the replaced composites, so rebuild it */
+		rspamd_composites_compile (cfg);
+	}
+
 	lua_settop (L, 0);
 }
 
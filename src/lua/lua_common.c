@@ -270,6 +270,8 @@ rspamd_lua_init ()
 	luaopen_fann (L);
 	luaopen_sqlite3 (L);
 	luaopen_cryptobox (L);
+	luaopen_async (L);
+	luaopen_ffi (L);
 	luaopen_lpeg (L);
 
 	rspamd_lua_add_preload (L, "ucl", luaopen_ucl);
@@ -372,6 +374,9 @@ rspamd_init_lua_filters (struct rspamd_config *cfg)
 	/* Assign state */
 	cfg->lua_state = L;
 
+	/* Build merged tries before forking, so workers do not compile them */
+	rspamd_lua_trie_compile_registered ();
+
 	return TRUE;
 }
 
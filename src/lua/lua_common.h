@@ -20,6 +20,12 @@
 #define luaL_reg    luaL_Reg
 #endif
 
+#if LUA_VERSION_NUM > 501
+#define rspamd_lua_resume(L, nargs) lua_resume ((L), NULL, (nargs))
+#else
+#define rspamd_lua_resume(L, nargs) lua_resume ((L), (nargs))
+#endif
+
 #define LUA_ENUM(L, name, val) \
 	lua_pushlstring (L, # name, sizeof(# name) - 1); \
 	lua_pushnumber (L, val); \
@@ -109,6 +115,32 @@ struct rspamd_lua_map {
 	} data;
 };
 
+struct rspamd_lua_coroutine;
+
+/**
+ * Called when a coroutine is finished, `status` is the result of `lua_resume`
+ * and `nresults` is the number of values returned (or 1 for an error message)
+ */
+typedef void (*rspamd_lua_coroutine_fin_t) (struct rspamd_lua_coroutine *co,
+		gint status, gint nresults, gpointer ud);
+
+/**
+ * Lua thread that runs some function on behalf of a task and could be
+ * suspended by asynchronous functions
+ */
+struct rspamd_lua_coroutine {
+	lua_State *L;
+	lua_State *main;
+	struct rspamd_task *task;
+	struct rspamd_lua_coroutine *parent;
+	struct rspamd_async_watcher *w;
+	rspamd_lua_coroutine_fin_t fin;
+	gpointer ud;
+	gint ref;
+	gboolean watching;
+	gboolean finished;
+};
+
 /* Common utility functions */
 
 /**
@@ -162,6 +194,11 @@ lua_State *rspamd_lua_init (void);
  */
 gboolean rspamd_init_lua_filters (struct rspamd_config *cfg);
 
+/**
+ * Compile merged matchers of tries registered for searching in tasks
+ */
+void rspamd_lua_trie_compile_registered (void);
+
 /**
  * Initialize new locked lua_State structure
  */
@@ -255,6 +292,8 @@ void luaopen_html (lua_State * L);
 void luaopen_fann (lua_State *L);
 void luaopen_sqlite3 (lua_State *L);
 void luaopen_cryptobox (lua_State *L);
+void luaopen_async (lua_State *L);
+void luaopen_ffi (lua_State *L);
 
 void rspamd_lua_call_post_filters (struct rspamd_task *task);
 void rspamd_lua_call_pre_filters (struct rspamd_task *task);
@@ -356,5 +395,39 @@ gsize lua_logger_out_type (lua_State *L, gint pos, gchar *outbuf,
  */
 void *rspamd_lua_check_udata (lua_State *L, gint pos, const gchar *classname);
 
+/**
+ * Creates new coroutine for the specified task, the coroutine lives until the
+ * task's pool is destroyed. The function to run should be pushed to `co->L`
+ * and then `rspamd_lua_coroutine_resume` should be called
+ * @param L lua state (or another coroutine for nested coroutines)
+ * @param task task object
+ * @param fin function called when coroutine is finished
+ * @param ud userdata for `fin`
+ * @return new coroutine
+ */
+struct rspamd_lua_coroutine *rspamd_lua_coroutine_new (lua_State *L,
+		struct rspamd_task *task,
+		rspamd_lua_coroutine_fin_t fin,
+		gpointer ud);
+
+/**
+ * Starts or continues coroutine passing `nargs` values from the top of its stack
+ * @param co coroutine
+ * @param nargs number of arguments
+ * @return result of `lua_resume`
+ */
+gint rspamd_lua_coroutine_resume (struct rspamd_lua_coroutine *co, gint nargs);
+
+/**
+ * Returns coroutine for lua state `L` or NULL if `L` is not a coroutine
+ */
+struct rspamd_lua_coroutine *rspamd_lua_coroutine_current (lua_State *L);
+
+/**
+ * Returns the main lua state if `L` is a coroutine: callbacks must not be
+ * called using coroutine state as it could be suspended or finished
+ */
+lua_State *rspamd_lua_coroutine_main_state (lua_State *L);
+
 #endif /* WITH_LUA */
 #endif /* RSPAMD_LUA_H */
@@ -177,6 +177,8 @@ LUA_FUNCTION_DEF (config, get_classifier);
  *     + `empty` if symbol can be called for empty messages
  *     + `skip` if symbol should be skipped now
  * - `parent`: id of parent symbol (useful for virtual symbols)
+ * - `coroutine`: run callback as a coroutine, so asynchronous requests
+ *     could be issued without callbacks (see `rspamd_async` module)
  *
  * @return {number} id of symbol registered
  */
@@ -632,6 +634,7 @@ struct lua_callback_data {
 		gint ref;
 	} callback;
 	gboolean cb_is_ref;
+	gboolean coroutine;
 	gint order;
 };
 
@@ -870,6 +873,87 @@ lua_config_get_key (lua_State *L)
 	return 1;
 }
 
+static void
+lua_metric_symbol_process_results (lua_State *L, struct rspamd_task *task,
+		struct lua_callback_data *cd, gint level)
+{
+	/* Function returned boolean, so maybe we need to insert result? */
+	gint res = 0;
+	GList *opts = NULL;
+	gint i;
+	gdouble flag = 1.0;
+
+	if (lua_type (L, level + 1) == LUA_TBOOLEAN) {
+		res = lua_toboolean (L, level + 1);
+	}
+	else {
+		res = lua_tonumber (L, level + 1);
+	}
+
+	if (res) {
+		gint first_opt = 2;
+
+		if (lua_type (L, level + 2) == LUA_TNUMBER) {
+			flag = lua_tonumber (L, level + 2);
+			/* Shift opt index */
+			first_opt = 3;
+		}
+		else {
+			flag = res;
+		}
+
+		for (i = lua_gettop (L); i >= level + first_opt; i--) {
+			if (lua_type (L, i) == LUA_TSTRING) {
+				const char *opt = lua_tostring (L, i);
+
+				opts = g_list_prepend (opts,
+						rspamd_mempool_strdup (task->task_pool,
+								opt));
+			}
+		}
+
+		rspamd_task_insert_result (task, cd->symbol, flag, opts);
+	}
+}
+
+static void
+lua_metric_symbol_coroutine_fin (struct rspamd_lua_coroutine *co, gint status,
+		gint nresults, gpointer ud)
+{
+	struct lua_callback_data *cd = ud;
+	struct rspamd_task *task = co->task;
+
+	if (status != 0) {
+		msg_err_task ("call to (%s) failed: %s", cd->symbol,
+				lua_tostring (co->L, -1));
+	}
+	else if (nresults >= 1) {
+		lua_metric_symbol_process_results (co->L, task, cd,
+				lua_gettop (co->L) - nresults);
+	}
+}
+
+static void
+lua_metric_symbol_callback_coroutine (struct rspamd_task *task,
+		struct lua_callback_data *cd)
+{
+	struct rspamd_lua_coroutine *co;
+
+	co = rspamd_lua_coroutine_new (cd->L, task,
+			lua_metric_symbol_coroutine_fin, cd);
+
+	if (cd->cb_is_ref) {
+		lua_rawgeti (co->L, LUA_REGISTRYINDEX, cd->callback.ref);
+	}
+	else {
+		lua_getglobal (co->L, cd->callback.name);
+	}
+
+	rspamd_lua_task_push (co->L, task);
+	/* Symbol is finished when the coroutine is finished */
+	rspamd_lua_coroutine_resume (co, 1);
+}
+
 static void
 lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
 {
@@ -879,6 +963,12 @@ lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
 	lua_State *L = cd->L;
 	GString *tb;
 
+	if (cd->coroutine) {
+		lua_metric_symbol_callback_coroutine (task, cd);
+
+		return;
+	}
+
 	lua_pushcfunction (L, &rspamd_lua_traceback);
 	err_idx = lua_gettop (L);
 
@@ -905,44 +995,7 @@ lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
 		nresults = lua_gettop (L) - level;
 
 		if (nresults >= 1) {
-			/* Function returned boolean, so maybe we need to insert result? */
-			gint res = 0;
-			GList *opts = NULL;
-			gint i;
-			gdouble flag = 1.0;
-
-			if (lua_type (cd->L, level + 1) == LUA_TBOOLEAN) {
-				res = lua_toboolean (L, level + 1);
-			}
-			else {
-				res = lua_tonumber (L, level + 1);
-			}
-
-			if (res) {
-				gint first_opt = 2;
-
-				if (lua_type (L, level + 2) == LUA_TNUMBER) {
-					flag = lua_tonumber (L, level + 2);
-					/* Shift opt index */
-					first_opt = 3;
-				}
-				else {
-					flag = res;
-				}
-
-				for (i = lua_gettop (L); i >= level + first_opt; i--) {
-					if (lua_type (L, i) == LUA_TSTRING) {
-						const char *opt = lua_tostring (L, i);
-
-						opts = g_list_prepend (opts,
-								rspamd_mempool_strdup (task->task_pool,
-										opt));
-					}
-				}
-
-				rspamd_task_insert_result (task, cd->symbol, flag, opts);
-			}
-
+			lua_metric_symbol_process_results (L, task, cd, level);
 			lua_pop (L, nresults);
 		}
 	}
@@ -959,7 +1012,8 @@ rspamd_register_symbol_fromlua (lua_State *L,
 		gint priority,
 		enum rspamd_symbol_type type,
 		gint parent,
-		gboolean optional)
+		gboolean optional,
+		gboolean coroutine)
 {
 	struct lua_callback_data *cd;
 	gint ret = -1;
@@ -968,6 +1022,7 @@ rspamd_register_symbol_fromlua (lua_State *L,
 			sizeof (struct lua_callback_data));
 	cd->magic = rspamd_lua_callback_magic;
 	cd->cb_is_ref = TRUE;
+	cd->coroutine = coroutine;
 	cd->callback.ref = ref;
 	cd->L = L;
 	cd->symbol = rspamd_mempool_strdup (cfg->cfg_pool, name);
@@ -1057,13 +1112,15 @@ lua_config_register_symbol (lua_State * L)
 	double weight = 0;
 	gint ret = -1, cbref = -1, type;
 	gint64 parent = 0, priority = 0;
+	gboolean coroutine = FALSE;
 	GError *err = NULL;
 
 	if (cfg) {
 		if (!rspamd_lua_parse_table_arguments (L, 2, &err,
-				"name=S;weigth=N;callback=F;flags=S;type=S;priority=I;parent=I",
+				"name=S;weigth=N;callback=F;flags=S;type=S;priority=I;parent=I;"
+				"coroutine=B",
 				&name, &weight, &cbref, &flags_str, &type_str,
-				&priority, &parent)) {
+				&priority, &parent, &coroutine)) {
 			msg_err_config ("bad arguments: %e", err);
 			g_error_free (err);
 
@@ -1089,7 +1146,8 @@ lua_config_register_symbol (lua_State * L)
 				priority,
 				type,
 				parent == 0 ? -1 : parent,
-				FALSE);
+				FALSE,
+				coroutine);
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
@@ -1142,6 +1200,7 @@ lua_config_register_symbols (lua_State *L)
 				0,
 				SYMBOL_TYPE_CALLBACK,
 				-1,
+				FALSE,
 				FALSE);
 
 		for (i = top; i <= lua_gettop (L); i++) {
@@ -1231,6 +1290,7 @@ lua_config_register_callback_symbol (lua_State * L)
 				0,
 				SYMBOL_TYPE_CALLBACK,
 				-1,
+				FALSE,
 				FALSE);
 	}
 
@@ -1272,6 +1332,7 @@ lua_config_register_callback_symbol_priority (lua_State * L)
 				priority,
 				SYMBOL_TYPE_CALLBACK,
 				-1,
+				FALSE,
 				FALSE);
 	}
 
@@ -1481,6 +1542,11 @@ lua_config_add_composite (lua_State * L)
 							0, NULL, NULL, SYMBOL_TYPE_COMPOSITE, -1);
 				}
 
+				if (cfg->composites_index != NULL) {
+					/* Config has been already loaded, so rebuild index now */
+					rspamd_composites_compile (cfg);
+				}
+
 				ret = TRUE;
 			}
 		}
@@ -1513,6 +1579,7 @@ lua_config_newindex (lua_State *L)
 					0,
 					SYMBOL_TYPE_NORMAL,
 					-1,
+					FALSE,
 					FALSE);
 		}
 		else if (lua_type (L, 3) == LUA_TTABLE) {
@@ -1599,7 +1666,8 @@ lua_config_newindex (lua_State *L)
 					priority,
 					type,
 					-1,
-					optional);
+					optional,
+					FALSE);
 
 			if (id != -1) {
 				/* Check for condition */
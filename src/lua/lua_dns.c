@@ -83,6 +83,7 @@ struct lua_dns_cbdata {
 	const gchar *user_str;
 	struct rspamd_async_watcher *w;
 	struct rspamd_async_session *s;
+	struct rspamd_lua_coroutine *co;
 };
 
 static int
@@ -128,69 +129,83 @@ lua_dns_get_type (lua_State *L, int argno)
 }
 
 static void
-lua_dns_callback (struct rdns_reply *reply, gpointer arg)
+lua_dns_push_results (lua_State *L, struct rdns_reply *reply)
 {
-	struct lua_dns_cbdata *cd = arg;
 	gint i = 0;
-	struct rspamd_dns_resolver **presolver;
 	struct rdns_reply_entry *elt;
 	rspamd_inet_addr_t *addr;
 
-	lua_rawgeti (cd->L, LUA_REGISTRYINDEX, cd->cbref);
-	presolver = lua_newuserdata (cd->L, sizeof (gpointer));
-	rspamd_lua_setclass (cd->L, "rspamd{resolver}", -1);
-
-	*presolver = cd->resolver;
-	lua_pushstring (cd->L, cd->to_resolve);
-
 	/*
 	 * XXX: rework to handle different request types
 	 */
 	if (reply->code == RDNS_RC_NOERROR) {
-		lua_newtable (cd->L);
+		lua_newtable (L);
 		LL_FOREACH (reply->entries, elt)
 		{
 			switch (elt->type) {
 			case RDNS_REQUEST_A:
 				addr = rspamd_inet_address_new (AF_INET, &elt->content.a.addr);
-				rspamd_lua_ip_push (cd->L, addr);
+				rspamd_lua_ip_push (L, addr);
 				rspamd_inet_address_destroy (addr);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_AAAA:
 				addr = rspamd_inet_address_new (AF_INET6, &elt->content.aaa.addr);
-				rspamd_lua_ip_push (cd->L, addr);
+				rspamd_lua_ip_push (L, addr);
 				rspamd_inet_address_destroy (addr);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_PTR:
-				lua_pushstring (cd->L, elt->content.ptr.name);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_pushstring (L, elt->content.ptr.name);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_TXT:
 			case RDNS_REQUEST_SPF:
-				lua_pushstring (cd->L, elt->content.txt.data);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_pushstring (L, elt->content.txt.data);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_MX:
 				/* mx['name'], mx['priority'] */
-				lua_newtable (cd->L);
-				rspamd_lua_table_set (cd->L, "name", elt->content.mx.name);
-				lua_pushstring (cd->L, "priority");
-				lua_pushnumber (cd->L, elt->content.mx.priority);
-				lua_settable (cd->L, -3);
+				lua_newtable (L);
+				rspamd_lua_table_set (L, "name", elt->content.mx.name);
+				lua_pushstring (L, "priority");
+				lua_pushnumber (L, elt->content.mx.priority);
+				lua_settable (L, -3);
 
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			}
 		}
-		lua_pushnil (cd->L);
+		lua_pushnil (L);
 	}
 	else {
-		lua_pushnil (cd->L);
-		lua_pushstring (cd->L, rdns_strerror (reply->code));
+		lua_pushnil (L);
+		lua_pushstring (L, rdns_strerror (reply->code));
+	}
+}
+
+static void
+lua_dns_callback (struct rdns_reply *reply, gpointer arg)
+{
+	struct lua_dns_cbdata *cd = arg;
+	struct rspamd_dns_resolver **presolver;
+
+	if (cd->co) {
+		/* Results are returned from the suspended request function */
+		lua_dns_push_results (cd->co->L, reply);
+		rspamd_lua_coroutine_resume (cd->co, 2);
+
+		return;
 	}
 
+	lua_rawgeti (cd->L, LUA_REGISTRYINDEX, cd->cbref);
+	presolver = lua_newuserdata (cd->L, sizeof (gpointer));
+	rspamd_lua_setclass (cd->L, "rspamd{resolver}", -1);
+
+	*presolver = cd->resolver;
+	lua_pushstring (cd->L, cd->to_resolve);
+	lua_dns_push_results (cd->L, reply);
+
 	if (cd->user_str != NULL) {
 		lua_pushstring (cd->L, cd->user_str);
 	}
@@ -260,6 +275,7 @@ lua_dns_resolver_resolve_common (lua_State *L,
 	rspamd_mempool_t *pool = NULL;
 	const gchar *to_resolve = NULL, *user_str = NULL;
 	struct lua_dns_cbdata *cbdata;
+	struct rspamd_lua_coroutine *co;
 	gint cbref = -1, ret;
 	struct rspamd_task *task = NULL;
 	GError *err = NULL;
@@ -267,7 +283,7 @@ lua_dns_resolver_resolve_common (lua_State *L,
 
 	/* Check arguments */
 	if (!rspamd_lua_parse_table_arguments (L, first, &err,
-			"session=U{session};mempool=U{mempool};*name=S;*callback=F;"
+			"session=U{session};mempool=U{mempool};*name=S;callback=F;"
 			"option=S;task=U{task};forced=B",
 			&session, &pool, &to_resolve, &cbref, &user_str, &task, &forced)) {
 
@@ -286,11 +302,16 @@ lua_dns_resolver_resolve_common (lua_State *L,
 		session = task->s;
 	}
 
-	if (pool != NULL && session != NULL && to_resolve != NULL && cbref != -1) {
+	/* Without callback we can only suspend the current coroutine */
+	co = cbref == -1 ? rspamd_lua_coroutine_current (L) : NULL;
+
+	if (pool != NULL && session != NULL && to_resolve != NULL &&
+			(cbref != -1 || co != NULL)) {
 		cbdata = rspamd_mempool_alloc0 (pool, sizeof (struct lua_dns_cbdata));
-		cbdata->L = L;
+		cbdata->L = rspamd_lua_coroutine_main_state (L);
 		cbdata->resolver = resolver;
 		cbdata->cbref = cbref;
+		cbdata->co = co;
 		cbdata->user_str = rspamd_mempool_strdup (pool, user_str);
 
 		if (type != RDNS_REQUEST_PTR) {
@@ -323,6 +344,10 @@ lua_dns_resolver_resolve_common (lua_State *L,
 					type,
 					to_resolve)) {
 
+				if (co) {
+					return lua_yield (L, 0);
+				}
+
 				lua_pushboolean (L, TRUE);
 
 				if (session) {
@@ -352,6 +377,10 @@ lua_dns_resolver_resolve_common (lua_State *L,
 			}
 
 			if (ret) {
+				if (co) {
+					return lua_yield (L, 0);
+				}
+
 				lua_pushboolean (L, TRUE);
 				cbdata->s = session;
 				cbdata->w = rspamd_session_get_watcher (session);
@@ -377,7 +406,7 @@ lua_dns_resolver_resolve_common (lua_State *L,
  * @param {mempool} pool memory pool for storing intermediate data
  * @param {string} host name to resolve
  * @param {function} callback callback function to be called upon name resolution is finished; must be of type `function (resolver, to_resolve, results, err)`
- * @return {boolean} `true` if DNS request has been scheduled
+ * @return {boolean} `true` if DNS request has been scheduled; if `callback` is omitted in a coroutine (see `rspamd_async`) then `results, err` are returned when the request is finished
  */
 static int
 lua_dns_resolver_resolve_a (lua_State *L)
@@ -404,7 +433,7 @@ lua_dns_resolver_resolve_a (lua_State *L)
  * @param {mempool} pool memory pool for storing intermediate data
  * @param {string} ip name to resolve in string form (e.g. '8.8.8.8' or '2001:dead::')
  * @param {function} callback callback function to be called upon name resolution is finished; must be of type `function (resolver, to_resolve, results, err)`
- * @return {boolean} `true` if DNS request has been scheduled
+ * @return {boolean} `true` if DNS request has been scheduled; if `callback` is omitted in a coroutine (see `rspamd_async`) then `results, err` are returned when the request is finished
  */
 static int
 lua_dns_resolver_resolve_ptr (lua_State *L)
@@ -431,7 +460,7 @@ lua_dns_resolver_resolve_ptr (lua_State *L)
  * @param {mempool} pool memory pool for storing intermediate data
  * @param {string} host name to get TXT record for
  * @param {function} callback callback function to be called upon name resolution is finished; must be of type `function (resolver, to_resolve, results, err)`
- * @return {boolean} `true` if DNS request has been scheduled
+ * @return {boolean} `true` if DNS request has been scheduled; if `callback` is omitted in a coroutine (see `rspamd_async`) then `results, err` are returned when the request is finished
  */
 static int
 lua_dns_resolver_resolve_txt (lua_State *L)
@@ -458,7 +487,7 @@ lua_dns_resolver_resolve_txt (lua_State *L)
  * @param {mempool} pool memory pool for storing intermediate data
  * @param {string} host name to get MX record for
  * @param {function} callback callback function to be called upon name resolution is finished; must be of type `function (resolver, to_resolve, results, err)`
- * @return {boolean} `true` if DNS request has been scheduled
+ * @return {boolean} `true` if DNS request has been scheduled; if `callback` is omitted in a coroutine (see `rspamd_async`) then `results, err` are returned when the request is finished
  */
 static int
 lua_dns_resolver_resolve_mx (lua_State *L)
@@ -0,0 +1,360 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "lua_common.h"
+#include "lua_ffi.h"
+#include "message.h"
+#include "url.h"
+#include "filter.h"
+#include "utlist.h"
+
+/***
+ * @module rspamd_ffi
+ * This module provides access to the hot task data (headers, urls, text parts
+ * and words) and symbols insertion via LuaJIT FFI. Unlike methods of
+ * `rspamd_task`, these functions are not opaque to the JIT compiler, so loops
+ * over words or urls could be compiled completely. All arrays returned are
+ * FFI arrays indexed from zero and strings are pointers with lengths that
+ * should be converted by `ffi.string` when needed. All data is owned by a task
+ * and must not be used after a task is finished.
+ *
+ * This module is available merely when rspamd is built with LuaJIT.
+ * @example
+local rspamd_ffi = require "rspamd_ffi"
+local ffi = require "ffi"
+
+local function symbol_callback(task)
+	local t = rspamd_ffi.task(task)
+	local parts, nparts = rspamd_ffi.text_parts(t)
+
+	for i = 0, nparts - 1 do
+		local words, nwords = rspamd_ffi.words(t, i)
+
+		for j = 0, nwords - 1 do
+			if words[j].len > 32 then
+				rspamd_ffi.insert_result(t, 'LONG_WORD', 1.0,
+					ffi.string(words[j].begin, words[j].len))
+				return
+			end
+		end
+	end
+end
+ */
+
+/*
+ * Must be kept in sync with lua_ffi.h
+ */
+static const gchar rspamd_ffi_cdef[] = ""
+		"struct rspamd_task;"
+		"struct rspamd_ffi_header {"
+		"  const char *name; const char *value; const char *decoded;"
+		"  size_t name_len; size_t value_len; size_t decoded_len;"
+		"};"
+		"struct rspamd_ffi_url {"
+		"  const char *string; const char *host; const char *tld;"
+		"  const char *user; const char *data; const char *query;"
+		"  size_t len; size_t host_len; size_t tld_len;"
+		"  size_t user_len; size_t data_len; size_t query_len;"
+		"  int protocol; unsigned int port; unsigned int flags;"
+		"};"
+		"struct rspamd_ffi_text_part {"
+		"  const char *content; const char *stripped; const char *lang;"
+		"  size_t len; size_t stripped_len;"
+		"  unsigned int flags; unsigned int nlines; unsigned int nwords;"
+		"};"
+		"struct rspamd_ffi_word { size_t len; const char *begin; };"
+		"unsigned int rspamd_ffi_abi_version (void);"
+		"size_t rspamd_ffi_task_get_headers (struct rspamd_task *task,"
+		"  const char *name, int strong,"
+		"  struct rspamd_ffi_header *out, size_t max);"
+		"size_t rspamd_ffi_task_get_urls (struct rspamd_task *task,"
+		"  int need_emails, struct rspamd_ffi_url *out, size_t max);"
+		"size_t rspamd_ffi_task_get_text_parts (struct rspamd_task *task,"
+		"  struct rspamd_ffi_text_part *out, size_t max);"
+		"const struct rspamd_ffi_word *rspamd_ffi_text_part_get_words ("
+		"  struct rspamd_task *task, size_t part, size_t *nwords);"
+		"void rspamd_ffi_task_insert_result (struct rspamd_task *task,"
+		"  const char *symbol, double weight, const char *option);";
+
+/*
+ * Lua part of module: called with cdef string and ABI version as arguments
+ */
+static const gchar rspamd_ffi_lua[] = ""
+		"local cdef, version = ...\n"
+		"local ffi = require 'ffi'\n"
+		"ffi.cdef(cdef)\n"
+		"local C = ffi.C\n"
+		"if C.rspamd_ffi_abi_version() ~= version then\n"
+		"  error('rspamd ffi ABI version mismatch')\n"
+		"end\n"
+		"local task_pp = ffi.typeof('struct rspamd_task **')\n"
+		"local headers_t = ffi.typeof('struct rspamd_ffi_header[?]')\n"
+		"local urls_t = ffi.typeof('struct rspamd_ffi_url[?]')\n"
+		"local parts_t = ffi.typeof('struct rspamd_ffi_text_part[?]')\n"
+		"local nwords = ffi.new('size_t[1]')\n"
+		"local exports = { C = C }\n"
+		/* Userdata is cast to the pointer to its payload */
+		"function exports.task(task)\n"
+		"  return ffi.cast(task_pp, task)[0]\n"
+		"end\n"
+		"function exports.headers(t, name, strong)\n"
+		"  local s = strong and 1 or 0\n"
+		"  local n = tonumber(C.rspamd_ffi_task_get_headers(t, name, s, nil, 0))\n"
+		"  local res = headers_t(n)\n"
+		"  if n > 0 then C.rspamd_ffi_task_get_headers(t, name, s, res, n) end\n"
+		"  return res, n\n"
+		"end\n"
+		"function exports.urls(t, need_emails)\n"
+		"  local e = need_emails and 1 or 0\n"
+		"  local n = tonumber(C.rspamd_ffi_task_get_urls(t, e, nil, 0))\n"
+		"  local res = urls_t(n)\n"
+		"  if n > 0 then n = tonumber(C.rspamd_ffi_task_get_urls(t, e, res, n)) end\n"
+		"  return res, n\n"
+		"end\n"
+		"function exports.text_parts(t)\n"
+		"  local n = tonumber(C.rspamd_ffi_task_get_text_parts(t, nil, 0))\n"
+		"  local res = parts_t(n)\n"
+		"  if n > 0 then C.rspamd_ffi_task_get_text_parts(t, res, n) end\n"
+		"  return res, n\n"
+		"end\n"
+		"function exports.words(t, part)\n"
+		"  local w = C.rspamd_ffi_text_part_get_words(t, part, nwords)\n"
+		"  return w, tonumber(nwords[0])\n"
+		"end\n"
+		"function exports.insert_result(t, symbol, weight, option)\n"
+		"  C.rspamd_ffi_task_insert_result(t, symbol, weight or 1.0, option)\n"
+		"end\n"
+		"return exports\n";
+
+G_STATIC_ASSERT (sizeof (struct rspamd_ffi_word) == sizeof (rspamd_ftok_t));
+G_STATIC_ASSERT (G_STRUCT_OFFSET (struct rspamd_ffi_word, begin) ==
+		G_STRUCT_OFFSET (rspamd_ftok_t, begin));
+
+unsigned int
+rspamd_ffi_abi_version (void)
+{
+	return RSPAMD_FFI_ABI_VERSION;
+}
+
+size_t
+rspamd_ffi_task_get_headers (struct rspamd_task *task,
+		const char *name, int strong,
+		struct rspamd_ffi_header *out, size_t max)
+{
+	struct raw_header *rh, *cur;
+	struct rspamd_ffi_header *h;
+	size_t nelts = 0;
+
+	g_assert (task != NULL);
+
+	if (name == NULL) {
+		return 0;
+	}
+
+	rh = g_hash_table_lookup (task->raw_headers, name);
+
+	/* Avoid allocation of array unlike rspamd_message_get_header_array */
+	LL_FOREACH (rh, cur) {
+		if (strong && strcmp (cur->name, name) != 0) {
+			continue;
+		}
+
+		if (nelts < max) {
+			h = &out[nelts];
+			h->name = cur->name;
+			h->name_len = cur->name ? strlen (cur->name) : 0;
+			h->value = cur->value;
+			h->value_len = cur->value ? strlen (cur->value) : 0;
+			h->decoded = cur->decoded;
+			h->decoded_len = cur->decoded ? strlen (cur->decoded) : 0;
+		}
+
+		nelts ++;
+	}
+
+	return nelts;
+}
+
+struct rspamd_ffi_urls_cbdata {
+	struct rspamd_ffi_url *out;
+	size_t max;
+	size_t nelts;
+};
+
+static void
+rspamd_ffi_url_callback (gpointer key, gpointer value, gpointer ud)
+{
+	struct rspamd_ffi_urls_cbdata *cbd = ud;
+	struct rspamd_url *url = value;
+	struct rspamd_ffi_url *u;
+
+	if (cbd->nelts < cbd->max) {
+		u = &cbd->out[cbd->nelts];
+		u->string = url->string;
+		u->len = url->urllen;
+		u->host = url->host;
+		u->host_len = url->hostlen;
+		u->tld = url->tld;
+		u->tld_len = url->tldlen;
+		u->user = url->user;
+		u->user_len = url->userlen;
+		u->data = url->data;
+		u->data_len = url->datalen;
+		u->query = url->query;
+		u->query_len = url->querylen;
+		u->protocol = url->protocol;
+		u->port = url->port;
+		u->flags = url->flags;
+	}
+
+	cbd->nelts ++;
+}
+
+size_t
+rspamd_ffi_task_get_urls (struct rspamd_task *task,
+		int need_emails,
+		struct rspamd_ffi_url *out, size_t max)
+{
+	struct rspamd_ffi_urls_cbdata cbd;
+
+	g_assert (task != NULL);
+
+	if (max == 0) {
+		return g_hash_table_size (task->urls) +
+				(need_emails ? g_hash_table_size (task->emails) : 0);
+	}
+
+	cbd.out = out;
+	cbd.max = max;
+	cbd.nelts = 0;
+	g_hash_table_foreach (task->urls, rspamd_ffi_url_callback, &cbd);
+
+	if (need_emails) {
+		g_hash_table_foreach (task->emails, rspamd_ffi_url_callback, &cbd);
+	}
+
+	return MIN (cbd.nelts, max);
+}
+
+size_t
+rspamd_ffi_task_get_text_parts (struct rspamd_task *task,
+		struct rspamd_ffi_text_part *out, size_t max)
+{
+	struct mime_text_part *part;
+	struct rspamd_ffi_text_part *p;
+	guint i;
+
+	g_assert (task != NULL);
+
+	for (i = 0; i < task->text_parts->len && i < max; i ++) {
+		part = g_ptr_array_index (task->text_parts, i);
+		p = &out[i];
+		memset (p, 0, sizeof (*p));
+		p->flags = part->flags;
+		p->nlines = part->nlines;
+		p->lang = part->lang_code;
+
+		if (!IS_PART_EMPTY (part)) {
+			if (part->content) {
+				p->content = (const char *)part->content->data;
+				p->len = part->content->len;
+			}
+
+			if (part->stripped_content) {
+				p->stripped = (const char *)part->stripped_content->data;
+				p->stripped_len = part->stripped_content->len;
+			}
+
+			if (part->normalized_words) {
+				p->nwords = part->normalized_words->len;
+			}
+		}
+	}
+
+	return task->text_parts->len;
+}
+
+const struct rspamd_ffi_word *
+rspamd_ffi_text_part_get_words (struct rspamd_task *task, size_t part,
+		size_t *nwords)
+{
+	struct mime_text_part *tp;
+
+	g_assert (task != NULL);
+	g_assert (nwords != NULL);
+
+	*nwords = 0;
+
+	if (part >= task->text_parts->len) {
+		return NULL;
+	}
+
+	tp = g_ptr_array_index (task->text_parts, part);
+
+	if (IS_PART_EMPTY (tp) || tp->normalized_words == NULL) {
+		return NULL;
+	}
+
+	*nwords = tp->normalized_words->len;
+
+	return (const struct rspamd_ffi_word *)tp->normalized_words->data;
+}
+
+void
+rspamd_ffi_task_insert_result (struct rspamd_task *task,
+		const char *symbol, double weight, const char *option)
+{
+	GList *opts = NULL;
+
+	g_assert (task != NULL);
+
+	if (symbol == NULL) {
+		return;
+	}
+
+	/* FFI strings are valid during the call merely */
+	if (option != NULL) {
+		opts = g_list_prepend (opts,
+				rspamd_mempool_strdup (task->task_pool, option));
+	}
+
+	rspamd_task_insert_result (task,
+			rspamd_mempool_strdup (task->task_pool, symbol), weight, opts);
+}
+
+static gint
+lua_load_ffi (lua_State *L)
+{
+#ifdef WITH_LUAJIT
+	if (luaL_loadbuffer (L, rspamd_ffi_lua, sizeof (rspamd_ffi_lua) - 1,
+			"rspamd_ffi") != 0) {
+		return lua_error (L);
+	}
+
+	lua_pushlstring (L, rspamd_ffi_cdef, sizeof (rspamd_ffi_cdef) - 1);
+	lua_pushnumber (L, RSPAMD_FFI_ABI_VERSION);
+	lua_call (L, 2, 1);
+
+	return 1;
+#else
+	return luaL_error (L, "rspamd_ffi module requires LuaJIT");
+#endif
+}
+
+void
+luaopen_ffi (lua_State * L)
+{
+	rspamd_lua_add_preload (L, "rspamd_ffi", lua_load_ffi);
+}
@@ -0,0 +1,137 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LUA_LUA_FFI_H_
+#define SRC_LUA_LUA_FFI_H_
+
+#include "config.h"
+
+/**
+ * @file lua_ffi.h
+ * Flat C interface to the hot task data designed to be called from LuaJIT FFI.
+ * Only plain C types are used here, and declarations must be kept in sync
+ * with the `cdef` string in lua_ffi.c. The version should be increased on
+ * any incompatible change.
+ */
+
+#define RSPAMD_FFI_ABI_VERSION 1
+
+struct rspamd_task;
+
+struct rspamd_ffi_header {
+	const char *name;
+	const char *value;
+	const char *decoded;
+	size_t name_len;
+	size_t value_len;
+	size_t decoded_len;
+};
+
+struct rspamd_ffi_url {
+	const char *string;
+	const char *host;
+	const char *tld;
+	const char *user;
+	const char *data;
+	const char *query;
+	size_t len;
+	size_t host_len;
+	size_t tld_len;
+	size_t user_len;
+	size_t data_len;
+	size_t query_len;
+	int protocol;
+	unsigned int port;
+	unsigned int flags;
+};
+
+struct rspamd_ffi_text_part {
+	const char *content;
+	const char *stripped;
+	const char *lang;
+	size_t len;
+	size_t stripped_len;
+	unsigned int flags;
+	unsigned int nlines;
+	unsigned int nwords;
+};
+
+/* Has the same layout as rspamd_ftok_t, so words are not copied */
+struct rspamd_ffi_word {
+	size_t len;
+	const char *begin;
+};
+
+/**
+ * Returns version of this interface
+ */
+unsigned int rspamd_ffi_abi_version (void);
+
+/**
+ * Fills array with headers of the specified name
+ * @param task task object
+ * @param name name of header
+ * @param strong if non-zero then name is case sensitive
+ * @param out output array (can be NULL if max is 0)
+ * @param max maximum number of elements to fill
+ * @return total number of headers found
+ */
+size_t rspamd_ffi_task_get_headers (struct rspamd_task *task,
+		const char *name, int strong,
+		struct rspamd_ffi_header *out, size_t max);
+
+/**
+ * Fills array with urls found in a task
+ * @param task task object
+ * @param need_emails if non-zero then emails are also returned
+ * @param out output array (can be NULL if max is 0)
+ * @param max maximum number of elements to fill
+ * @return total number of urls
+ */
+size_t rspamd_ffi_task_get_urls (struct rspamd_task *task,
+		int need_emails,
+		struct rspamd_ffi_url *out, size_t max);
+
+/**
+ * Fills array with text parts of a task
+ * @param task task object
+ * @param out output array (can be NULL if max is 0)
+ * @param max maximum number of elements to fill
+ * @return total number of text parts
+ */
+size_t rspamd_ffi_task_get_text_parts (struct rspamd_task *task,
+		struct rspamd_ffi_text_part *out, size_t max);
+
+/**
+ * Returns normalized words of a text part, the array is owned by task
+ * @param task task object
+ * @param part index of text part
+ * @param nwords output number of words
+ * @return array of words or NULL if there are no words in a part
+ */
+const struct rspamd_ffi_word *rspamd_ffi_text_part_get_words (
+		struct rspamd_task *task, size_t part, size_t *nwords);
+
+/**
+ * Inserts symbol to the task's result
+ * @param task task object
+ * @param symbol name of symbol
+ * @param weight dynamic weight of symbol
+ * @param option symbol's option (can be NULL)
+ */
+void rspamd_ffi_task_insert_result (struct rspamd_task *task,
+		const char *symbol, double weight, const char *option);
+
+#endif /* SRC_LUA_LUA_FFI_H_ */
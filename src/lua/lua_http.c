@@ -61,6 +61,7 @@ struct lua_http_cbdata {
 	struct rspamd_async_session *session;
 	struct rspamd_async_watcher *w;
 	struct rspamd_http_message *msg;
+	struct rspamd_lua_coroutine *co;
 	struct event_base *ev_base;
 	struct timeval tv;
 	rspamd_inet_addr_t *addr;
@@ -133,6 +134,13 @@ lua_http_maybe_free (struct lua_http_cbdata *cbd)
 static void
 lua_http_push_error (struct lua_http_cbdata *cbd, const char *err)
 {
+	if (cbd->co) {
+		lua_pushstring (cbd->co->L, err);
+		rspamd_lua_coroutine_resume (cbd->co, 1);
+
+		return;
+	}
+
 	lua_rawgeti (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
 	lua_pushstring (cbd->L, err);
 
@@ -159,33 +167,44 @@ lua_http_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_header *h, *htmp;
 	const gchar *body;
 	gsize body_len;
+	lua_State *L;
+
+	if (cbd->co) {
+		L = cbd->co->L;
+	}
+	else {
+		L = cbd->L;
+		lua_rawgeti (L, LUA_REGISTRYINDEX, cbd->cbref);
+	}
 
-	lua_rawgeti (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
 	/* Error */
-	lua_pushnil (cbd->L);
+	lua_pushnil (L);
 	/* Reply code */
-	lua_pushinteger (cbd->L, msg->code);
+	lua_pushinteger (L, msg->code);
 	/* Body */
 	body = rspamd_http_message_get_body (msg, &body_len);
 
 	if (body_len > 0) {
-		lua_pushlstring (cbd->L, body, body_len);
+		lua_pushlstring (L, body, body_len);
 	}
 	else {
-		lua_pushnil (cbd->L);
+		lua_pushnil (L);
 	}
 	/* Headers */
-	lua_newtable (cbd->L);
+	lua_newtable (L);
 
 	HASH_ITER (hh, msg->headers, h, htmp) {
-		lua_pushlstring (cbd->L, h->name->begin, h->name->len);
-		lua_pushlstring (cbd->L, h->value->begin, h->value->len);
-		lua_settable (cbd->L, -3);
+		lua_pushlstring (L, h->name->begin, h->name->len);
+		lua_pushlstring (L, h->value->begin, h->value->len);
+		lua_settable (L, -3);
 	}
 
-	if (lua_pcall (cbd->L, 4, 0, 0) != 0) {
-		msg_info ("callback call failed: %s", lua_tostring (cbd->L, -1));
-		lua_pop (cbd->L, 1);
+	if (cbd->co) {
+		rspamd_lua_coroutine_resume (cbd->co, 4);
+	}
+	else if (lua_pcall (L, 4, 0, 0) != 0) {
+		msg_info ("callback call failed: %s", lua_tostring (L, -1));
+		lua_pop (L, 1);
 	}
 
 	lua_http_maybe_free (cbd);
@@ -284,6 +303,10 @@ lua_http_push_headers (lua_State *L, struct rspamd_http_message *msg)
  * @param {string/text} body full body content, can be opaque `rspamd{text}` to avoid data copying
  * @param {number} timeout floating point request timeout value in seconds (default is 5.0 seconds)
  * @return {boolean} `true` if a request has been successfuly scheduled. If this value is `false` then some error occurred, the callback thus will not be called
+ *
+ * If `callback` is omitted when called from a coroutine (see `rspamd_async`), then this
+ * function suspends the coroutine and returns `err_message, code, body, headers` when
+ * the request is finished (or `false` at once if a request cannot be scheduled).
  */
 static gint
 lua_http_request (lua_State *L)
@@ -292,6 +315,7 @@ lua_http_request (lua_State *L)
 	gchar *to_resolve;
 	gint cbref;
 	gsize bodylen;
+	struct rspamd_lua_coroutine *co = NULL;
 	struct event_base *ev_base;
 	struct rspamd_http_message *msg;
 	struct lua_http_cbdata *cbd;
@@ -348,13 +372,24 @@ lua_http_request (lua_State *L)
 
 		lua_pushstring (L, "callback");
 		lua_gettable (L, -2);
-		if (url == NULL || lua_type (L, -1) != LUA_TFUNCTION) {
+		if (lua_type (L, -1) != LUA_TFUNCTION) {
+			/* Without callback we can only suspend the current coroutine */
+			co = rspamd_lua_coroutine_current (L);
+		}
+		if (url == NULL || (lua_type (L, -1) != LUA_TFUNCTION && co == NULL)) {
 			lua_pop (L, 1);
 			msg_err ("http request has bad params");
 			lua_pushboolean (L, FALSE);
 			return 1;
 		}
-		cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+		if (co) {
+			lua_pop (L, 1);
+			cbref = -1;
+		}
+		else {
+			cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
 
 		lua_pushstring (L, "task");
 		lua_gettable (L, -2);
@@ -449,8 +484,9 @@ lua_http_request (lua_State *L)
 	}
 
 	cbd = g_slice_alloc0 (sizeof (*cbd));
-	cbd->L = L;
+	cbd->L = rspamd_lua_coroutine_main_state (L);
 	cbd->cbref = cbref;
+	cbd->co = co;
 	cbd->msg = msg;
 	cbd->ev_base = ev_base;
 	cbd->mime_type = mime_type;
@@ -467,8 +503,12 @@ lua_http_request (lua_State *L)
 				(event_finalizer_t)lua_http_fin,
 				cbd,
 				g_quark_from_static_string ("lua http"));
-		cbd->w = rspamd_session_get_watcher (session);
-		rspamd_session_watcher_push (session);
+
+		/* Coroutine itself keeps a symbol pending */
+		if (co == NULL) {
+			cbd->w = rspamd_session_get_watcher (session);
+			rspamd_session_watcher_push (session);
+		}
 	}
 
 	if (rspamd_parse_inet_address (&cbd->addr, msg->host->str, msg->host->len)) {
@@ -510,6 +550,10 @@ lua_http_request (lua_State *L)
 		}
 	}
 
+	if (co) {
+		return lua_yield (L, 0);
+	}
+
 	lua_pushboolean (L, TRUE);
 	return 1;
 }
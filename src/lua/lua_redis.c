@@ -19,7 +19,7 @@
 
 #ifdef WITH_HIREDIS
 #include "hiredis.h"
-#include "adapters/libevent.h"
+#include "libserver/redis_pool.h"
 #endif
 
 #define REDIS_DEFAULT_TIMEOUT 1.0
@@ -95,6 +95,7 @@ struct lua_redis_specific_userdata;
  */
 struct lua_redis_userdata {
 	redisAsyncContext *ctx;
+	struct rspamd_redis_pool *pool;
 	lua_State *L;
 	struct rspamd_task *task;
 	gchar *server;
@@ -112,6 +113,7 @@ struct lua_redis_specific_userdata {
 	struct rspamd_async_watcher *w;
 	struct lua_redis_userdata *c;
 	struct lua_redis_ctx *ctx;
+	struct rspamd_lua_coroutine *co;
 	struct lua_redis_specific_userdata *next;
 	struct event timeout;
 	gboolean replied;
@@ -162,14 +164,18 @@ lua_redis_dtor (struct lua_redis_ctx *ctx)
 
 		if (ud->ctx) {
 			ud->terminated = 1;
+
 			/*
-			 * On calling of redisFree, hiredis calls for callbacks pending
-			 * Hence, to avoid double free, we ensure that the object must
-			 * still be alive here!
+			 * Connection might be shared with other users, so we do not close
+			 * it but merely ignore replies for our commands pending
 			 */
-			ctx->ref.refcount = 100500;
-			redisAsyncFree (ud->ctx);
-			ctx->ref.refcount = 0;
+			LL_FOREACH (ud->specific, cur) {
+				rspamd_redis_pool_detach_callbacks (ud->ctx, cur);
+			}
+
+			rspamd_redis_pool_release_connection (ud->pool, ud->ctx,
+					RSPAMD_REDIS_RELEASE_DEFAULT);
+			ud->ctx = NULL;
 			is_connected = TRUE;
 		}
 		LL_FOREACH_SAFE (ud->specific, cur, tmp) {
@@ -234,9 +240,14 @@ lua_redis_push_error (const gchar *err,
 {
 	struct rspamd_task **ptask;
 	struct lua_redis_userdata *ud = sp_ud->c;
+	struct rspamd_lua_coroutine *co = sp_ud->co;
 
 	if (!sp_ud->replied) {
-		if (sp_ud->cbref != -1) {
+		if (co) {
+			lua_pushstring (co->L, err);
+			lua_pushnil (co->L);
+		}
+		else if (sp_ud->cbref != -1) {
 			/* Push error */
 			lua_rawgeti (ud->L, LUA_REGISTRYINDEX, sp_ud->cbref);
 			ptask = lua_newuserdata (ud->L, sizeof (struct rspamd_task *));
@@ -258,6 +269,10 @@ lua_redis_push_error (const gchar *err,
 			rspamd_session_watcher_pop (ud->task->s, sp_ud->w);
 			rspamd_session_remove_event (ud->task->s, lua_redis_fin, sp_ud);
 		}
+
+		if (co) {
+			rspamd_lua_coroutine_resume (co, 2);
+		}
 	}
 }
 
@@ -302,9 +317,14 @@ lua_redis_push_data (const redisReply *r, struct lua_redis_ctx *ctx,
 {
 	struct rspamd_task **ptask;
 	struct lua_redis_userdata *ud = sp_ud->c;
+	struct rspamd_lua_coroutine *co = sp_ud->co;
 
 	if (!sp_ud->replied) {
-		if (sp_ud->cbref != -1) {
+		if (co) {
+			lua_pushnil (co->L);
+			lua_redis_push_reply (co->L, r);
+		}
+		else if (sp_ud->cbref != -1) {
 			/* Push error */
 			lua_rawgeti (ud->L, LUA_REGISTRYINDEX, sp_ud->cbref);
 			ptask = lua_newuserdata (ud->L, sizeof (struct rspamd_task *));
@@ -325,6 +345,11 @@ lua_redis_push_data (const redisReply *r, struct lua_redis_ctx *ctx,
 
 		rspamd_session_watcher_pop (ud->task->s, sp_ud->w);
 		rspamd_session_remove_event (ud->task->s, lua_redis_fin, sp_ud);
+
+		if (co) {
+			/* Context is retained by the caller, so it is safe to resume here */
+			rspamd_lua_coroutine_resume (co, 2);
+		}
 	}
 }
 
@@ -379,13 +404,14 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 
 	if (ctx->cmds_pending == 0 && !ud->terminated) {
-		/* Disconnect redis early as we don't need it anymore */
+		/* Return connection to the pool early as we don't need it anymore */
 		ud->terminated = 1;
 		ac = ud->ctx;
 		ud->ctx = NULL;
 
 		if (ac != NULL) {
-			redisAsyncFree (ac);
+			rspamd_redis_pool_release_connection (ud->pool, ac,
+					RSPAMD_REDIS_RELEASE_DEFAULT);
 		}
 	}
 
@@ -397,24 +423,38 @@ lua_redis_timeout (int fd, short what, gpointer u)
 {
 	struct lua_redis_specific_userdata *sp_ud = u;
 	struct lua_redis_ctx *ctx;
+	struct lua_redis_userdata *ud;
 	redisAsyncContext *ac;
 
 	ctx = sp_ud->ctx;
+	ud = sp_ud->c;
 
 	REDIS_RETAIN (ctx);
 	msg_debug ("timeout while querying redis server");
-	lua_redis_push_error ("timeout while connecting the server", ctx, sp_ud, TRUE);
 
-	if (sp_ud->c->ctx) {
-		ac = sp_ud->c->ctx;
-		/* Set to NULL to avoid double free in dtor */
-		sp_ud->c->ctx = NULL;
+	if (ud->ctx) {
 		/*
-		 * This will call all callbacks pending so the entire context
-		 * will be destructed
+		 * Connection might be shared with other tasks, so we do not close it
+		 * but just ignore the reply for this command
 		 */
-		redisAsyncFree (ac);
+		rspamd_redis_pool_detach_callbacks (ud->ctx, sp_ud);
+		ctx->cmds_pending --;
 	}
+
+	lua_redis_push_error ("timeout while connecting the server", ctx, sp_ud, TRUE);
+
+	if (ctx->cmds_pending == 0 && !ud->terminated) {
+		ud->terminated = 1;
+		ac = ud->ctx;
+		ud->ctx = NULL;
+
+		if (ac != NULL) {
+			/* Connection might be stalled, so it should not get new users */
+			rspamd_redis_pool_release_connection (ud->pool, ac,
+					RSPAMD_REDIS_RELEASE_DRAIN);
+		}
+	}
+
 	REDIS_RELEASE (ctx);
 }
 
@@ -464,22 +504,40 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
 	*nargs = top;
 }
 
-static void
-lua_redis_connect_cb (const struct redisAsyncContext *c, int status)
+
+
+/*
+ * Commands that neither change state of connection nor block it, so they
+ * could be pipelined with commands of other tasks over a shared connection
+ */
+static const gchar *lua_redis_shareable_cmds[] = {
+	"GET", "MGET", "SET", "SETEX", "SETNX", "GETSET", "DEL", "EXISTS",
+	"EXPIRE", "PEXPIRE", "EXPIREAT", "TTL", "PTTL", "PERSIST",
+	"INCR", "INCRBY", "INCRBYFLOAT", "DECR", "DECRBY", "APPEND", "STRLEN",
+	"HGET", "HMGET", "HSET", "HMSET", "HSETNX", "HDEL", "HEXISTS", "HLEN",
+	"HGETALL", "HKEYS", "HVALS", "HINCRBY", "HINCRBYFLOAT",
+	"SADD", "SREM", "SISMEMBER", "SCARD", "SMEMBERS",
+	"ZADD", "ZREM", "ZINCRBY", "ZSCORE", "ZRANK", "ZCARD", "ZCOUNT",
+	"ZRANGE", "ZRANGEBYSCORE", "ZREVRANGE", "ZREVRANGEBYSCORE",
+	"ZREMRANGEBYSCORE", "ZREMRANGEBYRANK",
+	"LPUSH", "RPUSH", "LPOP", "RPOP", "LLEN", "LRANGE", "LTRIM", "LINDEX",
+	"EVAL", "EVALSHA", "PING",
+	NULL
+};
+
+static gboolean
+lua_redis_is_shareable (const gchar *cmd)
 {
-	/*
-	 * Workaround to prevent double close:
-	 * https://groups.google.com/forum/#!topic/redis-db/mQm46XkIPOY
-	 */
-#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR == 0 && HIREDIS_MINOR <= 11
-	struct redisAsyncContext *nc = (struct redisAsyncContext *)c;
-	if (status == REDIS_ERR) {
-		nc->c.fd = -1;
-	}
-#endif
-}
+	const gchar **pc;
 
+	for (pc = lua_redis_shareable_cmds; *pc != NULL; pc ++) {
+		if (g_ascii_strcasecmp (cmd, *pc) == 0) {
+			return TRUE;
+		}
+	}
 
+	return FALSE;
+}
 
 /***
  * @function rspamd_redis.make_request({params})
@@ -491,6 +549,13 @@ lua_redis_connect_cb (const struct redisAsyncContext *c, int status)
  * @param {table} args numeric array of strings used as redis arguments
  * @param {number} timeout timeout in seconds for request (1.0 by default)
  * @return {boolean} `true` if a request has been scheduled
+ *
+ * If `callback` is omitted when called from a coroutine (see `rspamd_async`), then this
+ * function suspends the coroutine and returns `err, data` when the request is finished.
+ *
+ * Connections are shared between tasks for a limited set of commands that do
+ * not change connection state and do not block (e.g. `GET`, `HINCRBY` or
+ * `EVALSHA`), other commands use a dedicated connection.
  */
 static int
 lua_redis_make_request (lua_State *L)
@@ -501,6 +566,7 @@ lua_redis_make_request (lua_State *L)
 	struct lua_redis_specific_userdata *sp_ud;
 	struct rspamd_lua_ip *addr = NULL;
 	struct rspamd_task *task = NULL;
+	struct rspamd_lua_coroutine *co = NULL;
 	const gchar *cmd = NULL, *host;
 	const gchar *password = NULL, *dbname = NULL;
 	gint top, cbref = -1, args_pos;
@@ -524,7 +590,13 @@ lua_redis_make_request (lua_State *L)
 			cbref = luaL_ref (L, LUA_REGISTRYINDEX);
 		}
 		else {
-			msg_err ("bad callback argument for lua redis");
+			/* Without callback we suspend the current coroutine if any */
+			co = rspamd_lua_coroutine_current (L);
+
+			if (co == NULL) {
+				msg_err ("bad callback argument for lua redis");
+			}
+
 			lua_pop (L, 1);
 		}
 
@@ -588,11 +660,12 @@ lua_redis_make_request (lua_State *L)
 			ctx->async = TRUE;
 			ud = &ctx->d.async;
 			ud->task = task;
-			ud->L = L;
+			ud->L = rspamd_lua_coroutine_main_state (L);
 
 			sp_ud = g_slice_alloc0 (sizeof (*sp_ud));
 			sp_ud->cbref = cbref;
 			sp_ud->c = ud;
+			sp_ud->co = co;
 
 			lua_pushstring (L, "args");
 			lua_gettable (L, -2);
@@ -622,7 +695,7 @@ lua_redis_make_request (lua_State *L)
 			ctx->async = TRUE;
 			ud = &ctx->d.async;
 			ud->task = task;
-			ud->L = L;
+			ud->L = rspamd_lua_coroutine_main_state (L);
 
 			args_pos = 3;
 
@@ -635,12 +708,14 @@ lua_redis_make_request (lua_State *L)
 			}
 			else {
 				cbref = -1;
+				co = rspamd_lua_coroutine_current (L);
 			}
 
 
 			sp_ud = g_slice_alloc0 (sizeof (*sp_ud));
 			sp_ud->cbref = cbref;
 			sp_ud->c = ud;
+			sp_ud->co = co;
 			cmd = luaL_checkstring (L, args_pos);
 			if (top > 4) {
 				lua_redis_parse_args (L, args_pos + 1, cmd, &sp_ud->args,
@@ -662,38 +737,39 @@ lua_redis_make_request (lua_State *L)
 	if (ret) {
 		ud->terminated = 0;
 		ud->timeout = timeout;
-		ud->ctx = redisAsyncConnect (rspamd_inet_address_to_string (addr->addr),
-				rspamd_inet_address_get_port (addr->addr));
+		ud->pool = task->cfg->redis_pool;
+		/* Pool sends AUTH and SELECT for new connections */
+		if (lua_redis_is_shareable (cmd)) {
+			ud->ctx = rspamd_redis_pool_connect (ud->pool,
+					dbname, password,
+					rspamd_inet_address_to_string (addr->addr),
+					rspamd_inet_address_get_port (addr->addr));
+		}
+		else {
+			ud->ctx = rspamd_redis_pool_connect_exclusive (ud->pool,
+					dbname, password,
+					rspamd_inet_address_to_string (addr->addr),
+					rspamd_inet_address_get_port (addr->addr));
+		}
+
+		if (ud->ctx == NULL) {
+			msg_err_task_check ("cannot connect to redis %s",
+					rspamd_inet_address_to_string (addr->addr));
+			REDIS_RELEASE (ctx);
 
-		if (ud->ctx == NULL || ud->ctx->err) {
-			if (ud->ctx) {
-				msg_err_task_check ("cannot connect to redis: %s",
-						ud->ctx->errstr);
-				redisAsyncFree (ud->ctx);
-				ud->ctx = NULL;
+			if (co) {
+				lua_pushstring (L, "cannot connect to redis");
 			}
 			else {
-				msg_err_task_check ("cannot connect to redis: unknown error");
+				lua_pushboolean (L, FALSE);
 			}
 
-			REDIS_RELEASE (ctx);
-			lua_pushboolean (L, FALSE);
 			lua_pushnil (L);
 
 			return 2;
 		}
 
-		redisAsyncSetConnectCallback (ud->ctx, lua_redis_connect_cb);
-		redisLibeventAttach (ud->ctx, ud->task->ev_base);
-
-		if (password) {
-			redisAsyncCommand (ud->ctx, NULL, NULL, "AUTH %s", password);
-		}
-		if (dbname) {
-			redisAsyncCommand (ud->ctx, NULL, NULL, "SELECT %s", dbname);
-		}
-
-		ret = redisAsyncCommandArgv (ud->ctx,
+		ret = rspamd_redis_pool_command_argv (ud->ctx,
 					lua_redis_callback,
 					sp_ud,
 					sp_ud->nargs,
@@ -705,8 +781,12 @@ lua_redis_make_request (lua_State *L)
 					lua_redis_fin,
 					sp_ud,
 					g_quark_from_static_string ("lua redis"));
-			sp_ud->w = rspamd_session_get_watcher (ud->task->s);
-			rspamd_session_watcher_push (ud->task->s);
+
+			/* Coroutine itself keeps a symbol pending */
+			if (co == NULL) {
+				sp_ud->w = rspamd_session_get_watcher (ud->task->s);
+				rspamd_session_watcher_push (ud->task->s);
+			}
 
 			sp_ud->ctx = ctx;
 			REDIS_RETAIN (ctx);
@@ -719,13 +799,28 @@ lua_redis_make_request (lua_State *L)
 		}
 		else {
 			msg_info_task_check ("call to redis failed: %s", ud->ctx->errstr);
-			redisAsyncFree (ud->ctx);
+			rspamd_redis_pool_release_connection (ud->pool, ud->ctx,
+					RSPAMD_REDIS_RELEASE_FATAL);
 			ud->ctx = NULL;
 			REDIS_RELEASE (ctx);
 			ret = FALSE;
 		}
 	}
 
+	if (co) {
+		if (ret) {
+			/* No lua object is returned, the request retains context itself */
+			REDIS_RELEASE (ctx);
+
+			return lua_yield (L, 0);
+		}
+
+		lua_pushstring (L, "cannot send redis request");
+		lua_pushnil (L);
+
+		return 2;
+	}
+
 	lua_pushboolean (L, ret);
 
 	if (ret) {
@@ -866,6 +961,9 @@ lua_redis_make_request_sync (lua_State *L)
  * @param {ip|string} host server address
  * @param {number} timeout timeout in seconds for request (1.0 by default)
  * @return {redis} new connection object or nil if connection failed
+ *
+ * Connection is dedicated to this object and it is not shared with other
+ * requests, it is closed when the object is destroyed.
  */
 static int
 lua_redis_connect (lua_State *L)
@@ -936,20 +1034,21 @@ lua_redis_connect (lua_State *L)
 	if (ret && ctx) {
 		ud->terminated = 0;
 		ud->timeout = timeout;
-		ud->ctx = redisAsyncConnect (rspamd_inet_address_to_string (addr->addr),
+		ud->pool = task->cfg->redis_pool;
+		ud->ctx = rspamd_redis_pool_connect_exclusive (ud->pool,
+				NULL, NULL,
+				rspamd_inet_address_to_string (addr->addr),
 				rspamd_inet_address_get_port (addr->addr));
 
-		if (ud->ctx == NULL || ud->ctx->err) {
-			msg_err_task_check ("cannot connect to redis: %s",
-					ud->ctx->errstr);
+		if (ud->ctx == NULL) {
+			msg_err_task_check ("cannot connect to redis %s",
+					rspamd_inet_address_to_string (addr->addr));
 			REDIS_RELEASE (ctx);
 			lua_pushboolean (L, FALSE);
 
 			return 1;
 		}
 
-		redisAsyncSetConnectCallback (ud->ctx, lua_redis_connect_cb);
-		redisLibeventAttach (ud->ctx, ud->task->ev_base);
 		pctx = lua_newuserdata (L, sizeof (ctx));
 		*pctx = ctx;
 		rspamd_lua_setclass (L, "rspamd{redis}", -1);
@@ -1081,6 +1180,13 @@ lua_redis_add_cmd (lua_State *L)
 		if (ctx->async) {
 			task = ctx->d.async.task;
 
+			if (ctx->d.async.ctx == NULL) {
+				/* Connection has been already returned to the pool */
+				lua_pushboolean (L, 0);
+				lua_pushstring (L, "connection is terminated");
+				return 2;
+			}
+
 			/* Async version */
 			if (lua_type (L, 2) == LUA_TSTRING) {
 				/* No callback version */
@@ -1107,7 +1213,7 @@ lua_redis_add_cmd (lua_State *L)
 
 			LL_PREPEND (sp_ud->c->specific, sp_ud);
 
-			ret = redisAsyncCommandArgv (sp_ud->c->ctx,
+			ret = rspamd_redis_pool_command_argv (sp_ud->c->ctx,
 					lua_redis_callback,
 					sp_ud,
 					sp_ud->nargs,
@@ -47,6 +47,16 @@ rspamd_config.DATE_IN_PAST = function(task)
 end
  */
 
+/* Task creation */
+/***
+ * @function rspamd_task.load_from_string(message, cfg)
+ * Creates a task from the specified message and parses it, the task should be
+ * destroyed by `task:destroy()`. This function is intended for tests merely.
+ * @param {string} message text of message
+ * @param {rspamd_config} cfg configuration object
+ * @return {rspamd_task} new task or nil if message cannot be loaded
+ */
+LUA_FUNCTION_DEF (task, load_from_string);
 /* Task methods */
 LUA_FUNCTION_DEF (task, get_message);
 LUA_FUNCTION_DEF (task, process_message);
@@ -120,7 +130,8 @@ LUA_FUNCTION_DEF (task, set_pre_result);
  * @method task:get_urls([need_emails])
  * Get all URLs found in a message.
  * @param {boolean} need_emails if `true` then reutrn also email urls
- * @return {table rspamd_url} list of all urls found
+ * @return {table rspamd_url} list of all urls found, this table is shared by all
+ * callers within a task and must not be modified
 @example
 local function phishing_cb(task)
 	local urls = task:get_urls();
@@ -166,7 +177,8 @@ LUA_FUNCTION_DEF (task, get_emails);
 /***
  * @method task:get_text_parts()
  * Get all text (and HTML) parts found in a message
- * @return {table rspamd_text_part} list of text parts
+ * @return {table rspamd_text_part} list of text parts, this table is shared by
+ * all callers within a task and must not be modified
  */
 LUA_FUNCTION_DEF (task, get_text_parts);
 /***
@@ -221,7 +233,8 @@ LUA_FUNCTION_DEF (task, get_header_raw);
  * - `empty_separator` - `true` if there are no separator between a header and a value
  * @param {string} name name of header to get
  * @param {boolean} case_sensitive case sensitiveness flag to search for a header
- * @return {list of tables} all values of a header as specified above
+ * @return {list of tables} all values of a header as specified above, these
+ * tables are shared by all callers within a task and must not be modified
 @example
 function check_header_delimiter_tab(task, header_name)
 	for _,rh in ipairs(task:get_header_full(header_name)) do
@@ -252,7 +265,8 @@ LUA_FUNCTION_DEF (task, get_raw_headers);
  *
  * Please note that in some situations rspamd cannot parse all the fields of received headers.
  * In that case you should check all strings for validity.
- * @return {table of tables} list of received headers described above
+ * @return {table of tables} list of received headers described above, these
+ * tables are shared by all callers within a task and must not be modified
  */
 LUA_FUNCTION_DEF (task, get_received_headers);
 /***
@@ -601,6 +615,7 @@ LUA_FUNCTION_DEF (task, has_flag);
 LUA_FUNCTION_DEF (task, get_flags);
 
 static const struct luaL_reg tasklib_f[] = {
+	LUA_INTERFACE_DEF (task, load_from_string),
 	{NULL, NULL}
 };
 
@@ -735,6 +750,131 @@ lua_check_text (lua_State * L, gint pos)
 	return ud ? (struct rspamd_lua_text *)ud : NULL;
 }
 
+/* Tables returned by task accessors are cached in the task's pool */
+#define LUA_TASK_CACHE_VAR "lua_task_cache"
+
+struct lua_task_cache {
+	lua_State *L;
+	gint ref;
+};
+
+static void
+lua_task_cache_dtor (gpointer p)
+{
+	struct lua_task_cache *cache = p;
+
+	luaL_unref (cache->L, LUA_REGISTRYINDEX, cache->ref);
+}
+
+/*
+ * Pushes value cached for a task by the specified key and returns TRUE,
+ * if there is no such value then nothing is pushed
+ */
+static gboolean
+lua_task_get_cached (lua_State *L, struct rspamd_task *task, const gchar *key)
+{
+	struct lua_task_cache *cache;
+
+	cache = rspamd_mempool_get_variable (task->task_pool, LUA_TASK_CACHE_VAR);
+
+	if (cache == NULL) {
+		return FALSE;
+	}
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cache->ref);
+	lua_getfield (L, -1, key);
+
+	if (lua_isnil (L, -1)) {
+		lua_pop (L, 2);
+
+		return FALSE;
+	}
+
+	lua_remove (L, -2);
+
+	return TRUE;
+}
+
+/*
+ * Caches value from the top of the stack, the value is left on the stack
+ */
+static void
+lua_task_set_cached (lua_State *L, struct rspamd_task *task, const gchar *key)
+{
+	struct lua_task_cache *cache;
+
+	cache = rspamd_mempool_get_variable (task->task_pool, LUA_TASK_CACHE_VAR);
+
+	if (cache == NULL) {
+		cache = rspamd_mempool_alloc (task->task_pool, sizeof (*cache));
+		/* Registry is shared by all threads, so use the main one */
+		cache->L = task->cfg->lua_state ? task->cfg->lua_state : L;
+		/* Reference is released by the dtor using the same state */
+		lua_newtable (cache->L);
+		cache->ref = luaL_ref (cache->L, LUA_REGISTRYINDEX);
+		rspamd_mempool_set_variable (task->task_pool, LUA_TASK_CACHE_VAR,
+				cache, lua_task_cache_dtor);
+	}
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, cache->ref);
+	lua_pushvalue (L, -2);
+	lua_setfield (L, -2, key);
+	lua_pop (L, 1);
+}
+
+/*
+ * Drops all cached values, e.g. when a message is parsed once again
+ */
+static void
+lua_task_reset_cached (lua_State *L, struct rspamd_task *task)
+{
+	struct lua_task_cache *cache;
+
+	cache = rspamd_mempool_get_variable (task->task_pool, LUA_TASK_CACHE_VAR);
+
+	if (cache != NULL) {
+		luaL_unref (cache->L, LUA_REGISTRYINDEX, cache->ref);
+		lua_newtable (cache->L);
+		cache->ref = luaL_ref (cache->L, LUA_REGISTRYINDEX);
+	}
+}
+
+/* Task creation */
+static int
+lua_task_load_from_string (lua_State *L)
+{
+	struct rspamd_task *task, **ptask;
+	struct rspamd_config *cfg;
+	const gchar *message;
+	gsize mlen;
+
+	message = luaL_checklstring (L, 1, &mlen);
+	cfg = lua_check_config (L, 2);
+
+	if (message == NULL || cfg == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	task = rspamd_task_new (NULL, cfg);
+	task->msg.begin = rspamd_mempool_alloc (task->task_pool, mlen);
+	memcpy ((gpointer)task->msg.begin, message, mlen);
+	task->msg.len = mlen;
+
+	if (!rspamd_task_load_message (task, NULL, task->msg.begin, mlen) ||
+			!rspamd_message_parse (task)) {
+		rspamd_task_free (task);
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	ptask = lua_newuserdata (L, sizeof (*ptask));
+	rspamd_lua_setclass (L, "rspamd{task}", -1);
+	*ptask = task;
+
+	return 1;
+}
+
 /* Task methods */
 static int
 lua_task_process_message (lua_State *L)
@@ -743,6 +883,8 @@ lua_task_process_message (lua_State *L)
 
 	if (task != NULL) {
 		if (task->msg.len > 0) {
+			lua_task_reset_cached (L, task);
+
 			if (rspamd_message_parse (task) == 0) {
 				lua_pushboolean (L, TRUE);
 			}
@@ -1012,13 +1154,23 @@ lua_task_get_urls (lua_State * L)
 	struct rspamd_task *task = lua_check_task (L, 1);
 	struct lua_tree_cb_data cb;
 	gboolean need_emails = FALSE;
+	gchar key[64];
 
 	if (task) {
 		if (lua_gettop (L) >= 2) {
 			need_emails = lua_toboolean (L, 2);
 		}
 
-		lua_newtable (L);
+		/* Urls can be added while a task is processed, so use size as a key */
+		rspamd_snprintf (key, sizeof (key), "urls:%ud:%ud",
+				g_hash_table_size (task->urls),
+				need_emails ? g_hash_table_size (task->emails) + 1 : 0);
+
+		if (lua_task_get_cached (L, task, key)) {
+			return 1;
+		}
+
+		lua_createtable (L, g_hash_table_size (task->urls), 0);
 		cb.i = 1;
 		cb.L = L;
 		g_hash_table_foreach (task->urls, lua_tree_url_callback, &cb);
@@ -1026,6 +1178,8 @@ lua_task_get_urls (lua_State * L)
 		if (need_emails) {
 			g_hash_table_foreach (task->emails, lua_tree_url_callback, &cb);
 		}
+
+		lua_task_set_cached (L, task, key);
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
@@ -1138,7 +1292,11 @@ lua_task_get_text_parts (lua_State * L)
 	struct mime_text_part *part, **ppart;
 
 	if (task != NULL) {
-		lua_newtable (L);
+		if (lua_task_get_cached (L, task, "text_parts")) {
+			return 1;
+		}
+
+		lua_createtable (L, task->text_parts->len, 0);
 
 		for (i = 0; i < task->text_parts->len; i ++) {
 			part = g_ptr_array_index (task->text_parts, i);
@@ -1148,6 +1306,8 @@ lua_task_get_text_parts (lua_State * L)
 			/* Make it array */
 			lua_rawseti (L, -2, i + 1);
 		}
+
+		lua_task_set_cached (L, task, "text_parts");
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
@@ -1366,7 +1526,7 @@ lua_task_get_header_common (lua_State *L, gboolean full, gboolean raw)
 {
 	gboolean strong = FALSE;
 	struct rspamd_task *task = lua_check_task (L, 1);
-	const gchar *name;
+	const gchar *name, *key;
 
 	name = luaL_checkstring (L, 2);
 
@@ -1375,6 +1535,24 @@ lua_task_get_header_common (lua_State *L, gboolean full, gboolean raw)
 			strong = lua_toboolean (L, 3);
 		}
 
+		if (full) {
+			/* Full headers are tables, so they are cached per task */
+			key = lua_pushfstring (L, "header:%d:%s", strong, name);
+
+			if (lua_task_get_cached (L, task, key)) {
+				return 1;
+			}
+
+			rspamd_lua_push_header (L, task->raw_headers, name,
+					strong, full, raw);
+
+			if (!lua_isnil (L, -1)) {
+				lua_task_set_cached (L, task, key);
+			}
+
+			return 1;
+		}
+
 		return rspamd_lua_push_header (L, task->raw_headers, name,
 				strong, full, raw);
 	}
@@ -1431,7 +1609,11 @@ lua_task_get_received_headers (lua_State * L)
 	guint i, k = 1;
 
 	if (task) {
-		lua_newtable (L);
+		if (lua_task_get_cached (L, task, "received")) {
+			return 1;
+		}
+
+		lua_createtable (L, task->received->len, 0);
 
 		for (i = 0; i < task->received->len; i ++) {
 			rh = g_ptr_array_index (task->received, i);
@@ -1489,6 +1671,8 @@ lua_task_get_received_headers (lua_State * L)
 			rspamd_lua_table_set (L, "by_hostname", rh->by_hostname);
 			lua_rawseti (L, -2, k ++);
 		}
+
+		lua_task_set_cached (L, task, "received");
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
@@ -66,6 +66,7 @@ struct lua_tcp_cbdata {
 	GString *in;
 	gchar *stop_pattern;
 	struct rspamd_async_watcher *w;
+	struct rspamd_lua_coroutine *co;
 	struct event ev;
 	gint fd;
 	gint cbref;
@@ -127,6 +128,15 @@ lua_tcp_push_error (struct lua_tcp_cbdata *cbd, const char *err, ...)
 {
 	va_list ap;
 
+	if (cbd->co) {
+		va_start (ap, err);
+		lua_pushvfstring (cbd->co->L, err, ap);
+		va_end (ap);
+		rspamd_lua_coroutine_resume (cbd->co, 1);
+
+		return;
+	}
+
 	va_start (ap, err);
 	lua_rawgeti (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
 	lua_pushvfstring (cbd->L, err, ap);
@@ -142,20 +152,32 @@ static void
 lua_tcp_push_data (struct lua_tcp_cbdata *cbd, const gchar *str, gsize len)
 {
 	struct rspamd_lua_text *t;
+	lua_State *L;
+
+	if (cbd->co) {
+		L = cbd->co->L;
+	}
+	else {
+		L = cbd->L;
+		lua_rawgeti (L, LUA_REGISTRYINDEX, cbd->cbref);
+	}
 
-	lua_rawgeti (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
 	/* Error */
-	lua_pushnil (cbd->L);
+	lua_pushnil (L);
 	/* Body */
-	t = lua_newuserdata (cbd->L, sizeof (*t));
-	rspamd_lua_setclass (cbd->L, "rspamd{text}", -1);
+	t = lua_newuserdata (L, sizeof (*t));
+	rspamd_lua_setclass (L, "rspamd{text}", -1);
 	t->start = str;
 	t->len = len;
 	t->own = FALSE;
 
-	if (lua_pcall (cbd->L, 2, 0, 0) != 0) {
-		msg_info ("callback call failed: %s", lua_tostring (cbd->L, -1));
-		lua_pop (cbd->L, 1);
+	if (cbd->co) {
+		/* As for callbacks, data is not copied and must not be stored */
+		rspamd_lua_coroutine_resume (cbd->co, 2);
+	}
+	else if (lua_pcall (L, 2, 0, 0) != 0) {
+		msg_info ("callback call failed: %s", lua_tostring (L, -1));
+		lua_pop (L, 1);
 	}
 }
 
@@ -433,6 +455,10 @@ lua_tcp_arg_toiovec (lua_State *L, gint pos, rspamd_mempool_t *pool,
  * - `timeout`: floating point value that specifies timeout for IO operations in seconds
  * - `partial`: boolean flag that specifies that callback should be called on any data portion received
  * - `stop_pattern`: stop reading on finding a certain pattern (e.g. \r\n.\r\n for smtp)
+ *
+ * If `callback` is omitted when called from a coroutine (see `rspamd_async`), then this
+ * function suspends the coroutine and returns `err, data` when the request is finished.
+ * This mode cannot be used with `partial` flag.
  * @return {boolean} true if request has been sent
  */
 static gint
@@ -447,6 +473,7 @@ lua_tcp_request (lua_State *L)
 	struct rspamd_dns_resolver *resolver;
 	struct rspamd_async_session *session;
 	struct rspamd_task *task = NULL;
+	struct rspamd_lua_coroutine *co = NULL;
 	rspamd_mempool_t *pool;
 	struct iovec *iov = NULL;
 	guint niov = 0, total_out;
@@ -466,13 +493,24 @@ lua_tcp_request (lua_State *L)
 
 		lua_pushstring (L, "callback");
 		lua_gettable (L, -2);
-		if (host == NULL || lua_type (L, -1) != LUA_TFUNCTION) {
+		if (lua_type (L, -1) != LUA_TFUNCTION) {
+			/* Without callback we can only suspend the current coroutine */
+			co = rspamd_lua_coroutine_current (L);
+		}
+		if (host == NULL || (lua_type (L, -1) != LUA_TFUNCTION && co == NULL)) {
 			lua_pop (L, 1);
 			msg_err ("tcp request has bad params");
 			lua_pushboolean (L, FALSE);
 			return 1;
 		}
-		cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+		if (co) {
+			lua_pop (L, 1);
+			cbref = -1;
+		}
+		else {
+			cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
 
 		lua_pushstring (L, "task");
 		lua_gettable (L, -2);
@@ -562,6 +600,12 @@ lua_tcp_request (lua_State *L)
 			return 1;
 		}
 
+		if (co && partial) {
+			msg_err ("tcp request in partial mode requires callback");
+			lua_pushboolean (L, FALSE);
+			return 1;
+		}
+
 		lua_pushstring (L, "data");
 		lua_gettable (L, -2);
 		total_out = 0;
@@ -617,8 +661,9 @@ lua_tcp_request (lua_State *L)
 	}
 
 	cbd = g_slice_alloc0 (sizeof (*cbd));
-	cbd->L = L;
+	cbd->L = rspamd_lua_coroutine_main_state (L);
 	cbd->cbref = cbref;
+	cbd->co = co;
 	cbd->ev_base = ev_base;
 	msec_to_tv (timeout, &cbd->tv);
 	cbd->fd = -1;
@@ -638,8 +683,12 @@ lua_tcp_request (lua_State *L)
 				(event_finalizer_t)lua_tcp_fin,
 				cbd,
 				g_quark_from_static_string ("lua tcp"));
-		cbd->w = rspamd_session_get_watcher (session);
-		rspamd_session_watcher_push (session);
+
+		/* Coroutine itself keeps a symbol pending */
+		if (co == NULL) {
+			cbd->w = rspamd_session_get_watcher (session);
+			rspamd_session_watcher_push (session);
+		}
 	}
 
 	if (rspamd_parse_inet_address (&cbd->addr, host, 0)) {
@@ -653,22 +702,35 @@ lua_tcp_request (lua_State *L)
 		}
 	}
 	else {
+		gboolean resolved;
+
 		if (task == NULL) {
-			if (!make_dns_request (resolver, session, NULL, lua_tcp_dns_handler, cbd,
-					RDNS_REQUEST_A, host)) {
-				lua_tcp_push_error (cbd, "cannot resolve host: %s", host);
-				lua_tcp_maybe_free (cbd);
-			}
+			resolved = make_dns_request (resolver, session, NULL,
+					lua_tcp_dns_handler, cbd, RDNS_REQUEST_A, host);
 		}
 		else {
-			if (!make_dns_request_task (task, lua_tcp_dns_handler, cbd,
-					RDNS_REQUEST_A, host)) {
-				lua_tcp_push_error (cbd, "cannot resolve host: %s", host);
+			resolved = make_dns_request_task (task, lua_tcp_dns_handler, cbd,
+					RDNS_REQUEST_A, host);
+		}
+
+		if (!resolved) {
+			if (co) {
+				/* Coroutine is still running, so return an error directly */
 				lua_tcp_maybe_free (cbd);
+				lua_pushfstring (L, "cannot resolve host: %s", host);
+
+				return 1;
 			}
+
+			lua_tcp_push_error (cbd, "cannot resolve host: %s", host);
+			lua_tcp_maybe_free (cbd);
 		}
 	}
 
+	if (co) {
+		return lua_yield (L, 0);
+	}
+
 	lua_pushboolean (L, TRUE);
 	return 1;
 }
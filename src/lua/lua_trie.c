@@ -35,6 +35,19 @@ local function trie_callback(number, pos)
 end
 
 trie:match('some big text', trie_callback)
+ *
+ * Tries that are used to search in task's content should be registered for the
+ * specific content types when created. Patterns of all tries registered for the
+ * same content type are merged into a single matcher, so the content of each
+ * task is scanned merely once and matches are dispatched to the owning tries
+ * when their search methods are called:
+ * @example
+local mime_trie = rspamd_trie.create(patterns, 'mime')
+local body_trie = rspamd_trie.create(other_patterns, {'rawbody', 'mime'})
+
+-- Both searches use the results of a single scan of text parts
+mime_trie:search_mime(task, trie_callback)
+body_trie:search_mime(task, trie_callback)
  */
 
 /* Suffix trie */
@@ -59,38 +72,270 @@ static const struct luaL_reg trielib_f[] = {
 	{NULL, NULL}
 };
 
-static struct rspamd_multipattern *
+enum lua_trie_search_type {
+	LUA_TRIE_SEARCH_MIME = 0,
+	LUA_TRIE_SEARCH_RAWMSG,
+	LUA_TRIE_SEARCH_RAWBODY,
+	LUA_TRIE_SEARCH_MAX
+};
+
+static const gchar *lua_trie_search_names[LUA_TRIE_SEARCH_MAX] = {
+	[LUA_TRIE_SEARCH_MIME] = "mime",
+	[LUA_TRIE_SEARCH_RAWMSG] = "rawmsg",
+	[LUA_TRIE_SEARCH_RAWBODY] = "rawbody",
+};
+
+static const gchar *lua_trie_hits_keys[LUA_TRIE_SEARCH_MAX] = {
+	[LUA_TRIE_SEARCH_MIME] = "lua_trie_hits_mime",
+	[LUA_TRIE_SEARCH_RAWMSG] = "lua_trie_hits_rawmsg",
+	[LUA_TRIE_SEARCH_RAWBODY] = "lua_trie_hits_rawbody",
+};
+
+static const gint lua_trie_flags = RSPAMD_MULTIPATTERN_ICASE|
+		RSPAMD_MULTIPATTERN_GLOB;
+
+struct lua_trie {
+	struct rspamd_multipattern *mp;
+	/* Original patterns, stored for registered tries merely */
+	GPtrArray *patterns;
+	/* Index of the first pattern in the merged matcher */
+	guint base[LUA_TRIE_SEARCH_MAX];
+	guint registered;
+};
+
+/*
+ * Registry of tries that search in task's content: patterns of all tries
+ * registered for some content type are merged into a single matcher
+ */
+struct lua_trie_registry {
+	GPtrArray *tries[LUA_TRIE_SEARCH_MAX];
+	struct rspamd_multipattern *mp[LUA_TRIE_SEARCH_MAX];
+	guint generation[LUA_TRIE_SEARCH_MAX];
+	gboolean dirty[LUA_TRIE_SEARCH_MAX];
+};
+
+struct lua_trie_hit {
+	guint id;
+	/* Index of text part for mime search */
+	guint chunk;
+	gint pos;
+};
+
+struct lua_trie_hits_cbdata {
+	GArray *hits;
+	guint chunk;
+};
+
+struct lua_trie_task_hits {
+	guint generation;
+	GArray *hits;
+};
+
+static struct lua_trie_registry *lua_trie_registry = NULL;
+
+static struct lua_trie *
 lua_check_trie (lua_State * L, gint idx)
 {
 	void *ud = rspamd_lua_check_udata (L, 1, "rspamd{trie}");
 
 	luaL_argcheck (L, ud != NULL, 1, "'trie' expected");
-	return ud ? *((struct rspamd_multipattern **)ud) : NULL;
+	return ud ? *((struct lua_trie **)ud) : NULL;
+}
+
+static void
+lua_trie_register (struct lua_trie *trie, enum lua_trie_search_type type)
+{
+	guint i;
+
+	if (lua_trie_registry == NULL) {
+		lua_trie_registry = g_malloc0 (sizeof (*lua_trie_registry));
+
+		for (i = 0; i < LUA_TRIE_SEARCH_MAX; i ++) {
+			lua_trie_registry->tries[i] = g_ptr_array_new ();
+		}
+	}
+
+	if (!(trie->registered & (1u << type))) {
+		trie->registered |= (1u << type);
+		g_ptr_array_add (lua_trie_registry->tries[type], trie);
+		lua_trie_registry->dirty[type] = TRUE;
+	}
 }
 
 static gint
 lua_trie_destroy (lua_State *L)
 {
-	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
+	struct lua_trie *trie = lua_check_trie (L, 1);
+	guint i;
 
 	if (trie) {
-		rspamd_multipattern_destroy (trie);
+		for (i = 0; i < LUA_TRIE_SEARCH_MAX; i ++) {
+			if (trie->registered & (1u << i)) {
+				g_ptr_array_remove (lua_trie_registry->tries[i], trie);
+				lua_trie_registry->dirty[i] = TRUE;
+			}
+		}
+
+		if (trie->patterns) {
+			g_ptr_array_free (trie->patterns, TRUE);
+		}
+
+		rspamd_multipattern_destroy (trie->mp);
+		g_slice_free1 (sizeof (*trie), trie);
 	}
 
 	return 0;
 }
 
+/*
+ * Returns merged matcher for the specified type rebuilding it if tries have
+ * been registered or destroyed since the last call
+ */
+static struct rspamd_multipattern *
+lua_trie_registry_get (enum lua_trie_search_type type, guint *generation)
+{
+	struct lua_trie_registry *reg = lua_trie_registry;
+	struct rspamd_multipattern *mp;
+	struct lua_trie *trie;
+	rspamd_fstring_t *pat;
+	GError *err = NULL;
+	guint i, j, npat = 0;
+
+	if (reg == NULL) {
+		return NULL;
+	}
+
+	if (reg->dirty[type]) {
+		reg->dirty[type] = FALSE;
+		reg->generation[type] ++;
+
+		if (reg->mp[type]) {
+			rspamd_multipattern_destroy (reg->mp[type]);
+			reg->mp[type] = NULL;
+		}
+
+		for (i = 0; i < reg->tries[type]->len; i ++) {
+			trie = g_ptr_array_index (reg->tries[type], i);
+			npat += trie->patterns->len;
+		}
+
+		if (npat > 0) {
+			mp = rspamd_multipattern_create_sized (npat, lua_trie_flags);
+			npat = 0;
+
+			for (i = 0; i < reg->tries[type]->len; i ++) {
+				trie = g_ptr_array_index (reg->tries[type], i);
+				trie->base[type] = npat;
+
+				for (j = 0; j < trie->patterns->len; j ++) {
+					pat = g_ptr_array_index (trie->patterns, j);
+					rspamd_multipattern_add_pattern_len (mp, pat->str, pat->len,
+							lua_trie_flags);
+				}
+
+				npat += trie->patterns->len;
+			}
+
+			if (!rspamd_multipattern_compile (mp, &err)) {
+				msg_err ("cannot compile merged %s multipattern: %e",
+						lua_trie_search_names[type], err);
+				g_error_free (err);
+				rspamd_multipattern_destroy (mp);
+			}
+			else {
+				msg_info ("compiled merged %s multipattern from %ud patterns "
+						"of %ud tries", lua_trie_search_names[type], npat,
+						reg->tries[type]->len);
+				reg->mp[type] = mp;
+			}
+		}
+	}
+
+	*generation = reg->generation[type];
+
+	return reg->mp[type];
+}
+
+void
+rspamd_lua_trie_compile_registered (void)
+{
+	guint i, generation;
+
+	/* Merged matchers are rebuilt merely if some tries have been changed */
+	for (i = 0; i < LUA_TRIE_SEARCH_MAX; i ++) {
+		lua_trie_registry_get (i, &generation);
+	}
+}
+
+static gint
+lua_trie_parse_search_type (const gchar *str)
+{
+	gint i;
+
+	for (i = 0; i < LUA_TRIE_SEARCH_MAX; i ++) {
+		if (g_ascii_strcasecmp (str, lua_trie_search_names[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static guint
+lua_trie_check_search_types (lua_State *L, gint pos)
+{
+	guint types = 0;
+	gint type;
+
+	if (lua_type (L, pos) == LUA_TSTRING) {
+		type = lua_trie_parse_search_type (lua_tostring (L, pos));
+
+		if (type == -1) {
+			msg_err ("invalid trie search type: %s", lua_tostring (L, pos));
+		}
+		else {
+			types |= 1u << type;
+		}
+	}
+	else if (lua_type (L, pos) == LUA_TTABLE) {
+		lua_pushvalue (L, pos);
+		lua_pushnil (L);
+
+		while (lua_next (L, -2) != 0) {
+			if (lua_type (L, -1) == LUA_TSTRING) {
+				type = lua_trie_parse_search_type (lua_tostring (L, -1));
+
+				if (type == -1) {
+					msg_err ("invalid trie search type: %s",
+							lua_tostring (L, -1));
+				}
+				else {
+					types |= 1u << type;
+				}
+			}
+
+			lua_pop (L, 1);
+		}
+
+		lua_pop (L, 1);
+	}
+
+	return types;
+}
+
 /***
- * function trie.create(patterns)
+ * function trie.create(patterns[, search])
  * Creates new trie data structure
  * @param {table} array of string patterns
+ * @param {string|table} search content types (`mime`, `rawmsg` or `rawbody`) this trie is used to search in; tries registered for the same content type share a single scan of task's content
  * @return {trie} new trie object
  */
 static gint
 lua_trie_create (lua_State *L)
 {
-	struct rspamd_multipattern *trie, **ptrie;
-	gint npat = 0, flags = RSPAMD_MULTIPATTERN_ICASE|RSPAMD_MULTIPATTERN_GLOB;
+	struct lua_trie *trie, **ptrie;
+	gint npat = 0, flags = lua_trie_flags;
+	guint types, i;
 	GError *err = NULL;
 
 	if (!lua_istable (L, 1)) {
@@ -109,7 +354,15 @@ lua_trie_create (lua_State *L)
 			lua_pop (L, 1);
 		}
 
-		trie = rspamd_multipattern_create_sized (npat, flags);
+		types = lua_trie_check_search_types (L, 2);
+		trie = g_slice_alloc0 (sizeof (*trie));
+		trie->mp = rspamd_multipattern_create_sized (npat, flags);
+
+		if (types != 0) {
+			trie->patterns = g_ptr_array_new_full (npat,
+					(GDestroyNotify)rspamd_fstring_free);
+		}
+
 		lua_pushnil (L);
 
 		while (lua_next (L, -2) != 0) {
@@ -118,7 +371,12 @@ lua_trie_create (lua_State *L)
 				gsize patlen;
 
 				pat = lua_tolstring (L, -1, &patlen);
-				rspamd_multipattern_add_pattern_len (trie, pat, patlen, flags);
+				rspamd_multipattern_add_pattern_len (trie->mp, pat, patlen, flags);
+
+				if (trie->patterns) {
+					g_ptr_array_add (trie->patterns,
+							rspamd_fstring_new_init (pat, patlen));
+				}
 			}
 
 			lua_pop (L, 1);
@@ -126,13 +384,25 @@ lua_trie_create (lua_State *L)
 
 		lua_pop (L, 1); /* table */
 
-		if (!rspamd_multipattern_compile (trie, &err)) {
+		if (!rspamd_multipattern_compile (trie->mp, &err)) {
 			msg_err ("cannot compile multipattern: %e", err);
 			g_error_free (err);
-			rspamd_multipattern_destroy (trie);
+			rspamd_multipattern_destroy (trie->mp);
+
+			if (trie->patterns) {
+				g_ptr_array_free (trie->patterns, TRUE);
+			}
+
+			g_slice_free1 (sizeof (*trie), trie);
 			lua_pushnil (L);
 		}
 		else {
+			for (i = 0; i < LUA_TRIE_SEARCH_MAX; i ++) {
+				if (types & (1u << i)) {
+					lua_trie_register (trie, i);
+				}
+			}
+
 			ptrie = lua_newuserdata (L, sizeof (void *));
 			rspamd_lua_setclass (L, "rspamd{trie}", -1);
 			*ptrie = trie;
@@ -142,16 +412,12 @@ lua_trie_create (lua_State *L)
 	return 1;
 }
 
+/*
+ * We assume that callback argument is at pos 3
+ */
 static gint
-lua_trie_callback (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint textpos,
-		const gchar *text,
-		gsize len,
-		void *context)
+lua_trie_call (lua_State *L, guint strnum, gint textpos)
 {
-	lua_State *L = context;
 	gint ret;
 
 	/* Function */
@@ -173,6 +439,40 @@ lua_trie_callback (struct rspamd_multipattern *mp,
 	return ret;
 }
 
+static gint
+lua_trie_callback (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint textpos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	lua_State *L = context;
+
+	return lua_trie_call (L, strnum, textpos);
+}
+
+static gint
+lua_trie_hits_callback (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint textpos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	struct lua_trie_hits_cbdata *cbd = context;
+	struct lua_trie_hit hit;
+
+	hit.id = strnum;
+	hit.chunk = cbd->chunk;
+	hit.pos = textpos;
+	g_array_append_val (cbd->hits, hit);
+
+	return 0;
+}
+
 /*
  * We assume that callback argument is at pos 3 and icase is in position 4
  */
@@ -202,7 +502,7 @@ lua_trie_search_str (lua_State *L, struct rspamd_multipattern *trie,
 static gint
 lua_trie_match (lua_State *L)
 {
-	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
+	struct lua_trie *trie = lua_check_trie (L, 1);
 	const gchar *text;
 	gsize len;
 	gboolean found = FALSE;
@@ -216,7 +516,7 @@ lua_trie_match (lua_State *L)
 				if (lua_isstring (L, -1)) {
 					text = lua_tolstring (L, -1, &len);
 
-					if (lua_trie_search_str (L, trie, text, len)) {
+					if (lua_trie_search_str (L, trie->mp, text, len)) {
 						found = TRUE;
 					}
 				}
@@ -228,7 +528,7 @@ lua_trie_match (lua_State *L)
 		else if (lua_type (L, 2) == LUA_TSTRING) {
 			text = lua_tolstring (L, 2, &len);
 
-			if (lua_trie_search_str (L, trie, text, len)) {
+			if (lua_trie_search_str (L, trie->mp, text, len)) {
 				found = TRUE;
 			}
 		}
@@ -238,6 +538,177 @@ lua_trie_match (lua_State *L)
 	return 1;
 }
 
+/*
+ * Returns text of the specified type, mime content consists of several chunks
+ * (text parts), so this function returns FALSE when there are no more chunks
+ * and sets text to NULL for an empty chunk
+ */
+static gboolean
+lua_trie_get_text (struct rspamd_task *task, enum lua_trie_search_type type,
+		guint idx, const gchar **text, gsize *len)
+{
+	struct mime_text_part *part;
+
+	*text = NULL;
+	*len = 0;
+
+	switch (type) {
+	case LUA_TRIE_SEARCH_MIME:
+		if (idx >= task->text_parts->len) {
+			return FALSE;
+		}
+
+		part = g_ptr_array_index (task->text_parts, idx);
+
+		if (!IS_PART_EMPTY (part) && part->content != NULL) {
+			*text = (const gchar *)part->content->data;
+			*len = part->content->len;
+		}
+		break;
+	case LUA_TRIE_SEARCH_RAWMSG:
+		if (idx > 0) {
+			return FALSE;
+		}
+
+		*text = task->msg.begin;
+		*len = task->msg.len;
+		break;
+	case LUA_TRIE_SEARCH_RAWBODY:
+		if (idx > 0) {
+			return FALSE;
+		}
+
+		if (task->raw_headers_content.len > 0) {
+			*text = task->msg.begin + task->raw_headers_content.len;
+			*len = task->msg.len - task->raw_headers_content.len;
+		}
+		else {
+			/* Treat as raw message */
+			*text = task->msg.begin;
+			*len = task->msg.len;
+		}
+		break;
+	default:
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Scans task's content with the merged matcher once per task storing all
+ * matches in the task's pool
+ */
+static GArray *
+lua_trie_task_hits (struct rspamd_task *task, enum lua_trie_search_type type)
+{
+	struct rspamd_multipattern *mp;
+	struct lua_trie_task_hits *th;
+	struct lua_trie_hits_cbdata cbd;
+	const gchar *text;
+	gsize len;
+	guint generation, i;
+
+	mp = lua_trie_registry_get (type, &generation);
+
+	if (mp == NULL) {
+		return NULL;
+	}
+
+	th = rspamd_mempool_get_variable (task->task_pool, lua_trie_hits_keys[type]);
+
+	if (th != NULL && th->generation == generation) {
+		return th->hits;
+	}
+
+	th = rspamd_mempool_alloc (task->task_pool, sizeof (*th));
+	th->generation = generation;
+	th->hits = g_array_new (FALSE, FALSE, sizeof (struct lua_trie_hit));
+	rspamd_mempool_add_destructor (task->task_pool, rspamd_array_free_hard,
+			th->hits);
+
+	cbd.hits = th->hits;
+
+	for (i = 0; lua_trie_get_text (task, type, i, &text, &len); i ++) {
+		if (text != NULL && len > 0) {
+			cbd.chunk = i;
+			rspamd_multipattern_lookup (mp, text, len, lua_trie_hits_callback,
+					&cbd, NULL);
+		}
+	}
+
+	rspamd_mempool_set_variable (task->task_pool, lua_trie_hits_keys[type],
+			th, NULL);
+
+	return th->hits;
+}
+
+/*
+ * Calls callback for matches of the specified trie. As in lua_trie_search_str,
+ * a non-zero value returned by callback stops search in the current text part
+ * merely, and the next part is searched then
+ */
+static gboolean
+lua_trie_dispatch_hits (lua_State *L, struct lua_trie *trie, GArray *hits,
+		enum lua_trie_search_type type)
+{
+	struct lua_trie_hit *hit;
+	guint i, base, npat;
+	gint skip_chunk = -1;
+	gboolean found = FALSE;
+
+	base = trie->base[type];
+	npat = trie->patterns->len;
+
+	for (i = 0; i < hits->len; i ++) {
+		hit = &g_array_index (hits, struct lua_trie_hit, i);
+
+		if ((gint)hit->chunk == skip_chunk) {
+			continue;
+		}
+
+		if (hit->id >= base && hit->id < base + npat) {
+			found = TRUE;
+
+			if (lua_trie_call (L, hit->id - base, hit->pos) != 0) {
+				skip_chunk = hit->chunk;
+			}
+		}
+	}
+
+	return found;
+}
+
+static gboolean
+lua_trie_search_task (lua_State *L, struct lua_trie *trie,
+		struct rspamd_task *task, enum lua_trie_search_type type)
+{
+	GArray *hits = NULL;
+	const gchar *text;
+	gsize len;
+	guint i;
+	gboolean found = FALSE;
+
+	if (trie->registered & (1u << type)) {
+		hits = lua_trie_task_hits (task, type);
+	}
+
+	if (hits != NULL) {
+		return lua_trie_dispatch_hits (L, trie, hits, type);
+	}
+
+	/* Not registered trie: search on its own */
+	for (i = 0; lua_trie_get_text (task, type, i, &text, &len); i ++) {
+		if (text != NULL) {
+			if (lua_trie_search_str (L, trie->mp, text, len) != 0) {
+				found = TRUE;
+			}
+		}
+	}
+
+	return found;
+}
+
 /***
  * @method trie:search_mime(task, cb[, caseless])
  * This is a helper mehthod to search pattern within text parts of a message in rspamd task
@@ -249,26 +720,12 @@ lua_trie_match (lua_State *L)
 static gint
 lua_trie_search_mime (lua_State *L)
 {
-	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
+	struct lua_trie *trie = lua_check_trie (L, 1);
 	struct rspamd_task *task = lua_check_task (L, 2);
-	struct mime_text_part *part;
-	const gchar *text;
-	gsize len, i;
 	gboolean found = FALSE;
 
-	if (trie) {
-		for (i = 0; i < task->text_parts->len; i ++) {
-			part = g_ptr_array_index (task->text_parts, i);
-
-			if (!IS_PART_EMPTY (part) && part->content != NULL) {
-				text = part->content->data;
-				len = part->content->len;
-
-				if (lua_trie_search_str (L, trie, text, len) != 0) {
-					found = TRUE;
-				}
-			}
-		}
+	if (trie && task) {
+		found = lua_trie_search_task (L, trie, task, LUA_TRIE_SEARCH_MIME);
 	}
 
 	lua_pushboolean (L, found);
@@ -286,19 +743,12 @@ lua_trie_search_mime (lua_State *L)
 static gint
 lua_trie_search_rawmsg (lua_State *L)
 {
-	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
+	struct lua_trie *trie = lua_check_trie (L, 1);
 	struct rspamd_task *task = lua_check_task (L, 2);
-	const gchar *text;
-	gsize len;
 	gboolean found = FALSE;
 
-	if (trie) {
-		text = task->msg.begin;
-		len = task->msg.len;
-
-		if (lua_trie_search_str (L, trie, text, len) != 0) {
-			found = TRUE;
-		}
+	if (trie && task) {
+		found = lua_trie_search_task (L, trie, task, LUA_TRIE_SEARCH_RAWMSG);
 	}
 
 	lua_pushboolean (L, found);
@@ -316,26 +766,12 @@ lua_trie_search_rawmsg (lua_State *L)
 static gint
 lua_trie_search_rawbody (lua_State *L)
 {
-	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
+	struct lua_trie *trie = lua_check_trie (L, 1);
 	struct rspamd_task *task = lua_check_task (L, 2);
-	const gchar *text;
-	gsize len;
 	gboolean found = FALSE;
 
-	if (trie) {
-		if (task->raw_headers_content.len > 0) {
-			text = task->msg.begin + task->raw_headers_content.len;
-			len = task->msg.len - task->raw_headers_content.len;
-		}
-		else {
-			/* Treat as raw message */
-			text = task->msg.begin;
-			len = task->msg.len;
-		}
-
-		if (lua_trie_search_str (L, trie, text, len) != 0) {
-			found = TRUE;
-		}
+	if (trie && task) {
+		found = lua_trie_search_task (L, trie, task, LUA_TRIE_SEARCH_RAWBODY);
 	}
 
 	lua_pushboolean (L, found);
@@ -27,6 +27,7 @@
  * - round-robin: balance upstreams one by one selecting accordingly to their weight
  * - hash: use stable hashing algorithm to distribute values according to some static strings
  * - master-slave: always prefer upstream with higher priority unless it is not available
+ * - latency: prefer upstreams with lower latency and less requests in flight
  *
  * Here is an example of upstreams manipulations:
  * @example
@@ -57,12 +58,14 @@ LUA_FUNCTION_DEF (upstream_list, destroy);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_by_hash);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_round_robin);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_master_slave);
+LUA_FUNCTION_DEF (upstream_list, get_upstream_by_latency);
 
 static const struct luaL_reg upstream_list_m[] = {
 
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_by_hash),
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_round_robin),
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_master_slave),
+	LUA_INTERFACE_DEF (upstream_list, get_upstream_by_latency),
 	{"__tostring", rspamd_lua_class_tostring},
 	{"__gc", lua_upstream_list_destroy},
 	{NULL, NULL}
@@ -76,10 +79,12 @@ static const struct luaL_reg upstream_list_f[] = {
 LUA_FUNCTION_DEF (upstream, ok);
 LUA_FUNCTION_DEF (upstream, fail);
 LUA_FUNCTION_DEF (upstream, get_addr);
+LUA_FUNCTION_DEF (upstream, latency);
 
 static const struct luaL_reg upstream_m[] = {
 	LUA_INTERFACE_DEF (upstream, ok),
 	LUA_INTERFACE_DEF (upstream, fail),
+	LUA_INTERFACE_DEF (upstream, latency),
 	LUA_INTERFACE_DEF (upstream, get_addr),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
@@ -148,6 +153,24 @@ lua_upstream_ok (lua_State *L)
 	return 0;
 }
 
+/***
+ * @method upstream:latency(seconds)
+ * Reports latency of a successful request to an upstream. Upstreams selected
+ * by latency should report each finished request with this method or `fail`.
+ * @param {number} seconds time spent for the request
+ */
+static gint
+lua_upstream_latency (lua_State *L)
+{
+	struct upstream *up = lua_check_upstream (L);
+
+	if (up) {
+		rspamd_upstream_latency (up, luaL_checknumber (L, 2));
+	}
+
+	return 0;
+}
+
 /* Upstream list class */
 
 static struct upstream_list *
@@ -319,6 +342,39 @@ lua_upstream_list_get_upstream_master_slave (lua_State *L)
 	return 1;
 }
 
+/***
+ * @method upstream_list:get_upstream_by_latency()
+ * Get upstream with lower latency and less requests in flight
+ * @return {upstream} upstream from a list selected by latency
+ */
+static gint
+lua_upstream_list_get_upstream_by_latency (lua_State *L)
+{
+	struct upstream_list *upl;
+	struct upstream *selected, **pselected;
+
+	upl = lua_check_upstream_list (L);
+	if (upl) {
+
+		selected = rspamd_upstream_get (upl, RSPAMD_UPSTREAM_LATENCY,
+				NULL,
+				0);
+		if (selected) {
+			pselected = lua_newuserdata (L, sizeof (struct upstream *));
+			rspamd_lua_setclass (L, "rspamd{upstream}", -1);
+			*pselected = selected;
+		}
+		else {
+			lua_pushnil (L);
+		}
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
 static gint
 lua_load_upstream_list (lua_State * L)
 {
@@ -117,71 +117,120 @@ chartable_module_reconfig (struct rspamd_config *cfg)
 	return chartable_module_config (cfg);
 }
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CHARTABLE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/*
+ * Count pairs of adjacent bytes where ascii letter is followed by 8 bit
+ * character or vice versa (mark) and pairs of characters of the same class
+ */
+static void
+check_part_raw (const guchar *p, gsize len, guint32 *pmark, guint32 *ptotal)
+{
+	guint32 mark = 0, total = 0;
+	gsize i = 0;
+#ifdef CHARTABLE_SSE2
+	const __m128i lc = _mm_set1_epi8 (0x20),
+			before_a = _mm_set1_epi8 ('a' - 1),
+			after_z = _mm_set1_epi8 ('z' + 1);
+	__m128i v0, v1;
+	guint hi0, hi1, alpha0, alpha1, m;
+
+	/* Process 16 pairs at once */
+	while (i + 17 <= len) {
+		v0 = _mm_loadu_si128 ((const __m128i *)(p + i));
+		v1 = _mm_loadu_si128 ((const __m128i *)(p + i + 1));
+		hi0 = _mm_movemask_epi8 (v0);
+		hi1 = _mm_movemask_epi8 (v1);
+		/* 8 bit characters are negative and thus never in 'a'..'z' */
+		v0 = _mm_or_si128 (v0, lc);
+		v1 = _mm_or_si128 (v1, lc);
+		alpha0 = _mm_movemask_epi8 (_mm_and_si128 (
+				_mm_cmpgt_epi8 (v0, before_a), _mm_cmplt_epi8 (v0, after_z)));
+		alpha1 = _mm_movemask_epi8 (_mm_and_si128 (
+				_mm_cmpgt_epi8 (v1, before_a), _mm_cmplt_epi8 (v1, after_z)));
+		m = (alpha0 & hi1) | (hi0 & alpha1);
+		mark += __builtin_popcount (m);
+		total += __builtin_popcount (m | (hi0 & hi1) | (alpha0 & alpha1));
+		i += 16;
+	}
+#endif
+
+	for (; i + 1 < len; i ++) {
+		if ((g_ascii_isalpha (p[i]) && (p[i + 1] & 0x80)) ||
+			((p[i] & 0x80) && g_ascii_isalpha (p[i + 1]))) {
+			mark++;
+			total++;
+		}
+		/* Current and next symbols are of one class */
+		else if (((p[i] & 0x80) && (p[i + 1] & 0x80)) ||
+			(g_ascii_isalpha (p[i]) && g_ascii_isalpha (p[i + 1]))) {
+			total++;
+		}
+	}
+
+	*pmark += mark;
+	*ptotal += total;
+}
+
 static gboolean
 check_part (struct mime_text_part *part, gboolean raw_mode)
 {
-	guchar *p, *p1;
-	gunichar c, t;
-	GUnicodeScript scc, sct;
+	guchar *p;
+	gunichar buf[256];
+	GUnicodeScript scc = 0, sct;
 	guint32 mark = 0, total = 0, max = 0, i;
-	guint32 remain = part->content->len;
+	gsize remain = part->content->len, n, j, consumed, k = 0;
 	guint32 scripts[G_UNICODE_SCRIPT_NKO];
 	GUnicodeScript sel = 0;
+	gboolean c_alpha = FALSE, t_alpha;
 
 	p = part->content->data;
 
 	if (IS_PART_UTF (part) || raw_mode) {
-		while (remain > 1) {
-			if ((g_ascii_isalpha (*p) &&
-				(*(p + 1) & 0x80)) ||
-				((*p & 0x80) && g_ascii_isalpha (*(p + 1)))) {
-				mark++;
-				total++;
-			}
-			/* Current and next symbols are of one class */
-			else if (((*p & 0x80) &&
-				(*(p + 1) & 0x80)) ||
-				(g_ascii_isalpha (*p) && g_ascii_isalpha (*(p + 1)))) {
-				total++;
-			}
-			p++;
-			remain--;
-		}
+		check_part_raw (p, remain, &mark, &total);
 	}
 	else {
 		memset (&scripts, 0, sizeof (scripts));
+
+		/*
+		 * Characters are checked in pairs: the script of the first one is
+		 * counted and script changes are counted between alphabetic members
+		 * of each pair
+		 */
 		while (remain > 0) {
-			c = g_utf8_get_char_validated (p, remain);
-			if (c == (gunichar) - 2 || c == (gunichar) - 1) {
-				/* Invalid characters detected, stop processing */
-				return FALSE;
-			}
+			n = rspamd_utf8_decode (p, remain, buf, G_N_ELEMENTS (buf),
+					&consumed);
 
-			scc = g_unichar_get_script (c);
-			if (scc < (gint)G_N_ELEMENTS (scripts)) {
-				scripts[scc]++;
-			}
-			p1 = g_utf8_next_char (p);
-			remain -= p1 - p;
-			p = p1;
-
-			if (remain > 0) {
-				t = g_utf8_get_char_validated (p, remain);
-				if (t == (gunichar) - 2 || t == (gunichar) - 1) {
-					/* Invalid characters detected, stop processing */
-					return FALSE;
+			for (j = 0; j < n; j ++, k ++) {
+				if ((k & 1) == 0) {
+					scc = rspamd_unichar_get_script (buf[j], &c_alpha);
+
+					if (scc < (gint)G_N_ELEMENTS (scripts)) {
+						scripts[scc]++;
+					}
 				}
-				sct = g_unichar_get_script (t);
-				if (g_unichar_isalpha (c) && g_unichar_isalpha (t)) {
-					/* We have two unicode alphanumeric characters, so we can check its script */
-					if (sct != scc) {
-						mark++;
+				else {
+					sct = rspamd_unichar_get_script (buf[j], &t_alpha);
+
+					if (c_alpha && t_alpha) {
+						/* We have two unicode alphanumeric characters, so we can check its script */
+						if (sct != scc) {
+							mark++;
+						}
+						total++;
 					}
-					total++;
 				}
-				p1 = g_utf8_next_char (p);
-				remain -= p1 - p;
-				p = p1;
+			}
+
+			p += consumed;
+			remain -= consumed;
+
+			if (n < G_N_ELEMENTS (buf) && remain > 0) {
+				/* Invalid characters detected, stop processing */
+				return FALSE;
 			}
 		}
 		/* Detect the mostly charset of this part */
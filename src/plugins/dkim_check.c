@@ -42,6 +42,8 @@
 #define DEFAULT_CACHE_SIZE 2048
 #define DEFAULT_CACHE_MAXAGE 86400
 #define DEFAULT_TIME_JITTER 60
+/* DER of RSA 4096 public key is about 550 bytes */
+#define DEFAULT_SHARED_KEY_SIZE 1024
 
 struct dkim_ctx {
 	struct module_ctx ctx;
@@ -55,6 +57,7 @@ struct dkim_ctx {
 	guint strict_multiplier;
 	guint time_jitter;
 	rspamd_lru_hash_t *dkim_hash;
+	rspamd_shared_cache_t *dkim_shared;
 	gboolean trusted_only;
 	gboolean skip_multi;
 };
@@ -350,6 +353,14 @@ dkim_module_config (struct rspamd_config *cfg)
 				cache_size,
 				g_free, /* Keys are just C-strings */
 				dkim_module_key_dtor);
+		/*
+		 * Keys fetched by one worker are shared with others via the cache
+		 * that is allocated before forking
+		 */
+		dkim_module_ctx->dkim_shared = rspamd_shared_cache_new (
+				dkim_module_ctx->dkim_pool,
+				cache_size,
+				DEFAULT_SHARED_KEY_SIZE);
 
 		msg_info_config ("init internal dkim module");
 #ifndef HAVE_OPENSSL
@@ -491,6 +502,61 @@ dkim_module_check (struct dkim_check_result *res)
 	}
 }
 
+static void
+dkim_module_share_key (rspamd_dkim_key_t *key, const gchar *dns_key,
+		time_t now)
+{
+	const guchar *der;
+	gsize len;
+
+	if (dkim_module_ctx->dkim_shared == NULL) {
+		return;
+	}
+
+	der = rspamd_dkim_key_get_der (key, &len);
+
+	if (der != NULL) {
+		rspamd_shared_cache_insert (dkim_module_ctx->dkim_shared,
+				dns_key, strlen (dns_key), der, len, now,
+				rspamd_dkim_key_get_ttl (key));
+	}
+}
+
+/*
+ * Try to load key that has been fetched by another worker, on success the key
+ * is also inserted to the local cache
+ */
+static rspamd_dkim_key_t *
+dkim_module_shared_key (struct rspamd_task *task, const gchar *dns_key)
+{
+	guchar der[DEFAULT_SHARED_KEY_SIZE];
+	rspamd_dkim_key_t *key;
+	gssize len;
+	guint ttl;
+
+	if (dkim_module_ctx->dkim_shared == NULL) {
+		return NULL;
+	}
+
+	len = rspamd_shared_cache_lookup (dkim_module_ctx->dkim_shared,
+			dns_key, strlen (dns_key), der, task->tv.tv_sec, &ttl);
+
+	if (len <= 0) {
+		return NULL;
+	}
+
+	key = rspamd_dkim_key_from_der (der, len, ttl, NULL);
+
+	if (key != NULL) {
+		msg_debug_task ("loaded dkim key %s from the shared cache", dns_key);
+		/* LRU hash owns this reference */
+		rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
+				g_strdup (dns_key), key, task->tv.tv_sec, ttl);
+	}
+
+	return key;
+}
+
 static void
 dkim_module_key_handler (rspamd_dkim_key_t *key,
 	gsize keylen,
@@ -511,6 +577,8 @@ dkim_module_key_handler (rspamd_dkim_key_t *key,
 		rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
 			g_strdup (rspamd_dkim_get_dns_key (ctx)),
 			key, res->task->tv.tv_sec, rspamd_dkim_key_get_ttl (key));
+		dkim_module_share_key (key, rspamd_dkim_get_dns_key (ctx),
+				res->task->tv.tv_sec);
 		/* Another ref belongs to the check context */
 		 res->key = rspamd_dkim_key_ref (key);
 		/* Release key when task is processed */
@@ -622,6 +690,11 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 							rspamd_dkim_get_dns_key (ctx),
 							task->tv.tv_sec);
 
+					if (key == NULL) {
+						key = dkim_module_shared_key (task,
+								rspamd_dkim_get_dns_key (ctx));
+					}
+
 					if (key != NULL) {
 						cur->key = rspamd_dkim_key_ref (key);
 						/* Release key when task is processed */
@@ -42,6 +42,7 @@
 #include "keypair.h"
 #include "lua/lua_common.h"
 #include "unix-std.h"
+#include "ref.h"
 #include "libutil/http_private.h"
 #include <math.h>
 
@@ -53,6 +54,9 @@
 #define DEFAULT_IO_TIMEOUT 500
 #define DEFAULT_RETRANSMITS 3
 #define DEFAULT_PORT 11335
+/* Maximum number of datagrams sent or received by a single syscall */
+#define FUZZY_CHANNEL_BATCH 64
+#define FUZZY_CHANNEL_READ_BATCH 16
 
 #define RSPAMD_FUZZY_PLUGIN_VERSION RSPAMD_FUZZY_VERSION
 
@@ -102,19 +106,37 @@ struct fuzzy_ctx {
 	guint32 min_width;
 	guint32 io_timeout;
 	guint32 retransmits;
+	/* Shared channels indexed by upstream */
+	GHashTable *channels;
+};
+
+/*
+ * Socket shared by all tasks of a worker to talk to a fuzzy server, replies
+ * are dispatched to the waiting sessions by tags of commands
+ */
+struct fuzzy_client_channel {
+	struct fuzzy_rule *rule;
+	struct upstream *server;
+	rspamd_inet_addr_t *addr;
+	struct event_base *ev_base;
+	struct event ev;
+	/* Tag -> fuzzy_client_session */
+	GHashTable *waiters;
+	/* Commands waiting for the socket to become writable */
+	GPtrArray *outq;
+	gint fd;
+	gboolean writing;
+	ref_entry_t ref;
 };
 
 struct fuzzy_client_session {
 	GPtrArray *commands;
 	struct rspamd_task *task;
-	struct upstream *server;
-	rspamd_inet_addr_t *addr;
+	struct fuzzy_client_channel *channel;
 	struct fuzzy_rule *rule;
-	struct event ev;
 	struct event timev;
 	struct timeval tv;
-	gint state;
-	gint fd;
+	gdouble start_time;
 	guint retransmits;
 };
 
@@ -148,6 +170,8 @@ static struct fuzzy_ctx *fuzzy_module_ctx = NULL;
 static const char *default_headers = "Subject,Content-Type,Reply-To,X-Mailer";
 
 static void fuzzy_symbol_callback (struct rspamd_task *task, void *unused);
+static void fuzzy_io_fin (void *ud);
+static void fuzzy_channel_close (struct fuzzy_client_channel *chan);
 
 /* Initialization */
 gint fuzzy_check_module_init (struct rspamd_config *cfg,
@@ -450,6 +474,9 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 					g_ascii_strcasecmp (rule->algorithm_str, "fast") == 0) {
 				rule->alg = RSPAMD_SHINGLES_FAST;
 			}
+			else if (g_ascii_strcasecmp (rule->algorithm_str, "vector") == 0) {
+				rule->alg = RSPAMD_SHINGLES_VECTOR;
+			}
 			else {
 				msg_warn_config ("unknown algorithm: %s, use siphash by default");
 			}
@@ -470,6 +497,9 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 	case RSPAMD_SHINGLES_FAST:
 		rule->algorithm_str = "fast";
 		break;
+	case RSPAMD_SHINGLES_VECTOR:
+		rule->algorithm_str = "vec";
+		break;
 	}
 
 	if ((value = ucl_object_lookup (obj, "servers")) != NULL) {
@@ -964,6 +994,19 @@ gint
 fuzzy_check_module_reconfig (struct rspamd_config *cfg)
 {
 	struct module_ctx saved_ctx;
+	GList *channels, *cur;
+
+	if (fuzzy_module_ctx->channels != NULL) {
+		/* Channels refer to rules and upstreams that are destroyed below */
+		channels = g_hash_table_get_values (fuzzy_module_ctx->channels);
+
+		for (cur = channels; cur != NULL; cur = g_list_next (cur)) {
+			fuzzy_channel_close (cur->data);
+		}
+
+		g_list_free (channels);
+		g_hash_table_unref (fuzzy_module_ctx->channels);
+	}
 
 	saved_ctx = fuzzy_module_ctx->ctx;
 	rspamd_mempool_delete (fuzzy_module_ctx->fuzzy_pool);
@@ -975,21 +1018,6 @@ fuzzy_check_module_reconfig (struct rspamd_config *cfg)
 	return fuzzy_check_module_config (cfg);
 }
 
-/* Finalize IO */
-static void
-fuzzy_io_fin (void *ud)
-{
-	struct fuzzy_client_session *session = ud;
-
-	if (session->commands) {
-		g_ptr_array_free (session->commands, TRUE);
-	}
-
-	event_del (&session->ev);
-	event_del (&session->timev);
-	close (session->fd);
-}
-
 static GArray *
 fuzzy_preprocess_words (struct mime_text_part *part, rspamd_mempool_t *pool)
 {
@@ -1397,25 +1425,21 @@ fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
 }
 
 /*
- * Read replies one-by-one and remove them from req array
+ * Read the next reply from the wire decrypting it if needed
  */
 static const struct rspamd_fuzzy_reply *
-fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
-		struct fuzzy_rule *rule, struct rspamd_fuzzy_cmd **pcmd)
+fuzzy_read_reply (guchar **pos, gint *r, struct fuzzy_rule *rule)
 {
 	guchar *p = *pos;
 	gint remain = *r;
-	guint i, required_size;
-	struct fuzzy_cmd_io *io;
-	const struct rspamd_fuzzy_reply *rep;
+	guint required_size;
 	struct rspamd_fuzzy_encrypted_reply encrep;
-	gboolean found = FALSE;
 
 	if (rule->peer_key) {
 		required_size = sizeof (encrep);
 	}
 	else {
-		required_size = sizeof (*rep);
+		required_size = sizeof (struct rspamd_fuzzy_reply);
 	}
 
 	if (remain <= 0 || (guint)remain < required_size) {
@@ -1450,10 +1474,20 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 		*r -= required_size;
 	}
 
-	rep = (const struct rspamd_fuzzy_reply *) p;
-	/*
-	 * Search for tag
-	 */
+	return (const struct rspamd_fuzzy_reply *) p;
+}
+
+/*
+ * Find command for the reply and mark it as replied
+ */
+static gboolean
+fuzzy_reply_match (const struct rspamd_fuzzy_reply *rep, GPtrArray *req,
+		struct rspamd_fuzzy_cmd **pcmd)
+{
+	guint i;
+	struct fuzzy_cmd_io *io;
+	gboolean found = FALSE;
+
 	for (i = 0; i < req->len; i ++) {
 		io = g_ptr_array_index (req, i);
 
@@ -1465,7 +1499,7 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 					*pcmd = &io->cmd;
 				}
 
-				return rep;
+				return TRUE;
 			}
 			found = TRUE;
 		}
@@ -1475,7 +1509,25 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 		msg_info ("unexpected tag: %ud", rep->tag);
 	}
 
-	return NULL;
+	return FALSE;
+}
+
+/*
+ * Read replies one-by-one and remove them from req array
+ */
+static const struct rspamd_fuzzy_reply *
+fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
+		struct fuzzy_rule *rule, struct rspamd_fuzzy_cmd **pcmd)
+{
+	const struct rspamd_fuzzy_reply *rep;
+
+	rep = fuzzy_read_reply (pos, r, rule);
+
+	if (rep == NULL || !fuzzy_reply_match (rep, req, pcmd)) {
+		return NULL;
+	}
+
+	return rep;
 }
 
 static void
@@ -1538,74 +1590,49 @@ fuzzy_insert_result (struct fuzzy_client_session *session,
 	}
 }
 
-static gint
-fuzzy_check_try_read (struct fuzzy_client_session *session)
+static void
+fuzzy_check_process_reply (struct fuzzy_client_session *session,
+		const struct rspamd_fuzzy_reply *rep,
+		struct rspamd_fuzzy_cmd *cmd)
 {
-	struct rspamd_task *task;
-	const struct rspamd_fuzzy_reply *rep;
-	struct rspamd_fuzzy_cmd *cmd = NULL;
-	gint r, ret;
-	guchar buf[2048], *p;
-
-	task = session->task;
+	struct rspamd_task *task = session->task;
 
-	if ((r = read (session->fd, buf, sizeof (buf) - 1)) == -1) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-			return 0;
+	if (rep->prob > 0.5) {
+		if (cmd->cmd == FUZZY_CHECK) {
+			fuzzy_insert_result (session, rep, cmd, rep->flag);
 		}
-		else {
-			return -1;
-		}
-	}
-	else {
-		p = buf;
-
-		ret = 0;
-
-		while ((rep = fuzzy_process_reply (&p, &r,
-				session->commands, session->rule, &cmd)) != NULL) {
-			if (rep->prob > 0.5) {
-				if (cmd->cmd == FUZZY_CHECK) {
-					fuzzy_insert_result (session, rep, cmd, rep->flag);
-				}
-				else if (cmd->cmd == FUZZY_STAT) {
-					/* Just set pool variable to extract it in further */
-					struct rspamd_fuzzy_stat_entry *pval;
-					GList *res;
+		else if (cmd->cmd == FUZZY_STAT) {
+			/* Just set pool variable to extract it in further */
+			struct rspamd_fuzzy_stat_entry *pval;
+			GList *res;
 
-					pval = rspamd_mempool_alloc (task->task_pool, sizeof (*pval));
-					pval->fuzzy_cnt = rep->flag;
-					pval->name = session->rule->name;
+			pval = rspamd_mempool_alloc (task->task_pool, sizeof (*pval));
+			pval->fuzzy_cnt = rep->flag;
+			pval->name = session->rule->name;
 
-					res = rspamd_mempool_get_variable (task->task_pool, "fuzzy_stat");
+			res = rspamd_mempool_get_variable (task->task_pool, "fuzzy_stat");
 
-					if (res == NULL) {
-						res = g_list_append (NULL, pval);
-						rspamd_mempool_set_variable (task->task_pool, "fuzzy_stat",
-								res, (rspamd_mempool_destruct_t)g_list_free);
-					}
-					else {
-						res = g_list_append (res, pval);
-					}
-				}
-			}
-			else if (rep->value == 403) {
-				msg_info_task (
-						"fuzzy check error for %d: forbidden",
-						rep->flag);
+			if (res == NULL) {
+				res = g_list_append (NULL, pval);
+				rspamd_mempool_set_variable (task->task_pool, "fuzzy_stat",
+						res, (rspamd_mempool_destruct_t)g_list_free);
 			}
-			else if (rep->value != 0) {
-				msg_info_task (
-						"fuzzy check error for %d: unknown error (%d)",
-						rep->flag,
-						rep->value);
+			else {
+				res = g_list_append (res, pval);
 			}
-
-			ret = 1;
 		}
 	}
-
-	return ret;
+	else if (rep->value == 403) {
+		msg_info_task (
+				"fuzzy check error for %d: forbidden",
+				rep->flag);
+	}
+	else if (rep->value != 0) {
+		msg_info_task (
+				"fuzzy check error for %d: unknown error (%d)",
+				rep->flag,
+				rep->value);
+	}
 }
 
 static gboolean
@@ -1614,7 +1641,7 @@ fuzzy_check_session_is_completed (struct fuzzy_client_session *session)
 	struct fuzzy_cmd_io *io;
 	guint nreplied = 0, i;
 
-	rspamd_upstream_ok (session->server);
+	rspamd_upstream_ok (session->channel->server);
 
 	for (i = 0; i < session->commands->len; i++) {
 		io = g_ptr_array_index (session->commands, i);
@@ -1625,6 +1652,8 @@ fuzzy_check_session_is_completed (struct fuzzy_client_session *session)
 	}
 
 	if (nreplied == session->commands->len) {
+		rspamd_upstream_latency (session->channel->server,
+				rspamd_get_ticks () - session->start_time);
 		rspamd_session_remove_event (session->task->s, fuzzy_io_fin, session);
 
 		return TRUE;
@@ -1633,85 +1662,373 @@ fuzzy_check_session_is_completed (struct fuzzy_client_session *session)
 	return FALSE;
 }
 
-/* Fuzzy check callback */
+static void fuzzy_channel_handler (gint fd, short what, void *arg);
+
 static void
-fuzzy_check_io_callback (gint fd, short what, void *arg)
+fuzzy_channel_dtor (struct fuzzy_client_channel *chan)
 {
-	struct fuzzy_client_session *session = arg;
-	struct rspamd_task *task;
-	struct event_base *ev_base;
+	if (chan->fd != -1) {
+		event_del (&chan->ev);
+		close (chan->fd);
+	}
+
+	g_hash_table_unref (chan->waiters);
+	g_ptr_array_free (chan->outq, TRUE);
+	g_slice_free1 (sizeof (*chan), chan);
+}
+
+static void
+fuzzy_channel_set_writing (struct fuzzy_client_channel *chan, gboolean writing)
+{
+	if (chan->writing != writing && chan->fd != -1) {
+		event_del (&chan->ev);
+		event_set (&chan->ev, chan->fd,
+				writing ? (EV_READ|EV_WRITE|EV_PERSIST) : (EV_READ|EV_PERSIST),
+				fuzzy_channel_handler, chan);
+		event_base_set (chan->ev_base, &chan->ev);
+		event_add (&chan->ev, NULL);
+		chan->writing = writing;
+	}
+}
+
+/*
+ * Returns a shared channel for the specified upstream, the socket is
+ * connected on the first use
+ */
+static struct fuzzy_client_channel *
+fuzzy_channel_get (struct rspamd_task *task, struct fuzzy_rule *rule,
+		struct upstream *up)
+{
+	struct fuzzy_client_channel *chan;
+	rspamd_inet_addr_t *addr;
+	gint sock;
+
+	if (fuzzy_module_ctx->channels == NULL) {
+		fuzzy_module_ctx->channels = g_hash_table_new (g_direct_hash,
+				g_direct_equal);
+	}
+
+	chan = g_hash_table_lookup (fuzzy_module_ctx->channels, up);
+
+	if (chan != NULL) {
+		return chan;
+	}
+
+	addr = rspamd_upstream_addr (up);
+
+	if ((sock = rspamd_inet_address_connect (addr, SOCK_DGRAM, TRUE)) == -1) {
+		msg_warn_task ("cannot connect to %s(%s), %d, %s",
+				rspamd_upstream_name (up),
+				rspamd_inet_address_to_string (addr),
+				errno,
+				strerror (errno));
+		rspamd_upstream_fail (up);
+
+		return NULL;
+	}
+
+	chan = g_slice_alloc0 (sizeof (*chan));
+	/* This reference is owned by channels table */
+	REF_INIT_RETAIN (chan, fuzzy_channel_dtor);
+	chan->rule = rule;
+	chan->server = up;
+	chan->addr = addr;
+	chan->ev_base = task->ev_base;
+	chan->fd = sock;
+	chan->waiters = g_hash_table_new (g_direct_hash, g_direct_equal);
+	chan->outq = g_ptr_array_new ();
+
+	event_set (&chan->ev, sock, EV_READ|EV_PERSIST, fuzzy_channel_handler,
+			chan);
+	event_base_set (chan->ev_base, &chan->ev);
+	event_add (&chan->ev, NULL);
+
+	g_hash_table_insert (fuzzy_module_ctx->channels, up, chan);
+
+	return chan;
+}
+
+static void
+fuzzy_channel_enqueue (struct fuzzy_client_channel *chan,
+		struct fuzzy_cmd_io *io)
+{
+	io->flags &= ~FUZZY_CMD_FLAG_SENT;
+	g_ptr_array_add (chan->outq, io);
+	/* Commands are sent when the loop finds socket writable */
+	fuzzy_channel_set_writing (chan, TRUE);
+}
+
+/*
+ * Removes channel from the shared table, so the next request selects an
+ * upstream and its address again; waiting sessions still use the channel
+ */
+static void
+fuzzy_channel_detach (struct fuzzy_client_channel *chan)
+{
+	if (fuzzy_module_ctx->channels != NULL &&
+			g_hash_table_lookup (fuzzy_module_ctx->channels, chan->server) == chan) {
+		g_hash_table_remove (fuzzy_module_ctx->channels, chan->server);
+		/* Release reference of channels table */
+		REF_RELEASE (chan);
+	}
+}
+
+/*
+ * Closes channel socket and finishes all sessions that wait for it
+ */
+static void
+fuzzy_channel_close (struct fuzzy_client_channel *chan)
+{
+	GHashTable *sessions;
+	GHashTableIter it;
+	gpointer k, v;
+	GList *cur, *l;
+	struct fuzzy_client_session *session;
+
+	/* Sessions could release the last reference */
+	REF_RETAIN (chan);
+
+	if (chan->fd != -1) {
+		event_del (&chan->ev);
+		close (chan->fd);
+		chan->fd = -1;
+	}
+
+	fuzzy_channel_detach (chan);
+
+	/* Waiters table contains a session once per its command */
+	sessions = g_hash_table_new (g_direct_hash, g_direct_equal);
+	g_hash_table_iter_init (&it, chan->waiters);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		g_hash_table_insert (sessions, v, v);
+	}
+
+	l = g_hash_table_get_keys (sessions);
+	g_hash_table_unref (sessions);
+
+	for (cur = l; cur != NULL; cur = g_list_next (cur)) {
+		session = cur->data;
+		rspamd_session_remove_event (session->task->s, fuzzy_io_fin, session);
+	}
+
+	g_list_free (l);
+	REF_RELEASE (chan);
+}
+
+/*
+ * Closes channel after IO error
+ */
+static void
+fuzzy_channel_fail (struct fuzzy_client_channel *chan, const gchar *what)
+{
+	msg_err ("got error on IO with server %s(%s), on %s, %d, %s",
+			rspamd_upstream_name (chan->server),
+			rspamd_inet_address_to_string (chan->addr),
+			what,
+			errno,
+			strerror (errno));
+	rspamd_upstream_fail (chan->server);
+	fuzzy_channel_close (chan);
+}
+
+static gboolean
+fuzzy_channel_flush (struct fuzzy_client_channel *chan)
+{
+	struct fuzzy_cmd_io *io;
+	guint i, j, n;
 	gint r;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[FUZZY_CHANNEL_BATCH];
+#else
+	struct msghdr msg;
+#endif
 
-	enum {
-		return_error = 0,
-		return_want_more,
-		return_finished
-	} ret = return_error;
+	/* Skip commands that have been replied while waiting for retransmit */
+	for (i = 0, j = 0; i < chan->outq->len; i ++) {
+		io = g_ptr_array_index (chan->outq, i);
 
-	task = session->task;
+		if (!(io->flags & FUZZY_CMD_FLAG_REPLIED)) {
+			g_ptr_array_index (chan->outq, j ++) = io;
+		}
+	}
 
-	if ((what & EV_READ) || session->state == 1) {
-		/* Try to read reply */
-		r = fuzzy_check_try_read (session);
+	g_ptr_array_set_size (chan->outq, j);
 
-		switch (r) {
-		case 0:
-			ret = return_want_more;
-			break;
-		case 1:
-			ret = return_finished;
-			break;
-		default:
-			ret = return_error;
-			break;
+	while (chan->outq->len > 0) {
+		n = MIN (chan->outq->len, FUZZY_CHANNEL_BATCH);
+#ifdef HAVE_SENDMMSG
+		memset (msgs, 0, sizeof (*msgs) * n);
+
+		for (i = 0; i < n; i ++) {
+			io = g_ptr_array_index (chan->outq, i);
+			msgs[i].msg_hdr.msg_iov = &io->io;
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		r = sendmmsg (chan->fd, msgs, n, 0);
+#else
+		io = g_ptr_array_index (chan->outq, 0);
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov = &io->io;
+		msg.msg_iovlen = 1;
+
+		r = sendmsg (chan->fd, &msg, 0) == -1 ? -1 : 1;
+#endif
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* Wait for the socket to become writable */
+				return TRUE;
+			}
+
+			return FALSE;
+		}
+
+		for (i = 0; i < (guint)r; i ++) {
+			io = g_ptr_array_index (chan->outq, i);
+			io->flags |= FUZZY_CMD_FLAG_SENT;
 		}
+
+		g_ptr_array_remove_range (chan->outq, 0, r);
 	}
-	else if (what & EV_WRITE) {
-		if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
-			ret = return_error;
+
+	return TRUE;
+}
+
+/*
+ * Dispatches replies from a datagram to the sessions that wait for them
+ */
+static void
+fuzzy_channel_process (struct fuzzy_client_channel *chan, guchar *p, gint r)
+{
+	const struct rspamd_fuzzy_reply *rep;
+	struct fuzzy_client_session *session;
+	struct rspamd_fuzzy_cmd *cmd = NULL;
+
+	while ((rep = fuzzy_read_reply (&p, &r, chan->rule)) != NULL) {
+		session = g_hash_table_lookup (chan->waiters,
+				GUINT_TO_POINTER (rep->tag));
+
+		if (session == NULL) {
+			/* Retransmitted command for already finished session */
+			msg_debug ("unexpected tag: %ud", rep->tag);
+			continue;
 		}
-		else {
-			session->state = 1;
-			ret = return_want_more;
+
+		if (fuzzy_reply_match (rep, session->commands, &cmd)) {
+			fuzzy_check_process_reply (session, rep, cmd);
+			fuzzy_check_session_is_completed (session);
 		}
 	}
-	else {
-		/* Should not happen */
-		g_assert (0);
+}
+
+static gboolean
+fuzzy_channel_read (struct fuzzy_client_channel *chan)
+{
+	guchar buf[FUZZY_CHANNEL_READ_BATCH][2048];
+	gint r;
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[FUZZY_CHANNEL_READ_BATCH];
+	struct iovec iov[FUZZY_CHANNEL_READ_BATCH];
+	gint i;
+#endif
+
+	for (;;) {
+#ifdef HAVE_RECVMMSG
+		memset (msgs, 0, sizeof (msgs));
+
+		for (i = 0; i < FUZZY_CHANNEL_READ_BATCH; i ++) {
+			iov[i].iov_base = buf[i];
+			iov[i].iov_len = sizeof (buf[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		r = recvmmsg (chan->fd, msgs, FUZZY_CHANNEL_READ_BATCH, 0, NULL);
+#else
+		r = read (chan->fd, buf[0], sizeof (buf[0]));
+#endif
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return TRUE;
+			}
+
+			return FALSE;
+		}
+
+#ifdef HAVE_RECVMMSG
+		for (i = 0; i < r; i ++) {
+			fuzzy_channel_process (chan, buf[i], msgs[i].msg_len);
+		}
+
+		if (r < FUZZY_CHANNEL_READ_BATCH) {
+			return TRUE;
+		}
+#else
+		fuzzy_channel_process (chan, buf[0], r);
+#endif
 	}
 
-	if (ret == return_want_more) {
-		/* Processed write, switch to reading */
-		ev_base = event_get_base (&session->ev);
-		event_del (&session->ev);
-		event_set (&session->ev, fd, EV_READ,
-				fuzzy_check_io_callback, session);
-		event_base_set (ev_base, &session->ev);
-		event_add (&session->ev, NULL);
+	return TRUE;
+}
+
+/* Shared fuzzy socket callback */
+static void
+fuzzy_channel_handler (gint fd, short what, void *arg)
+{
+	struct fuzzy_client_channel *chan = arg;
+
+	if (what & EV_READ) {
+		if (!fuzzy_channel_read (chan)) {
+			fuzzy_channel_fail (chan, "read");
+			return;
+		}
 	}
-	else if (ret == return_error) {
-		/* Error state */
-		msg_err_task ("got error on IO with server %s(%s), on %s, %d, %s",
-			rspamd_upstream_name (session->server),
-			rspamd_inet_address_to_string (session->addr),
-			session->state == 1 ? "read" : "write",
-			errno,
-			strerror (errno));
-		rspamd_upstream_fail (session->server);
-		rspamd_session_remove_event (session->task->s, fuzzy_io_fin, session);
+
+	if (what & EV_WRITE) {
+		if (!fuzzy_channel_flush (chan)) {
+			fuzzy_channel_fail (chan, "write");
+			return;
+		}
+
+		fuzzy_channel_set_writing (chan, chan->outq->len > 0);
 	}
-	else {
-		/* Read something from network */
-		if (!fuzzy_check_session_is_completed (session)) {
-			/* Need to read more */
-			ev_base = event_get_base (&session->ev);
-			event_del (&session->ev);
-			event_set (&session->ev, session->fd, EV_READ,
-					fuzzy_check_io_callback, session);
-			event_base_set (ev_base, &session->ev);
-			event_add (&session->ev, NULL);
+}
+
+/* Finalize IO */
+static void
+fuzzy_io_fin (void *ud)
+{
+	struct fuzzy_client_session *session = ud;
+	struct fuzzy_client_channel *chan = session->channel;
+	struct fuzzy_cmd_io *io;
+	guint i;
+
+	for (i = 0; i < session->commands->len; i ++) {
+		io = g_ptr_array_index (session->commands, i);
+
+		if (g_hash_table_lookup (chan->waiters,
+				GUINT_TO_POINTER (io->tag)) == session) {
+			g_hash_table_remove (chan->waiters, GUINT_TO_POINTER (io->tag));
+		}
+
+		if (!(io->flags & FUZZY_CMD_FLAG_SENT)) {
+			/* Command is still in the output queue */
+			g_ptr_array_remove_fast (chan->outq, io);
 		}
 	}
+
+	g_ptr_array_free (session->commands, TRUE);
+	event_del (&session->timev);
+	REF_RELEASE (chan);
 }
 
 /* Fuzzy check timeout callback */
@@ -1719,34 +2036,34 @@ static void
 fuzzy_check_timer_callback (gint fd, short what, void *arg)
 {
 	struct fuzzy_client_session *session = arg;
+	struct fuzzy_client_channel *chan = session->channel;
+	struct fuzzy_cmd_io *io;
 	struct rspamd_task *task;
 	struct event_base *ev_base;
+	guint i;
 
 	task = session->task;
 
-	/* We might be here because of other checks being slow */
-	if (fuzzy_check_try_read (session) > 0) {
-		if (fuzzy_check_session_is_completed (session)) {
-			return;
-		}
-	}
-
 	if (session->retransmits >= fuzzy_module_ctx->retransmits) {
 		msg_err_task ("got IO timeout with server %s(%s), after %d retransmits",
-				rspamd_upstream_name (session->server),
-				rspamd_inet_address_to_string (session->addr),
+				rspamd_upstream_name (chan->server),
+				rspamd_inet_address_to_string (chan->addr),
 				session->retransmits);
-		rspamd_upstream_fail (session->server);
+		rspamd_upstream_fail (chan->server);
+		/* New sessions should not use the failed upstream address */
+		fuzzy_channel_detach (chan);
 		rspamd_session_remove_event (session->task->s, fuzzy_io_fin, session);
 	}
 	else {
-		/* Plan write event */
-		ev_base = event_get_base (&session->ev);
-		event_del (&session->ev);
-		event_set (&session->ev, fd, EV_WRITE|EV_READ,
-				fuzzy_check_io_callback, session);
-		event_base_set (ev_base, &session->ev);
-		event_add (&session->ev, NULL);
+		/* Resend commands that have been sent but not replied */
+		for (i = 0; i < session->commands->len; i ++) {
+			io = g_ptr_array_index (session->commands, i);
+
+			if ((io->flags & (FUZZY_CMD_FLAG_SENT|FUZZY_CMD_FLAG_REPLIED)) ==
+					FUZZY_CMD_FLAG_SENT) {
+				fuzzy_channel_enqueue (chan, io);
+			}
+		}
 
 		/* Plan new retransmit timer */
 		ev_base = event_get_base (&session->timev);
@@ -2115,53 +2432,52 @@ register_fuzzy_client_call (struct rspamd_task *task,
 	GPtrArray *commands)
 {
 	struct fuzzy_client_session *session;
+	struct fuzzy_client_channel *chan = NULL;
 	struct upstream *selected;
-	rspamd_inet_addr_t *addr;
-	gint sock;
+	struct fuzzy_cmd_io *io;
+	guint i;
 
 	/* Get upstream */
 	selected = rspamd_upstream_get (rule->servers, RSPAMD_UPSTREAM_ROUND_ROBIN,
 			NULL, 0);
 	if (selected) {
-		addr = rspamd_upstream_addr (selected);
-		if ((sock = rspamd_inet_address_connect (addr, SOCK_DGRAM, TRUE)) == -1) {
-			msg_warn_task ("cannot connect to %s(%s), %d, %s",
-				rspamd_upstream_name (selected),
-				rspamd_inet_address_to_string (addr),
-				errno,
-				strerror (errno));
-			rspamd_upstream_fail (selected);
-		}
-		else {
-			/* Create session for a socket */
-			session =
-				rspamd_mempool_alloc0 (task->task_pool,
-					sizeof (struct fuzzy_client_session));
-			msec_to_tv (fuzzy_module_ctx->io_timeout, &session->tv);
-			session->state = 0;
-			session->commands = commands;
-			session->task = task;
-			session->fd = sock;
-			session->server = selected;
-			session->rule = rule;
-			session->addr = addr;
-
-			event_set (&session->ev, sock, EV_WRITE, fuzzy_check_io_callback,
-					session);
-			event_base_set (session->task->ev_base, &session->ev);
-			event_add (&session->ev, NULL);
-
-			evtimer_set (&session->timev, fuzzy_check_timer_callback,
-					session);
-			event_base_set (session->task->ev_base, &session->timev);
-			event_add (&session->timev, &session->tv);
-
-			rspamd_session_add_event (task->s,
-				fuzzy_io_fin,
-				session,
-				g_quark_from_static_string ("fuzzy check"));
-		}
+		chan = fuzzy_channel_get (task, rule, selected);
 	}
+
+	if (chan == NULL) {
+		g_ptr_array_free (commands, TRUE);
+		return;
+	}
+
+	/* Create session for a shared socket */
+	session =
+		rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (struct fuzzy_client_session));
+	msec_to_tv (fuzzy_module_ctx->io_timeout, &session->tv);
+	session->commands = commands;
+	session->task = task;
+	session->channel = chan;
+	session->rule = rule;
+	session->start_time = rspamd_get_ticks ();
+	REF_RETAIN (chan);
+
+	for (i = 0; i < commands->len; i ++) {
+		io = g_ptr_array_index (commands, i);
+		/* Random tags might collide, the older command would time out */
+		g_hash_table_replace (chan->waiters, GUINT_TO_POINTER (io->tag),
+				session);
+		fuzzy_channel_enqueue (chan, io);
+	}
+
+	evtimer_set (&session->timev, fuzzy_check_timer_callback,
+			session);
+	event_base_set (session->task->ev_base, &session->timev);
+	event_add (&session->timev, &session->tv);
+
+	rspamd_session_add_event (task->s,
+		fuzzy_io_fin,
+		session,
+		g_quark_from_static_string ("fuzzy check"));
 }
 
 /* This callback is called when we check message in fuzzy hashes storage */
@@ -72,7 +72,7 @@ local function tries_callback(task)
     raw_trie:search_rawmsg(task, gen_trie_cb('rawmessage'))
   end
   if body_trie then
-    raw_trie:search_rawbody(task, gen_trie_cb('rawbody'))
+    body_trie:search_rawbody(task, gen_trie_cb('rawbody'))
   end
 end
 
@@ -135,17 +135,17 @@ if opts then
   end
 
   if #raw_patterns > 0 then
-    raw_trie = rspamd_trie.create(raw_patterns)
+    raw_trie = rspamd_trie.create(raw_patterns, 'rawmsg')
     rspamd_logger.infox(rspamd_config, 'registered raw search trie from %1 patterns', #raw_patterns)
 	end
 
   if #mime_patterns > 0 then
-    mime_trie = rspamd_trie.create(mime_patterns)
+    mime_trie = rspamd_trie.create(mime_patterns, 'mime')
     rspamd_logger.infox(rspamd_config, 'registered mime search trie from %1 patterns', #mime_patterns)
   end
 
   if #body_patterns > 0 then
-    body_trie = rspamd_trie.create(body_patterns)
+    body_trie = rspamd_trie.create(body_patterns, 'rawbody')
     rspamd_logger.infox(rspamd_config, 'registered body search trie from %1 patterns', #body_patterns)
   end
 
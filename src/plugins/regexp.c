@@ -22,8 +22,10 @@
 #include "libmime/message.h"
 #include "expression.h"
 #include "mime_expressions.h"
+#include "libmime/sa_rules.h"
 #include "libutil/map.h"
 #include "lua/lua_common.h"
+#include <glob.h>
 
 static const guint64 rspamd_regexp_cb_magic = 0xca9d9649fc3e2659ULL;
 
@@ -37,6 +39,7 @@ struct regexp_module_item {
 struct regexp_ctx {
 	struct module_ctx ctx;
 	rspamd_mempool_t *regexp_pool;
+	struct rspamd_sa_rules *sa_rules;
 	gsize max_size;
 };
 
@@ -86,6 +89,54 @@ read_regexp_expression (rspamd_mempool_t * pool,
 	return TRUE;
 }
 
+/* Load SpamAssassin rules from files matched by glob patterns */
+static void
+read_sa_rules (struct rspamd_config *cfg, const ucl_object_t *obj)
+{
+	const ucl_object_t *cur;
+	ucl_object_iter_t it = NULL;
+	glob_t globbuf;
+	GError *err = NULL;
+	guint i;
+
+	if (ucl_object_type (obj) == UCL_ARRAY) {
+		while ((cur = ucl_object_iterate (obj, &it, true)) != NULL) {
+			read_sa_rules (cfg, cur);
+		}
+
+		return;
+	}
+
+	if (ucl_object_type (obj) != UCL_STRING) {
+		msg_err_config ("invalid sa_rules attribute, must be string or array");
+		return;
+	}
+
+	if (regexp_module_ctx->sa_rules == NULL) {
+		regexp_module_ctx->sa_rules = rspamd_sa_rules_new (cfg,
+				regexp_module_ctx->regexp_pool);
+	}
+
+	memset (&globbuf, 0, sizeof (globbuf));
+
+	if (glob (ucl_object_tostring (obj), GLOB_DOOFFS, NULL, &globbuf) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i++) {
+			if (!rspamd_sa_rules_load_file (regexp_module_ctx->sa_rules,
+					globbuf.gl_pathv[i], &err)) {
+				msg_err_config ("cannot load SpamAssassin rules from %s: %e",
+						globbuf.gl_pathv[i], err);
+				g_error_free (err);
+				err = NULL;
+			}
+		}
+
+		globfree (&globbuf);
+	}
+	else {
+		msg_err_config ("cannot find SpamAssassin rules matching %s",
+				ucl_object_tostring (obj));
+	}
+}
 
 /* Init function */
 gint
@@ -117,6 +168,16 @@ regexp_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			NULL,
 			0);
 
+	rspamd_rcl_add_doc_by_path (cfg,
+			"regexp",
+			"SpamAssassin rules files (glob patterns) that are compiled natively",
+			"sa_rules",
+			UCL_STRING,
+			NULL,
+			0,
+			NULL,
+			0);
+
 	return 0;
 }
 
@@ -139,6 +200,7 @@ regexp_module_config (struct rspamd_config *cfg)
 	}
 
 	regexp_module_ctx->max_size = 0;
+	regexp_module_ctx->sa_rules = NULL;
 
 	while ((value = ucl_object_iterate (sec, &it, true)) != NULL) {
 		if (g_ascii_strncasecmp (ucl_object_key (value), "max_size",
@@ -146,6 +208,9 @@ regexp_module_config (struct rspamd_config *cfg)
 			regexp_module_ctx->max_size = ucl_obj_toint (value);
 			rspamd_re_cache_set_limit (cfg->re_cache, regexp_module_ctx->max_size);
 		}
+		else if (g_ascii_strcasecmp (ucl_object_key (value), "sa_rules") == 0) {
+			read_sa_rules (cfg, value);
+		}
 		else if (g_ascii_strncasecmp (ucl_object_key (value), "max_threads",
 			sizeof ("max_threads") - 1) == 0) {
 			msg_warn_config ("regexp module is now single threaded, max_threads is ignored");
@@ -301,6 +366,10 @@ regexp_module_config (struct rspamd_config *cfg)
 		}
 	}
 
+	if (regexp_module_ctx->sa_rules != NULL) {
+		nre += rspamd_sa_rules_compile (regexp_module_ctx->sa_rules);
+	}
+
 	msg_info_config ("init internal regexp module, %d regexp rules and %d "
 			"lua rules are loaded", nre, nlua);
 
@@ -37,6 +37,8 @@
 #define DEFAULT_SYMBOL_ALLOW "R_SPF_ALLOW"
 #define DEFAULT_CACHE_SIZE 2048
 #define DEFAULT_CACHE_MAXAGE 86400
+/* Larger records are not shared between workers */
+#define DEFAULT_SHARED_RECORD_SIZE 4096
 
 struct spf_ctx {
 	struct module_ctx ctx;
@@ -48,6 +50,7 @@ struct spf_ctx {
 	rspamd_mempool_t *spf_pool;
 	radix_compressed_t *whitelist_ip;
 	rspamd_lru_hash_t *spf_hash;
+	rspamd_shared_cache_t *spf_shared;
 };
 
 static struct spf_ctx *spf_module_ctx = NULL;
@@ -240,6 +243,11 @@ spf_module_config (struct rspamd_config *cfg)
 			cache_size,
 			NULL,
 			(GDestroyNotify)spf_record_unref);
+	/* Records resolved by one worker are shared with others */
+	spf_module_ctx->spf_shared = rspamd_shared_cache_new (
+			spf_module_ctx->spf_pool,
+			cache_size,
+			DEFAULT_SHARED_RECORD_SIZE);
 
 	msg_info_config ("init internal spf module");
 
@@ -372,6 +380,60 @@ spf_check_list (struct spf_resolved *rec, struct rspamd_task *task)
 	}
 }
 
+static void
+spf_share_record (struct spf_resolved *record, struct rspamd_task *task)
+{
+	guchar *data;
+	gsize len;
+
+	if (spf_module_ctx->spf_shared == NULL) {
+		return;
+	}
+
+	data = spf_record_serialize (record, &len);
+	rspamd_shared_cache_insert (spf_module_ctx->spf_shared,
+			record->domain, strlen (record->domain), data, len,
+			task->tv.tv_sec, record->ttl);
+	g_free (data);
+}
+
+/*
+ * Try to load record resolved by another worker, on success the record
+ * is also inserted to the local cache
+ */
+static struct spf_resolved *
+spf_shared_record (const gchar *domain, struct rspamd_task *task)
+{
+	guchar data[DEFAULT_SHARED_RECORD_SIZE];
+	struct spf_resolved *l;
+	gssize len;
+	guint ttl;
+
+	if (spf_module_ctx->spf_shared == NULL) {
+		return NULL;
+	}
+
+	len = rspamd_shared_cache_lookup (spf_module_ctx->spf_shared,
+			domain, strlen (domain), data, task->tv.tv_sec, &ttl);
+
+	if (len <= 0) {
+		return NULL;
+	}
+
+	l = spf_record_deserialize (data, len);
+
+	if (l != NULL) {
+		msg_debug_task ("loaded spf record for %s from the shared cache",
+				domain);
+		l->ttl = ttl;
+		/* LRU hash owns this reference */
+		rspamd_lru_hash_insert (spf_module_ctx->spf_hash,
+				l->domain, l, task->tv.tv_sec, ttl);
+	}
+
+	return l;
+}
+
 static void
 spf_plugin_callback (struct spf_resolved *record, struct rspamd_task *task)
 {
@@ -387,6 +449,7 @@ spf_plugin_callback (struct spf_resolved *record, struct rspamd_task *task)
 			rspamd_lru_hash_insert (spf_module_ctx->spf_hash,
 				record->domain, l,
 				task->tv.tv_sec, record->ttl);
+			spf_share_record (record, task);
 
 		}
 		spf_record_ref (l);
@@ -418,7 +481,8 @@ spf_symbol_callback (struct rspamd_task *task, void *unused)
 	if (domain) {
 		if ((l =
 			rspamd_lru_hash_lookup (spf_module_ctx->spf_hash, domain,
-			task->tv.tv_sec)) != NULL) {
+			task->tv.tv_sec)) != NULL ||
+			(l = spf_shared_record (domain, task)) != NULL) {
 			spf_record_ref (l);
 			spf_check_list (l, task);
 			spf_record_unref (l);
@@ -471,7 +471,7 @@ surbl_module_config (struct rspamd_config *cfg)
 	ucl_object_iter_t it = NULL;
 	const gchar *redir_val, *ip_val;
 	guint32 bit;
-	gint cb_id, nrules = 0;
+	gint cb_id = -1, nrules = 0;
 
 	if (!rspamd_config_is_module_enabled (cfg, "surbl")) {
 		return TRUE;
@@ -648,13 +648,17 @@ surbl_module_config (struct rspamd_config *cfg)
 						"mutually exclusive for suffix %s", new_suffix->suffix);
 			}
 
-			cb_id = rspamd_symbols_cache_add_symbol (cfg->cache,
-					"SURBL_CALLBACK",
-					0,
-					surbl_test_url,
-					new_suffix,
-					SYMBOL_TYPE_CALLBACK,
-					-1);
+			if (cb_id == -1) {
+				/* All rules are checked by a single callback */
+				cb_id = rspamd_symbols_cache_add_symbol (cfg->cache,
+						"SURBL_CALLBACK",
+						0,
+						surbl_test_url,
+						NULL,
+						SYMBOL_TYPE_CALLBACK,
+						-1);
+			}
+
 			nrules++;
 			new_suffix->callback_id = cb_id;
 
@@ -982,85 +986,185 @@ format_surbl_request (rspamd_mempool_t * pool,
 	return result;
 }
 
+static struct surbl_plan *
+surbl_plan_new (struct rspamd_task *task)
+{
+	struct surbl_plan *plan;
+
+	plan = rspamd_mempool_alloc0 (task->task_pool, sizeof (*plan));
+	plan->task = task;
+	plan->requests = g_hash_table_new (rspamd_strcase_hash,
+			rspamd_strcase_equal);
+	plan->ip_requests = g_hash_table_new (rspamd_strcase_hash,
+			rspamd_strcase_equal);
+	plan->pending = g_ptr_array_new ();
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref,
+			plan->requests);
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref,
+			plan->ip_requests);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_ptr_array_free_hard,
+			plan->pending);
+
+	return plan;
+}
+
+/*
+ * Add DNS request for the specified suffix to the plan, identical requests
+ * from different rules and urls are merged
+ */
 static void
-make_surbl_requests (struct rspamd_url *url, struct rspamd_task *task,
-	struct suffix_item *suffix, gboolean forced, GHashTable *tree)
+surbl_plan_request (struct surbl_plan *plan, struct rspamd_url *url,
+	const gchar *host, const gchar *request, struct suffix_item *suffix,
+	gboolean resolve_ip)
 {
-	gchar *surbl_req;
-	rspamd_ftok_t f;
-	GError *err = NULL;
+	struct rspamd_task *task = plan->task;
 	struct dns_param *param;
+	GHashTable *tbl;
+	gboolean insert = TRUE;
+	guint i;
 
-	f.begin = url->host;
-	f.len = url->hostlen;
+	tbl = resolve_ip ? plan->ip_requests : plan->requests;
+	param = g_hash_table_lookup (tbl, request);
+
+	if (param != NULL) {
+		for (i = 0; i < param->suffixes->len; i ++) {
+			if (g_ptr_array_index (param->suffixes, i) == suffix) {
+				msg_debug_task ("url %s is already registered", request);
+				plan->deduplicated ++;
 
-	if (suffix->options & SURBL_OPTION_RESOLVEIP) {
-		/*
-		 * We need to get url real TLD, resolve it with no suffix and then
-		 * check against surbl using reverse octets printing
-		 */
-		surbl_req = format_surbl_request (task->task_pool, &f, suffix, FALSE,
-				&err, forced, tree, url);
-
-		if (surbl_req == NULL) {
-			if (err != NULL) {
-				if (err->code != WHITELIST_ERROR && err->code != DUPLICATE_ERROR) {
-					msg_info_task ("cannot format url string for surbl %*s, %e",
-							url->urllen, url->string,
-							err);
-				}
-				g_error_free (err);
 				return;
 			}
 		}
-		else {
-			/* XXX: We make merely A request here */
-			param =
-					rspamd_mempool_alloc (task->task_pool,
-							sizeof (struct dns_param));
-			param->url = url;
-			param->task = task;
-			param->suffix = suffix;
-			param->host_resolve =
-					rspamd_mempool_strdup (task->task_pool, surbl_req);
-			debug_task ("send surbl dns ip request %s to %s", surbl_req,
-					suffix->suffix);
-
-			if (make_dns_request_task (task,
-					surbl_dns_ip_callback,
-					(void *) param, RDNS_REQUEST_A, surbl_req)) {
-				param->w = rspamd_session_get_watcher (task->s);
-				rspamd_session_watcher_push (task->s);
+
+		if (!param->sent) {
+			g_ptr_array_add (param->suffixes, suffix);
+			plan->deduplicated ++;
+
+			return;
+		}
+
+		/* Reply could be already processed, so send a separate request */
+		insert = FALSE;
+	}
+
+	param = rspamd_mempool_alloc0 (task->task_pool, sizeof (*param));
+	param->url = url;
+	param->task = task;
+	param->plan = plan;
+	param->host_resolve = rspamd_mempool_strdup (task->task_pool, host);
+	param->request = rspamd_mempool_strdup (task->task_pool, request);
+	param->resolve_ip = resolve_ip;
+	param->suffixes = g_ptr_array_sized_new (1);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_ptr_array_free_hard, param->suffixes);
+	g_ptr_array_add (param->suffixes, suffix);
+
+	if (insert) {
+		g_hash_table_insert (tbl, param->request, param);
+	}
+
+	g_ptr_array_add (plan->pending, param);
+	plan->nrequests ++;
+}
+
+/*
+ * Normalize url once and plan requests for all suffixes
+ */
+static void
+surbl_plan_url (struct surbl_plan *plan, struct rspamd_url *url,
+	gboolean images)
+{
+	struct rspamd_task *task = plan->task;
+	struct suffix_item *suffix;
+	gchar *host, *request;
+	rspamd_ftok_t f;
+	GError *err = NULL;
+	GList *cur;
+	gsize len;
+
+	f.begin = url->host;
+	f.len = url->hostlen;
+	host = format_surbl_request (task->task_pool, &f, NULL, FALSE,
+			&err, FALSE, NULL, url);
+
+	if (host == NULL) {
+		if (err != NULL) {
+			if (err->code != WHITELIST_ERROR && err->code != DUPLICATE_ERROR) {
+				msg_info_task ("cannot format url string for surbl %*s, %e",
+						url->urllen, url->string,
+						err);
 			}
+			g_error_free (err);
 		}
+
+		return;
 	}
-	else if ((surbl_req = format_surbl_request (task->task_pool, &f, suffix, TRUE,
-		&err, forced, tree, url)) != NULL) {
-		param =
-			rspamd_mempool_alloc (task->task_pool, sizeof (struct dns_param));
-		param->url = url;
-		param->task = task;
-		param->suffix = suffix;
-		param->host_resolve =
-			rspamd_mempool_strdup (task->task_pool, surbl_req);
-		debug_task ("send surbl dns request %s", surbl_req);
 
-		if (make_dns_request_task (task,
-				surbl_dns_callback,
-				(void *) param, RDNS_REQUEST_A, surbl_req)) {
-			param->w = rspamd_session_get_watcher (task->s);
-			rspamd_session_watcher_push (task->s);
+	for (cur = surbl_module_ctx->suffixes; cur != NULL; cur = g_list_next (cur)) {
+		suffix = cur->data;
+
+		if (images && !(suffix->options & SURBL_OPTION_CHECKIMAGES)) {
+			continue;
+		}
+
+		if ((url->flags & RSPAMD_URL_FLAG_NUMERIC) &&
+				(suffix->options & SURBL_OPTION_NOIP)) {
+			/* Ignore such requests */
+			msg_info_task ("ignore request of ip url for list %s",
+					suffix->symbol);
+			continue;
+		}
+
+		if (suffix->options & SURBL_OPTION_RESOLVEIP) {
+			/*
+			 * We need to get url real TLD, resolve it with no suffix and then
+			 * check against surbl using reverse octets printing
+			 */
+			surbl_plan_request (plan, url, host, host, suffix, TRUE);
+		}
+		else {
+			len = strlen (host) + strlen (suffix->suffix) + 2;
+			request = rspamd_mempool_alloc (task->task_pool, len);
+			rspamd_snprintf (request, len, "%s.%s", host, suffix->suffix);
+			surbl_plan_request (plan, url, request, request, suffix, FALSE);
 		}
 	}
-	else if (err != NULL) {
-		if (err->code != WHITELIST_ERROR && err->code != DUPLICATE_ERROR) {
-			msg_info_task ("cannot format url string for surbl %*s, %e",
-					url->urllen,
-					url->string, err);
+}
+
+/*
+ * Send all pending requests, if `w` is NULL then the current watcher is used
+ */
+static void
+surbl_plan_dispatch (struct surbl_plan *plan, struct rspamd_async_watcher *w)
+{
+	struct rspamd_task *task = plan->task;
+	struct dns_param *param;
+	guint i;
+
+	for (i = 0; i < plan->pending->len; i ++) {
+		param = g_ptr_array_index (plan->pending, i);
+		param->sent = TRUE;
+		debug_task ("send surbl dns request %s for %ud rules", param->request,
+				param->suffixes->len);
+
+		if (make_dns_request_task (task,
+				param->resolve_ip ? surbl_dns_ip_callback : surbl_dns_callback,
+				(void *) param, RDNS_REQUEST_A, param->request)) {
+			if (w == NULL) {
+				param->w = rspamd_session_get_watcher (task->s);
+				rspamd_session_watcher_push (task->s);
+			}
+			else {
+				param->w = w;
+				rspamd_session_watcher_push_specific (task->s, w);
+			}
 		}
-		g_error_free (err);
-		return;
 	}
+
+	g_ptr_array_set_size (plan->pending, 0);
 }
 
 static void
@@ -1135,23 +1239,29 @@ surbl_dns_callback (struct rdns_reply *reply, gpointer arg)
 	struct dns_param *param = (struct dns_param *)arg;
 	struct rspamd_task *task;
 	struct rdns_reply_entry *elt;
+	struct suffix_item *suffix;
+	guint i;
 
 	task = param->task;
 	/* If we have result from DNS server, this url exists in SURBL, so increase score */
 	if (reply->code == RDNS_RC_NOERROR && reply->entries) {
 		msg_debug_task ("<%s> domain [%s] is in surbl %s",
 				param->task->message_id,
-			param->host_resolve, param->suffix->suffix);
+			param->host_resolve, param->request);
 		elt = reply->entries;
 		if (elt->type == RDNS_REQUEST_A) {
-			process_dns_results (param->task, param->suffix,
-				param->host_resolve, (guint32)elt->content.a.addr.s_addr);
+			/* Fan out result to all rules that share this request */
+			for (i = 0; i < param->suffixes->len; i ++) {
+				suffix = g_ptr_array_index (param->suffixes, i);
+				process_dns_results (param->task, suffix,
+					param->host_resolve, (guint32)elt->content.a.addr.s_addr);
+			}
 		}
 	}
 	else {
 		msg_debug_task ("<%s> domain [%s] is not in surbl %s",
 			param->task->message_id, param->host_resolve,
-			param->suffix->suffix);
+			param->request);
 	}
 
 	rspamd_session_watcher_pop (param->task->s, param->w);
@@ -1163,47 +1273,47 @@ surbl_dns_ip_callback (struct rdns_reply *reply, gpointer arg)
 	struct dns_param *param = (struct dns_param *) arg;
 	struct rspamd_task *task;
 	struct rdns_reply_entry *elt;
+	struct suffix_item *suffix;
 	GString *to_resolve;
 	guint32 ip_addr;
+	guint i;
 
 	task = param->task;
 	/* If we have result from DNS server, this url exists in SURBL, so increase score */
 	if (reply->code == RDNS_RC_NOERROR && reply->entries) {
+		to_resolve = g_string_sized_new (64);
 
 		LL_FOREACH (reply->entries, elt) {
 
 			if (elt->type == RDNS_REQUEST_A) {
-				to_resolve = g_string_sized_new (
-						strlen (param->suffix->suffix) +
-						sizeof ("255.255.255.255."));
 				ip_addr = elt->content.a.addr.s_addr;
 
-				/* Big endian <4>.<3>.<2>.<1> */
-				rspamd_printf_gstring (to_resolve, "%d.%d.%d.%d.%s",
-						ip_addr >> 24 & 0xff,
-						ip_addr >> 16 & 0xff,
-						ip_addr >> 8 & 0xff,
-						ip_addr & 0xff, param->suffix->suffix);
-				msg_debug_task (
-						"<%s> domain [%s] send %v request to surbl",
-						param->task->message_id,
-						param->host_resolve,
-						to_resolve);
-
-				if (make_dns_request_task (task,
-						surbl_dns_callback,
-						param, RDNS_REQUEST_A, to_resolve->str)) {
-					rspamd_session_watcher_push_specific (task->s, param->w);
+				for (i = 0; i < param->suffixes->len; i ++) {
+					suffix = g_ptr_array_index (param->suffixes, i);
+					g_string_truncate (to_resolve, 0);
+					/* Big endian <4>.<3>.<2>.<1> */
+					rspamd_printf_gstring (to_resolve, "%d.%d.%d.%d.%s",
+							ip_addr >> 24 & 0xff,
+							ip_addr >> 16 & 0xff,
+							ip_addr >> 8 & 0xff,
+							ip_addr & 0xff, suffix->suffix);
+					msg_debug_task (
+							"<%s> domain [%s] send %v request to surbl",
+							param->task->message_id,
+							param->host_resolve,
+							to_resolve);
+					surbl_plan_request (param->plan, param->url,
+							param->host_resolve, to_resolve->str, suffix, FALSE);
 				}
-
-				g_string_free (to_resolve, TRUE);
 			}
 		}
+
+		g_string_free (to_resolve, TRUE);
+		surbl_plan_dispatch (param->plan, param->w);
 	}
 	else {
-		msg_debug_task ("<%s> domain [%s] cannot be resolved for SURBL check %s",
-				param->task->message_id, param->host_resolve,
-				param->suffix->suffix);
+		msg_debug_task ("<%s> domain [%s] cannot be resolved for SURBL check",
+				param->task->message_id, param->host_resolve);
 
 	}
 
@@ -1273,11 +1383,8 @@ surbl_redirector_finish (struct rspamd_http_connection *conn,
 					redirected_url->flags |= RSPAMD_URL_FLAG_REDIRECTED;
 				}
 
-				make_surbl_requests (redirected_url,
-						param->task,
-						param->suffix,
-						FALSE,
-						param->tree);
+				surbl_plan_url (param->plan, redirected_url, param->images);
+				surbl_plan_dispatch (param->plan, NULL);
 			}
 			else {
 				msg_info_task ("cannot parse redirector reply: %s", urlstr);
@@ -1300,7 +1407,7 @@ surbl_redirector_finish (struct rspamd_http_connection *conn,
 
 static void
 register_redirector_call (struct rspamd_url *url, struct rspamd_task *task,
-	struct suffix_item *suffix, const gchar *rule, GHashTable *tree)
+	struct surbl_plan *plan, gboolean images, const gchar *rule)
 {
 	gint s = -1;
 	struct redirector_param *param;
@@ -1320,7 +1427,8 @@ register_redirector_call (struct rspamd_url *url, struct rspamd_task *task,
 		msg_info_task ("<%s> cannot create tcp socket failed: %s",
 			task->message_id,
 			strerror (errno));
-		make_surbl_requests (url, task, suffix, FALSE, tree);
+		/* Requests are sent by the caller */
+		surbl_plan_url (plan, url, images);
 		return;
 	}
 
@@ -1339,9 +1447,9 @@ register_redirector_call (struct rspamd_url *url, struct rspamd_task *task,
 	msg = rspamd_http_new_message (HTTP_REQUEST);
 	msg->url = rspamd_fstring_assign (msg->url, url->string, url->urllen);
 	param->sock = s;
-	param->suffix = suffix;
+	param->plan = plan;
+	param->images = images;
 	param->redirector = selected;
-	param->tree = tree;
 	timeout = rspamd_mempool_alloc (task->task_pool, sizeof (struct timeval));
 	double_to_tv (surbl_module_ctx->read_timeout, timeout);
 
@@ -1362,11 +1470,10 @@ register_redirector_call (struct rspamd_url *url, struct rspamd_task *task,
 }
 
 static void
-surbl_tree_url_callback (gpointer key, gpointer value, void *data)
+surbl_check_url (struct redirector_param *param, struct rspamd_url *url,
+	gboolean images)
 {
-	struct redirector_param *param = data;
 	struct rspamd_task *task;
-	struct rspamd_url *url = value;
 	rspamd_regexp_t *re;
 	rspamd_ftok_t srch;
 	gboolean found = FALSE;
@@ -1406,43 +1513,56 @@ surbl_tree_url_callback (gpointer key, gpointer value, void *data)
 
 				register_redirector_call (url,
 						param->task,
-						param->suffix,
-						found_tld,
-						param->tree);
+						param->plan,
+						images,
+						found_tld);
 
 				return;
 			}
 		}
-
-		make_surbl_requests (url, param->task, param->suffix, FALSE,
-			param->tree);
-	}
-	else {
-		make_surbl_requests (url, param->task, param->suffix, FALSE,
-			param->tree);
 	}
+
+	surbl_plan_url (param->plan, url, images);
+}
+
+static void
+surbl_tree_url_callback (gpointer key, gpointer value, void *data)
+{
+	surbl_check_url (data, value, FALSE);
 }
 
 static void
 surbl_test_url (struct rspamd_task *task, void *user_data)
 {
 	struct redirector_param param;
-	struct suffix_item *suffix = user_data;
+	struct suffix_item *suffix;
 	guint i, j;
 	struct mime_text_part *part;
 	struct html_image *img;
 	struct rspamd_url *url;
-
+	gboolean check_images = FALSE;
+	GList *cur;
+
+	/*
+	 * Collect requests for all urls and all rules first, so every DNS name
+	 * is requested only once per task
+	 */
+	memset (&param, 0, sizeof (param));
 	param.task = task;
-	param.suffix = suffix;
-	param.tree = g_hash_table_new (rspamd_strcase_hash, rspamd_strcase_equal);
-	rspamd_mempool_add_destructor (task->task_pool,
-		(rspamd_mempool_destruct_t)g_hash_table_unref,
-		param.tree);
+	param.plan = surbl_plan_new (task);
 	g_hash_table_foreach (task->urls, surbl_tree_url_callback, &param);
 
+	for (cur = surbl_module_ctx->suffixes; cur != NULL; cur = g_list_next (cur)) {
+		suffix = cur->data;
+
+		if (suffix->options & SURBL_OPTION_CHECKIMAGES) {
+			check_images = TRUE;
+			break;
+		}
+	}
+
 	/* We also need to check and process img URLs */
-	if (suffix->options & SURBL_OPTION_CHECKIMAGES) {
+	if (check_images) {
 		for (i = 0; i < task->text_parts->len; i ++) {
 			part = g_ptr_array_index (task->text_parts, i);
 
@@ -1456,13 +1576,17 @@ surbl_test_url (struct rspamd_task *task, void *user_data)
 								img->src, strlen (img->src), NULL);
 
 						if (url) {
-							surbl_tree_url_callback (url, url, &param);
-							msg_debug_task ("checked image url %s over %s",
-									img->src, suffix->suffix);
+							surbl_check_url (&param, url, TRUE);
+							msg_debug_task ("checked image url %s",
+									img->src);
 						}
 					}
 				}
 			}
 		}
 	}
+
+	msg_debug_task ("send %ud surbl requests, %ud duplicates skipped",
+			param.plan->nrequests, param.plan->deduplicated);
+	surbl_plan_dispatch (param.plan, NULL);
 }
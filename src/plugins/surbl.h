@@ -48,12 +48,26 @@ struct suffix_item {
 	gint callback_id;
 };
 
+/* Requests of all SURBL rules for a single task */
+struct surbl_plan {
+	struct rspamd_task *task;
+	GHashTable *requests;       /* DNS name -> struct dns_param */
+	GHashTable *ip_requests;    /* host -> struct dns_param for resolve_ip rules */
+	GPtrArray *pending;         /* requests that are not sent yet */
+	guint nrequests;
+	guint deduplicated;
+};
+
 struct dns_param {
 	struct rspamd_url *url;
 	struct rspamd_task *task;
 	gchar *host_resolve;
-	struct suffix_item *suffix;
+	gchar *request;
+	GPtrArray *suffixes;        /* all suffixes that share this request */
+	struct surbl_plan *plan;
 	struct rspamd_async_watcher *w;
+	gboolean resolve_ip;
+	gboolean sent;
 };
 
 struct redirector_param {
@@ -62,8 +76,8 @@ struct redirector_param {
 	struct upstream *redirector;
 	struct rspamd_http_connection *conn;
 	gint sock;
-	GHashTable *tree;
-	struct suffix_item *suffix;
+	struct surbl_plan *plan;
+	gboolean images;
 };
 
 struct surbl_bit_item {
@@ -135,6 +135,7 @@ struct rspamd_proxy_backend_connection {
 	const gchar *err;
 	struct rspamd_proxy_session *s;
 	struct timeval *io_tv;
+	gdouble start_time;
 	gint backend_sock;
 	enum rspamd_backend_flags flags;
 	gint parser_from_ref;
@@ -968,6 +969,8 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_proxy_session *session;
 
 	session = bk_conn->s;
+	rspamd_upstream_latency (bk_conn->up,
+			rspamd_get_ticks () - bk_conn->start_time);
 
 	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
 			bk_conn->parser_from_ref, msg->body_buf.begin, msg->body_buf.len)) {
@@ -1030,6 +1033,8 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 			continue;
 		}
 
+		bk_conn->start_time = rspamd_get_ticks ();
+
 		msg = rspamd_http_connection_copy_msg (session->client_conn);
 
 		if (msg == NULL) {
@@ -1121,6 +1126,8 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 	rspamd_fstring_t *reply;
 
 	session = bk_conn->s;
+	rspamd_upstream_latency (bk_conn->up,
+			rspamd_get_ticks () - bk_conn->start_time);
 	rspamd_http_connection_steal_msg (session->master_conn->backend_conn);
 
 	rspamd_http_message_remove_header (msg, "Content-Length");
@@ -1231,6 +1238,8 @@ proxy_client_finish_handler (struct rspamd_http_connection *conn,
 				goto err;
 			}
 
+			session->master_conn->start_time = rspamd_get_ticks ();
+
 			if (!proxy_check_file (msg, session)) {
 				goto err;
 			}
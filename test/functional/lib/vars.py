@@ -3,5 +3,7 @@ KEY_PUB1 = 'm8kneubpcjsb8sbsoj7jy7azj9fdd3xmj63txni86a8ye9ncomny'
 LOCAL_ADDR = 'localhost'
 PORT_CONTROLLER = 56790
 PORT_NORMAL = 56789
+# Nothing should listen on this port
+PORT_UNUSED = 56791
 RSPAMD_GROUP = 'nogroup'
 RSPAMD_USER = 'nobody'
@@ -0,0 +1,54 @@
+local rspamd_async = require "rspamd_async"
+local rspamd_http = require "rspamd_http"
+
+-- Ports are defined by the test framework in lua_test.conf
+local opts = rspamd_config:get_all_opt('lua_test')
+
+local function async_all_cb(task)
+  local dns_done, http_code = rspamd_async.all(
+    function()
+      -- Test environment may have no network, so we merely check resuming
+      local results, err = task:get_resolver():resolve_a({
+        task = task,
+        name = 'example.com',
+      })
+      return results ~= nil or err ~= nil
+    end,
+    function()
+      local err, code = rspamd_http.request({
+        task = task,
+        url = string.format('http://127.0.0.1:%d/auth', opts.controller_port),
+        timeout = 5.0,
+      })
+      return code
+    end)
+
+  if dns_done and http_code == 200 then
+    task:insert_result('ASYNC_ALL', 1.0, tostring(http_code))
+  end
+end
+
+local function async_error_cb(task)
+  -- Nothing listens on this port
+  local err, code = rspamd_http.request({
+    task = task,
+    url = string.format('http://127.0.0.1:%d/', opts.unused_port),
+    timeout = 1.0,
+  })
+
+  if err and not code then
+    task:insert_result('ASYNC_ERROR', 1.0)
+  end
+end
+
+rspamd_config:register_symbol({
+  name = 'ASYNC_ALL',
+  callback = async_all_cb,
+  coroutine = true,
+})
+
+rspamd_config:register_symbol({
+  name = 'ASYNC_ERROR',
+  callback = async_error_cb,
+  coroutine = true,
+})
@@ -0,0 +1,147 @@
+-- Tests for flat task interface available via LuaJIT FFI
+
+context("Task FFI interface", function()
+  local ffi = require("ffi")
+  local rspamd_ffi = require("rspamd_ffi")
+  local rspamd_util = require("rspamd_util")
+  local rspamd_task = require("rspamd_task")
+  local test_dir = string.gsub(debug.getinfo(1).source, "^@(.+/)[^/]+$", "%1")
+
+  local cfg = rspamd_util.config_from_ucl({
+    options = {
+      url_tld = string.format('%s/%s', test_dir, "test_tld.dat"),
+    },
+    logging = {
+      type = 'console',
+      level = 'debug'
+    },
+    metric = {
+      name = 'default',
+      actions = {
+        reject = 100500,
+      },
+      unknown_weight = 1
+    }
+  })
+
+  local msg = [[
+From: <user@example.com>
+To: <nobody@example.com>
+Subject: test
+Received: from first
+Received: from second
+Content-Type: multipart/alternative; boundary="xxx"
+
+--xxx
+Content-Type: text/plain
+
+hello world, see http://example.com/path?query=1 or write to info@example.org
+--xxx
+Content-Type: text/plain
+
+second part
+--xxx--
+]]
+
+  local function load_task()
+    assert_not_nil(cfg)
+    local task = rspamd_task.load_from_string(msg, cfg)
+    assert_not_nil(task, "cannot load task")
+
+    return task, rspamd_ffi.task(task)
+  end
+
+  test("ABI version", function()
+    assert_true(rspamd_ffi.C.rspamd_ffi_abi_version() >= 1)
+  end)
+
+  test("Get headers", function()
+    local task, t = load_task()
+
+    local hdrs, n = rspamd_ffi.headers(t, 'Subject')
+    assert_equal(n, 1)
+    assert_equal(ffi.string(hdrs[0].name, hdrs[0].name_len), 'Subject')
+    assert_equal(ffi.string(hdrs[0].value, hdrs[0].value_len), 'test')
+    assert_equal(ffi.string(hdrs[0].decoded, hdrs[0].decoded_len), 'test')
+
+    -- Names are case insensitive unless strong match is requested
+    _, n = rspamd_ffi.headers(t, 'subject')
+    assert_equal(n, 1)
+    _, n = rspamd_ffi.headers(t, 'subject', true)
+    assert_equal(n, 0)
+    _, n = rspamd_ffi.headers(t, 'X-Missing')
+    assert_equal(n, 0)
+
+    -- Total number is returned when array is too short
+    local one = ffi.new('struct rspamd_ffi_header[1]')
+    assert_equal(tonumber(rspamd_ffi.C.rspamd_ffi_task_get_headers(t,
+      'Received', 0, one, 1)), 2)
+    assert_equal(string.sub(ffi.string(one[0].value, one[0].value_len), 1, 5),
+      'from ')
+
+    task:destroy()
+  end)
+
+  test("Get urls", function()
+    local task, t = load_task()
+
+    local urls, n = rspamd_ffi.urls(t)
+    assert_equal(n, 1)
+    assert_equal(ffi.string(urls[0].host, urls[0].host_len), 'example.com')
+    assert_true(urls[0].tld_len > 0)
+    assert_equal(ffi.string(urls[0].query, urls[0].query_len), 'query=1')
+
+    -- Emails are returned after urls if requested
+    local _, nall = rspamd_ffi.urls(t, true)
+    assert_true(nall >= n)
+    assert_equal(tonumber(rspamd_ffi.C.rspamd_ffi_task_get_urls(t, 1, nil, 0)),
+      nall)
+
+    task:destroy()
+  end)
+
+  test("Get text parts and words", function()
+    local task, t = load_task()
+
+    local parts, n = rspamd_ffi.text_parts(t)
+    assert_equal(n, 2)
+    assert_true(parts[0].len > 0)
+    assert_not_nil(string.find(ffi.string(parts[0].content, parts[0].len),
+      'hello world', 1, true))
+
+    for i = 0, n - 1 do
+      local words, nwords = rspamd_ffi.words(t, i)
+      assert_equal(nwords, parts[i].nwords)
+      assert_true(nwords > 0)
+
+      local found = false
+      for j = 0, nwords - 1 do
+        local w = string.lower(ffi.string(words[j].begin, words[j].len))
+        if w == 'hello' or w == 'second' then found = true end
+      end
+      assert_true(found)
+    end
+
+    -- No words for non existing parts
+    local words, nwords = rspamd_ffi.words(t, n)
+    assert_true(words == nil)
+    assert_equal(nwords, 0)
+
+    task:destroy()
+  end)
+
+  test("Insert result", function()
+    local task, t = load_task()
+
+    rspamd_ffi.insert_result(t, 'FFI_SYMBOL', 1.0, 'ffi option')
+    rspamd_ffi.insert_result(t, 'FFI_SYMBOL_NOOPT', 2.0)
+    assert_true(task:has_symbol('FFI_SYMBOL'))
+    assert_true(task:has_symbol('FFI_SYMBOL_NOOPT'))
+
+    local res = task:get_symbol('FFI_SYMBOL')
+    assert_not_nil(res)
+    assert_equal(res[1].options[1], 'ffi option')
+
+    task:destroy()
+  end)
+end)
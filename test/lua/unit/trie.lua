@@ -60,4 +60,115 @@ context("Trie search functions", function()
     end
 
   end)
+
+  test("Trie case insensitive search", function()
+    -- Flags must not depend on the number of patterns
+    for _,patterns in ipairs({{'test', 'Hello'}, {'test', 'Hello', 'x', 'y', 'z'}}) do
+      local trie = t.create(patterns)
+      assert_not_nil(trie, "cannot create trie")
+
+      local res = {}
+      local ret = trie:match('HELLO TeSt', function(idx, pos)
+        table.insert(res, {pos, idx})
+        return 0
+      end)
+
+      assert_true(ret, 'no case insensitive match for ' .. #patterns .. ' patterns')
+      table.sort(res, function(a, b) return a[1] < b[1] end)
+      assert_equal(2, #res, 'invalid matches: ' .. logger.slog('%s', res))
+      assert_equal(5, res[1][1])
+      assert_equal(2, res[1][2])
+      assert_equal(10, res[2][1])
+      assert_equal(1, res[2][2])
+    end
+  end)
+
+  test("Registered trie search", function()
+    local rspamd_util = require "rspamd_util"
+    local rspamd_task = require "rspamd_task"
+    local test_dir = string.gsub(debug.getinfo(1).source, "^@(.+/)[^/]+$", "%1")
+    local cfg = rspamd_util.config_from_ucl({
+      options = {
+        url_tld = string.format('%s/%s', test_dir, "test_tld.dat"),
+      },
+      logging = {
+        type = 'console',
+        level = 'debug'
+      },
+    })
+    assert_not_nil(cfg)
+
+    local msg = [[
+From: <>
+To: <nobody@example.com>
+Subject: test
+Content-Type: multipart/alternative; boundary="xxx"
+
+--xxx
+Content-Type: text/plain
+
+first test part
+--xxx
+Content-Type: text/plain
+
+second test part
+--xxx--
+]]
+    local task = rspamd_task.load_from_string(msg, cfg)
+    assert_not_nil(task, "cannot load task")
+
+    -- Both tries share a single scan of text parts
+    local trie1 = t.create({'first', 'part'}, 'mime')
+    local trie2 = t.create({'second', 'test'}, {'mime', 'rawbody'})
+    local unregistered = t.create({'second', 'test'})
+    assert_not_nil(trie1, "cannot create trie")
+    assert_not_nil(trie2, "cannot create trie")
+
+    local function same(t1, t2)
+      if #t1 ~= #t2 then return false end
+      for i=1,#t1 do
+        if t1[i] ~= t2[i] then return false end
+      end
+      return true
+    end
+
+    local function collect(trie, stop)
+      local res = {}
+      local ret = trie:search_mime(task, function(idx, pos)
+        table.insert(res, idx)
+        if stop then return 1 end
+        return 0
+      end)
+
+      table.sort(res)
+      return ret, res
+    end
+
+    local ret, res = collect(trie1)
+    assert_true(ret, 'registered trie has not matched')
+    assert_true(same({1, 2, 2}, res), 'invalid matches: ' .. logger.slog('%s', res))
+
+    ret, res = collect(trie2)
+    assert_true(ret, 'registered trie has not matched')
+    local ret_unreg, res_unreg = collect(unregistered)
+    assert_equal(ret_unreg, ret)
+    assert_true(same(res_unreg, res), 'invalid matches: ' .. logger.slog('%s', res))
+
+    -- Stopping search in one part continues with the next part
+    ret, res = collect(trie2, true)
+    ret_unreg, res_unreg = collect(unregistered, true)
+    assert_equal(2, #res)
+    assert_true(same(res_unreg, res), 'invalid matches: ' .. logger.slog('%s', res))
+
+    ret = trie2:search_rawbody(task, function() return 0 end)
+    assert_true(ret, 'registered trie has not matched raw body')
+
+    -- Merged matcher is case insensitive as well
+    local trie3 = t.create({'FIRST', 'Second'}, 'mime')
+    ret, res = collect(trie3)
+    assert_true(ret, 'registered trie has not matched')
+    assert_true(same({1, 2}, res), 'invalid matches: ' .. logger.slog('%s', res))
+
+    task:destroy()
+  end)
 end)
@@ -0,0 +1,203 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "bloom.h"
+#include "unix-std.h"
+#include <sys/wait.h>
+
+static const guint nelts = 100000;
+/* Theoretical rate for 10 bits per element is about 1%, blocks add a bit */
+static const gdouble max_fp_rate = 0.02;
+
+static guint
+bloom_test_key (guint i, gchar *buf, gsize len)
+{
+	return rspamd_snprintf (buf, len, "bloom test key %ud", i);
+}
+
+static void
+bloom_test_add_range (rspamd_blocked_bloom_t *bloom, guint start, guint end)
+{
+	gchar key[64];
+	guint i, len;
+
+	for (i = start; i < end; i ++) {
+		len = bloom_test_key (i, key, sizeof (key));
+		g_assert (rspamd_blocked_bloom_add (bloom, key, len));
+	}
+}
+
+/* Checks that there are no false negatives in range */
+static void
+bloom_test_check_range (rspamd_blocked_bloom_t *bloom, guint start, guint end)
+{
+	gchar key[64];
+	guint i, len;
+
+	for (i = start; i < end; i ++) {
+		len = bloom_test_key (i, key, sizeof (key));
+		g_assert (rspamd_blocked_bloom_check (bloom, key, len));
+	}
+}
+
+static gdouble
+bloom_test_fp_rate (rspamd_blocked_bloom_t *bloom, guint start, guint end)
+{
+	gchar key[64];
+	guint i, len, fp = 0;
+
+	for (i = start; i < end; i ++) {
+		len = bloom_test_key (i, key, sizeof (key));
+
+		if (rspamd_blocked_bloom_check (bloom, key, len)) {
+			fp ++;
+		}
+	}
+
+	return (gdouble)fp / (end - start);
+}
+
+static void
+bloom_test_plain (void)
+{
+	rspamd_blocked_bloom_t *bloom;
+	gdouble rate;
+
+	bloom = rspamd_blocked_bloom_new (nelts, 0, 0);
+	g_assert (bloom != NULL);
+	bloom_test_add_range (bloom, 0, nelts);
+	bloom_test_check_range (bloom, 0, nelts);
+	rate = bloom_test_fp_rate (bloom, nelts, nelts * 11);
+	msg_info ("plain filter false positives rate: %.4f", rate);
+	g_assert (rate < max_fp_rate);
+
+	/* Elements cannot be deleted from plain filter */
+	g_assert (!rspamd_blocked_bloom_del (bloom, "bloom test key 0",
+			sizeof ("bloom test key 0") - 1));
+	bloom_test_check_range (bloom, 0, 1);
+
+	rspamd_blocked_bloom_destroy (bloom);
+}
+
+static void
+bloom_test_counting (void)
+{
+	rspamd_blocked_bloom_t *bloom;
+	gchar key[64];
+	guint i, len;
+	gdouble rate;
+
+	bloom = rspamd_blocked_bloom_new (nelts, 0, RSPAMD_BLOOM_COUNTING);
+	g_assert (bloom != NULL);
+	bloom_test_add_range (bloom, 0, nelts);
+	bloom_test_check_range (bloom, 0, nelts);
+	rate = bloom_test_fp_rate (bloom, nelts, nelts * 11);
+	msg_info ("counting filter false positives rate: %.4f", rate);
+	g_assert (rate < max_fp_rate);
+
+	/* Delete the first half of elements */
+	for (i = 0; i < nelts / 2; i ++) {
+		len = bloom_test_key (i, key, sizeof (key));
+		g_assert (rspamd_blocked_bloom_del (bloom, key, len));
+	}
+
+	/* Remaining elements must be still found */
+	bloom_test_check_range (bloom, nelts / 2, nelts);
+	/* Deleted elements are found merely as false positives */
+	rate = bloom_test_fp_rate (bloom, 0, nelts / 2);
+	msg_info ("counting filter deleted elements rate: %.4f", rate);
+	g_assert (rate < max_fp_rate);
+
+	rspamd_blocked_bloom_destroy (bloom);
+}
+
+static void
+bloom_test_shared (void)
+{
+	rspamd_blocked_bloom_t *bloom;
+	pid_t pid;
+	gint status;
+
+	bloom = rspamd_blocked_bloom_new (nelts, 0,
+			RSPAMD_BLOOM_COUNTING | RSPAMD_BLOOM_SHARED);
+	g_assert (bloom != NULL);
+
+	/* Both processes update the same blocks concurrently */
+	pid = fork ();
+	g_assert (pid != -1);
+
+	if (pid == 0) {
+		bloom_test_add_range (bloom, 0, nelts / 2);
+		_exit (0);
+	}
+
+	bloom_test_add_range (bloom, nelts / 2, nelts);
+	g_assert (waitpid (pid, &status, 0) == pid);
+	g_assert (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+
+	/* Lost updates would lead to false negatives */
+	bloom_test_check_range (bloom, 0, nelts);
+
+	rspamd_blocked_bloom_destroy (bloom);
+}
+
+static void
+bloom_test_save (void)
+{
+	rspamd_blocked_bloom_t *bloom, *saved;
+	gchar path[PATH_MAX];
+	GError *err = NULL;
+	gint fd;
+
+	rspamd_strlcpy (path, "/tmp/rspamd-bloom-test.XXXXXX", sizeof (path));
+	fd = mkstemp (path);
+	g_assert (fd != -1);
+	close (fd);
+
+	bloom = rspamd_blocked_bloom_new (nelts, 0, 0);
+	g_assert (bloom != NULL);
+	bloom_test_add_range (bloom, 0, nelts);
+	g_assert (rspamd_blocked_bloom_save (bloom, path, &err));
+
+	saved = rspamd_blocked_bloom_open (path, &err);
+	g_assert (saved != NULL);
+	bloom_test_check_range (saved, 0, nelts);
+	/* Both filters must give the same answers for other elements */
+	g_assert (bloom_test_fp_rate (saved, nelts, nelts * 2) ==
+			bloom_test_fp_rate (bloom, nelts, nelts * 2));
+	/* Mapped filter is read only */
+	g_assert (!rspamd_blocked_bloom_add (saved, "new key",
+			sizeof ("new key") - 1));
+
+	rspamd_blocked_bloom_destroy (saved);
+	rspamd_blocked_bloom_destroy (bloom);
+	unlink (path);
+
+	/* Removed file cannot be opened */
+	g_assert (rspamd_blocked_bloom_open (path, &err) == NULL);
+	g_error_free (err);
+}
+
+void
+rspamd_bloom_test_func (void)
+{
+	bloom_test_plain ();
+	bloom_test_counting ();
+	bloom_test_shared ();
+	bloom_test_save ();
+}
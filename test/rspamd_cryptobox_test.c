@@ -152,6 +152,97 @@ create_constrainted_split (struct rspamd_cryptobox_segment *seg, int mseg,
 	return used;
 }
 
+#define BATCH_MSGS 1024
+#define BATCH_MSG_LEN 100
+
+/*
+ * Batch decryption must be equal to decrypting messages one by one
+ */
+static void
+test_batch (void)
+{
+	struct rspamd_cryptobox_batch_elt *elts;
+	guchar *plain, *data, *nonces, *nms, *macs;
+	gsize lens[BATCH_MSGS], max_len = 1500;
+	double t1, t2, t_single, t_batch;
+	guint i, iter;
+
+	elts = g_malloc0 (sizeof (*elts) * BATCH_MSGS);
+	plain = g_malloc (BATCH_MSGS * max_len);
+	data = g_malloc (BATCH_MSGS * max_len);
+	nonces = g_malloc (BATCH_MSGS * sizeof (rspamd_nonce_t));
+	nms = g_malloc (BATCH_MSGS * sizeof (rspamd_nm_t));
+	macs = g_malloc (BATCH_MSGS * sizeof (rspamd_mac_t));
+	ottery_rand_bytes (plain, BATCH_MSGS * max_len);
+	ottery_rand_bytes (nonces, BATCH_MSGS * sizeof (rspamd_nonce_t));
+	ottery_rand_bytes (nms, BATCH_MSGS * sizeof (rspamd_nm_t));
+
+	for (iter = 0; iter < 2; iter ++) {
+		for (i = 0; i < BATCH_MSGS; i ++) {
+			/* Some messages are too long to be decrypted in lanes */
+			lens[i] = iter == 0 ? ottery_rand_range (max_len - 1) :
+					BATCH_MSG_LEN;
+			memcpy (data + i * max_len, plain + i * max_len, lens[i]);
+			rspamd_cryptobox_encrypt_nm_inplace (data + i * max_len, lens[i],
+					nonces + i * sizeof (rspamd_nonce_t),
+					nms + i * sizeof (rspamd_nm_t),
+					macs + i * sizeof (rspamd_mac_t), mode);
+			elts[i].data = data + i * max_len;
+			elts[i].len = lens[i];
+			elts[i].nonce = nonces + i * sizeof (rspamd_nonce_t);
+			elts[i].nm = nms + i * sizeof (rspamd_nm_t);
+			elts[i].mac = macs + i * sizeof (rspamd_mac_t);
+		}
+
+		/* Corrupt one message */
+		macs[5 * sizeof (rspamd_mac_t)] ^= 0xff;
+		t1 = rspamd_get_ticks ();
+		rspamd_cryptobox_decrypt_nm_inplace_batch (elts, BATCH_MSGS, mode);
+		t2 = rspamd_get_ticks ();
+		t_batch = t2 - t1;
+
+		for (i = 0; i < BATCH_MSGS; i ++) {
+			g_assert (elts[i].ok == (i != 5));
+
+			if (elts[i].ok) {
+				g_assert (memcmp (elts[i].data, plain + i * max_len,
+						lens[i]) == 0);
+			}
+		}
+
+		/* Encrypt again to compare with a single message decryption */
+		for (i = 0; i < BATCH_MSGS; i ++) {
+			memcpy (data + i * max_len, plain + i * max_len, lens[i]);
+			rspamd_cryptobox_encrypt_nm_inplace (data + i * max_len, lens[i],
+					nonces + i * sizeof (rspamd_nonce_t),
+					nms + i * sizeof (rspamd_nm_t),
+					macs + i * sizeof (rspamd_mac_t), mode);
+		}
+
+		t1 = rspamd_get_ticks ();
+		for (i = 0; i < BATCH_MSGS; i ++) {
+			g_assert (rspamd_cryptobox_decrypt_nm_inplace (data + i * max_len,
+					lens[i],
+					nonces + i * sizeof (rspamd_nonce_t),
+					nms + i * sizeof (rspamd_nm_t),
+					macs + i * sizeof (rspamd_mac_t), mode));
+		}
+		t2 = rspamd_get_ticks ();
+		t_single = t2 - t1;
+
+		msg_info ("%s batch decryption of %d messages: %.6f, one by one: %.6f",
+				iter == 0 ? "random length" : "100 bytes", BATCH_MSGS,
+				t_batch, t_single);
+	}
+
+	g_free (elts);
+	g_free (plain);
+	g_free (data);
+	g_free (nonces);
+	g_free (nms);
+	g_free (macs);
+}
+
 void
 rspamd_cryptobox_test_func (void)
 {
@@ -345,4 +436,7 @@ start:
 		mode = RSPAMD_CRYPTOBOX_MODE_NIST;
 		goto start;
 	}
+
+	mode = RSPAMD_CRYPTOBOX_MODE_25519;
+	test_batch ();
 }
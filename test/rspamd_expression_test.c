@@ -0,0 +1,185 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "expression.h"
+#include "ottery.h"
+
+#define NATOMS 26
+
+static const guint niter = 100000;
+
+struct test_atoms {
+	gint values[NATOMS];
+	/* Emulated cost of each atom */
+	guint costs[NATOMS];
+};
+
+/* Typical shapes of regexp and composite rules */
+static const gchar *test_exprs[] = {
+	"A & B | !C",
+	"A & (!B | C)",
+	"A + B + C + D + E + F >= 2",
+	"((A + B + C + D) > 1) & F",
+	"(A + B + C + D) > 1 && F || E",
+	"(A + B + C + D) > 100 && F || !E",
+	"F && ((A + B + C + D) > 1)",
+	"(E) && ((B + B + B + B) >= 1)",
+	"!!C",
+	"(B) & (D) & ((G) | (H) | (I) | (A))",
+	"A & C & (!D || !C || !E)",
+	"A & C & !(D || C || E)",
+	"Z & Y & X & (A | B | C | D | E)",
+	"(K + L + M + N + O + P + Q) >= 3 & !R",
+	"S | T | U | V | (W & X)",
+	"(A & B & C & D) | (E & F & G & H) | (I & J & K & L)",
+	"!(M | N) & (O + P + Q + R > 2)",
+};
+
+static rspamd_expression_atom_t *
+test_expr_parse (const gchar *line, gsize len,
+		rspamd_mempool_t *pool, gpointer ud, GError **err)
+{
+	rspamd_expression_atom_t *atom;
+
+	if (!g_ascii_isupper (*line)) {
+		g_set_error (err, g_quark_from_static_string ("test"), 100,
+				"invalid atom: %c", *line);
+		return NULL;
+	}
+
+	atom = rspamd_mempool_alloc0 (pool, sizeof (*atom));
+	atom->str = line;
+	atom->len = 1;
+	atom->data = GINT_TO_POINTER (*line - 'A');
+
+	return atom;
+}
+
+static gint
+test_expr_process (gpointer input, rspamd_expression_atom_t *atom)
+{
+	struct test_atoms *ta = input;
+	gint idx = GPOINTER_TO_INT (atom->data);
+	volatile guint i, cnt = 0;
+
+	for (i = 0; i < ta->costs[idx]; i ++) {
+		cnt ++;
+	}
+
+	return ta->values[idx];
+}
+
+static gint
+test_expr_priority (rspamd_expression_atom_t *atom)
+{
+	return 0;
+}
+
+static const struct rspamd_atom_subr test_expr_subr = {
+	.parse = test_expr_parse,
+	.process = test_expr_process,
+	.priority = test_expr_priority,
+	.destroy = NULL
+};
+
+static void
+test_expr_fill_atoms (struct test_atoms *ta)
+{
+	guint i;
+
+	for (i = 0; i < NATOMS; i ++) {
+		/* Most of atoms are false as most of rules do not match */
+		ta->values[i] = (ottery_rand_range (9) == 0);
+	}
+}
+
+static gdouble
+test_expr_bench (struct rspamd_expression **exprs, guint nexprs,
+		struct test_atoms *inputs, guint ninputs, gint flags)
+{
+	gdouble t1, t2;
+	guint i, j;
+	volatile gint res = 0;
+
+	t1 = rspamd_get_virtual_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		for (j = 0; j < nexprs; j ++) {
+			res += rspamd_process_expression (exprs[j], flags,
+					&inputs[i % ninputs]);
+		}
+	}
+
+	t2 = rspamd_get_virtual_ticks ();
+
+	return t2 - t1;
+}
+
+void
+rspamd_expression_test_func (void)
+{
+	rspamd_mempool_t *pool;
+	struct rspamd_expression *exprs[G_N_ELEMENTS (test_exprs)];
+	struct test_atoms inputs[64];
+	GError *err = NULL;
+	gdouble t_ast, t_code;
+	gint r1, r2;
+	guint i, j;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "expression");
+
+	for (i = 0; i < G_N_ELEMENTS (test_exprs); i ++) {
+		g_assert (rspamd_parse_expression (test_exprs[i], 0, &test_expr_subr,
+				NULL, pool, &err, &exprs[i]));
+	}
+
+	for (j = 0; j < G_N_ELEMENTS (inputs); j ++) {
+		test_expr_fill_atoms (&inputs[j]);
+
+		for (i = 0; i < NATOMS; i ++) {
+			/* Some atoms are much more expensive than others */
+			inputs[j].costs[i] = (i % 5 == 0) ? 2000 : 10;
+		}
+	}
+
+	/* Compiled code and AST walker must agree on all inputs and in all modes */
+	for (j = 0; j < niter / 10; j ++) {
+		for (i = 0; i < G_N_ELEMENTS (test_exprs); i ++) {
+			r1 = rspamd_process_expression (exprs[i], RSPAMD_EXPRESSION_FLAG_AST,
+					&inputs[j % G_N_ELEMENTS (inputs)]);
+			r2 = rspamd_process_expression (exprs[i], 0,
+					&inputs[j % G_N_ELEMENTS (inputs)]);
+			g_assert (r1 == r2);
+			r2 = rspamd_process_expression (exprs[i],
+					RSPAMD_EXPRESSION_FLAG_NOOPT,
+					&inputs[j % G_N_ELEMENTS (inputs)]);
+			g_assert (r1 == r2);
+		}
+	}
+
+	t_ast = test_expr_bench (exprs, G_N_ELEMENTS (exprs), inputs,
+			G_N_ELEMENTS (inputs), RSPAMD_EXPRESSION_FLAG_AST);
+	t_code = test_expr_bench (exprs, G_N_ELEMENTS (exprs), inputs,
+			G_N_ELEMENTS (inputs), 0);
+
+	msg_info ("processed %ud expressions %ud times: ast walker %.4f, "
+			"compiled code %.4f", (guint)G_N_ELEMENTS (exprs), niter,
+			t_ast, t_code);
+
+	rspamd_mempool_delete (pool);
+}
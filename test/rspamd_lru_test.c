@@ -0,0 +1,256 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "hash.h"
+#include "heap.h"
+#include "ottery.h"
+
+static const guint niter = 1000000;
+static const guint nkeys = 65536;
+static const guint cache_size = 8192;
+
+static guint ndestroyed = 0;
+
+static void
+lru_test_destroy (gpointer p)
+{
+	ndestroyed ++;
+}
+
+/*
+ * Heap based lru hash used by rspamd before, it is kept here to compare
+ * performance of the implementations
+ */
+struct heap_lru_elt {
+	struct rspamd_min_heap_elt helt;
+	guint usages;
+	gpointer key;
+	gpointer data;
+};
+
+struct heap_lru {
+	guint maxsize;
+	struct rspamd_min_heap *heap;
+	GHashTable *tbl;
+};
+
+static void
+heap_lru_elt_free (gpointer p)
+{
+	g_slice_free1 (sizeof (struct heap_lru_elt), p);
+}
+
+static struct heap_lru *
+heap_lru_new (guint maxsize)
+{
+	struct heap_lru *lru;
+
+	lru = g_slice_alloc (sizeof (*lru));
+	lru->maxsize = maxsize;
+	lru->heap = rspamd_min_heap_create (maxsize);
+	lru->tbl = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+			heap_lru_elt_free);
+
+	return lru;
+}
+
+static gpointer
+heap_lru_lookup (struct heap_lru *lru, gconstpointer key)
+{
+	struct heap_lru_elt *elt;
+
+	elt = g_hash_table_lookup (lru->tbl, key);
+
+	if (elt != NULL) {
+		rspamd_min_heap_update_elt (lru->heap, &elt->helt,
+				G_MAXUINT / ++elt->usages);
+
+		return elt->data;
+	}
+
+	return NULL;
+}
+
+static void
+heap_lru_insert (struct heap_lru *lru, gpointer key, gpointer value)
+{
+	struct heap_lru_elt *elt;
+
+	elt = g_hash_table_lookup (lru->tbl, key);
+
+	if (elt != NULL) {
+		rspamd_min_heap_remove_elt (lru->heap, &elt->helt);
+		g_hash_table_remove (lru->tbl, key);
+	}
+	else if (g_hash_table_size (lru->tbl) >= lru->maxsize) {
+		elt = (struct heap_lru_elt *)rspamd_min_heap_pop (lru->heap);
+
+		if (elt) {
+			g_hash_table_remove (lru->tbl, elt->key);
+		}
+	}
+
+	elt = g_slice_alloc (sizeof (*elt));
+	elt->key = key;
+	elt->data = value;
+	elt->usages = 1;
+	elt->helt.pri = G_MAXUINT;
+	g_hash_table_insert (lru->tbl, key, elt);
+	rspamd_min_heap_push (lru->heap, &elt->helt);
+}
+
+static void
+heap_lru_destroy (struct heap_lru *lru)
+{
+	rspamd_min_heap_destroy (lru->heap);
+	g_hash_table_unref (lru->tbl);
+	g_slice_free1 (sizeof (*lru), lru);
+}
+
+/* Skewed keys distribution: most of lookups hit a small subset of keys */
+static guint
+lru_test_key (void)
+{
+	if (ottery_rand_range (3) == 0) {
+		return ottery_rand_range (nkeys - 1) + 1;
+	}
+
+	return ottery_rand_range (cache_size / 4 - 1) + 1;
+}
+
+static void
+lru_test_bench (guint *keys)
+{
+	rspamd_lru_hash_t *hash;
+	struct heap_lru *lru;
+	gdouble t1, t2, t3, t4;
+	guint i, hits_clock = 0, hits_heap = 0;
+	gpointer k;
+
+	hash = rspamd_lru_hash_new_full (cache_size, NULL, NULL,
+			g_direct_hash, g_direct_equal);
+	t1 = rspamd_get_virtual_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		k = GUINT_TO_POINTER (keys[i]);
+
+		if (rspamd_lru_hash_lookup (hash, k, 0) != NULL) {
+			hits_clock ++;
+		}
+		else {
+			rspamd_lru_hash_insert (hash, k, k, 0, 0);
+		}
+	}
+
+	t2 = rspamd_get_virtual_ticks ();
+	rspamd_lru_hash_destroy (hash);
+
+	lru = heap_lru_new (cache_size);
+	t3 = rspamd_get_virtual_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		k = GUINT_TO_POINTER (keys[i]);
+
+		if (heap_lru_lookup (lru, k) != NULL) {
+			hits_heap ++;
+		}
+		else {
+			heap_lru_insert (lru, k, k);
+		}
+	}
+
+	t4 = rspamd_get_virtual_ticks ();
+	heap_lru_destroy (lru);
+
+	msg_info ("lru hash: %ud operations, clock: %.4f (%.2f%% hits), "
+			"heap: %.4f (%.2f%% hits)", niter,
+			t2 - t1, hits_clock * 100.0 / niter,
+			t4 - t3, hits_heap * 100.0 / niter);
+}
+
+void
+rspamd_lru_test_func (void)
+{
+	rspamd_lru_hash_t *hash;
+	guint i, *keys, cnt;
+	gint it;
+	gpointer k, v;
+
+	/* Basic operations */
+	hash = rspamd_lru_hash_new_full (cache_size, lru_test_destroy, NULL,
+			g_direct_hash, g_direct_equal);
+
+	for (i = 1; i <= cache_size; i ++) {
+		rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (i),
+				GUINT_TO_POINTER (i), 0, 0);
+	}
+
+	g_assert (rspamd_lru_hash_size (hash) == cache_size);
+
+	for (i = 1; i <= cache_size; i ++) {
+		g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (i), 0) ==
+				GUINT_TO_POINTER (i));
+	}
+
+	/* Replace the value */
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (1),
+			GUINT_TO_POINTER (2), 0, 0);
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (1), 0) ==
+			GUINT_TO_POINTER (2));
+	g_assert (ndestroyed == 1);
+
+	/* Recently used element must survive eviction */
+	for (i = cache_size + 1; i <= cache_size * 2; i ++) {
+		g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (1), 0) != NULL);
+		rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (i),
+				GUINT_TO_POINTER (i), 0, 0);
+		g_assert (rspamd_lru_hash_size (hash) <= cache_size);
+	}
+
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (1), 0) != NULL);
+
+	/* Expiration */
+	rspamd_lru_hash_insert (hash, GUINT_TO_POINTER (nkeys + 1),
+			GUINT_TO_POINTER (1), 100, 10);
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (nkeys + 1),
+			105) != NULL);
+	g_assert (rspamd_lru_hash_lookup (hash, GUINT_TO_POINTER (nkeys + 1),
+			111) == NULL);
+
+	cnt = 0;
+	it = 0;
+
+	while ((it = rspamd_lru_hash_foreach (hash, it, &k, &v)) != -1) {
+		g_assert (rspamd_lru_hash_lookup (hash, k, 0) == v);
+		cnt ++;
+	}
+
+	g_assert (cnt == rspamd_lru_hash_size (hash));
+	rspamd_lru_hash_destroy (hash);
+	/* All keys must be destroyed */
+	g_assert (ndestroyed == cache_size * 2 + 2);
+
+	keys = g_malloc (niter * sizeof (*keys));
+
+	for (i = 0; i < niter; i ++) {
+		keys[i] = lru_test_key ();
+	}
+
+	lru_test_bench (keys);
+	g_free (keys);
+}
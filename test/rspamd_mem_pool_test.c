@@ -1,4 +1,5 @@
 #include "config.h"
+#include "rspamd.h"
 #include "mem_pool.h"
 #include "tests.h"
 #include "unix-std.h"
@@ -11,6 +12,49 @@
 #define TEST_BUF "test bufffer"
 #define TEST2_BUF "test bufffertest bufffer"
 
+/*
+ * Emulates pool of a task: many small allocations with ~300Kb in total
+ */
+static void
+rspamd_mem_pool_fill (rspamd_mempool_t *pool, gsize total)
+{
+	gsize allocated = 0, sz;
+	guint i = 0;
+	guchar *p;
+
+	while (allocated < total) {
+		sz = 16 + (i ++ * 37) % 1024;
+		p = rspamd_mempool_alloc (pool, sz);
+		p[0] = p[sz - 1] = 0xAA;
+		allocated += sz;
+	}
+}
+
+static gdouble
+rspamd_mem_pool_bench (const gchar *tag, gboolean recycle, guint niter)
+{
+	rspamd_mempool_t *pool;
+	gdouble ts1, ts2;
+	guint i;
+
+	rspamd_mempool_release_cached ();
+	ts1 = rspamd_get_virtual_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), tag);
+		rspamd_mem_pool_fill (pool, 300 * 1024);
+		rspamd_mempool_delete (pool);
+
+		if (!recycle) {
+			rspamd_mempool_release_cached ();
+		}
+	}
+
+	ts2 = rspamd_get_virtual_ticks ();
+
+	return ts2 - ts1;
+}
+
 void
 rspamd_mem_pool_test_func ()
 {
@@ -19,6 +63,10 @@ rspamd_mem_pool_test_func ()
 	char *tmp, *tmp2, *tmp3;
 	pid_t pid;
 	int ret;
+	gdouble t_plain, t_hints, t_recycle;
+	GArray *tags;
+	rspamd_mempool_tag_stat_t *tst;
+	guint i;
 
 	pool = rspamd_mempool_new (sizeof (TEST_BUF), NULL);
 	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
@@ -35,5 +83,36 @@ rspamd_mem_pool_test_func ()
 	
 	rspamd_mempool_delete (pool);
 	rspamd_mempool_stat (&st);
-	
+
+	/* Tagged pool must start with a single chain after learning its size */
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "test");
+	rspamd_mem_pool_fill (pool, 300 * 1024);
+	rspamd_mempool_delete (pool);
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "test");
+	rspamd_mem_pool_fill (pool, 300 * 1024);
+	g_assert (pool->pools[RSPAMD_MEMPOOL_NORMAL]->len == 1);
+	rspamd_mempool_delete (pool);
+
+	/* Both pools should be accounted in the same bucket of peak sizes */
+	tags = rspamd_mempool_tag_stat ();
+	tst = NULL;
+
+	for (i = 0; i < tags->len; i ++) {
+		if (strcmp (g_array_index (tags, rspamd_mempool_tag_stat_t, i).tagname,
+				"test") == 0) {
+			tst = &g_array_index (tags, rspamd_mempool_tag_stat_t, i);
+		}
+	}
+
+	g_assert (tst != NULL);
+	g_assert (tst->pools == 2);
+	g_assert (tst->peak_hist[6] == 2);
+	g_array_free (tags, TRUE);
+
+	t_plain = rspamd_mem_pool_bench (NULL, FALSE, 1000);
+	t_hints = rspamd_mem_pool_bench ("bench", FALSE, 1000);
+	t_recycle = rspamd_mem_pool_bench ("bench", TRUE, 1000);
+	msg_info ("1000 pools of 300Kb: plain %.4f sec, size hints %.4f sec, "
+			"size hints and recycling %.4f sec", t_plain, t_hints, t_recycle);
+	rspamd_mempool_release_cached ();
 }
@@ -18,6 +18,7 @@
 #include "radix.h"
 #include "ottery.h"
 #include "btrie.h"
+#include "unix-std.h"
 
 const gsize max_elts = 500 * 1024;
 const gint lookup_cycles = 1 * 1024;
@@ -137,6 +138,173 @@ rspamd_radix_test_vec (void)
 	radix_destroy_compressed (tree);
 }
 
+static void
+rspamd_radix_test_flat (void)
+{
+	radix_compressed_t *tree = radix_create_compressed (), *flat;
+	struct _tv *t;
+	guint8 key[16];
+	guchar *image, *data;
+	gsize len, i;
+	uintptr_t v1, v2;
+
+	for (t = &test_vec[0]; t->ip != NULL; t ++) {
+		/* Skip default route as it matches everything */
+		if (t->mask != t->len * NBBY) {
+			radix_insert_compressed (tree, t->addr, t->len, t->mask, 1);
+		}
+	}
+
+	for (i = 0; i < 1024; i ++) {
+		ottery_rand_bytes (key, sizeof (key));
+		radix_insert_compressed (tree, key, sizeof (key),
+				ottery_rand_range (120) + 1, 1);
+	}
+
+	image = radix_serialize_flat (tree, 1, &len);
+	g_assert (image != NULL);
+	data = mmap (NULL, len, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+	g_assert (data != MAP_FAILED);
+	memcpy (data, image, len);
+	g_free (image);
+	flat = radix_create_compressed_flat (data, len, 1);
+	g_assert (flat != NULL);
+	g_assert (radix_is_flat (flat));
+
+	/* Flat image must give the same answers as the original trie */
+	for (t = &test_vec[0]; t->ip != NULL; t ++) {
+		for (i = 0; i < 256; i ++) {
+			memcpy (key, t->addr, t->len);
+			key[t->len - 1] ^= i;
+			v1 = radix_find_compressed (tree, key, t->len);
+			v2 = radix_find_compressed (flat, key, t->len);
+			g_assert (v1 == v2);
+		}
+	}
+
+	for (i = 0; i < 100000; i ++) {
+		ottery_rand_bytes (key, sizeof (key));
+		v1 = radix_find_compressed (tree, key, sizeof (key));
+		v2 = radix_find_compressed (flat, key, sizeof (key));
+		g_assert (v1 == v2);
+		v1 = radix_find_compressed (tree, key, sizeof (guint32));
+		v2 = radix_find_compressed (flat, key, sizeof (guint32));
+		g_assert (v1 == v2);
+	}
+
+	/* Tries with custom values cannot be flattened */
+	g_assert (radix_serialize_flat (tree, 2, &len) == NULL);
+	radix_insert_compressed (tree, key, sizeof (key), 8, 2);
+	g_assert (radix_serialize_flat (tree, 1, &len) == NULL);
+
+	radix_destroy_compressed (flat);
+	radix_destroy_compressed (tree);
+}
+
+static gdouble
+rspamd_radix_bench_lookup (radix_compressed_t *tree, guint8 *keys,
+		gsize nkeys, gsize keylen, gsize *found)
+{
+	gdouble ts1, ts2;
+	gsize i;
+
+	*found = 0;
+	ts1 = rspamd_get_ticks ();
+
+	for (i = 0; i < nkeys; i ++) {
+		if (radix_find_compressed (tree, keys + i * keylen, keylen) !=
+				RADIX_NO_VALUE) {
+			(*found) ++;
+		}
+	}
+
+	ts2 = rspamd_get_ticks ();
+
+	return (ts2 - ts1) * 1000.0;
+}
+
+static void
+rspamd_radix_test_poptrie (void)
+{
+	radix_compressed_t *bt, *pt;
+	const gsize keylens[] = {4, 16};
+	gsize nprefixes = 16 * 1024, nkeys = 64 * 1024;
+	guint8 *keys, *prefixes, *key;
+	gsize i, j, keylen, found_bt, found_pt;
+	guint plen;
+	gdouble ts1, ts2, t_bt, t_pt;
+
+	if (g_test_perf ()) {
+		/* Benchmark on the size of a full routing table with -m perf */
+		nprefixes = 1024 * 1024;
+		nkeys = 4 * 1024 * 1024;
+	}
+
+	for (j = 0; j < G_N_ELEMENTS (keylens); j ++) {
+		keylen = keylens[j];
+		bt = radix_create_compressed_engine (RSPAMD_RADIX_ENGINE_BTRIE);
+		pt = radix_create_compressed_engine (RSPAMD_RADIX_ENGINE_POPTRIE);
+		prefixes = g_malloc (nprefixes * keylen);
+		ottery_rand_bytes (prefixes, nprefixes * keylen);
+
+		for (i = 0; i < nprefixes; i ++) {
+			key = prefixes + i * keylen;
+
+			/* Typical lengths of the routed prefixes */
+			if (keylen == 4) {
+				plen = masks[ottery_rand_range (G_N_ELEMENTS (masks) - 1)];
+			}
+			else {
+				plen = 20 + ottery_rand_range (28);
+
+				if (i % 64 == 0) {
+					/* Some host addresses */
+					plen = 128;
+				}
+			}
+
+			radix_insert_compressed (bt, key, keylen, keylen * NBBY - plen,
+					i + 1);
+			radix_insert_compressed (pt, key, keylen, keylen * NBBY - plen,
+					i + 1);
+		}
+
+		/* Half of keys are taken from prefixes, half are random */
+		keys = g_malloc (nkeys * keylen);
+		ottery_rand_bytes (keys, nkeys * keylen);
+
+		for (i = 0; i < nkeys; i += 2) {
+			memcpy (keys + i * keylen,
+					prefixes + ottery_rand_range (nprefixes - 1) * keylen,
+					keylen);
+		}
+
+		ts1 = rspamd_get_ticks ();
+		radix_get_info (pt);
+		ts2 = rspamd_get_ticks ();
+		msg_info ("compiled poptrie of %z prefixes (%z bytes keys) "
+				"in %.6f ms: %s", nprefixes, keylen, (ts2 - ts1) * 1000.0,
+				radix_get_info (pt));
+
+		for (i = 0; i < nkeys; i ++) {
+			g_assert (radix_find_compressed (bt, keys + i * keylen, keylen) ==
+					radix_find_compressed (pt, keys + i * keylen, keylen));
+		}
+
+		t_bt = rspamd_radix_bench_lookup (bt, keys, nkeys, keylen, &found_bt);
+		t_pt = rspamd_radix_bench_lookup (pt, keys, nkeys, keylen, &found_pt);
+		g_assert (found_bt == found_pt);
+
+		msg_info ("checked %z keys of %z bytes (%z found): btrie %.6f ms, "
+				"poptrie %.6f ms", nkeys, keylen, found_bt, t_bt, t_pt);
+
+		radix_destroy_compressed (bt);
+		radix_destroy_compressed (pt);
+		g_free (keys);
+		g_free (prefixes);
+	}
+}
+
 static void
 rspamd_btrie_test_vec (void)
 {
@@ -226,6 +394,8 @@ rspamd_radix_test_func (void)
 
 	rspamd_btrie_test_vec ();
 	rspamd_radix_test_vec ();
+	rspamd_radix_test_flat ();
+	rspamd_radix_test_poptrie ();
 
 	nelts = max_elts;
 	/* First of all we generate many elements and push them to the array */
@@ -0,0 +1,221 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "task.h"
+#include "message.h"
+#include "re_cache.h"
+#include "symbols_cache.h"
+#include "sa_rules.h"
+
+extern struct rspamd_main *rspamd_main;
+
+static const gchar *test_rules[] = {
+	"header SA_SUBJ Subject =~ /hello/i",
+	"header SA_SUBJ_RAW Subject:raw =~ /=\\?utf-8\\?B\\?/i",
+	"header SA_SUBJ_DECODED Subject =~ /utf-8/i",
+	"header SA_SUBJ_NEGATE Subject !~ /spam/",
+	/* To is present while Cc and Bcc are absent */
+	"header SA_TOCC_NEGATE ToCc !~ /example/",
+	"header SA_TOCC_NEGATE_MISS ToCc !~ /nomatch/",
+	"header SA_TOCC ToCc =~ /example/",
+	"header SA_NAME_CASE subject:case =~ /hello/i",
+	"header SA_NAME_NOCASE subject =~ /hello/i",
+	"header SA_UNSET X-Missing =~ /^none$/ [if-unset: none]",
+	"header SA_UNSET_PRESENT Subject =~ /^none$/ [if-unset: none]",
+	"mimeheader SA_MIME_UNSET Content-Disposition =~ /^none$/ [if-unset: none]",
+	"mimeheader SA_MIME_DISP Content-Disposition =~ /inline/",
+	"header SA_EXISTS exists:X-Mailer",
+	"header SA_NOT_EXISTS exists:X-Missing",
+	"header SA_ADDR From:addr =~ /example/",
+	"body SA_BODY /test body/",
+	"body SA_EVAL eval:check_something()",
+	"header SPF_PASS eval:check_for_spf_pass()",
+	/* Meta rules */
+	"meta SA_META_ARITH (SA_SUBJ + SA_BODY + SA_NOT_EXISTS) > 1",
+	"meta SA_META_ARITH_FALSE (SA_SUBJ + SA_NOT_EXISTS) > 1",
+	"meta SA_META_LOGIC SA_SUBJ && !SA_NOT_EXISTS",
+	"meta SA_META_EVAL SA_BODY && !SA_EVAL",
+	"meta SA_META_ADDR SA_BODY || SA_ADDR",
+	"meta __SA_SUB SA_EVAL || SA_SUBJ",
+	"meta SA_META_SUB __SA_SUB && SA_BODY",
+	/* Symbol has rspamd equivalent */
+	"meta SA_META_SPF SPF_PASS || SA_SUBJ",
+	/* Plugins sections */
+	"ifplugin Mail::SpamAssassin::Plugin::Unknown",
+	"header SA_PLUGIN_UNKNOWN Subject =~ /hello/i",
+	"if !plugin(Mail::SpamAssassin::Plugin::Unknown)",
+	"header SA_PLUGIN_UNKNOWN_NESTED Subject =~ /hello/i",
+	"endif",
+	"endif",
+	"ifplugin Mail::SpamAssassin::Plugin::FreeMail",
+	"header SA_PLUGIN_KNOWN Subject =~ /hello/i",
+	"if !plugin(Mail::SpamAssassin::Plugin::Unknown)",
+	"header SA_PLUGIN_KNOWN_NESTED Subject =~ /hello/i",
+	"endif",
+	"endif",
+	"if !plugin(Mail::SpamAssassin::Plugin::HeaderEval)",
+	"header SA_NOT_PLUGIN_KNOWN Subject =~ /hello/i",
+	"endif",
+	/* Scores and flags */
+	"describe SA_SUBJ Subject test",
+	"score SA_SUBJ 1.5",
+	"score SA_BODY 0 1 2 3.5",
+	"score SA_META_EVAL 2.0",
+	"tflags SA_EXISTS publish",
+	NULL
+};
+
+static const gchar *test_message = ""
+		"From: <user@example.com>\r\n"
+		"To: <rcpt@example.com>\r\n"
+		"Subject: =?utf-8?B?SGVsbG8gd29ybGQ=?=\r\n"
+		"X-Mailer: test\r\n"
+		"MIME-Version: 1.0\r\n"
+		"Content-Type: multipart/mixed; boundary=\"XXX\"\r\n"
+		"\r\n"
+		"--XXX\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Disposition: inline\r\n"
+		"\r\n"
+		"This is a test body\r\n"
+		"--XXX--\r\n";
+
+static const struct {
+	const gchar *name;
+	gint result;
+} test_results[] = {
+	{"SA_SUBJ", 1},
+	{"SA_SUBJ_RAW", 1},
+	{"SA_SUBJ_DECODED", 0},
+	{"SA_SUBJ_NEGATE", 1},
+	{"SA_TOCC_NEGATE", 0},
+	{"SA_TOCC_NEGATE_MISS", 1},
+	{"SA_TOCC", 1},
+	{"SA_NAME_CASE", 0},
+	{"SA_NAME_NOCASE", 1},
+	{"SA_UNSET", 1},
+	{"SA_UNSET_PRESENT", 0},
+	{"SA_MIME_UNSET", 0},
+	{"SA_MIME_DISP", 1},
+	{"SA_EXISTS", 1},
+	{"SA_NOT_EXISTS", 0},
+	{"SA_BODY", 1},
+	{"SA_META_ARITH", 1},
+	{"SA_META_ARITH_FALSE", 0},
+	{"SA_META_LOGIC", 1},
+	{"SA_META_SPF", 1},
+	/* Depend on unsupported rules */
+	{"SA_META_EVAL", 0},
+	{"SA_META_ADDR", 0},
+	{"__SA_SUB", 0},
+	{"SA_META_SUB", 0},
+	{"SA_PLUGIN_KNOWN", 1},
+	{"SA_PLUGIN_KNOWN_NESTED", 1},
+	/* Not defined */
+	{"SA_ADDR", -1},
+	{"SA_EVAL", -1},
+	{"SA_PLUGIN_UNKNOWN", -1},
+	{"SA_PLUGIN_UNKNOWN_NESTED", -1},
+	{"SA_NOT_PLUGIN_KNOWN", -1},
+};
+
+static void
+sa_rules_test_symbols (struct rspamd_config *cfg)
+{
+	struct rspamd_symbol_def *sdef;
+
+	/* Scored, published and meta rules are registered */
+	g_assert (rspamd_symbols_cache_find_symbol (cfg->cache, "SA_SUBJ") >= 0);
+	g_assert (rspamd_symbols_cache_find_symbol (cfg->cache, "SA_BODY") >= 0);
+	g_assert (rspamd_symbols_cache_find_symbol (cfg->cache, "SA_EXISTS") >= 0);
+	g_assert (rspamd_symbols_cache_find_symbol (cfg->cache,
+			"SA_META_ARITH") >= 0);
+	g_assert (rspamd_symbols_cache_find_symbol (cfg->cache,
+			"SA_NOT_EXISTS") < 0);
+	g_assert (rspamd_symbols_cache_find_symbol (cfg->cache, "__SA_SUB") < 0);
+	g_assert (rspamd_symbols_cache_find_symbol (cfg->cache,
+			"SA_META_SPF") >= 0);
+	/* Disabled meta rules are not registered */
+	g_assert (rspamd_symbols_cache_find_symbol (cfg->cache,
+			"SA_META_EVAL") < 0);
+	g_assert (rspamd_symbols_cache_find_symbol (cfg->cache,
+			"SA_META_SUB") < 0);
+
+	sdef = g_hash_table_lookup (cfg->default_metric->symbols, "SA_SUBJ");
+	g_assert (sdef != NULL);
+	g_assert (sdef->score == 1.5);
+	g_assert_cmpstr (sdef->description, ==, "Subject test");
+	/* The last score is used */
+	sdef = g_hash_table_lookup (cfg->default_metric->symbols, "SA_BODY");
+	g_assert (sdef != NULL);
+	g_assert (sdef->score == 3.5);
+	g_assert (g_hash_table_lookup (cfg->default_metric->symbols,
+			"SA_META_EVAL") == NULL);
+}
+
+void
+rspamd_sa_rules_test_func (void)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamd_sa_rules *rules;
+	struct rspamd_task *task;
+	rspamd_mempool_t *pool;
+	GError *err = NULL;
+	gsize mlen;
+	guint i;
+	gint res;
+
+	if (cfg->default_metric == NULL) {
+		rspamd_config_new_metric (cfg, NULL, DEFAULT_METRIC);
+	}
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "sa_rules");
+	rules = rspamd_sa_rules_new (cfg, pool);
+
+	for (i = 0; test_rules[i] != NULL; i ++) {
+		g_assert (rspamd_sa_rules_parse_line (rules, test_rules[i], &err));
+	}
+
+	/* Invalid definitions */
+	g_assert (!rspamd_sa_rules_parse_line (rules, "header SA_INVALID", &err));
+	g_assert (err != NULL);
+	g_error_free (err);
+	err = NULL;
+
+	g_assert (rspamd_sa_rules_compile (rules) > 0);
+	rspamd_re_cache_init (cfg->re_cache, cfg);
+	sa_rules_test_symbols (cfg);
+
+	task = rspamd_task_new (NULL, cfg);
+	mlen = strlen (test_message);
+	task->msg.begin = rspamd_mempool_alloc (task->task_pool, mlen);
+	memcpy ((gpointer)task->msg.begin, test_message, mlen);
+	task->msg.len = mlen;
+	g_assert (rspamd_task_load_message (task, NULL, task->msg.begin, mlen));
+	g_assert (rspamd_message_parse (task));
+
+	for (i = 0; i < G_N_ELEMENTS (test_results); i ++) {
+		res = rspamd_sa_rules_process (rules, task, test_results[i].name);
+		msg_info ("rule %s: %d, expected: %d", test_results[i].name, res,
+				test_results[i].result);
+		g_assert_cmpint (res > 0 ? 1 : res, ==, test_results[i].result);
+	}
+
+	rspamd_task_free (task);
+	rspamd_mempool_delete (pool);
+}
@@ -37,6 +37,9 @@ algorithm_to_string (enum rspamd_shingle_alg alg)
 	case RSPAMD_SHINGLES_FAST:
 		ret = "fasthash";
 		break;
+	case RSPAMD_SHINGLES_VECTOR:
+		ret = "vector";
+		break;
 	}
 
 	return ret;
@@ -136,6 +139,60 @@ test_case (gsize cnt, gsize max_len, gdouble perm_factor,
 	g_free (sgl_permuted);
 }
 
+static guint64
+test_filter_wrapper (guint64 *input, gsize count,
+		gint shno, const guchar *key, gpointer ud)
+{
+	return rspamd_shingles_default_filter (input, count, shno, key, ud);
+}
+
+static void
+test_bench (gsize cnt, gsize max_len)
+{
+	GArray *input;
+	struct rspamd_shingle *sgl, *sgl2;
+	guchar key[16];
+	gdouble ts1, ts2, t_fast, t_vec;
+	const guint niter = 20;
+	guint i;
+
+	ottery_rand_bytes (key, sizeof (key));
+	input = generate_fuzzy_words (cnt, max_len);
+
+	ts1 = rspamd_get_virtual_ticks ();
+	for (i = 0; i < niter; i ++) {
+		sgl = rspamd_shingles_generate (input, key, NULL,
+				rspamd_shingles_default_filter, NULL, RSPAMD_SHINGLES_FAST);
+		g_free (sgl);
+	}
+	ts2 = rspamd_get_virtual_ticks ();
+	t_fast = ts2 - ts1;
+
+	ts1 = rspamd_get_virtual_ticks ();
+	for (i = 0; i < niter; i ++) {
+		sgl = rspamd_shingles_generate (input, key, NULL,
+				rspamd_shingles_default_filter, NULL, RSPAMD_SHINGLES_VECTOR);
+		g_free (sgl);
+	}
+	ts2 = rspamd_get_virtual_ticks ();
+	t_vec = ts2 - ts1;
+
+	/* Fused minhash must be equal to the generic filtering */
+	sgl = rspamd_shingles_generate (input, key, NULL,
+			rspamd_shingles_default_filter, NULL, RSPAMD_SHINGLES_VECTOR);
+	sgl2 = rspamd_shingles_generate (input, key, NULL,
+			test_filter_wrapper, NULL, RSPAMD_SHINGLES_VECTOR);
+	g_assert (memcmp (sgl, sgl2, sizeof (*sgl)) == 0);
+
+	msg_info ("%z words of %z max len, %ud iterations: fasthash %.4f sec, "
+			"vector %.4f sec", cnt, max_len, niter, t_fast, t_vec);
+
+	free_fuzzy_words (input);
+	g_array_free (input, TRUE);
+	g_free (sgl);
+	g_free (sgl2);
+}
+
 static const guint64 expected_old[RSPAMD_SHINGLE_SIZE] = {
 	0x2a97e024235cedc5, 0x46238acbcc55e9e0, 0x2378ff151af075b3, 0xde1f29a95cad109,
 	0x5d3bbbdb5db5d19f, 0x4d75a0ec52af10a6, 0x215ecd6372e755b5, 0x7b52295758295350,
@@ -231,7 +288,7 @@ rspamd_shingles_test_func (void)
 	}
 	g_free (sgl);
 
-	for (alg = RSPAMD_SHINGLES_OLD; alg <= RSPAMD_SHINGLES_FAST; alg ++) {
+	for (alg = RSPAMD_SHINGLES_OLD; alg <= RSPAMD_SHINGLES_VECTOR; alg ++) {
 		test_case (200, 10, 0.1, alg);
 		test_case (500, 20, 0.01, alg);
 		test_case (5000, 20, 0.01, alg);
@@ -241,4 +298,8 @@ rspamd_shingles_test_func (void)
 		test_case (50000, 5, 0.02, alg);
 		test_case (50000, 16, 0.02, alg);
 	}
+
+	test_bench (500, 10);
+	test_bench (5000, 20);
+	test_bench (50000, 16);
 }
@@ -50,6 +50,10 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
 	g_test_add_func ("/rspamd/heap", rspamd_heap_test_func);
+	g_test_add_func ("/rspamd/expression", rspamd_expression_test_func);
+	g_test_add_func ("/rspamd/lru", rspamd_lru_test_func);
+	g_test_add_func ("/rspamd/bloom", rspamd_bloom_test_func);
+	g_test_add_func ("/rspamd/sa_rules", rspamd_sa_rules_test_func);
 
 #if 0
 	g_test_add_func ("/rspamd/url", rspamd_url_test_func);
@@ -41,6 +41,71 @@ rspamd_upstream_test_method (struct upstream_list *ls,
 	}
 }
 
+static void
+rspamd_upstream_test_collect (struct upstream *up, void *ud)
+{
+	GPtrArray *ar = ud;
+
+	g_ptr_array_add (ar, up);
+}
+
+static void
+rspamd_upstream_test_latency (struct rspamd_config *cfg)
+{
+	struct upstream_list *ls;
+	struct upstream *up, *fast, *slow;
+	GPtrArray *ar;
+	gint i;
+	gboolean recovered = FALSE;
+
+	ls = rspamd_upstreams_create (cfg->ups_ctx);
+	g_assert (rspamd_upstreams_parse_line (ls, "127.0.0.1,127.0.0.2", 11333,
+			NULL));
+	ar = g_ptr_array_new ();
+	rspamd_upstreams_foreach (ls, rspamd_upstream_test_collect, ar);
+	g_assert (ar->len == 2);
+	fast = g_ptr_array_index (ar, 0);
+	slow = g_ptr_array_index (ar, 1);
+	g_ptr_array_free (ar, TRUE);
+
+	rspamd_upstream_latency (fast, 0.01);
+	rspamd_upstream_latency (slow, 0.5);
+
+	/* With two upstreams both are compared, so the fast one always wins */
+	for (i = 0; i < 100; i ++) {
+		up = rspamd_upstream_get (ls, RSPAMD_UPSTREAM_LATENCY, NULL, 0);
+		g_assert (up == fast);
+		rspamd_upstream_latency (up, 0.01);
+	}
+
+	/* Slow reply followed by failure is limited by error time (2 seconds) */
+	rspamd_upstream_latency (fast, 100.0);
+	rspamd_upstream_fail (fast);
+	up = rspamd_upstream_get (ls, RSPAMD_UPSTREAM_LATENCY, NULL, 0);
+	g_assert (up == slow);
+	rspamd_upstream_latency (up, 0.5);
+
+	/*
+	 * Penalty decays while the slow upstream keeps answering, so the fast one
+	 * is selected again in about 3 seconds
+	 */
+	for (i = 0; i < 60 && !recovered; i ++) {
+		g_usleep (100000);
+		up = rspamd_upstream_get (ls, RSPAMD_UPSTREAM_LATENCY, NULL, 0);
+
+		if (up == fast) {
+			recovered = TRUE;
+			rspamd_upstream_latency (up, 0.01);
+		}
+		else {
+			rspamd_upstream_latency (up, 0.5);
+		}
+	}
+
+	g_assert (recovered);
+	rspamd_upstreams_destroy (ls);
+}
+
 static void
 rspamd_upstream_timeout_handler (int fd, short what, void *arg)
 {
@@ -176,5 +241,7 @@ rspamd_upstream_test_func (void)
 	g_assert (rspamd_upstreams_alive (ls) == 3);
 
 	rspamd_upstreams_destroy (ls);
+
+	rspamd_upstream_test_latency (cfg);
 	REF_RELEASE (cfg);
 }
@@ -41,4 +41,12 @@ void rspamd_cryptobox_test_func (void);
 
 void rspamd_heap_test_func (void);
 
+void rspamd_expression_test_func (void);
+
+void rspamd_lru_test_func (void);
+
+void rspamd_bloom_test_func (void);
+
+void rspamd_sa_rules_test_func (void);
+
 #endif